@@ -0,0 +1,244 @@
+#include "AesGcmCipher.h"
+
+#include <sstream>
+#include <stdexcept>
+
+#pragma comment(lib, "bcrypt.lib")
+
+AesGcmCipher::AesGcmCipher(std::shared_ptr<ILogger> logger, const std::string& preSharedKey)
+   : _logger(logger),
+   _preSharedKey(preSharedKey),
+   _aesAlgorithm(nullptr),
+   _hmacAlgorithm(nullptr)
+{
+   if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&_aesAlgorithm, BCRYPT_AES_ALGORITHM, nullptr, 0)))
+   {
+      throw std::runtime_error("open AES provider failed");
+   }
+
+   if (!BCRYPT_SUCCESS(BCryptSetProperty(_aesAlgorithm, BCRYPT_CHAINING_MODE, (PUCHAR)BCRYPT_CHAIN_MODE_GCM, sizeof(BCRYPT_CHAIN_MODE_GCM), 0)))
+   {
+      BCryptCloseAlgorithmProvider(_aesAlgorithm, 0);
+      throw std::runtime_error("set GCM chaining mode failed");
+   }
+
+   if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&_hmacAlgorithm, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG)))
+   {
+      BCryptCloseAlgorithmProvider(_aesAlgorithm, 0);
+      throw std::runtime_error("open HMAC provider failed");
+   }
+}
+
+AesGcmCipher::~AesGcmCipher()
+{
+   // Nothing else holds a key once the cipher is going
+   _keys.clear();
+
+   BCryptCloseAlgorithmProvider(_hmacAlgorithm, 0);
+   BCryptCloseAlgorithmProvider(_aesAlgorithm, 0);
+}
+
+void AesGcmCipher::BeginTransaction(uint32_t transactionID, std::vector<char>& handshake)
+{
+   handshake.resize(SaltSize);
+   if (!BCRYPT_SUCCESS(BCryptGenRandom(nullptr, (PUCHAR)handshake.data(), (ULONG)handshake.size(), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+   {
+      throw std::runtime_error("generate salt failed");
+   }
+
+   auto key = CreateKey(transactionID, handshake);
+   if (!key)
+   {
+      throw std::runtime_error("create transaction key failed");
+   }
+   InstallKey(transactionID, key);
+}
+
+bool AesGcmCipher::AcceptTransaction(const std::vector<char>& handshake, TransactionUnit& tu)
+{
+   if (handshake.size() != SaltSize) return false;
+
+   auto key = CreateKey(tu.transactionid, handshake);
+   if (!key) return false;
+
+   // Only a peer holding the pre-shared key can produce a start unit that opens, anything else must not
+   // disturb the keys of a transaction that is already running
+   if (!Open(*key, tu)) return false;
+
+   InstallKey(tu.transactionid, key);
+   return true;
+}
+
+bool AesGcmCipher::SealReply(const std::vector<char>& handshake, const TransactionUnit& start, TransactionUnit& reply)
+{
+   if (handshake.size() != SaltSize) return false;
+
+   auto key = CreateKey(start.transactionid, handshake);
+   if (!key) return false;
+
+   // Only answered for a peer holding the pre-shared key
+   TransactionUnit opened = start;
+   if (!Open(*key, opened)) return false;
+
+   Seal(*key, reply);
+   return true;
+}
+
+void AesGcmCipher::EndTransaction(uint32_t transactionID)
+{
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   // A seal or open still using the key keeps it until it is done
+   _keys.erase(transactionID);
+}
+
+void AesGcmCipher::Seal(TransactionUnit& tu)
+{
+   auto key = FindKey(tu.transactionid);
+   if (!key) throw std::runtime_error("no key for transaction");
+
+   Seal(*key, tu);
+}
+
+void AesGcmCipher::Seal(TransactionKey& key, TransactionUnit& tu)
+{
+   // Stamped now rather than when formatted, so the timestamp is covered
+   tu.timestamp = GetWireTimestamp();
+   tu.stamped = true;
+
+   unsigned char authData[AuthDataSize];
+   FormatAuthData(tu, authData);
+
+   // Encrypt in place, the nonce and tag are written straight into the space reserved after the data
+   auto size = tu.messagedata.size();
+   tu.messagedata.resize(size + NonceSize + TagSize);
+   auto data = (PUCHAR)tu.messagedata.data();
+
+   auto nonce = data + size;
+   auto count = key.sealed++;
+   memcpy(nonce, key.noncePrefix, NoncePrefixSize);
+   memcpy(nonce + NoncePrefixSize, &count, sizeof(count));
+
+   BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+   BCRYPT_INIT_AUTH_MODE_INFO(info);
+   info.pbNonce = nonce;
+   info.cbNonce = NonceSize;
+   info.pbAuthData = authData;
+   info.cbAuthData = AuthDataSize;
+   info.pbTag = nonce + NonceSize;
+   info.cbTag = TagSize;
+
+   ULONG written = 0;
+   if (!BCRYPT_SUCCESS(BCryptEncrypt(key.handle, data, (ULONG)size, &info, nullptr, 0, data, (ULONG)size, &written, 0)))
+   {
+      throw std::runtime_error("encrypt failed");
+   }
+
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+}
+
+bool AesGcmCipher::Open(TransactionUnit& tu)
+{
+   auto key = FindKey(tu.transactionid);
+   if (!key) return false;
+
+   return Open(*key, tu);
+}
+
+bool AesGcmCipher::Open(TransactionKey& key, TransactionUnit& tu)
+{
+   if (tu.messagedata.size() < NonceSize + TagSize) return false;
+
+   unsigned char authData[AuthDataSize];
+   FormatAuthData(tu, authData);
+
+   auto size = tu.messagedata.size() - NonceSize - TagSize;
+   auto data = (PUCHAR)tu.messagedata.data();
+   auto nonce = data + size;
+
+   BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+   BCRYPT_INIT_AUTH_MODE_INFO(info);
+   info.pbNonce = nonce;
+   info.cbNonce = NonceSize;
+   info.pbAuthData = authData;
+   info.cbAuthData = AuthDataSize;
+   info.pbTag = nonce + NonceSize;
+   info.cbTag = TagSize;
+
+   ULONG written = 0;
+   if (!BCRYPT_SUCCESS(BCryptDecrypt(key.handle, data, (ULONG)size, &info, nullptr, 0, data, (ULONG)size, &written, 0)))
+   {
+      std::stringstream ss;
+      ss << "Authentication failed for transaction " << tu.transactionid << " sequence " << tu.sequencenum;
+      _logger->Log(3, ss.str());
+      return false;
+   }
+
+   tu.messagedata.resize(size);
+   tu.messagelength = (uint16_t)size;
+   return true;
+}
+
+std::shared_ptr<AesGcmCipher::TransactionKey> AesGcmCipher::CreateKey(uint32_t transactionID, const std::vector<char>& salt)
+{
+   // Derive the transaction key from the pre-shared key
+   unsigned char keyData[KeySize];
+
+   BCRYPT_HASH_HANDLE hash = nullptr;
+   if (!BCRYPT_SUCCESS(BCryptCreateHash(_hmacAlgorithm, &hash, nullptr, 0, (PUCHAR)_preSharedKey.data(), (ULONG)_preSharedKey.size(), 0)))
+   {
+      return nullptr;
+   }
+
+   bool ok = BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)salt.data(), (ULONG)salt.size(), 0)) &&
+             BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)&transactionID, sizeof(transactionID), 0)) &&
+             BCRYPT_SUCCESS(BCryptFinishHash(hash, keyData, sizeof(keyData), 0));
+   BCryptDestroyHash(hash);
+   if (!ok) return nullptr;
+
+   BCRYPT_KEY_HANDLE key = nullptr;
+   if (!BCRYPT_SUCCESS(BCryptGenerateSymmetricKey(_aesAlgorithm, &key, nullptr, 0, keyData, sizeof(keyData), 0)))
+   {
+      key = nullptr;
+   }
+   SecureZeroMemory(keyData, sizeof(keyData));
+   if (!key) return nullptr;
+
+   // Where this end's nonces start
+   auto transactionKey = std::make_shared<TransactionKey>(key);
+   uint64_t sealed = 0;
+   if (!BCRYPT_SUCCESS(BCryptGenRandom(nullptr, transactionKey->noncePrefix, NoncePrefixSize, BCRYPT_USE_SYSTEM_PREFERRED_RNG)) ||
+       !BCRYPT_SUCCESS(BCryptGenRandom(nullptr, (PUCHAR)&sealed, sizeof(sealed), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+   {
+      return nullptr;
+   }
+   transactionKey->sealed = sealed;
+
+   return transactionKey;
+}
+
+void AesGcmCipher::InstallKey(uint32_t transactionID, std::shared_ptr<TransactionKey> key)
+{
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   // A repeated start replaces the old key
+   _keys[transactionID] = key;
+}
+
+std::shared_ptr<AesGcmCipher::TransactionKey> AesGcmCipher::FindKey(uint32_t transactionID)
+{
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   auto iter = _keys.find(transactionID);
+   return iter != _keys.end() ? iter->second : nullptr;
+}
+
+void AesGcmCipher::FormatAuthData(const TransactionUnit& tu, unsigned char* authData)
+{
+   // Authenticated data: transaction id (4) | message type (2) | sequence number (4) | timestamp (4) | echoed timestamp (4)
+   memcpy(authData, &tu.transactionid, sizeof(tu.transactionid));
+   memcpy(authData + 4, &tu.messagetype, sizeof(tu.messagetype));
+   memcpy(authData + 6, &tu.sequencenum, sizeof(tu.sequencenum));
+   memcpy(authData + 10, &tu.timestamp, sizeof(tu.timestamp));
+   memcpy(authData + 14, &tu.echoTimestamp, sizeof(tu.echoTimestamp));
+}
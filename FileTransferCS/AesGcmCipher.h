@@ -0,0 +1,80 @@
+#pragma once
+
+#include "ITransactionCipher.h"
+#include "ILogger.h"
+
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+
+#include <windows.h>
+#include <bcrypt.h>
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// AES-256-GCM using the Windows CNG provider, which uses AES-NI where the CPU supports it.
+///
+/// Both peers share a pre-shared key.  The client's handshake is a random salt and the transaction
+/// key is HMAC-SHA256(pre-shared key, salt | transaction id).  Each sealed unit carries its nonce,
+/// a random prefix drawn for the key and a count of the units sealed with it, starting from a random
+/// value.  A unit sealed again, say a retransmission reread from a source that has changed since,
+/// gets a nonce of its own, and the two ends of a transaction don't collide though they seal under
+/// the same key.  The transaction id, message type, sequence number and both timestamps are
+/// authenticated along with the data, so the delays measured from them can't be skewed on the way.
+/// A unit is stamped as it is sealed, the formatting that follows keeps the stamp.
+///
+/// Keys are kept by transaction id, so the two ends of a transaction need a cipher each.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class AesGcmCipher : public ITransactionCipher
+{
+public:
+   AesGcmCipher(std::shared_ptr<ILogger> logger, const std::string& preSharedKey);
+   ~AesGcmCipher();
+   AesGcmCipher(const AesGcmCipher&) = delete;
+
+   void BeginTransaction(uint32_t transactionID, std::vector<char>& handshake) override;
+   bool AcceptTransaction(const std::vector<char>& handshake, TransactionUnit& tu) override;
+   bool SealReply(const std::vector<char>& handshake, const TransactionUnit& start, TransactionUnit& reply) override;
+   void EndTransaction(uint32_t transactionID) override;
+   size_t GetHandshakeSize() override { return SaltSize; }
+
+   void Seal(TransactionUnit& tu) override;
+   bool Open(TransactionUnit& tu) override;
+
+private:
+   static const size_t SaltSize = 32;
+   static const size_t KeySize = 32;
+   static const size_t NonceSize = 12;
+   static const size_t NoncePrefixSize = NonceSize - sizeof(uint64_t);
+   static const size_t AuthDataSize = 18;
+   static const size_t TagSize = 16;
+
+   // Shared by the map and each seal or open using the key, so the key outlives a transaction ending while a unit
+   // of it is being sealed
+   struct TransactionKey
+   {
+      TransactionKey(BCRYPT_KEY_HANDLE handle) : handle(handle) {}
+      ~TransactionKey() { BCryptDestroyKey(handle); }
+      TransactionKey(const TransactionKey&) = delete;
+
+      BCRYPT_KEY_HANDLE handle;
+      unsigned char noncePrefix[NoncePrefixSize];     // Random, leads every nonce sealed with the key here
+      std::atomic<uint64_t> sealed;                   // Follows the prefix, counted up from a random start
+   };
+
+   std::shared_ptr<TransactionKey> CreateKey(uint32_t transactionID, const std::vector<char>& salt);
+   void InstallKey(uint32_t transactionID, std::shared_ptr<TransactionKey> key);
+   std::shared_ptr<TransactionKey> FindKey(uint32_t transactionID);
+   void Seal(TransactionKey& key, TransactionUnit& tu);
+   bool Open(TransactionKey& key, TransactionUnit& tu);
+   void FormatAuthData(const TransactionUnit& tu, unsigned char* authData);
+
+   std::shared_ptr<ILogger> _logger;
+   std::string _preSharedKey;
+   BCRYPT_ALG_HANDLE _aesAlgorithm;
+   BCRYPT_ALG_HANDLE _hmacAlgorithm;
+
+   std::mutex _mutex;
+   std::map<uint32_t, std::shared_ptr<TransactionKey>> _keys;
+};
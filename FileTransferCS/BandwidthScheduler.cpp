@@ -0,0 +1,163 @@
+#include "BandwidthScheduler.h"
+
+#include <algorithm>
+
+BandwidthScheduler::TokenBucket::TokenBucket(uint64_t bytesPerSecond, uint64_t burstBytes, Clock::time_point now)
+   : _rate((double)bytesPerSecond),
+   _burst((double)burstBytes),
+   _tokens((double)burstBytes),
+   _lastRefill(now)
+{}
+
+void BandwidthScheduler::TokenBucket::Refill(Clock::time_point now)
+{
+   auto elapsed = std::chrono::duration<double>(now - _lastRefill).count();
+   _tokens = std::min(_burst, _tokens + elapsed * _rate);
+   _lastRefill = now;
+}
+
+BandwidthScheduler::Clock::duration BandwidthScheduler::TokenBucket::GetWait(Clock::time_point now)
+{
+   if (_rate == 0) return Clock::duration::zero();
+
+   Refill(now);
+
+   // A send is allowed whenever the bucket isn't in debt, it may then go into debt by the size of the send.
+   // That way sends larger than the burst still make progress
+   if (_tokens >= 0) return Clock::duration::zero();
+
+   return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-_tokens / _rate));
+}
+
+void BandwidthScheduler::TokenBucket::Take(size_t bytes)
+{
+   if (_rate == 0) return;
+
+   _tokens -= (double)bytes;
+}
+
+BandwidthScheduler::BandwidthScheduler(uint64_t bytesPerSecond, uint64_t burstBytes, std::function<Clock::time_point()> now)
+   : _now(now),
+   _global(bytesPerSecond, burstBytes, now()),
+   _virtualTime(0),
+   _nextFlowID(0),
+   _nextTicket(0)
+{}
+
+int BandwidthScheduler::AddFlow(uint32_t weight, uint64_t bytesPerSecond, uint64_t burstBytes)
+{
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   auto flowID = _nextFlowID++;
+   _flows.emplace(std::piecewise_construct, std::forward_as_tuple(flowID), std::forward_as_tuple(weight, bytesPerSecond, burstBytes, _now()));
+   return flowID;
+}
+
+void BandwidthScheduler::RemoveFlow(int flowID)
+{
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto iter = _flows.find(flowID);
+      if (iter == _flows.end()) return;
+
+      // Waiters hold a reference to the flow, the last of them to leave erases it
+      if (iter->second.waiters == 0)
+      {
+         _flows.erase(iter);
+         return;
+      }
+      iter->second.removed = true;
+   }
+
+   _conditionVariable.notify_all();
+}
+
+bool BandwidthScheduler::Acquire(int flowID, size_t bytes)
+{
+   std::unique_lock<std::mutex> lock(_mutex);
+
+   auto flowIter = _flows.find(flowID);
+   if (flowIter == _flows.end() || flowIter->second.removed) return false;
+   auto& flow = flowIter->second;
+   flow.waiters++;
+
+   // Tag the send with its virtual finish time.  An idle flow starts from the current virtual time so it
+   // can't bank credit while it isn't sending
+   auto startTag = std::max(flow.finishTag, _virtualTime);
+   flow.finishTag = startTag + (double)bytes / flow.weight;
+
+   WaitKey key(flow.finishTag, _nextTicket++);
+   _waiting.emplace(key, Waiter{ flowID, bytes });
+
+   while (1)
+   {
+      // Removed while waiting, give up the place in the queue
+      if (flow.removed)
+      {
+         _waiting.erase(key);
+         if (--flow.waiters == 0) _flows.erase(flowIter);
+
+         lock.unlock();
+         _conditionVariable.notify_all();
+         return false;
+      }
+
+      auto now = _now();
+
+      // The head is the waiter with the lowest tag whose own flow cap allows it to send.  Waiters held
+      // back by their own cap don't block anyone else
+      auto head = _waiting.end();
+      auto wait = Clock::duration::max();
+      for (auto iter = _waiting.begin(); iter != _waiting.end(); ++iter)
+      {
+         // Every waiting flow is still there, but a removed one's waiters are on their way out
+         auto& waiting = _flows.at(iter->second.flowID);
+         if (waiting.removed) continue;
+
+         auto flowWait = waiting.bucket.GetWait(now);
+         if (flowWait == Clock::duration::zero())
+         {
+            head = iter;
+            break;
+         }
+         wait = std::min(wait, flowWait);
+      }
+
+      if (head != _waiting.end())
+      {
+         auto globalWait = _global.GetWait(now);
+         if (globalWait == Clock::duration::zero() && head->first == key)
+         {
+            // Our turn
+            _global.Take(bytes);
+            flow.bucket.Take(bytes);
+            _virtualTime = key.first;
+            _waiting.erase(head);
+            flow.waiters--;
+
+            lock.unlock();
+            _conditionVariable.notify_all();
+            return true;
+         }
+
+         wait = std::min(wait, globalWait);
+      }
+
+      // Sleep until the next waiter could be eligible, or until a send is granted and the queue changes.  The
+      // wait is relative, the clock read may not be the one the condition variable sleeps by
+      if (wait == Clock::duration::zero() || wait == Clock::duration::max())
+      {
+         _conditionVariable.wait(lock);
+      }
+      else
+      {
+         _conditionVariable.wait_for(lock, wait);
+      }
+   }
+}
+
+size_t BandwidthScheduler::GetWaitingCount()
+{
+   std::lock_guard<std::mutex> lock(_mutex);
+   return _waiting.size();
+}
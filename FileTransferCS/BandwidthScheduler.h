@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Shares egress bandwidth between flows.  A global token bucket caps the total rate and each flow
+/// may have its own cap.  When flows compete, sends are granted in order of a weighted virtual
+/// finish time, and the virtual time advances to the finish tag of each send granted (self-clocked
+/// fair queueing).  A flow with weight 4 gets four times the bandwidth of a flow with weight 1 and
+/// a newly busy flow never waits behind another flow's backlog.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class BandwidthScheduler
+{
+public:
+   using Clock = std::chrono::steady_clock;
+
+   // A rate of 0 means unlimited.  The burst is the most that can be sent at once after an idle period.  Buckets
+   // refill by the time now returns, tests pass a clock they move on themselves
+   BandwidthScheduler(uint64_t bytesPerSecond, uint64_t burstBytes = 0x10000, std::function<Clock::time_point()> now = Clock::now);
+   BandwidthScheduler(const BandwidthScheduler&) = delete;
+
+   int AddFlow(uint32_t weight, uint64_t bytesPerSecond = 0, uint64_t burstBytes = 0x10000);
+
+   // Safe while the flow is being waited on, the waits return without sending and the flow goes with the last of them
+   void RemoveFlow(int flowID);
+
+   // Blocks until the flow may send this many bytes.  Returns false straight away once the flow is removed
+   bool Acquire(int flowID, size_t bytes);
+
+   // Sends waiting for their turn
+   size_t GetWaitingCount();
+
+private:
+   class TokenBucket
+   {
+   public:
+      TokenBucket(uint64_t bytesPerSecond, uint64_t burstBytes, Clock::time_point now);
+
+      // Time until the bucket has tokens, zero if it has them now
+      Clock::duration GetWait(Clock::time_point now);
+      void Take(size_t bytes);
+
+   private:
+      void Refill(Clock::time_point now);
+
+      const double _rate;
+      const double _burst;
+      double _tokens;
+      Clock::time_point _lastRefill;
+   };
+
+   struct Flow
+   {
+      Flow(uint32_t weight, uint64_t bytesPerSecond, uint64_t burstBytes, Clock::time_point now)
+         : weight(weight > 0 ? weight : 1), bucket(bytesPerSecond, burstBytes, now), finishTag(0), waiters(0), removed(false)
+      {}
+
+      uint32_t weight;
+      TokenBucket bucket;
+      double finishTag;
+      size_t waiters;      // Threads in Acquire for the flow, it is only erased once there are none
+      bool removed;
+   };
+
+   struct Waiter
+   {
+      int flowID;
+      size_t bytes;
+   };
+
+   // Waiters are ordered by finish tag, ties broken by arrival
+   using WaitKey = std::pair<double, uint64_t>;
+
+   std::function<Clock::time_point()> _now;
+   std::mutex _mutex;
+   std::condition_variable _conditionVariable;
+   TokenBucket _global;
+   std::map<int, Flow> _flows;
+   std::map<WaitKey, Waiter> _waiting;
+   double _virtualTime;
+   int _nextFlowID;
+   uint64_t _nextTicket;
+};
@@ -0,0 +1,129 @@
+#include "BlockCache.h"
+
+#include <fstream>
+#include <sstream>
+
+BlockCache::BlockCache(std::shared_ptr<ILogger> logger, uint64_t capacityBytes, uint32_t blockSize)
+   : _logger(logger),
+   _capacity(capacityBytes),
+   _blockSize(blockSize > 0 ? blockSize : DefaultCacheBlockSize),
+   _cachedBytes(0),
+   _hits(0),
+   _misses(0),
+   _bytesRead(0),
+   _evictions(0)
+{}
+
+BlockCache::Block BlockCache::Get(const std::string& filename, uint64_t index)
+{
+   Key key(filename, index);
+   std::promise<Block> promise;
+   std::shared_future<Block> cached;
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+
+      auto iter = _entries.find(key);
+      if (iter != _entries.end())
+      {
+         // Most recently used now.  The block may still be being read, in which case this waits for it below
+         _recent.splice(_recent.begin(), _recent, iter->second.recent);
+         _hits++;
+         cached = iter->second.block;
+      }
+      else
+      {
+         // Claim the read, anyone else asking for the block waits on it
+         _misses++;
+         _recent.push_front(key);
+
+         Entry entry;
+         entry.block = promise.get_future().share();
+         entry.recent = _recent.begin();
+         entry.size = _blockSize;
+         _entries[key] = entry;
+         _cachedBytes += entry.size;
+      }
+   }
+
+   // An empty block marks the end of the file, kept so readers reaching the end don't go to disk to find it
+   if (cached.valid())
+   {
+      auto block = cached.get();
+      return block && !block->empty() ? block : nullptr;
+   }
+
+   // Read outside the guard, so other blocks are served meanwhile
+   auto block = ReadBlock(filename, index);
+   promise.set_value(block);
+
+   std::lock_guard<std::mutex> lock(_guard);
+   auto iter = _entries.find(key);
+   if (iter != _entries.end())
+   {
+      _cachedBytes -= iter->second.size;
+      if (block)
+      {
+         iter->second.size = block->size();
+         _cachedBytes += iter->second.size;
+      }
+      else
+      {
+         // Not kept, the next reader tries the file again
+         _recent.erase(iter->second.recent);
+         _entries.erase(iter);
+      }
+   }
+   Evict();
+
+   return block && !block->empty() ? block : nullptr;
+}
+
+BlockCache::Block BlockCache::ReadBlock(const std::string& filename, uint64_t index)
+{
+   std::ifstream stream(filename, std::ios::in | std::ios::binary);
+   if (!stream.is_open())
+   {
+      std::stringstream ss;
+      ss << "Unable to open " << filename << " for reading";
+      _logger->Log(5, ss.str());
+      return nullptr;
+   }
+
+   stream.seekg((std::streamoff)(index * _blockSize));
+
+   auto data = std::make_shared<std::vector<char>>(_blockSize);
+   stream.read(data->data(), data->size());
+   data->resize((size_t)stream.gcount());
+   _bytesRead += data->size();
+   return data;
+}
+
+void BlockCache::Evict()
+{
+   // Called with the guard held.  Blocks still being read are skipped, their readers are about to use them
+   auto iter = _recent.end();
+   while (_cachedBytes > _capacity && iter != _recent.begin())
+   {
+      --iter;
+      auto entry = _entries.find(*iter);
+      if (entry->second.block.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+
+      _cachedBytes -= entry->second.size;
+      _entries.erase(entry);
+      iter = _recent.erase(iter);
+      _evictions++;
+   }
+}
+
+BlockCacheStats BlockCache::GetStats()
+{
+   std::lock_guard<std::mutex> lock(_guard);
+
+   BlockCacheStats stats;
+   stats.hits = _hits;
+   stats.misses = _misses;
+   stats.bytesRead = _bytesRead;
+   stats.evictions = _evictions;
+   stats.cachedBytes = _cachedBytes;
+   return stats;
+}
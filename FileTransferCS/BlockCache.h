@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ILogger.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <mutex>
+#include <future>
+#include <atomic>
+
+// Default bytes held by a block cache, and the size of the blocks it reads
+static const uint64_t DefaultBlockCacheCapacity = 0x10000000;     // 256MB
+static const uint32_t DefaultCacheBlockSize = 0x10000;            // 64KB
+
+struct BlockCacheStats
+{
+   uint64_t hits;          // Blocks found in the cache, including ones another reader was still reading
+   uint64_t misses;        // Blocks that had to be read, each one read from disk
+   uint64_t bytesRead;     // Bytes read from disk
+   uint64_t evictions;
+   uint64_t cachedBytes;   // Bytes held now
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Shared read cache of fixed size file blocks, so many readers of the same hot file read it from
+/// disk once between them.  A block missing from the cache is read by the first reader to ask for
+/// it, readers asking while it is being read wait for that read rather than issuing their own.
+/// Beyond the capacity the least recently used blocks are evicted.  Blocks are handed out as
+/// shared pointers, so an evicted block stays valid for whoever still holds it.
+///
+/// Files are assumed not to change while they are being served.  Thread safe.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class BlockCache
+{
+public:
+   BlockCache(std::shared_ptr<ILogger> logger, uint64_t capacityBytes = DefaultBlockCacheCapacity, uint32_t blockSize = DefaultCacheBlockSize);
+   BlockCache(const BlockCache&) = delete;
+
+   typedef std::shared_ptr<const std::vector<char>> Block;
+
+   // The block at index * block size in the file.  Shorter than the block size at the end of the file, null past
+   // the end or when the file can't be read
+   Block Get(const std::string& filename, uint64_t index);
+
+   uint32_t GetBlockSize() const { return _blockSize; }
+
+   BlockCacheStats GetStats();
+
+private:
+   typedef std::pair<std::string, uint64_t> Key;
+
+   struct Entry
+   {
+      std::shared_future<Block> block;
+      std::list<Key>::iterator recent;
+      size_t size;                  // Counted as a whole block until it has been read
+   };
+
+   Block ReadBlock(const std::string& filename, uint64_t index);
+   void Evict();
+
+   std::shared_ptr<ILogger> _logger;
+   const uint64_t _capacity;
+   const uint32_t _blockSize;
+
+   std::mutex _guard;
+   std::map<Key, Entry> _entries;
+   std::list<Key> _recent;          // Most recently used first
+   uint64_t _cachedBytes;
+
+   std::atomic<uint64_t> _hits;
+   std::atomic<uint64_t> _misses;
+   std::atomic<uint64_t> _bytesRead;
+   std::atomic<uint64_t> _evictions;
+};
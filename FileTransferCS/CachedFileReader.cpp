@@ -0,0 +1,65 @@
+#include "CachedFileReader.h"
+
+#include <algorithm>
+
+CachedFileReader::CachedFileReader(std::shared_ptr<BlockCache> cache, const std::string& filename, const std::string& source)
+   : _cache(cache),
+   _filename(filename),
+   _source(source),
+   _unitSize(128),
+   _blockIndex(0),
+   _blockOffset(0)
+{}
+
+uint32_t CachedFileReader::Read(std::vector<char>& s)
+{
+   if (!_block)
+   {
+      _block = _cache->Get(_filename, _blockIndex);
+   }
+   else if (_blockOffset >= _block->size())
+   {
+      // A short block is the last one
+      if (_block->size() < _cache->GetBlockSize())
+      {
+         s.clear();
+         return 0;
+      }
+
+      _block = _cache->Get(_filename, ++_blockIndex);
+      _blockOffset = 0;
+   }
+
+   if (!_block)
+   {
+      s.clear();
+      return 0;
+   }
+
+   auto count = std::min<size_t>(_unitSize, _block->size() - _blockOffset);
+   s.assign(_block->begin() + _blockOffset, _block->begin() + _blockOffset + count);
+   _blockOffset += count;
+   return (uint32_t)count;
+}
+
+uint32_t CachedFileReader::ReadAt(uint64_t offset, uint32_t length, std::vector<char>& s)
+{
+   // Called from the receive thread for retransmissions, so goes to the cache rather than the current block
+   s.clear();
+
+   auto blockSize = _cache->GetBlockSize();
+   while (s.size() < length)
+   {
+      auto position = offset + s.size();
+      auto block = _cache->Get(_filename, position / blockSize);
+      if (!block) break;
+
+      auto start = (size_t)(position % blockSize);
+      if (start >= block->size()) break;
+
+      auto count = std::min<size_t>(length - s.size(), block->size() - start);
+      s.insert(s.end(), block->begin() + start, block->begin() + start + count);
+   }
+
+   return (uint32_t)s.size();
+}
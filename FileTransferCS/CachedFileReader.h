@@ -0,0 +1,36 @@
+#pragma once
+
+#include "IReader.h"
+#include "BlockCache.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Reader that takes a file's blocks from a shared BlockCache rather than the file, so any number of
+/// transfers of the same file cost one read of it.  Hands out the same size units as FileReader.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class CachedFileReader : public IReader
+{
+public:
+   // Reads filename, naming the source as source to the receiver
+   CachedFileReader(std::shared_ptr<BlockCache> cache, const std::string& filename, const std::string& source);
+   CachedFileReader(const CachedFileReader&) = delete;
+
+   uint32_t Read(std::vector<char>& s) override;
+   uint32_t ReadAt(uint64_t offset, uint32_t length, std::vector<char>& s) override;
+   bool CanReadAt() override { return true; }
+   const std::string& GetSource() override { return _source; }
+
+private:
+   std::shared_ptr<BlockCache> _cache;
+   const std::string _filename;
+   const std::string _source;
+   const uint32_t _unitSize;
+
+   // The cache block being read through, held so each unit isn't a cache lookup
+   BlockCache::Block _block;
+   uint64_t _blockIndex;
+   size_t _blockOffset;
+};
@@ -0,0 +1,150 @@
+#include "ChunkStore.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+
+#include <windows.h>
+#include <bcrypt.h>
+
+#pragma comment(lib, "bcrypt.lib")
+
+ChunkStore::ChunkStore(std::shared_ptr<ILogger> logger, const std::string& directory)
+   : _logger(logger),
+   _directory(directory),
+   _hits(0),
+   _misses(0),
+   _hitBytes(0),
+   _storedBytes(0),
+   _tempCounter(0)
+{
+   std::error_code ec;
+   std::filesystem::create_directories(_directory, ec);
+   if (!std::filesystem::is_directory(_directory))
+   {
+      throw std::runtime_error("create chunk store directory failed");
+   }
+}
+
+ChunkFingerprint ChunkStore::Fingerprint(const char* data, size_t length)
+{
+   // Opening a provider is expensive so one is shared.  Hash objects created from it are independent
+   static BCRYPT_ALG_HANDLE algorithm = []()
+   {
+      BCRYPT_ALG_HANDLE h = nullptr;
+      if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&h, BCRYPT_SHA256_ALGORITHM, nullptr, 0)))
+      {
+         throw std::runtime_error("open SHA256 provider failed");
+      }
+      return h;
+   }();
+
+   ChunkFingerprint fingerprint;
+
+   BCRYPT_HASH_HANDLE hash = nullptr;
+   if (!BCRYPT_SUCCESS(BCryptCreateHash(algorithm, &hash, nullptr, 0, nullptr, 0, 0)))
+   {
+      throw std::runtime_error("create hash failed");
+   }
+
+   bool ok = BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)data, (ULONG)length, 0)) &&
+             BCRYPT_SUCCESS(BCryptFinishHash(hash, fingerprint.data(), (ULONG)fingerprint.size(), 0));
+   BCryptDestroyHash(hash);
+
+   if (!ok)
+   {
+      throw std::runtime_error("hash chunk failed");
+   }
+
+   return fingerprint;
+}
+
+bool ChunkStore::Get(const ChunkFingerprint& fingerprint, uint32_t length, std::vector<char>& data)
+{
+   std::ifstream f(GetPath(fingerprint), std::ios::in | std::ios::binary);
+   if (f.is_open())
+   {
+      data.resize(length);
+      f.read(data.data(), data.size());
+
+      // Guard against a damaged or truncated file, it is simply treated as missing
+      if ((size_t)f.gcount() == length && f.peek() == std::ifstream::traits_type::eof() &&
+          Fingerprint(data.data(), data.size()) == fingerprint)
+      {
+         _hits++;
+         _hitBytes += length;
+         return true;
+      }
+
+      std::stringstream ss;
+      ss << "Chunk " << GetPath(fingerprint) << " is damaged, ignoring it";
+      _logger->Log(3, ss.str());
+   }
+
+   _misses++;
+   return false;
+}
+
+void ChunkStore::Put(const ChunkFingerprint& fingerprint, const std::vector<char>& data)
+{
+   auto path = GetPath(fingerprint);
+
+   std::error_code ec;
+   if (std::filesystem::exists(path, ec)) return;
+
+   std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+   std::stringstream ss;
+   ss << path << "." << GetCurrentProcessId() << "." << _tempCounter++ << ".tmp";
+   auto tempPath = ss.str();
+
+   {
+      std::ofstream f(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+      f.write(data.data(), data.size());
+      if (!f.good())
+      {
+         f.close();
+         std::filesystem::remove(tempPath, ec);
+
+         std::stringstream ss;
+         ss << "Unable to write chunk " << path;
+         _logger->Log(3, ss.str());
+         return;
+      }
+   }
+
+   std::filesystem::rename(tempPath, path, ec);
+   if (ec)
+   {
+      // Most likely another transaction stored the same chunk first
+      std::filesystem::remove(tempPath, ec);
+      return;
+   }
+
+   _storedBytes += data.size();
+}
+
+ChunkStoreStats ChunkStore::GetStats()
+{
+   ChunkStoreStats stats;
+   stats.hits = _hits;
+   stats.misses = _misses;
+   stats.hitBytes = _hitBytes;
+   stats.storedBytes = _storedBytes;
+   return stats;
+}
+
+std::string ChunkStore::GetPath(const ChunkFingerprint& fingerprint)
+{
+   std::stringstream name;
+   name << std::hex << std::setfill('0');
+   for (auto b : fingerprint)
+   {
+      name << std::setw(2) << (int)b;
+   }
+
+   auto s = name.str();
+   return (std::filesystem::path(_directory) / s.substr(0, 2) / (s + ".chunk")).string();
+}
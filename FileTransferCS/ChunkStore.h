@@ -0,0 +1,54 @@
+#pragma once
+
+#include "ILogger.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// SHA-256 of a chunk's contents
+typedef std::array<uint8_t, 32> ChunkFingerprint;
+
+struct ChunkStoreStats
+{
+   uint64_t hits;          // Chunks found in the store
+   uint64_t misses;        // Chunks asked for that were not there
+   uint64_t hitBytes;      // Bytes served from the store
+   uint64_t storedBytes;   // Bytes added to the store
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Persistent content addressed store of chunks, one file per chunk named by its fingerprint.
+/// Files are fanned out over subdirectories on the first byte of the fingerprint and are written
+/// under a temporary name and renamed, so a reader never sees a partial chunk.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class ChunkStore
+{
+public:
+   ChunkStore(std::shared_ptr<ILogger> logger, const std::string& directory);
+   ChunkStore(const ChunkStore&) = delete;
+
+   // Fingerprint of a block of data, used by both ends
+   static ChunkFingerprint Fingerprint(const char* data, size_t length);
+
+   // Reads a stored chunk.  False if it is missing or does not match its fingerprint
+   bool Get(const ChunkFingerprint& fingerprint, uint32_t length, std::vector<char>& data);
+
+   void Put(const ChunkFingerprint& fingerprint, const std::vector<char>& data);
+
+   ChunkStoreStats GetStats();
+
+private:
+   std::string GetPath(const ChunkFingerprint& fingerprint);
+
+   std::shared_ptr<ILogger> _logger;
+   std::string _directory;
+
+   std::atomic<uint64_t> _hits;
+   std::atomic<uint64_t> _misses;
+   std::atomic<uint64_t> _hitBytes;
+   std::atomic<uint64_t> _storedBytes;
+   std::atomic<uint32_t> _tempCounter;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <cstdint>
+
+// Default chunk sizes.  The maximum has to fit a single datagram along with the header and cipher overhead
+static const uint32_t DefaultMinChunkSize = 0x800;          // 2 KB
+static const uint32_t DefaultAverageChunkSize = 0x1000;     // 4 KB
+static const uint32_t DefaultMaxChunkSize = 0x4000;         // 16 KB
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Splits a byte stream into content defined chunks using a gear rolling hash (FastCDC).  Boundaries
+/// depend only on the bytes near them, so an insert or delete early in a file only changes the
+/// chunks around the edit and the rest still match chunks sent before.
+///
+/// Cutting starts at the minimum size, below the average a stricter mask is used and above it a
+/// looser one, which keeps chunk sizes close to the average.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class ContentChunker
+{
+public:
+   ContentChunker(uint32_t minSize = DefaultMinChunkSize, uint32_t averageSize = DefaultAverageChunkSize, uint32_t maxSize = DefaultMaxChunkSize)
+      : _minSize(minSize),
+      _averageSize(averageSize),
+      _maxSize(maxSize)
+   {
+      int bits = 0;
+      while ((1u << (bits + 1)) <= averageSize) bits++;
+
+      // Mask the top bits, those have seen the most bytes of the window
+      _maskSmall = TopBits(bits + 1);
+      _maskLarge = TopBits(bits - 1);
+   }
+
+   uint32_t GetMaxSize() const { return _maxSize; }
+
+   // Length of the chunk at the front of data.  For the cut to be stable data must hold at least
+   // GetMaxSize() bytes, unless this is the end of the stream
+   size_t Cut(const char* data, size_t length) const
+   {
+      if (length <= _minSize) return length;
+      if (length > _maxSize) length = _maxSize;
+
+      auto& gear = GetGearTable();
+      auto normal = std::min<size_t>(_averageSize, length);
+
+      uint64_t hash = 0;
+      size_t i = _minSize;
+      for (; i < normal; i++)
+      {
+         hash = (hash << 1) + gear[(uint8_t)data[i]];
+         if (!(hash & _maskSmall)) return i + 1;
+      }
+
+      for (; i < length; i++)
+      {
+         hash = (hash << 1) + gear[(uint8_t)data[i]];
+         if (!(hash & _maskLarge)) return i + 1;
+      }
+
+      return length;
+   }
+
+private:
+   static uint64_t TopBits(int count)
+   {
+      if (count <= 0) return 0;
+      return ~0ull << (64 - count);
+   }
+
+   // Random values per byte.  Generated from a fixed seed as both ends must agree on the boundaries
+   static const std::array<uint64_t, 256>& GetGearTable()
+   {
+      static const std::array<uint64_t, 256> table = []()
+      {
+         std::array<uint64_t, 256> t;
+         uint64_t state = 0x46696C6543445321ull;
+         for (auto& value : t)
+         {
+            // splitmix64
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            value = z ^ (z >> 31);
+         }
+         return t;
+      }();
+      return table;
+   }
+
+   const uint32_t _minSize;
+   const uint32_t _averageSize;
+   const uint32_t _maxSize;
+   uint64_t _maskSmall;
+   uint64_t _maskLarge;
+};
@@ -1,43 +1,175 @@
 #include "DataTransferClient.h"
+#include "ChunkStore.h"
 
 #include <random>
 #include <sstream>
+#include <cstring>
+
+// Longest run of zeros sent as a single zero range
+static const uint32_t MaxZeroRange = 0x40000000;
+
+// The start, and then the cookie echo, are resent at this interval until answered
+static const int HandshakeRetryMs = 200;
+static const int HandshakeAttempts = 10;
+
+// The end is resent at this interval until the final acknowledgement arrives.  The attempts start over whenever an
+// acknowledgement shows the server is still making progress
+static const int EndRetryMs = 500;
+static const int EndAttempts = 20;
+
+// Units sent per step when sending from the thread pool, before making way for other transfers
+static const int SendBatchUnits = 64;
+
+// A sequence repaired for a NAK is not repaired again within this time
+static const int RepairHoldoffMs = 100;
 
 DataTransferClient::DataTransferClient(std::shared_ptr<ILogger> logger, 
                                        std::shared_ptr<IWorkerThreadPool> threadPool, 
                                        std::shared_ptr<IReader> reader, 
-                                       std::shared_ptr<ISenderReceiver> senderReceiver)
+                                       std::shared_ptr<ISenderReceiver> senderReceiver,
+                                       const DataTransferClientOptions& options)
    : _logger(logger),
    _threadPool(threadPool),
    _reader(reader),
-   _senderReceiver(senderReceiver)
+   _senderReceiver(senderReceiver),
+   _options(options),
+   _transactionID(0),
+   _keepData(!reader->CanReadAt()),
+   _established(false),
+   _handshakeAttempts(0),
+   _echoSent(false),
+   _sendState(SendState_Start),
+   _sequenceNumber(0),
+   _offset(0),
+   _endOfSource(false),
+   _endSequence(UINT32_MAX),
+   _endAttempts(0),
+   _acknowledged(0),
+   _completionFuture(_completion.get_future().share()),
+   _completed(false),
+   _sendContext(std::make_shared<SendContext>())
 {
+   _sendContext->client = this;
+
    RunReceiver();
-   RunSender();
+
+   if (_options.sendAsync) ScheduleStep(0);
+   else RunSender();
+}
+
+DataTransferClient::~DataTransferClient()
+{
+   {
+      // Waits out a step that is running now, later ones find no client and do nothing
+      std::lock_guard<std::mutex> lock(_sendContext->guard);
+      _sendContext->client = nullptr;
+   }
+
+   Complete(false);
+
+   // The key is kept until now so late retransmit requests can still be answered
+   if (_options.cipher) _options.cipher->EndTransaction(_transactionID);
 }
 
 void DataTransferClient::RunReceiver()
 {
-   _senderReceiver->Receive([&](auto buf)
+   _senderReceiver->Receive([&](const std::vector<char>& buf)
    {
-      // Handle the new packet
+      // Handle the new packet.  The network stack's arrival time is the more precise, where the transport has it
+      auto receiveTime = _senderReceiver->GetReceiveTime();
+      auto receivedAt = receiveTime ? (uint32_t)receiveTime : GetWireTimestamp();
       auto tu = std::make_shared<TransactionUnit>(buf);
 
-      std::stringstream ss;
-      ss << "Client got " << buf.size() << " bytes";
-      _logger->Log(0, ss.str());
+      if (_logger->IsEnabled(0))
+      {
+         std::stringstream ss;
+         ss << "Client got " << buf.size() << " bytes";
+         _logger->Log(0, ss.str());
+      }
 
       // Ensure we got the right cookie, otherwise just drop the message on the floor
       if (tu->IsValid())
       {
+         // With encryption on the server seals its replies with the transaction's key.  One that does not open is
+         // forged, and could otherwise release unacknowledged data or complete the transfer
+         switch (tu->messagetype)
+         {
+         case MsgType_RetransmitReq:
+         case MsgType_Nak:
+         case MsgType_Ack:
+         case MsgType_Challenge:
+            if (tu->transactionid != _transactionID || (_options.cipher && !_options.cipher->Open(*tu))) return;
+            break;
+         default:
+            break;
+         }
+
          // Okay, this look like a valid message.  See what to do with it, check the message type
          switch (tu->messagetype)
          {
          case MsgType_RetransmitReq:
          {
-            std::stringstream ss;
-            ss << "Client got retransmit request";
-            _logger->Log(0, ss.str());
+            if (_logger->IsEnabled(0))
+            {
+               std::stringstream ss;
+               ss << "Client got retransmit request for " << tu->sequencenum;
+               _logger->Log(0, ss.str());
+            }
+
+            if (tu->transactionid == _transactionID) Retransmit(tu->sequencenum);
+         }
+         break;
+
+         case MsgType_Nak:
+         {
+            if (tu->transactionid == _transactionID) Repair(*tu);
+         }
+         break;
+
+         case MsgType_Ack:
+         {
+            // Everything before the acknowledged sequence has been received, there is no need to keep it
+            if (tu->transactionid == _transactionID)
+            {
+               if (tu->echoTimestamp)
+               {
+                  std::lock_guard<std::mutex> lock(_roundTripGuard);
+                  _roundTrip.AddSample(receivedAt - tu->echoTimestamp);
+               }
+
+               _retransmitStore.Release(tu->sequencenum);
+               if (tu->sequencenum >= _endSequence) Complete(true);
+
+               if (tu->sequencenum > _acknowledged)
+               {
+                  _acknowledged = tu->sequencenum;
+                  _endAttempts = 0;
+               }
+
+               // The first acknowledgement also completes the cookie handshake
+               bool established;
+               {
+                  std::lock_guard<std::mutex> lock(_handshakeGuard);
+                  established = !_established;
+                  _established = true;
+                  _handshakeWake.notify_all();
+               }
+               if (established && _options.sendAsync) ScheduleStep(0);
+            }
+         }
+         break;
+
+         case MsgType_Challenge:
+         {
+            if (tu->transactionid == _transactionID)
+            {
+               {
+                  std::lock_guard<std::mutex> lock(_handshakeGuard);
+                  _cookie = tu->messagedata;
+                  _handshakeWake.notify_all();
+               }
+               if (_options.sendAsync) ScheduleStep(0);
+            }
          }
          break;
 
@@ -57,67 +189,466 @@ void DataTransferClient::RunReceiver()
    });
 }
 
+DelayStats DataTransferClient::GetRoundTrip()
+{
+   std::lock_guard<std::mutex> lock(_roundTripGuard);
+   return _roundTrip.GetStats();
+}
+
 void DataTransferClient::RunSender()
 {
    try
    {
-      std::vector<char> buffer;
+      BuildStart();
 
-      // Create a random number generator for the transaction id
+      if (!_options.cookieHandshake)
+      {
+         _senderReceiver->Send(_start);
+      }
+      else if (!Handshake())
+      {
+         _logger->Log(5, "Server did not complete the start handshake");
+         Complete(false);
+         return;
+      }
+
+      while (SendNext());
+      SendEnd();
+   }
+   catch (std::exception& e)
+   {
+      _logger->Log(5, e.what());
+      Complete(false);
+   }
+}
+
+void DataTransferClient::SendStep(bool resume)
+{
+   // Runs on a pool thread with the send context guard held
+   try
+   {
+      bool entered = false;
+      if (_sendState == SendState_Start)
+      {
+         BuildStart();
+
+         if (_options.cookieHandshake)
+         {
+            _sendState = SendState_Handshake;
+         }
+         else
+         {
+            _senderReceiver->Send(_start);
+            _sendState = SendState_Units;
+            entered = true;
+         }
+      }
+
+      if (_sendState == SendState_Handshake)
+      {
+         // Picked up again when the server answers or the retry interval is up
+         if (!HandshakeStep()) return;
+         _sendState = SendState_Units;
+         entered = true;
+      }
+
+      // Units are sent by one chain of steps, started by the step that got here first.  Handshake retries and
+      // answers arriving late are ignored rather than starting another
+      if (_sendState == SendState_Units && (entered || resume))
+      {
+         for (int i = 0; i < SendBatchUnits; i++)
+         {
+            if (!SendNext())
+            {
+               SendEnd();
+               _sendState = SendState_Done;
+               return;
+            }
+         }
+
+         // Back of the queue, behind the other transfers sharing the pool
+         ScheduleStep(0, true);
+      }
+   }
+   catch (std::exception& e)
+   {
+      _logger->Log(5, e.what());
+      _sendState = SendState_Done;
+      Complete(false);
+   }
+}
+
+void DataTransferClient::ScheduleStep(int delayMs, bool resume)
+{
+   auto step = [context = _sendContext, resume]()
+   {
+      std::lock_guard<std::mutex> lock(context->guard);
+      if (context->client) context->client->SendStep(resume);
+   };
+
+   if (delayMs > 0) _threadPool->StartTimer(delayMs, step);
+   else _threadPool->Post(step);
+}
+
+void DataTransferClient::Complete(bool success)
+{
+   {
+      std::lock_guard<std::mutex> lock(_completionGuard);
+      if (_completed) return;
+
+      _completed = true;
+      _completion.set_value(success);
+   }
+
+   if (_options.onComplete) _options.onComplete();
+}
+
+void DataTransferClient::BuildStart()
+{
+   if (_options.transactionID)
+   {
+      _transactionID = _options.transactionID;
+   }
+   else
+   {
+      // Any id but zero, drawn from the full 32 bits so concurrent transactions to a server rarely collide
       std::random_device rd;
       std::mt19937 mt(rd());
-      std::uniform_real_distribution<double> dist(0, 0xFFFF);
-      auto transactionID = dist(mt);
-
-      // Start sequencing a zero
-      int sequenceNumber = 0;
-
-      // Create a transaction unit for the start block
-      auto tu = std::make_shared<TransactionUnit>();
-      
-      auto source = _reader->GetSource();
-      tu->messagedata.assign(source.begin(), source.end());
-      tu->messagelength = (uint16_t)source.size();
-      tu->messagetype = MsgType_StartTransaction;
-      tu->transactionid = (uint32_t)transactionID;
-      tu->sequencenum = 0;
-
-      tu->GetBlob(buffer);
+      std::uniform_int_distribution<uint32_t> dist(1, UINT32_MAX);
+      _transactionID = dist(mt);
+   }
+
+   // Create a transaction unit for the start block
+   TransactionUnit tu;
+
+   auto source = _reader->GetSource();
+   tu.messagedata.assign(source.begin(), source.end());
+   tu.messagelength = (uint16_t)source.size();
+   tu.messagetype = MsgType_StartTransaction;
+   tu.transactionid = _transactionID;
+   tu.sequencenum = _options.sync ? StartFlag_Sync : 0;
+
+   if (_options.cipher)
+   {
+      // Secure start, the handshake goes in the clear ahead of the sealed filename
+      std::vector<char> handshake;
+      _options.cipher->BeginTransaction(tu.transactionid, handshake);
+
+      tu.messagetype = MsgType_StartSecureTransaction;
+      _options.cipher->Seal(tu);
+
+      tu.messagedata.insert(tu.messagedata.begin(), handshake.begin(), handshake.end());
+      tu.messagelength = (uint16_t)tu.messagedata.size();
+   }
+
+   tu.GetBlob(_start);
+}
+
+bool DataTransferClient::Handshake()
+{
+   std::unique_lock<std::mutex> lock(_handshakeGuard);
+
+   // Send the start until the server answers with a cookie, then echo the cookie with the same start until it
+   // acknowledges.  The server keeps nothing between the two, the echo carries all it needs
+   for (int attempt = 0; attempt < HandshakeAttempts && !_established; attempt++)
+   {
+      bool echo;
+      auto buffer = GetHandshakeMessage(echo);
+
+      // Not held while sending, the answer may arrive on this thread
+      lock.unlock();
       _senderReceiver->Send(buffer);
+      lock.lock();
 
-      while (1)
+      _handshakeWake.wait_for(lock, std::chrono::milliseconds(HandshakeRetryMs), [&]()
       {
-         // Create a transaction unit for this block
-         auto tu = std::make_shared<TransactionUnit>();
-
-         // Read the first block from the file
-         int read = _reader->Read(tu->messagedata);
-         if (read == 0) break;
-
-         tu->messagetype = MsgType_Data;
-         tu->messagelength = (uint16_t)tu->messagedata.size();
-         tu->transactionid = (uint32_t)transactionID;
-         tu->sequencenum = sequenceNumber++;
-         _manager.Add(tu);
-
-         // Send this block to the server
-         tu->GetBlob(buffer);
-         _senderReceiver->Send(buffer);
+         return _established || (!echo && !_cookie.empty());
+      });
+   }
+
+   return _established;
+}
+
+bool DataTransferClient::HandshakeStep()
+{
+   std::unique_lock<std::mutex> lock(_handshakeGuard);
+   if (_established) return true;
+
+   // Send again once the last message has gone unanswered for the retry interval, or straight away when a
+   // cookie has arrived for the start
+   auto now = std::chrono::steady_clock::now();
+   bool cookieArrived = !_cookie.empty() && !_echoSent;
+   if (_handshakeAttempts && !cookieArrived && now - _handshakeSentAt < std::chrono::milliseconds(HandshakeRetryMs)) return false;
+
+   if (_handshakeAttempts >= HandshakeAttempts)
+   {
+      _logger->Log(5, "Server did not complete the start handshake");
+      _sendState = SendState_Done;
+      Complete(false);
+      return false;
+   }
+
+   auto buffer = GetHandshakeMessage(_echoSent);
+   _handshakeAttempts++;
+   _handshakeSentAt = now;
+
+   lock.unlock();
+   _senderReceiver->Send(buffer);
+   ScheduleStep(HandshakeRetryMs);
+   return false;
+}
+
+std::vector<char> DataTransferClient::GetHandshakeMessage(bool& echo)
+{
+   // Called with the handshake guard held
+   echo = !_cookie.empty();
+   if (!echo) return _start;
+
+   TransactionUnit tu;
+   tu.messagedata = _cookie;
+   tu.messagedata.insert(tu.messagedata.end(), _start.begin(), _start.end());
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   tu.messagetype = MsgType_CookieEcho;
+   tu.transactionid = _transactionID;
+   tu.sequencenum = 0;
+
+   std::vector<char> buffer;
+   tu.GetBlob(buffer);
+   return buffer;
+}
+
+bool DataTransferClient::SendNext()
+{
+   if (_options.dedup) return SendNextChunk();
+
+   // Runs of zeros go as a single zero range rather than block by block
+   auto zeros = (uint32_t)_reader->ReadZeros(MaxZeroRange);
+   if (zeros)
+   {
+      _retransmitStore.Add(_sequenceNumber, _offset, zeros, true);
+      SendZeroRange(_transactionID, _sequenceNumber++, zeros);
+      _offset += zeros;
+      return true;
+   }
+
+   // Create a transaction unit for this block
+   TransactionUnit tu;
+   auto tracer = _options.tracer.get();
+
+   // Read the next block from the file
+   uint32_t read;
+   {
+      TraceSpan span(tracer, TraceStage_Read, _transactionID, _sequenceNumber);
+      read = _reader->Read(tu.messagedata);
+   }
+   if (read == 0) return false;
+
+   std::vector<char> buffer;
+   {
+      TraceSpan span(tracer, TraceStage_Framed, _transactionID, _sequenceNumber);
+      tu.messagetype = MsgType_Data;
+      tu.messagelength = (uint16_t)tu.messagedata.size();
+      tu.transactionid = _transactionID;
+      tu.sequencenum = _sequenceNumber++;
+      if (_keepData) _retransmitStore.Add(tu.sequencenum, _offset, tu.messagedata.data(), read);
+      else _retransmitStore.Add(tu.sequencenum, _offset, read);
+      _offset += read;
+      if (_options.cipher) _options.cipher->Seal(tu);
+      tu.GetHeader(buffer);
+   }
+
+   // Send this block to the server, the payload goes out directly from the unit's messagedata
+   TraceSpan span(tracer, TraceStage_Sent, tu.transactionid, tu.sequencenum);
+   _senderReceiver->Send(buffer, tu.messagedata);
+   return true;
+}
+
+bool DataTransferClient::SendNextChunk()
+{
+   // Between chunks, runs of zeros go as a zero range instead of being chunked
+   if (_pending.empty() && !_endOfSource)
+   {
+      auto zeros = (uint32_t)_reader->ReadZeros(MaxZeroRange);
+      if (zeros)
+      {
+         _retransmitStore.Add(_sequenceNumber, _offset, zeros, true);
+         SendZeroRange(_transactionID, _sequenceNumber++, zeros);
+         _offset += zeros;
+         return true;
       }
+   }
 
-      // Create a transaction unit for the end block
-      tu = std::make_shared<TransactionUnit>();
-      tu->messagedata.assign(source.begin(), source.end());
-      tu->messagelength = (uint16_t)source.size();
-      tu->messagetype = MsgType_EndTransaction;
-      tu->transactionid = (uint32_t)transactionID;
-      tu->sequencenum = 0;
+   // Keep a full maximum chunk in hand so cut points only depend on the data, not on how it was read
+   std::vector<char> block;
+   while (!_endOfSource && _pending.size() < _chunker.GetMaxSize())
+   {
+      if (_reader->Read(block) == 0) _endOfSource = true;
+      else _pending.insert(_pending.end(), block.begin(), block.end());
+   }
+   if (_pending.empty()) return false;
 
-      tu->GetBlob(buffer);
-      _senderReceiver->Send(buffer);
+   auto length = (uint32_t)_chunker.Cut(_pending.data(), _pending.size());
+   auto fingerprint = ChunkStore::Fingerprint(_pending.data(), length);
+
+   // Offer the chunk by reference.  If the server does not hold it, it asks for this sequence and
+   // gets the chunk's data back as an ordinary data unit
+   TransactionUnit tu;
+   tu.messagedata.assign(fingerprint.begin(), fingerprint.end());
+   tu.messagedata.insert(tu.messagedata.end(), (char*)&length, (char*)&length + sizeof(length));
+   tu.messagetype = MsgType_ChunkRef;
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   tu.transactionid = _transactionID;
+   tu.sequencenum = _sequenceNumber++;
+   if (_keepData) _retransmitStore.Add(tu.sequencenum, _offset, _pending.data(), length);
+   else _retransmitStore.Add(tu.sequencenum, _offset, length);
+   _offset += length;
+   if (_options.cipher) _options.cipher->Seal(tu);
+
+   std::vector<char> buffer;
+   tu.GetHeader(buffer);
+   _senderReceiver->Send(buffer, tu.messagedata);
+
+   _pending.erase(_pending.begin(), _pending.begin() + length);
+   return true;
+}
+
+void DataTransferClient::SendEnd()
+{
+   if (_options.dedup)
+   {
+      std::stringstream ss;
+      ss << "Client offered " << _sequenceNumber << " chunks covering " << _offset << " bytes";
+      _logger->Log(1, ss.str());
+   }
+
+   // The acknowledgement of every unit completes the transfer
+   _endSequence = _sequenceNumber;
+
+   // Create a transaction unit for the end block
+   TransactionUnit tu;
+   auto source = _reader->GetSource();
+   tu.messagedata.assign(source.begin(), source.end());
+   tu.messagelength = (uint16_t)source.size();
+   tu.messagetype = MsgType_EndTransaction;
+   tu.transactionid = _transactionID;
+   tu.sequencenum = _sequenceNumber;
+   if (_options.cipher) _options.cipher->Seal(tu);
+
+   tu.GetBlob(_end);
+   _senderReceiver->Send(_end);
+
+   // Either the end or the final acknowledgement can be lost, so the end is repeated until the transfer completes
+   if (_options.repeatEnd) ScheduleEndRetry();
+}
+
+void DataTransferClient::ScheduleEndRetry()
+{
+   _threadPool->StartTimer(EndRetryMs, [context = _sendContext]()
+   {
+      std::lock_guard<std::mutex> lock(context->guard);
+      if (context->client) context->client->OnEndTimer();
+   });
+}
+
+void DataTransferClient::OnEndTimer()
+{
+   // Runs on a pool thread with the send context guard held
+   {
+      std::lock_guard<std::mutex> lock(_completionGuard);
+      if (_completed) return;
+   }
+
+   if (++_endAttempts > EndAttempts)
+   {
+      _logger->Log(5, "Server did not acknowledge the end of the transfer");
+      Complete(false);
+      return;
+   }
+
+   _senderReceiver->Send(_end);
+   ScheduleEndRetry();
+}
+
+void DataTransferClient::SendZeroRange(uint32_t transactionID, uint32_t sequence, uint32_t length)
+{
+   TransactionUnit tu;
+   tu.messagedata.assign((char*)&length, (char*)&length + sizeof(length));
+   tu.messagetype = MsgType_ZeroRange;
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   tu.transactionid = transactionID;
+   tu.sequencenum = sequence;
+   if (_options.cipher) _options.cipher->Seal(tu);
+
+   std::vector<char> buffer;
+   tu.GetBlob(buffer);
+   _senderReceiver->Send(buffer);
+}
+
+void DataTransferClient::Repair(const TransactionUnit& nak)
+{
+   auto now = std::chrono::steady_clock::now();
+   auto holdoff = std::chrono::milliseconds(RepairHoldoffMs);
+
+   // Forget repairs that are past the holdoff
+   for (auto iter = _repaired.begin(); iter != _repaired.end(); )
+   {
+      if (now - iter->second >= holdoff) iter = _repaired.erase(iter);
+      else ++iter;
+   }
+
+   for (size_t offset = 0; offset + sizeof(uint32_t) <= nak.messagedata.size(); offset += sizeof(uint32_t))
+   {
+      uint32_t sequence;
+      memcpy(&sequence, nak.messagedata.data() + offset, sizeof(sequence));
+
+      if (_repaired.count(sequence)) continue;
+      _repaired[sequence] = now;
+
+      Retransmit(sequence);
+   }
+}
+
+void DataTransferClient::Retransmit(uint32_t sequence)
+{
+   try
+   {
+      uint64_t offset = 0;
+      uint32_t length = 0;
+      bool zeros = false;
+      if (!_retransmitStore.Find(sequence, offset, length, zeros))
+      {
+         // Already acknowledged or never sent
+         return;
+      }
+
+      if (zeros)
+      {
+         SendZeroRange(_transactionID, sequence, length);
+         return;
+      }
+
+      // Rebuild the block from the source, or from the copy kept of a source that can't be read again
+      TransactionUnit tu;
+      if (!_retransmitStore.FindData(sequence, tu.messagedata) && _reader->ReadAt(offset, length, tu.messagedata) != length)
+      {
+         std::stringstream ss;
+         ss << "Unable to reread block " << sequence << " for retransmission";
+         _logger->Log(3, ss.str());
+         return;
+      }
+
+      tu.messagetype = MsgType_Data;
+      tu.messagelength = (uint16_t)tu.messagedata.size();
+      tu.transactionid = _transactionID;
+      tu.sequencenum = sequence;
+      if (_options.cipher) _options.cipher->Seal(tu);
+
+      std::vector<char> buffer;
+      tu.GetHeader(buffer);
+      _senderReceiver->Send(buffer, tu.messagedata);
    }
    catch (std::exception& e)
    {
       _logger->Log(5, e.what());
    }
-}
\ No newline at end of file
+}
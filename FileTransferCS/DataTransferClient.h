@@ -1,27 +1,161 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
+#include <map>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <vector>
+#include <functional>
 
 #include "ILogger.h"
 #include "IWorkerThreadPool.h"
 #include "IReader.h"
 #include "ISenderReceiver.h"
+#include "ITransactionCipher.h"
 
-#include "TransactionManager.h"
+#include "RetransmitStore.h"
+#include "ContentChunker.h"
+#include "PacketTracer.h"
+#include "DelayEstimator.h"
+
+struct DataTransferClientOptions
+{
+   // Optional payload encryption.  When set the transaction is started with a cipher handshake and every
+   // message is sealed, and the server's replies are only taken if they open
+   std::shared_ptr<ITransactionCipher> cipher;
+
+   // Split the file into content defined chunks and offer each by fingerprint.  The server only asks
+   // for the data of chunks it does not already hold
+   bool dedup = false;
+
+   // Complete the server's cookie handshake before sending anything else, for servers that require it
+   bool cookieHandshake = false;
+
+   // Repeat the end until the server acknowledges it, failing the transfer if it never does.  Off for servers that
+   // don't acknowledge, those on a multicast group
+   bool repeatEnd = true;
+
+   // Send from the thread pool rather than in the constructor, which returns straight away.  The transfer goes
+   // out a batch of units at a time, so many transfers share the pool's threads.  The pool needs threads
+   bool sendAsync = false;
+
+   // Records how long sampled units take to read, frame and send
+   std::shared_ptr<PacketTracer> tracer;
+
+   // Ask the server to commit the file to stable storage each time it flushes it, rather than leaving that to the
+   // OS.  Slower, but once the end is acknowledged the file survives the server losing power
+   bool sync = false;
+
+   // Send under this transaction id rather than a random one.  Used to answer a pull, which names the id
+   uint32_t transactionID = 0;
+
+   // Called once the completion is ready, on whichever thread readied it, which may be one of the client's own.
+   // It must not destroy the client, post that elsewhere
+   std::function<void()> onComplete;
+};
 
 class DataTransferClient
 {
 public:
-   DataTransferClient(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<IReader> reader, std::shared_ptr<ISenderReceiver> sender);
+   DataTransferClient(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<IReader> reader, std::shared_ptr<ISenderReceiver> sender,
+                      const DataTransferClientOptions& options = DataTransferClientOptions());
+   ~DataTransferClient();
 
    void RunReceiver();
    void RunSender();
 
+   // Number of sent blocks the server has not acknowledged yet
+   size_t GetUnacknowledgedCount() { return _retransmitStore.GetCount(); }
+
+   // Ready once the server has acknowledged the whole transfer, true, or the transfer has failed or the client
+   // is destroyed first, false.  The end is repeated until acknowledged, a server not sending acknowledgements
+   // fails the transfer after about ten seconds of that.  Without repeatEnd such a server never completes it
+   std::shared_future<bool> GetCompletion() { return _completionFuture; }
+
+   // Round trip to the server, measured from the timestamps it echoes in its acknowledgements
+   DelayStats GetRoundTrip();
+
 private:
+   enum SendState
+   {
+      SendState_Start,
+      SendState_Handshake,
+      SendState_Units,
+      SendState_Done,
+   };
+
+   void BuildStart();
+   bool Handshake();
+   bool HandshakeStep();
+   std::vector<char> GetHandshakeMessage(bool& echo);
+   bool SendNext();
+   bool SendNextChunk();
+   void SendEnd();
+   void ScheduleEndRetry();
+   void OnEndTimer();
+   void SendStep(bool resume);
+   void ScheduleStep(int delayMs, bool resume = false);
+   void Complete(bool success);
+   void Repair(const TransactionUnit& nak);
+   void SendZeroRange(uint32_t transactionID, uint32_t sequence, uint32_t length);
+   void Retransmit(uint32_t sequence);
+
    std::shared_ptr<ILogger> _logger;
    std::shared_ptr<IWorkerThreadPool> _threadPool;
    std::shared_ptr<IReader> _reader;
    std::shared_ptr<ISenderReceiver> _senderReceiver;
+   DataTransferClientOptions _options;
+
+   std::atomic<uint32_t> _transactionID;
+   RetransmitStore _retransmitStore;
+   bool _keepData;                        // The source can't be read again, the store keeps each block's data
+
+   // When each sequence was last repaired for a NAK.  Receivers sharing a multicast group all see the one repair,
+   // so NAKs for it from others arriving just after are ignored
+   std::map<uint32_t, std::chrono::steady_clock::time_point> _repaired;
+
+   // Cookie handshake state, the cookie the server challenged with and whether it has accepted the echo
+   std::mutex _handshakeGuard;
+   std::condition_variable _handshakeWake;
+   std::vector<char> _cookie;
+   bool _established;
+   int _handshakeAttempts;
+   bool _echoSent;
+   std::chrono::steady_clock::time_point _handshakeSentAt;
+
+   // Where the send has got to.  Kept here rather than on the stack so an asynchronous send can resume it
+   SendState _sendState;
+   std::vector<char> _start;              // The start message as sent, echoed back in the cookie handshake
+   uint32_t _sequenceNumber;
+   uint64_t _offset;                      // Offset of the next block in the source, recorded for retransmission
+   ContentChunker _chunker;
+   std::vector<char> _pending;            // Bytes read from the source but not yet cut into a chunk
+   bool _endOfSource;
+
+   // Number of units sent in total, known once the end has been sent.  An acknowledgement reaching it completes
+   // the transfer
+   std::atomic<uint32_t> _endSequence;
+   std::vector<char> _end;                // The end message as sent, repeated until acknowledged
+   std::atomic<int> _endAttempts;
+   uint32_t _acknowledged;                // Highest sequence acknowledged, only touched by the receive callback
+   std::mutex _completionGuard;
+   std::promise<bool> _completion;
+   std::shared_future<bool> _completionFuture;
+   bool _completed;
+
+   // Asynchronous steps run on the thread pool and can fire after the client is gone, so they hold this rather
+   // than the client, which detaches itself on destruction.  The guard also keeps steps from overlapping
+   struct SendContext
+   {
+      std::mutex guard;
+      DataTransferClient* client = nullptr;
+   };
+
+   std::shared_ptr<SendContext> _sendContext;
 
-   TransactionManager _manager;
+   DelayEstimator _roundTrip;
+   std::mutex _roundTripGuard;
 };
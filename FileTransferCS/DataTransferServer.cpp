@@ -1,90 +1,1537 @@
-#include "DataTransferServer.h"
+#include "DataTransferServerBuilds.h"
+#include "CachedFileReader.h"
 
 #include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
 
-DataTransferServer::DataTransferServer(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<ISenderReceiver> senderReceiver, std::shared_ptr<IWriterFactory> writerFactory)
+// Number of units written between acknowledgements
+static const uint32_t AckInterval = 64;
+
+// NAK timing.  The random delay spreads receivers out so one NAK can suppress the rest, the holdoff gives a
+// repair time to arrive before the same sequence is asked for again
+static const int NakMinDelayMs = 10;
+static const int NakMaxDelayMs = 50;
+static const int NakHoldoffMs = 200;
+
+// Most sequences listed in one NAK
+static const size_t MaxNakSequences = 256;
+
+// Slots the idle expiry clock hand moves on for each message received
+static const size_t ExpireStepsPerMessage = 4;
+
+// Ended transactions kept for NextTransfer() when nobody is waiting, the oldest are dropped beyond this
+static const size_t MaxCompletedTransfers = 1024;
+
+// Finished transactions whose final acknowledgement is kept to answer a repeated end, the oldest are dropped beyond this
+static const size_t MaxFinishedTransactions = 4096;
+
+// A pull request is repeated at this interval until the transfer starts
+static const int PullRetryMs = 200;
+static const int PullAttempts = 10;
+
+// A relayed transaction finished here waits this long for every downstream server to acknowledge the end
+static const int RelayHoldMs = 30000;
+
+// Most pulled files sent at once, requests beyond this are refused
+static const size_t MaxDownloads = 1024;
+
+// Acknowledgements due in a session are held this long so those of other transactions can join them, unless this
+// many are already waiting
+static const int SessionAckDelayMs = 2;
+static const size_t MaxSessionAcks = 128;
+
+// Most sessions open at once, opens beyond this are refused
+static const size_t MaxSessions = 1024;
+
+// A session start opens with the session id and token, ahead of the start it carries
+static const size_t SessionPrefixSize = sizeof(uint32_t) + sizeof(uint64_t);
+
+// Chunk reference payload, fingerprint followed by the chunk length
+static const size_t ChunkRefSize = sizeof(ChunkFingerprint) + sizeof(uint32_t);
+
+// Coarse millisecond clock for transaction activity, wraps every 49 days
+static uint32_t GetTicks()
+{
+   return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A pulled file must be a relative path that stays inside the pull directory
+static bool IsServablePath(const std::filesystem::path& path)
+{
+   if (path.empty() || path.is_absolute() || path.has_root_name() || path.has_root_directory()) return false;
+
+   for (auto& part : path)
+   {
+      if (part == "..") return false;
+   }
+   return true;
+}
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Transport of a client sending a pulled file.  Sends go out on the server's own transport, which
+/// replies to wherever the pull request came from, and the server hands over the replies for the
+/// transaction as it receives them.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
+class BasicDataTransferServer<Policies>::PullChannel : public ISenderReceiver
+{
+public:
+   PullChannel(std::shared_ptr<Transport> senderReceiver)
+      : _senderReceiver(senderReceiver)
+   {}
+
+   void Send(const std::vector<char>& s) override { _senderReceiver->Send(s); }
+   void Send(const std::vector<char>& header, const std::vector<char>& payload) override { _senderReceiver->Send(header, payload); }
+   void Receive(std::function<void(const std::vector<char>&)> callback) override { _callback = callback; }
+   void Start(uint16_t port) override {}
+
+   void Deliver(const std::vector<char>& buffer)
+   {
+      if (_callback) _callback(buffer);
+   }
+
+private:
+   std::shared_ptr<Transport> _senderReceiver;
+   std::function<void(const std::vector<char>&)> _callback;
+};
+
+template <typename Policies>
+BasicDataTransferServer<Policies>::BasicDataTransferServer(std::shared_ptr<Logger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<Transport> senderReceiver,
+                                                           std::shared_ptr<WriterFactory> writerFactory, const DataTransferServerOptions& options)
       : _logger(logger),
       _threadPool(threadPool),
       _senderReceiver(senderReceiver),
-      _writerFactory(writerFactory)
+      _writerFactory(writerFactory),
+      _options(options),
+      _manager(options.transactionReorderBudget, options.globalReorderBudget, options.spillBudget),
+      _transactions(options.maxTransactions),
+      _downloadCount(0),
+      _timers(std::make_shared<TimerContext>())
 {
+   if (_options.requireCookie)
+   {
+      _cookies = std::make_unique<HandshakeCookie>();
+   }
+
+   if (!_options.pullDirectory.empty() && !_options.blockCache)
+   {
+      _options.blockCache = std::make_shared<BlockCache>(_logger);
+   }
+
+   _timers->server = this;
+   _timers->random.seed(std::random_device()());
+   _sessionRandom.seed(std::random_device()());
+
    Run();
 }
 
-void DataTransferServer::Run()
+template <typename Policies>
+BasicDataTransferServer<Policies>::~BasicDataTransferServer()
 {
-   _senderReceiver->Receive([&](auto buf)
+   // Waits out a timer that is running now, later ones find no server and do nothing
+   std::lock_guard<std::mutex> lock(_timers->guard);
+   _timers->server = nullptr;
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::Run()
+{
+   _senderReceiver->Receive([this](const std::vector<char>& buf)
+   {
+      // The network stack's arrival time is the more precise, where the transport has it
+      auto receiveTime = _senderReceiver->GetReceiveTime();
+      auto receivedAt = receiveTime ? (uint32_t)receiveTime : GetWireTimestamp();
+      auto sender = _senderReceiver->GetSender();
+
+      OnReceive(buf, false, receivedAt, sender);
+   });
+
+   // Replies from downstream servers when relaying
+   for (size_t i = 0; i < _options.relays.size(); i++)
    {
-      // Handle the new packet
-      auto tu = std::make_shared<TransactionUnit>(buf);
+      _options.relays[i]->Receive([this, i](const std::vector<char>& buf)
+      {
+         OnDownstream(i, buf);
+      });
+   }
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OnReceive(const std::vector<char>& buf, bool echoed, uint32_t receivedAt, uint64_t sender)
+{
+   // Handle the new packet
+   uint64_t received = _options.tracer ? _options.tracer->Now() : 0;
+   auto tu = std::make_shared<TransactionUnit>(buf);
 
+   if (_logger->IsEnabled(0))
+   {
       std::stringstream ss;
       ss << "Receiver got " << buf.size() << " bytes";
       _logger->Log(0, ss.str());
+   }
+
+   // Ensure we got the right cookie, otherwise just drop the message on the floor
+   if (tu->IsValid())
+   {
+      // Replies from the receivers of pulled files, for the clients sending them
+      if (!_downloads.empty() && PassToDownload(*tu, buf)) return;
+
+      // The end of a transaction that has finished here, its final acknowledgement was lost.  Answered ahead of the
+      // cookie and cipher checks, which no longer know the transaction
+      if (tu->messagetype == MsgType_EndTransaction && RepeatFinalAck(*tu)) return;
+
+      // Answered without a cookie handshake.  Nothing but the start is sent until the requester acknowledges it, so
+      // a spoofed request costs little
+      if (tu->messagetype == MsgType_PullRequest)
+      {
+         ServePull(*tu, sender);
+         return;
+      }
+
+      // Other receivers' NAKs, heard on a multicast group.  They carry no data so are taken before decryption
+      if (tu->messagetype == MsgType_Nak)
+      {
+         NoteNak(*tu);
+         return;
+      }
+
+      // A start in an open session is taken straight away, the session's token stands in for the cookie handshake
+      if (tu->messagetype == MsgType_SessionStart)
+      {
+         StartSessionTransaction(*tu, receivedAt, sender);
+         return;
+      }
+
+      if (tu->messagetype == MsgType_SessionClose)
+      {
+         CloseSession(*tu);
+         return;
+      }
 
-      // Ensure we got the right cookie, otherwise just drop the message on the floor
-      if (tu->IsValid())
+      if (_cookies && !echoed)
       {
-         // Okay, this look like a valid message.  See what to do with it, check the message type
-         switch (tu->messagetype)
+         // A start only gets a cookie back, the echo of the cookie is then handled as the start it carries.  The same
+         // goes for opening a session
+         if (tu->messagetype == MsgType_StartTransaction || tu->messagetype == MsgType_StartSecureTransaction ||
+             tu->messagetype == MsgType_SessionOpen)
          {
-         case MsgType_StartTransaction:
+            SendChallenge(*tu, buf, sender);
+            return;
+         }
+
+         if (tu->messagetype == MsgType_CookieEcho)
          {
-            // This is a new transaction.  Record it and create a writer to represent it.
-            auto writer = _writerFactory->Create(_logger);
-            _writers[tu->transactionid] = writer;
-            std::string s(tu->messagedata.begin(), tu->messagedata.end());
+            std::vector<char> start;
+            if (!OpenCookieEcho(*tu, sender, start)) return;
 
-            writer->SetDestination(s);
+            // The acknowledgement of an earlier echo was lost
+            if (_transactions.Find(tu->transactionid))
+            {
+               _senderReceiver->SetReplyAddress(tu->transactionid, sender);
+               SendAck(tu->transactionid);
+            }
+            else OnReceive(start, true, receivedAt, sender);
+            return;
          }
-         break;
 
-         case MsgType_EndTransaction:
-         {
-            Write(tu->transactionid);
-            _writers.erase(tu->transactionid);
+         if (!_transactions.Find(tu->transactionid)) return;
+      }
+
+      // Opened in the clear, the transactions in the session are sealed as usual.  Opening it again repeats the token
+      if (tu->messagetype == MsgType_SessionOpen)
+      {
+         OpenSession(*tu, sender);
+         return;
+      }
 
-            tu->messagelength = 0;
-            tu->messagetype = MsgType_RetransmitReq;
-            tu->transactionid = (uint32_t)tu->transactionid;
-            tu->sequencenum = 0;
+      if (_options.idleTimeoutMs > 0)
+      {
+         auto now = GetTicks();
+         _transactions.Touch(tu->transactionid, now);
+         ExpireIdle(now, ExpireStepsPerMessage);
+      }
 
-            std::vector<char> buffer;
-            tu->GetBlob(buffer);
-            _senderReceiver->Send(buffer);
-         }
-         break;
+      NoteArrival(*tu, receivedAt);
+
+      // With encryption on, everything except a secure start must open with the key of its transaction.
+      // This also rejects plain starts and anything for a transaction that was never securely started
+      if (_options.cipher && tu->messagetype != MsgType_StartSecureTransaction && !_options.cipher->Open(*tu))
+      {
+         return;
+      }
 
-         case MsgType_Data:
+      // Accepted, so replies for the transaction go where it came from.  A secure start only once its handshake is
+      if (tu->messagetype != MsgType_StartSecureTransaction) _senderReceiver->SetReplyAddress(tu->transactionid, sender);
+
+      // Pass everything on downstream straight away, sealed units go as they came.  A secure start is held
+      // back until it has been accepted
+      if (tu->messagetype != MsgType_StartSecureTransaction) Relay(buf);
+
+      // Okay, this look like a valid message.  See what to do with it, check the message type
+      switch (tu->messagetype)
+      {
+      case MsgType_StartTransaction:
+      {
+         StartTransaction(tu->transactionid, tu->messagedata, tu->sequencenum);
+      }
+      break;
+
+      case MsgType_StartSecureTransaction:
+      {
+         if (!_options.cipher)
          {
-            _manager.Add(tu);
+            _logger->Log(3, "Secure transaction received but no cipher is configured");
+            break;
+         }
 
-            Write(tu->transactionid);
+         std::vector<char> handshake;
+         if (SplitHandshake(*tu, handshake) && _options.cipher->AcceptTransaction(handshake, *tu))
+         {
+            _senderReceiver->SetReplyAddress(tu->transactionid, sender);
+            Relay(buf);
+            StartTransaction(tu->transactionid, tu->messagedata, tu->sequencenum);
          }
-         break;
+      }
+      break;
 
-         default:
+      case MsgType_EndTransaction:
+      {
+         // The end carries the number of units sent.  Wait for any still missing, asking for them in NAKs as a
+         // repairing receiver does.  The client answers those without repair on too
+         if (_manager.GetNextSequence(tu->transactionid) < tu->sequencenum && _transactions.Find(tu->transactionid))
          {
-            std::stringstream ss;
-            ss << "Unknown message type " << tu->messagetype;
-            _logger->Log(3, ss.str());
+            {
+               std::lock_guard<std::mutex> lock(_writerGuard);
+               auto transaction = _transactions.Find(tu->transactionid);
+               if (transaction) transaction->endPending = true;
+            }
+            {
+               std::lock_guard<std::mutex> lock(_timers->guard);
+               _timers->repairs[tu->transactionid].endSequence = tu->sequencenum;
+            }
+            ScheduleNak(tu->transactionid);
+            break;
          }
+
+         FinishTransaction(tu->transactionid);
+      }
+      break;
+
+      case MsgType_ChunkRef:
+      {
+         ResolveChunk(tu);
+      }
+      break;
+
+      case MsgType_Data:
+      {
+         StoreChunk(*tu);
+         TraceReceived(*tu, received);
+         _manager.Add(tu);
+
+         Write(tu->transactionid);
+      }
+      break;
+
+      case MsgType_ZeroRange:
+      {
+         _manager.Add(tu);
+
+         Write(tu->transactionid);
+      }
+      break;
+
+      // Replies from other receivers sharing a multicast group
+      case MsgType_Ack:
+      case MsgType_RetransmitReq:
          break;
+
+      default:
+      {
+         std::stringstream ss;
+         ss << "Unknown message type " << tu->messagetype;
+         _logger->Log(3, ss.str());
+      }
+      break;
+      }
+   }
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::NoteArrival(const TransactionUnit& tu, uint32_t receivedAt)
+{
+   // Acknowledgements are sent while handling the unit that prompts them, so echoing the latest timestamp
+   // leaves the client a round trip with next to no time spent here in it
+   std::lock_guard<std::mutex> lock(_writerGuard);
+   auto transaction = _transactions.Find(tu.transactionid);
+   if (!transaction || !tu.timestamp) return;
+
+   transaction->lastTimestamp = tu.timestamp;
+   transaction->transit.AddSample(receivedAt - tu.timestamp);
+}
+
+template <typename Policies>
+bool BasicDataTransferServer<Policies>::GetTransit(uint32_t transactionID, DelayStats& stats)
+{
+   std::lock_guard<std::mutex> lock(_writerGuard);
+   auto transaction = _transactions.Find(transactionID);
+   if (!transaction) return false;
+
+   stats = transaction->transit.GetStats();
+   return true;
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::TraceReceived(TransactionUnit& tu, uint64_t start)
+{
+   auto tracer = _options.tracer.get();
+   if (!tracer || !tracer->IsSampled(tu.sequencenum)) return;
+
+   // The unit's wait in the reorder buffer is timed from here
+   tu.receivedAt = tracer->Now();
+   tracer->Record(TraceStage_Received, tu.transactionid, tu.sequencenum, start, tu.receivedAt);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::FinishTransaction(uint32_t transactionID)
+{
+   Write(transactionID);
+
+   std::string destination;
+   bool started = false;
+   uint32_t echoTimestamp = 0;
+   {
+      // Push out whatever is still coalesced in the writer before it is released
+      std::lock_guard<std::mutex> lock(_writerGuard);
+      auto transaction = _transactions.Find(transactionID);
+      if (transaction)
+      {
+         transaction->writer->Flush();
+         destination = transaction->writer->GetDestination();
+         started = true;
+         echoTimestamp = transaction->lastTimestamp;
+         _transactions.Remove(transactionID);
+      }
+   }
+
+   // A relayed transaction is only over once every downstream server has it all, until then the acknowledgement is of
+   // what the slowest of them has
+   bool held = false;
+   {
+      std::lock_guard<std::mutex> lock(_relayGuard);
+      auto iter = _downstreamAcks.find(transactionID);
+      if (iter != _downstreamAcks.end())
+      {
+         // The end repeated for one finished already leaves it waiting as it was
+         auto& acks = iter->second;
+         if (started)
+         {
+            acks.finished = true;
+            acks.endSequence = _manager.GetNextSequence(transactionID);
+            acks.echoTimestamp = echoTimestamp;
          }
+         held = acks.finished && *std::min_element(acks.sequences.begin(), acks.sequences.end()) < acks.endSequence;
       }
-   });
+   }
+   if (held && started) StartRelayHoldTimer(transactionID);
+   if (started && !held) RememberFinished(transactionID, _manager.GetNextSequence(transactionID));
+
+   // Final acknowledgement, the client can release everything it still holds
+   SendAck(transactionID, echoTimestamp);
+
+   auto dedupIter = _dedupStats.find(transactionID);
+   if (dedupIter != _dedupStats.end())
+   {
+      auto& dedup = dedupIter->second;
+      std::stringstream ss;
+      ss << "Transaction " << transactionID << " deduplicated " << dedup.storedChunks << " of " << dedup.chunks << " chunks, "
+         << dedup.storedBytes << " of " << dedup.bytes << " bytes";
+      if (dedup.bytes) ss << " (" << (dedup.storedBytes * 100 / dedup.bytes) << "%)";
+      _logger->Log(1, ss.str());
+   }
+
+   ReleaseTransaction(transactionID, held);
+
+   auto stats = _manager.GetStats();
+   std::stringstream ss;
+   ss << "Transaction " << transactionID << " complete.  Reorder state: " << stats.transactions << " transactions, "
+      << stats.bufferedBytes << " bytes buffered, " << stats.spilledBytes << " bytes spilled, "
+      << stats.spillCount << " spills, " << stats.dropCount << " drops";
+   _logger->Log(1, ss.str());
+
+   if (started) NotifyTransfer(CompletedTransfer{ transactionID, destination, true });
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::ReleaseTransaction(uint32_t transactionID, bool heldForDownstream)
+{
+   // Everything held for the transaction besides its writer.  One held for downstream servers keeps its key to open
+   // their acknowledgements and seal the last one
+   if (!heldForDownstream) ReleaseRelay(transactionID);
+
+   {
+      std::lock_guard<std::mutex> lock(_timers->guard);
+      _timers->repairs.erase(transactionID);
+      _timers->pulls.erase(transactionID);
+   }
+   {
+      // An acknowledgement still due goes out with the session's next
+      std::lock_guard<std::mutex> lock(_sessionGuard);
+      _sessionTransactions.erase(transactionID);
+   }
+   _manager.Remove(transactionID);
+   _pendingChunks.erase(transactionID);
+   _dedupStats.erase(transactionID);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::ReleaseRelay(uint32_t transactionID)
+{
+   if (_options.cipher) _options.cipher->EndTransaction(transactionID);
+
+   std::lock_guard<std::mutex> lock(_relayGuard);
+   _downstreamAcks.erase(transactionID);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::ExpireIdle(uint32_t now, size_t steps)
+{
+   std::vector<std::pair<uint32_t, std::shared_ptr<Writer>>> expired;
+   {
+      std::lock_guard<std::mutex> lock(_writerGuard);
+      _transactions.ExpireIdle(now, (uint32_t)_options.idleTimeoutMs, steps, [&](uint32_t transactionID, ServerTransaction& transaction)
+      {
+         expired.emplace_back(transactionID, transaction.writer);
+      });
+   }
+
+   for (auto& pair : expired)
+   {
+      // Keep what did arrive
+      pair.second->Flush();
+      ReleaseTransaction(pair.first);
+
+      std::stringstream ss;
+      ss << "Transaction " << pair.first << " idle for over " << _options.idleTimeoutMs << "ms, abandoning it";
+      _logger->Log(3, ss.str());
+
+      NotifyTransfer(CompletedTransfer{ pair.first, pair.second->GetDestination(), false });
+   }
+}
+
+template <typename Policies>
+std::future<CompletedTransfer> BasicDataTransferServer<Policies>::NextTransfer()
+{
+   std::lock_guard<std::mutex> lock(_transferGuard);
+
+   std::promise<CompletedTransfer> promise;
+   auto future = promise.get_future();
+   if (!_completedTransfers.empty())
+   {
+      promise.set_value(_completedTransfers.front());
+      _completedTransfers.pop_front();
+   }
+   else
+   {
+      _transferWaiters.push_back(std::move(promise));
+   }
+   return future;
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::NotifyTransfer(const CompletedTransfer& transfer)
+{
+   std::lock_guard<std::mutex> lock(_transferGuard);
+
+   if (!_transferWaiters.empty())
+   {
+      _transferWaiters.front().set_value(transfer);
+      _transferWaiters.pop_front();
+      return;
+   }
+
+   if (_completedTransfers.size() >= MaxCompletedTransfers) _completedTransfers.pop_front();
+   _completedTransfers.push_back(transfer);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::StartTransaction(uint32_t transactionID, const std::vector<char>& destination, uint32_t flags)
+{
+   // A new transaction under the id of one finished earlier
+   {
+      std::lock_guard<std::mutex> lock(_finishedGuard);
+      _finished.erase(transactionID);
+   }
+
+   // The sender of a pulled file waits for the start to be acknowledged, as in the cookie handshake
+   bool pulled = false;
+   {
+      std::lock_guard<std::mutex> lock(_timers->guard);
+      auto iter = _timers->pulls.find(transactionID);
+      if (iter != _timers->pulls.end())
+      {
+         pulled = true;
+         iter->second.started = true;
+      }
+   }
+
+   // The acknowledgement of an earlier start was lost, keep what has been written
+   if (pulled && _transactions.Find(transactionID))
+   {
+      SendAck(transactionID);
+      return;
+   }
+
+   auto now = GetTicks();
+   if (!_transactions.Find(transactionID) && _transactions.GetCount() >= _options.maxTransactions)
+   {
+      // At the limit, make room from any transaction that has gone idle before refusing this one
+      if (_options.idleTimeoutMs > 0) ExpireIdle(now, _transactions.GetCapacity());
+
+      if (_transactions.GetCount() >= _options.maxTransactions)
+      {
+         std::stringstream ss;
+         ss << "Too many transactions, refusing transaction " << transactionID;
+         _logger->Log(3, ss.str());
+         return;
+      }
+   }
+
+   // This is a new transaction.  Record it and create a writer to represent it.
+   auto writer = Policies::CreateWriter(*_writerFactory, _logger);
+   std::string s(destination.begin(), destination.end());
+
+   writer->SetDestination(s);
+   if (flags & StartFlag_Sync) writer->SetSyncOnFlush(true);
+   {
+      std::lock_guard<std::mutex> lock(_writerGuard);
+      _transactions.Insert(transactionID, now)->writer = writer;
+   }
+
+   if (!_options.relays.empty())
+   {
+      std::lock_guard<std::mutex> lock(_relayGuard);
+      _downstreamAcks[transactionID].sequences.assign(_options.relays.size(), 0);
+   }
+
+   // Tells a client waiting on the cookie handshake that it can go ahead
+   if (_cookies || pulled) SendAck(transactionID);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::SendChallenge(const TransactionUnit& start, const std::vector<char>& buffer, uint64_t sender)
+{
+   // Smaller than the start it answers, so a spoofed start can't be used to amplify traffic at someone else
+   TransactionUnit tu;
+   tu.messagedata = _cookies->Make(sender, start.transactionid, buffer);
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   tu.messagetype = MsgType_Challenge;
+   tu.transactionid = start.transactionid;
+   tu.sequencenum = 0;
+
+   // Sealed with keys made from the start's handshake, so the client knows the cookie came from here.  Nothing is
+   // kept and a start that does not open gets no answer
+   if (_options.cipher)
+   {
+      TransactionUnit sealed = start;
+      std::vector<char> handshake;
+      if (!SplitHandshake(sealed, handshake) || !_options.cipher->SealReply(handshake, sealed, tu)) return;
+   }
+
+   // Straight back to the sender, where the transaction is answered only changes once the echo is accepted
+   std::vector<char> challenge;
+   tu.GetBlob(challenge);
+   _senderReceiver->SendTo(sender, challenge);
+}
+
+template <typename Policies>
+bool BasicDataTransferServer<Policies>::SplitHandshake(TransactionUnit& tu, std::vector<char>& handshake)
+{
+   // A secure start, or session open, has the cipher handshake in front of the sealed part
+   auto handshakeSize = _options.cipher->GetHandshakeSize();
+   if (tu.messagedata.size() < handshakeSize) return false;
+
+   handshake.assign(tu.messagedata.begin(), tu.messagedata.begin() + handshakeSize);
+   tu.messagedata.erase(tu.messagedata.begin(), tu.messagedata.begin() + handshakeSize);
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   return true;
+}
+
+template <typename Policies>
+bool BasicDataTransferServer<Policies>::Seal(TransactionUnit& tu)
+{
+   // With encryption on, replies are sealed with their transaction's key so the client can tell them from forgeries.
+   // A transaction without a key gets no reply
+   if (!_options.cipher) return true;
+
+   try
+   {
+      _options.cipher->Seal(tu);
+      return true;
+   }
+   catch (std::exception& e)
+   {
+      std::stringstream ss;
+      ss << "Unable to seal a reply for transaction " << tu.transactionid << ", " << e.what();
+      _logger->Log(3, ss.str());
+      return false;
+   }
+}
+
+template <typename Policies>
+bool BasicDataTransferServer<Policies>::OpenCookieEcho(const TransactionUnit& echo, uint64_t sender, std::vector<char>& start)
+{
+   if (echo.messagedata.size() <= HandshakeCookieSize) return false;
+
+   std::vector<char> cookie(echo.messagedata.begin(), echo.messagedata.begin() + HandshakeCookieSize);
+   start.assign(echo.messagedata.begin() + HandshakeCookieSize, echo.messagedata.end());
+
+   TransactionUnit tu(start);
+   if (!tu.IsValid() || tu.transactionid != echo.transactionid ||
+       (tu.messagetype != MsgType_StartTransaction && tu.messagetype != MsgType_StartSecureTransaction && tu.messagetype != MsgType_SessionOpen))
+   {
+      return false;
+   }
+
+   if (!_cookies->Check(cookie, sender, tu.transactionid, start))
+   {
+      std::stringstream ss;
+      ss << "Transaction " << tu.transactionid << " echoed a stale or forged cookie";
+      _logger->Log(3, ss.str());
+      return false;
+   }
+
+   return true;
 }
 
-void DataTransferServer::Write(uint32_t transactionID)
+template <typename Policies>
+void BasicDataTransferServer<Policies>::Write(uint32_t transactionID)
 {
+   // Data for a transaction we never saw start stays buffered until it does
+   auto transaction = _transactions.Find(transactionID);
+   if (!transaction) return;
+   auto writer = transaction->writer;
+
+   // Held while writing so a flush timer does not run alongside.  Released before taking the timer guard
+   std::unique_lock<std::mutex> writerLock(_writerGuard);
+   bool written = false;
+
    while (1)
    {
       auto pTu = _manager.Collect(transactionID);
       if (pTu)
       {
-         std::string s(pTu->messagedata.begin(), pTu->messagedata.end());
-         _writers[transactionID]->Write(s);
+         written = true;
+         auto tracer = _options.tracer.get();
+         if (tracer && pTu->receivedAt)
+         {
+            tracer->Record(TraceStage_Reordered, transactionID, pTu->sequencenum, pTu->receivedAt, tracer->Now());
+         }
+
+         {
+            TraceSpan span(tracer, TraceStage_Written, transactionID, pTu->sequencenum);
+            if (pTu->messagetype == MsgType_ZeroRange)
+            {
+               uint32_t length = 0;
+               if (pTu->messagedata.size() == sizeof(length)) memcpy(&length, pTu->messagedata.data(), sizeof(length));
+               writer->WriteZeros(length);
+            }
+            else
+            {
+               std::string s(pTu->messagedata.begin(), pTu->messagedata.end());
+               writer->Write(s);
+            }
+         }
+
+         // Acknowledge periodically so the client can release its retransmit state as we go
+         if (++transaction->unacknowledged >= AckInterval)
+         {
+            SendAck(transactionID, transaction->lastTimestamp);
+            transaction->unacknowledged = 0;
+         }
       }
       else break;
    }
-}
+   writerLock.unlock();
+
+   if (written && _options.flushIntervalMs > 0)
+   {
+      ScheduleFlush(transactionID);
+   }
+
+   if (_options.repair || transaction->endPending)
+   {
+      // Finish a transaction whose end was waiting on repairs, otherwise look for gaps to NAK
+      bool complete = false;
+      uint32_t endSequence = 0;
+      {
+         std::lock_guard<std::mutex> lock(_timers->guard);
+         auto iter = _timers->repairs.find(transactionID);
+         if (iter != _timers->repairs.end() && iter->second.endSequence)
+         {
+            endSequence = iter->second.endSequence;
+            if (_manager.GetNextSequence(transactionID) >= endSequence)
+            {
+               iter->second.endSequence = 0;
+               complete = true;
+            }
+         }
+      }
+
+      if (complete)
+      {
+         FinishTransaction(transactionID);
+      }
+      else if (!_manager.GetMissing(transactionID, 1, endSequence).empty())
+      {
+         ScheduleNak(transactionID);
+      }
+   }
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::SendAck(uint32_t transactionID, uint32_t echoTimestamp)
+{
+   if (!_options.sendAcks) return;
+
+   TransactionUnit tu;
+   tu.messagelength = 0;
+   tu.messagetype = MsgType_Ack;
+   tu.transactionid = transactionID;
+   tu.sequencenum = _manager.GetNextSequence(transactionID);
+   tu.echoTimestamp = echoTimestamp;
+
+   {
+      std::lock_guard<std::mutex> lock(_relayGuard);
+      auto iter = _downstreamAcks.find(transactionID);
+      if (iter != _downstreamAcks.end())
+      {
+         // Finished here, the reorder state is gone
+         if (iter->second.finished)
+         {
+            tu.sequencenum = iter->second.endSequence;
+            tu.echoTimestamp = iter->second.echoTimestamp;
+         }
+
+         for (auto sequence : iter->second.sequences)
+         {
+            tu.sequencenum = std::min(tu.sequencenum, sequence);
+         }
+      }
+   }
+
+   // Transactions in a session are acknowledged together
+   if (QueueSessionAck(transactionID, tu.sequencenum, echoTimestamp)) return;
+   if (!Seal(tu)) return;
+
+   std::vector<char> buffer;
+   tu.GetBlob(buffer);
+   _senderReceiver->Send(buffer);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::RememberFinished(uint32_t transactionID, uint32_t endSequence)
+{
+   // Called while the transaction still has its key.  Sent on its own even for a transaction in a session
+   if (!_options.sendAcks) return;
+
+   TransactionUnit tu;
+   tu.messagelength = 0;
+   tu.messagetype = MsgType_Ack;
+   tu.transactionid = transactionID;
+   tu.sequencenum = endSequence;
+   if (!Seal(tu)) return;
+
+   FinishedTransaction finished;
+   finished.endSequence = endSequence;
+   tu.GetBlob(finished.ack);
+
+   std::lock_guard<std::mutex> lock(_finishedGuard);
+   if (!_finished.emplace(transactionID, std::move(finished)).second) return;
+
+   _finishedOrder.push_back(transactionID);
+   if (_finishedOrder.size() > MaxFinishedTransactions)
+   {
+      _finished.erase(_finishedOrder.front());
+      _finishedOrder.pop_front();
+   }
+}
+
+template <typename Policies>
+bool BasicDataTransferServer<Policies>::RepeatFinalAck(const TransactionUnit& end)
+{
+   std::vector<char> ack;
+   {
+      std::lock_guard<std::mutex> lock(_finishedGuard);
+      auto iter = _finished.find(end.transactionid);
+      if (iter == _finished.end() || iter->second.endSequence != end.sequencenum) return false;
+      ack = iter->second.ack;
+   }
+
+   _senderReceiver->Send(ack);
+   return true;
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::SendRetransmitRequest(uint32_t transactionID, uint32_t sequence)
+{
+   TransactionUnit tu;
+   tu.messagelength = 0;
+   tu.messagetype = MsgType_RetransmitReq;
+   tu.transactionid = transactionID;
+   tu.sequencenum = sequence;
+   if (!Seal(tu)) return;
+
+   std::vector<char> buffer;
+   tu.GetBlob(buffer);
+   _senderReceiver->Send(buffer);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::ResolveChunk(std::shared_ptr<TransactionUnit> tu)
+{
+   if (tu->messagedata.size() != ChunkRefSize) return;
+
+   ChunkFingerprint fingerprint;
+   uint32_t length;
+   memcpy(fingerprint.data(), tu->messagedata.data(), fingerprint.size());
+   memcpy(&length, tu->messagedata.data() + fingerprint.size(), sizeof(length));
+   if (length == 0 || length > 0xFFFF) return;
+
+   // Already written, a duplicate of a reference we resolved before
+   if (tu->sequencenum < _manager.GetNextSequence(tu->transactionid)) return;
+
+   auto& dedup = _dedupStats[tu->transactionid];
+   dedup.chunks++;
+   dedup.bytes += length;
+
+   // Stored chunks become ordinary data units and are written in sequence like any other
+   if (_options.chunkStore && _options.chunkStore->Get(fingerprint, length, tu->messagedata))
+   {
+      dedup.storedChunks++;
+      dedup.storedBytes += length;
+
+      tu->messagetype = MsgType_Data;
+      tu->messagelength = (uint16_t)length;
+      _manager.Add(tu);
+
+      Write(tu->transactionid);
+      return;
+   }
+
+   // Ask for the data, the client answers with a data unit for this sequence
+   _pendingChunks[tu->transactionid][tu->sequencenum] = fingerprint;
+   SendRetransmitRequest(tu->transactionid, tu->sequencenum);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::StoreChunk(const TransactionUnit& tu)
+{
+   auto iter = _pendingChunks.find(tu.transactionid);
+   if (iter == _pendingChunks.end()) return;
+
+   auto chunkIter = iter->second.find(tu.sequencenum);
+   if (chunkIter == iter->second.end()) return;
+
+   auto fingerprint = chunkIter->second;
+   iter->second.erase(chunkIter);
+
+   if (!_options.chunkStore) return;
+
+   // The source may have changed since the chunk was fingerprinted, only keep data that matches its name
+   if (ChunkStore::Fingerprint(tu.messagedata.data(), tu.messagedata.size()) != fingerprint)
+   {
+      std::stringstream ss;
+      ss << "Chunk data for sequence " << tu.sequencenum << " does not match its fingerprint, not storing it";
+      _logger->Log(3, ss.str());
+      return;
+   }
+
+   _options.chunkStore->Put(fingerprint, tu.messagedata);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::Relay(const std::vector<char>& buffer)
+{
+   for (auto& relay : _options.relays)
+   {
+      relay->Send(buffer);
+   }
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OnDownstream(size_t index, const std::vector<char>& buffer)
+{
+   TransactionUnit tu(buffer);
+   if (!tu.IsValid()) return;
+
+   switch (tu.messagetype)
+   {
+   case MsgType_RetransmitReq:
+   case MsgType_Nak:
+   {
+      // Only the client can resend, pass the request up.  The answer comes back through here and is relayed
+      _senderReceiver->Send(buffer);
+   }
+   break;
+
+   case MsgType_Ack:
+   {
+      // Sealed downstream with the transaction's key, the same one as here
+      if (_options.cipher && !_options.cipher->Open(tu)) break;
+
+      bool complete = false;
+      uint32_t endSequence = 0;
+      {
+         std::lock_guard<std::mutex> lock(_relayGuard);
+         auto iter = _downstreamAcks.find(tu.transactionid);
+         if (iter == _downstreamAcks.end()) break;
+
+         auto& acks = iter->second;
+         acks.sequences[index] = std::max(acks.sequences[index], tu.sequencenum);
+         complete = acks.finished && *std::min_element(acks.sequences.begin(), acks.sequences.end()) >= acks.endSequence;
+         endSequence = acks.endSequence;
+      }
+
+      // The slowest downstream server may have moved on, let the client know.  Once all of them have the end this is
+      // the final acknowledgement and the transaction can go
+      SendAck(tu.transactionid);
+      if (complete)
+      {
+         RememberFinished(tu.transactionid, endSequence);
+         ReleaseRelay(tu.transactionid);
+      }
+   }
+   break;
+
+   default:
+      break;
+   }
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::ScheduleNak(uint32_t transactionID)
+{
+   std::lock_guard<std::mutex> lock(_timers->guard);
+   StartNakTimer(transactionID, _timers->repairs[transactionID]);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::StartNakTimer(uint32_t transactionID, RepairTransaction& transaction)
+{
+   // Called with the timer guard held
+   if (transaction.timerPending) return;
+   transaction.timerPending = true;
+
+   std::uniform_int_distribution<int> delay(NakMinDelayMs, NakMaxDelayMs);
+   _threadPool->StartTimer(delay(_timers->random), [timers = _timers, transactionID]()
+   {
+      std::lock_guard<std::mutex> lock(timers->guard);
+      if (timers->server) timers->server->OnNakTimer(transactionID);
+   });
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OnNakTimer(uint32_t transactionID)
+{
+   // Runs on a pool thread with the timer guard held
+   auto iter = _timers->repairs.find(transactionID);
+   if (iter == _timers->repairs.end()) return;
+
+   auto& transaction = iter->second;
+   transaction.timerPending = false;
+
+   // Leave out whatever someone asked for recently, the repair is most likely on its way
+   auto now = std::chrono::steady_clock::now();
+   auto missing = _manager.GetMissing(transactionID, MaxNakSequences * 4, transaction.endSequence);
+
+   TransactionUnit tu;
+   for (auto sequence : missing)
+   {
+      auto requested = transaction.requested.find(sequence);
+      if (requested != transaction.requested.end() && now - requested->second < std::chrono::milliseconds(NakHoldoffMs)) continue;
+
+      transaction.requested[sequence] = now;
+      tu.messagedata.insert(tu.messagedata.end(), (char*)&sequence, (char*)&sequence + sizeof(sequence));
+      if (tu.messagedata.size() >= MaxNakSequences * sizeof(sequence)) break;
+   }
+
+   // Nothing before the next expected sequence can be missing any more
+   transaction.requested.erase(transaction.requested.begin(), transaction.requested.lower_bound(_manager.GetNextSequence(transactionID)));
+
+   if (!tu.messagedata.empty())
+   {
+      tu.messagelength = (uint16_t)tu.messagedata.size();
+      tu.messagetype = MsgType_Nak;
+      tu.transactionid = transactionID;
+      tu.sequencenum = 0;
+
+      std::vector<char> buffer;
+      if (Seal(tu))
+      {
+         tu.GetBlob(buffer);
+         _senderReceiver->Send(buffer);
+      }
+   }
+
+   // Keep checking for as long as anything is missing
+   if (!missing.empty()) StartNakTimer(transactionID, transaction);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::ScheduleFlush(uint32_t transactionID)
+{
+   std::lock_guard<std::mutex> lock(_timers->guard);
+
+   // One flush covers everything written until it runs
+   if (!_timers->flushes.insert(transactionID).second) return;
+
+   _threadPool->StartTimer(_options.flushIntervalMs, [timers = _timers, transactionID]()
+   {
+      std::lock_guard<std::mutex> lock(timers->guard);
+      if (timers->server) timers->server->OnFlushTimer(transactionID);
+   });
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OnFlushTimer(uint32_t transactionID)
+{
+   // Runs on a pool thread with the timer guard held
+   _timers->flushes.erase(transactionID);
+
+   // The transaction may have finished in the meantime, which flushed it already
+   std::lock_guard<std::mutex> lock(_writerGuard);
+   auto transaction = _transactions.Find(transactionID);
+   if (transaction)
+   {
+      transaction->writer->Flush();
+   }
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::NoteNak(const TransactionUnit& nak)
+{
+   // Only transactions we are receiving ourselves
+   if (!_transactions.Find(nak.transactionid)) return;
+
+   // Other receivers seal their NAKs with the transaction's key, as this one does
+   TransactionUnit tu = nak;
+   if (_options.cipher && !_options.cipher->Open(tu)) return;
+
+   std::lock_guard<std::mutex> lock(_timers->guard);
+   auto& transaction = _timers->repairs[tu.transactionid];
+
+   auto now = std::chrono::steady_clock::now();
+   for (size_t offset = 0; offset + sizeof(uint32_t) <= tu.messagedata.size(); offset += sizeof(uint32_t))
+   {
+      uint32_t sequence;
+      memcpy(&sequence, tu.messagedata.data() + offset, sizeof(sequence));
+      transaction.requested[sequence] = now;
+   }
+}
+
+template <typename Policies>
+uint32_t BasicDataTransferServer<Policies>::Pull(const std::string& source)
+{
+   TransactionUnit tu;
+   tu.messagedata.assign(source.begin(), source.end());
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   tu.messagetype = MsgType_PullRequest;
+   tu.sequencenum = 0;
+
+   std::vector<char> request;
+   {
+      std::lock_guard<std::mutex> lock(_timers->guard);
+
+      // The sender replies under this id, so it has to be one nothing else here is using
+      std::uniform_int_distribution<uint32_t> ids(1, UINT32_MAX);
+      do
+      {
+         tu.transactionid = ids(_timers->random);
+      } while (_timers->pulls.count(tu.transactionid));
+
+      tu.GetBlob(request);
+
+      auto& pull = _timers->pulls[tu.transactionid];
+      pull.source = source;
+      pull.request = request;
+      pull.attempts = 1;
+   }
+
+   StartPullTimer(tu.transactionid);
+   _senderReceiver->Send(request);
+   return tu.transactionid;
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::StartPullTimer(uint32_t transactionID)
+{
+   _threadPool->StartTimer(PullRetryMs, [timers = _timers, transactionID]()
+   {
+      std::lock_guard<std::mutex> lock(timers->guard);
+      if (timers->server) timers->server->OnPullTimer(transactionID);
+   });
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OnPullTimer(uint32_t transactionID)
+{
+   // Runs on a pool thread with the timer guard held
+   auto iter = _timers->pulls.find(transactionID);
+   if (iter == _timers->pulls.end() || iter->second.started) return;
+
+   auto& pull = iter->second;
+   if (pull.attempts >= PullAttempts)
+   {
+      std::stringstream ss;
+      ss << "Pull of " << pull.source << " was not answered";
+      _logger->Log(3, ss.str());
+
+      NotifyTransfer(CompletedTransfer{ transactionID, pull.source, false });
+      _timers->pulls.erase(iter);
+      return;
+   }
+
+   pull.attempts++;
+   _senderReceiver->Send(pull.request);
+   StartPullTimer(transactionID);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::StartRelayHoldTimer(uint32_t transactionID)
+{
+   _threadPool->StartTimer(RelayHoldMs, [timers = _timers, transactionID]()
+   {
+      std::lock_guard<std::mutex> lock(timers->guard);
+      if (timers->server) timers->server->OnRelayHoldTimer(transactionID);
+   });
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OnRelayHoldTimer(uint32_t transactionID)
+{
+   // Runs on a pool thread with the timer guard held.  The transaction may have been let go already
+   {
+      std::lock_guard<std::mutex> lock(_relayGuard);
+      auto iter = _downstreamAcks.find(transactionID);
+      if (iter == _downstreamAcks.end() || !iter->second.finished) return;
+   }
+
+   std::stringstream ss;
+   ss << "Transaction " << transactionID << " was not acknowledged by every downstream server, giving up on it";
+   _logger->Log(3, ss.str());
+
+   ReleaseRelay(transactionID);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::ServePull(const TransactionUnit& request, uint64_t sender)
+{
+   if (_options.pullDirectory.empty())
+   {
+      _logger->Log(3, "Pull request received but pulls are not served");
+      return;
+   }
+
+   // A repeat of a request already being answered
+   if (_downloads.count(request.transactionid)) return;
+
+   // Clients that gave up on the handshake are only cleared away here, there are no replies to notice it by
+   for (auto iter = _downloads.begin(); iter != _downloads.end(); )
+   {
+      if (iter->second.client->GetCompletion().wait_for(std::chrono::seconds(0)) == std::future_status::ready) iter = _downloads.erase(iter);
+      else ++iter;
+   }
+   _downloadCount = _downloads.size();
+
+   std::string source(request.messagedata.begin(), request.messagedata.end());
+   std::filesystem::path path(source);
+   std::error_code ec;
+   auto filename = std::filesystem::path(_options.pullDirectory) / path;
+   if (!IsServablePath(path) || !std::filesystem::is_regular_file(filename, ec))
+   {
+      std::stringstream ss;
+      ss << "Transaction " << request.transactionid << " pulled " << source << ", which is not served";
+      _logger->Log(3, ss.str());
+      return;
+   }
+
+   if (_downloads.size() >= MaxDownloads)
+   {
+      std::stringstream ss;
+      ss << "Too many pulls, refusing transaction " << request.transactionid;
+      _logger->Log(3, ss.str());
+      return;
+   }
+
+   // Sent from the pool a batch at a time, so many pulls share a few threads
+   DataTransferClientOptions options;
+   options.cipher = _options.cipher;
+   options.cookieHandshake = true;
+   options.sendAsync = true;
+   options.tracer = _options.tracer;
+   options.transactionID = request.transactionid;
+
+   _senderReceiver->SetReplyAddress(request.transactionid, sender);
+   auto& download = _downloads[request.transactionid];
+   download.channel = std::make_shared<PullChannel>(_senderReceiver);
+   download.client = std::make_unique<DataTransferClient>(_logger, _threadPool, std::make_shared<CachedFileReader>(_options.blockCache, filename.string(), source),
+                                                          download.channel, options);
+   _downloadCount = _downloads.size();
+
+   std::stringstream ss;
+   ss << "Sending " << source << " for transaction " << request.transactionid;
+   _logger->Log(1, ss.str());
+}
+
+template <typename Policies>
+bool BasicDataTransferServer<Policies>::PassToDownload(const TransactionUnit& tu, const std::vector<char>& buffer)
+{
+   auto iter = _downloads.find(tu.transactionid);
+   if (iter == _downloads.end()) return false;
+
+   switch (tu.messagetype)
+   {
+   case MsgType_Ack:
+   case MsgType_Nak:
+   case MsgType_RetransmitReq:
+   case MsgType_Challenge:
+      break;
+
+   default:
+      return false;
+   }
+
+   iter->second.channel->Deliver(buffer);
+
+   // Done once the requester has acknowledged the end
+   if (iter->second.client->GetCompletion().wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+   {
+      std::stringstream ss;
+      ss << "Pulled transaction " << tu.transactionid << " sent";
+      _logger->Log(1, ss.str());
+
+      _downloads.erase(iter);
+      _downloadCount = _downloads.size();
+   }
+   return true;
+}
+
+template <typename Policies>
+size_t BasicDataTransferServer<Policies>::GetSessionCount()
+{
+   std::lock_guard<std::mutex> lock(_sessionGuard);
+   return _sessions.size();
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OpenSession(TransactionUnit& open, uint64_t sender)
+{
+   auto sessionID = open.transactionid;
+   {
+      std::lock_guard<std::mutex> lock(_sessionGuard);
+      if (!_sessions.count(sessionID) && _sessions.size() >= MaxSessions)
+      {
+         std::stringstream ss;
+         ss << "Too many sessions, refusing session " << sessionID;
+         _logger->Log(3, ss.str());
+         return;
+      }
+   }
+
+   // With encryption on the open carries a handshake as a secure start does.  The keys it makes seal the session's own
+   // messages, its transactions have keys of their own
+   std::vector<char> handshake;
+   if (_options.cipher && (!SplitHandshake(open, handshake) || !_options.cipher->AcceptTransaction(handshake, open))) return;
+   _senderReceiver->SetReplyAddress(sessionID, sender);
+
+   uint64_t token;
+   {
+      std::lock_guard<std::mutex> lock(_sessionGuard);
+      auto iter = _sessions.find(sessionID);
+      if (iter == _sessions.end())
+      {
+         iter = _sessions.emplace(sessionID, ServerSession()).first;
+         iter->second.token = _sessionRandom();
+
+         std::stringstream ss;
+         ss << "Session " << sessionID << " opened";
+         _logger->Log(1, ss.str());
+      }
+      token = iter->second.token;
+   }
+
+   // Sent even with acknowledgements off, the client can't use the session without the token
+   TransactionUnit tu;
+   tu.messagedata.assign((char*)&token, (char*)&token + sizeof(token));
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   tu.messagetype = MsgType_Ack;
+   tu.transactionid = sessionID;
+   tu.sequencenum = 0;
+   if (!Seal(tu)) return;
+
+   std::vector<char> buffer;
+   tu.GetBlob(buffer);
+   _senderReceiver->Send(buffer);
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::CloseSession(TransactionUnit& tu)
+{
+   if (_options.cipher && !_options.cipher->Open(tu)) return;
+
+   uint64_t token = 0;
+   if (tu.messagedata.size() != sizeof(token)) return;
+   memcpy(&token, tu.messagedata.data(), sizeof(token));
+
+   std::lock_guard<std::mutex> lock(_sessionGuard);
+   auto iter = _sessions.find(tu.transactionid);
+   if (iter == _sessions.end() || iter->second.token != token) return;
+
+   // Transactions still running carry on, acknowledged on their own
+   for (auto transaction = _sessionTransactions.begin(); transaction != _sessionTransactions.end(); )
+   {
+      if (transaction->second == tu.transactionid) transaction = _sessionTransactions.erase(transaction);
+      else ++transaction;
+   }
+   _sessions.erase(iter);
+   if (_options.cipher) _options.cipher->EndTransaction(tu.transactionid);
+
+   std::stringstream ss;
+   ss << "Session " << tu.transactionid << " closed";
+   _logger->Log(1, ss.str());
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::StartSessionTransaction(const TransactionUnit& tu, uint32_t receivedAt, uint64_t sender)
+{
+   if (tu.messagedata.size() <= SessionPrefixSize) return;
+
+   uint32_t sessionID;
+   uint64_t token;
+   memcpy(&sessionID, tu.messagedata.data(), sizeof(sessionID));
+   memcpy(&token, tu.messagedata.data() + sizeof(sessionID), sizeof(token));
+
+   std::vector<char> start(tu.messagedata.begin() + SessionPrefixSize, tu.messagedata.end());
+   TransactionUnit inner(start);
+   if (!inner.IsValid() || inner.transactionid != tu.transactionid ||
+       (inner.messagetype != MsgType_StartTransaction && inner.messagetype != MsgType_StartSecureTransaction))
+   {
+      return;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(_sessionGuard);
+      auto iter = _sessions.find(sessionID);
+      if (iter == _sessions.end() || iter->second.token != token)
+      {
+         std::stringstream ss;
+         ss << "Transaction " << tu.transactionid << " started in session " << sessionID << ", which is not open";
+         _logger->Log(3, ss.str());
+         return;
+      }
+
+      _sessionTransactions[tu.transactionid] = sessionID;
+   }
+
+   // Handled as a start that has been through the cookie handshake
+   OnReceive(start, true, receivedAt, sender);
+
+   // Refused, so it never joined the session
+   if (!_transactions.Find(tu.transactionid))
+   {
+      std::lock_guard<std::mutex> lock(_sessionGuard);
+      _sessionTransactions.erase(tu.transactionid);
+   }
+}
+
+template <typename Policies>
+bool BasicDataTransferServer<Policies>::QueueSessionAck(uint32_t transactionID, uint32_t sequence, uint32_t echoTimestamp)
+{
+   uint32_t sessionID;
+   bool startTimer = false;
+   std::vector<char> buffer;
+   {
+      std::lock_guard<std::mutex> lock(_sessionGuard);
+      auto iter = _sessionTransactions.find(transactionID);
+      if (iter == _sessionTransactions.end()) return false;
+
+      sessionID = iter->second;
+      auto& session = _sessions[sessionID];
+
+      // A later acknowledgement of the same transaction replaces an earlier one
+      session.acks[transactionID] = sequence;
+      if (echoTimestamp) session.echoTimestamp = echoTimestamp;
+
+      if (session.acks.size() >= MaxSessionAcks)
+      {
+         GetSessionAck(sessionID, buffer);
+      }
+      else if (!session.timerPending)
+      {
+         session.timerPending = true;
+         startTimer = true;
+      }
+   }
+
+   if (startTimer) StartSessionAckTimer(sessionID);
+   if (!buffer.empty()) _senderReceiver->Send(buffer);
+   return true;
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::GetSessionAck(uint32_t sessionID, std::vector<char>& buffer)
+{
+   // Called with the session guard held.  Takes the acknowledgements due, leaving none
+   auto& session = _sessions[sessionID];
+   if (session.acks.empty()) return;
+
+   TransactionUnit tu;
+   for (auto& ack : session.acks)
+   {
+      tu.messagedata.insert(tu.messagedata.end(), (const char*)&ack.first, (const char*)&ack.first + sizeof(ack.first));
+      tu.messagedata.insert(tu.messagedata.end(), (const char*)&ack.second, (const char*)&ack.second + sizeof(ack.second));
+   }
+   tu.messagelength = (uint16_t)tu.messagedata.size();
+   tu.messagetype = MsgType_SessionAck;
+   tu.transactionid = sessionID;
+   tu.sequencenum = 0;
+   tu.echoTimestamp = session.echoTimestamp;
+   if (Seal(tu)) tu.GetBlob(buffer);
+
+   session.acks.clear();
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::StartSessionAckTimer(uint32_t sessionID)
+{
+   _threadPool->StartTimer(SessionAckDelayMs, [timers = _timers, sessionID]()
+   {
+      std::lock_guard<std::mutex> lock(timers->guard);
+      if (timers->server) timers->server->OnSessionAckTimer(sessionID);
+   });
+}
+
+template <typename Policies>
+void BasicDataTransferServer<Policies>::OnSessionAckTimer(uint32_t sessionID)
+{
+   // Runs on a pool thread with the timer guard held
+   std::vector<char> buffer;
+   {
+      std::lock_guard<std::mutex> lock(_sessionGuard);
+      auto iter = _sessions.find(sessionID);
+      if (iter == _sessions.end()) return;
+
+      iter->second.timerPending = false;
+      GetSessionAck(sessionID, buffer);
+   }
+
+   if (!buffer.empty()) _senderReceiver->Send(buffer);
+}
+
+// Every build of the server.  The interface build takes any components, the others are in DataTransferServerBuilds.h
+template class BasicDataTransferServer<InterfaceServerPolicies>;
+template class BasicDataTransferServer<UdpFileServerPolicies>;
+template class BasicDataTransferServer<ReplayFileServerPolicies>;
@@ -2,31 +2,326 @@
 
 #include <memory>
 #include <fstream>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <set>
+#include <deque>
+#include <future>
+#include <string>
+#include <map>
+#include <atomic>
 
 #include "ILogger.h"
 #include "IWorkerThreadPool.h"
 #include "ISenderReceiver.h"
 #include "IWriter.h"
+#include "ITransactionCipher.h"
 
 #include "TransactionManager.h"
+#include "TransactionTable.h"
+#include "ChunkStore.h"
+#include "HandshakeCookie.h"
+#include "PacketTracer.h"
+#include "DelayEstimator.h"
+#include "BlockCache.h"
+#include "DataTransferClient.h"
 
-class DataTransferServer
+struct DataTransferServerOptions
+{
+   // Optional payload encryption.  When set, only secure transactions are accepted and every message must
+   // open with its transaction's key.  Replies are sealed with it too
+   std::shared_ptr<ITransactionCipher> cipher;
+
+   // Limits on units held while waiting for earlier ones, beyond these units are spilled to a scratch file
+   uint64_t transactionReorderBudget = DefaultTransactionReorderBudget;
+   uint64_t globalReorderBudget = DefaultGlobalReorderBudget;
+   uint64_t spillBudget = DefaultSpillBudget;
+
+   // Where chunks offered by reference are looked up, and where chunks the client had to send are kept.
+   // Without one every chunk reference is answered by asking for its data
+   std::shared_ptr<ChunkStore> chunkStore;
+
+   // Downstream servers everything received is passed on to, making this server a relay in a distribution tree.
+   // Units are forwarded as they arrive, ahead of being reordered and written here
+   std::vector<std::shared_ptr<ISenderReceiver>> relays;
+
+   // Detect gaps and ask for the missing sequences in aggregated NAKs, each sent after a random delay and held
+   // back for sequences another receiver has just asked for.  Meant for multicast, where receivers share a sender.
+   // Without it units are only asked for once the end arrives and shows them missing
+   bool repair = false;
+
+   // Periodic acknowledgements let the client release retransmit state.  Hundreds of multicast receivers
+   // acknowledging would swamp the sender, turn them off there
+   bool sendAcks = true;
+
+   // When set, data written for a transaction reaches the destination within this many milliseconds instead of
+   // waiting in the writer until its buffer fills or the transaction ends.  For live streams
+   int flushIntervalMs = 0;
+
+   // Answer each start with a cookie and only create the transaction when the client echoes it back, so a
+   // start from a spoofed or unreachable address costs nothing.  Units for transactions that have not
+   // completed the handshake are dropped.  The echo is acknowledged, so acknowledgements must be on
+   bool requireCookie = false;
+
+   // Drop transactions that have received nothing for this long, keeping what was written.  Expiry runs a
+   // little at a time as messages arrive.  Zero keeps transactions until they end
+   int idleTimeoutMs = 0;
+
+   // Most transactions held at once, starts beyond this are refused
+   size_t maxTransactions = DefaultMaxTransactions;
+
+   // Records how long sampled units take to handle, wait for earlier units and write
+   std::shared_ptr<PacketTracer> tracer;
+
+   // Files under this directory can be pulled.  A pull request naming one is answered by sending the file back
+   // under the request's transaction id, once the requester has acknowledged the start.  Empty refuses pulls
+   std::string pullDirectory;
+
+   // Pulled files are read through this, so concurrent pulls of the same file read each block from disk once.
+   // Share one between servers to share the reads.  Made with the default capacity if pulls are on and none is given
+   std::shared_ptr<BlockCache> blockCache;
+};
+
+struct CompletedTransfer
+{
+   uint32_t transactionID;
+   std::string destination;
+   bool complete;             // True once every unit up to the end was written.  False when the transaction was
+                              // dropped for being idle, possibly still waiting for units the end showed were missing
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// The components a server is built from, as a policy for BasicDataTransferServer.  The server
+/// holds and calls each through the type named here, so a policy naming concrete classes, final or
+/// with final methods, has the per packet calls to the transport, writers and logger made directly
+/// where they can be inlined.  CreateWriter makes a transaction's writer of the policy's type.
+///
+/// This policy goes through the interfaces, taking any components.  Tests use it, and so does every
+/// configuration without a build of its own.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+struct InterfaceServerPolicies
+{
+   using Logger = ILogger;
+   using Transport = ISenderReceiver;
+   using WriterFactory = IWriterFactory;
+   using Writer = IWriter;
+
+   static std::shared_ptr<Writer> CreateWriter(WriterFactory& factory, std::shared_ptr<ILogger> logger) { return factory.Create(logger); }
+};
+
+template <typename Policies>
+class BasicDataTransferServer
 {
 public:
-   DataTransferServer(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<ISenderReceiver> receiver, std::shared_ptr<IWriterFactory> writerFactory);
-   ~DataTransferServer() = default;
-   DataTransferServer(const DataTransferServer&) = delete;
-   DataTransferServer(DataTransferServer&&) = default;
+   using Logger = typename Policies::Logger;
+   using Transport = typename Policies::Transport;
+   using WriterFactory = typename Policies::WriterFactory;
+   using Writer = typename Policies::Writer;
+
+   BasicDataTransferServer(std::shared_ptr<Logger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<Transport> receiver, std::shared_ptr<WriterFactory> writerFactory,
+                           const DataTransferServerOptions& options = DataTransferServerOptions());
+   ~BasicDataTransferServer();
+   BasicDataTransferServer(const BasicDataTransferServer&) = delete;
+   // Not movable, repair timers hold a pointer to this server
+   BasicDataTransferServer(BasicDataTransferServer&&) = delete;
 
    void Run();
    void Write(uint32_t transactionID);
 
+   // Reorder buffer accounting for operators
+   TransactionManagerStats GetReorderStats() { return _manager.GetStats(); }
+
+   // Ready when the next transaction ends, in the order they end.  Transactions that end with nobody waiting
+   // are kept for later calls, up to a limit.  Waits still outstanding when the server is destroyed see a
+   // broken promise
+   std::future<CompletedTransfer> NextTransfer();
+
+   // One way delay of a transaction's units, from the client's timestamps to their arrival here.  The clocks
+   // are not synchronised, so the delay includes their offset but its variation is the jitter.  False for a
+   // transaction that is not running
+   bool GetTransit(uint32_t transactionID, DelayStats& stats);
+
+   // Asks the server at the other end of the transport to send the named file.  It arrives as a transaction like
+   // any upload, written through the writer factory and reported by NextTransfer().  The request is repeated until
+   // the transfer starts, and reported as incomplete if it never does.  Returns the transaction id
+   uint32_t Pull(const std::string& source);
+
+   // Pulled files being sent from here
+   size_t GetDownloadCount() { return _downloadCount; }
+
+   // Sessions clients have open with this server
+   size_t GetSessionCount();
+
 private:
-   std::shared_ptr<ILogger> _logger;
+   class PullChannel;
+
+   void OnReceive(const std::vector<char>& buf, bool echoed, uint32_t receivedAt, uint64_t sender);
+   void NoteArrival(const TransactionUnit& tu, uint32_t receivedAt);
+   void TraceReceived(TransactionUnit& tu, uint64_t start);
+   void StartTransaction(uint32_t transactionID, const std::vector<char>& destination, uint32_t flags);
+   void FinishTransaction(uint32_t transactionID);
+   void ReleaseTransaction(uint32_t transactionID, bool heldForDownstream = false);
+   void ReleaseRelay(uint32_t transactionID);
+   void ExpireIdle(uint32_t now, size_t steps);
+   void NotifyTransfer(const CompletedTransfer& transfer);
+   void SendChallenge(const TransactionUnit& start, const std::vector<char>& buffer, uint64_t sender);
+   bool SplitHandshake(TransactionUnit& tu, std::vector<char>& handshake);
+   bool Seal(TransactionUnit& tu);
+   bool OpenCookieEcho(const TransactionUnit& echo, uint64_t sender, std::vector<char>& start);
+   void SendAck(uint32_t transactionID, uint32_t echoTimestamp = 0);
+   void RememberFinished(uint32_t transactionID, uint32_t endSequence);
+   bool RepeatFinalAck(const TransactionUnit& end);
+   void SendRetransmitRequest(uint32_t transactionID, uint32_t sequence);
+   void ResolveChunk(std::shared_ptr<TransactionUnit> tu);
+   void StoreChunk(const TransactionUnit& tu);
+   void Relay(const std::vector<char>& buffer);
+   void OnDownstream(size_t index, const std::vector<char>& buffer);
+   void ScheduleNak(uint32_t transactionID);
+   void OnNakTimer(uint32_t transactionID);
+   void NoteNak(const TransactionUnit& tu);
+   void ServePull(const TransactionUnit& request, uint64_t sender);
+   bool PassToDownload(const TransactionUnit& tu, const std::vector<char>& buffer);
+   void OpenSession(TransactionUnit& open, uint64_t sender);
+   void CloseSession(TransactionUnit& tu);
+   void StartSessionTransaction(const TransactionUnit& tu, uint32_t receivedAt, uint64_t sender);
+   bool QueueSessionAck(uint32_t transactionID, uint32_t sequence, uint32_t echoTimestamp);
+   void GetSessionAck(uint32_t sessionID, std::vector<char>& buffer);
+
+   struct DedupStats
+   {
+      uint64_t chunks = 0;
+      uint64_t bytes = 0;
+      uint64_t storedChunks = 0;    // Chunks found in the store, their data never crossed the wire
+      uint64_t storedBytes = 0;
+   };
+
+   std::shared_ptr<Logger> _logger;
    std::shared_ptr<IWorkerThreadPool> _threadPool;
-   std::shared_ptr<ISenderReceiver> _senderReceiver;
-   std::shared_ptr<IWriterFactory> _writerFactory;
+   std::shared_ptr<Transport> _senderReceiver;
+   std::shared_ptr<WriterFactory> _writerFactory;
+   DataTransferServerOptions _options;
    TransactionManager _manager;
-   std::map<uint16_t, std::shared_ptr<IWriter>> _writers;
+   std::unique_ptr<HandshakeCookie> _cookies;
+
+   struct ServerTransaction
+   {
+      std::shared_ptr<Writer> writer;
+      uint32_t unacknowledged = 0;     // Units written since the last acknowledgement was sent
+      uint32_t lastTimestamp = 0;      // Latest client timestamp, echoed in acknowledgements
+      bool endPending = false;         // The end arrived with units still missing, they are being asked for
+      DelayEstimator transit;
+   };
+
+   // Started transactions.  Only changed while handling a received message, which reads it without the writer guard
+   TransactionTable<ServerTransaction> _transactions;
+
+   // Chunks asked for per transaction, sequence -> fingerprint the returned data must match
+   std::map<uint32_t, std::map<uint32_t, ChunkFingerprint>> _pendingChunks;
+   std::map<uint32_t, DedupStats> _dedupStats;
+
+   // Next expected sequence reported by each downstream server per transaction.  The client is only told to
+   // release what every downstream server has too, so their retransmit requests can still be answered.  A
+   // transaction finished here is held, with its key, until every downstream server has acknowledged the end
+   struct DownstreamAcks
+   {
+      std::vector<uint32_t> sequences;    // One per relay
+      bool finished = false;
+      uint32_t endSequence = 0;           // Units written here, known once finished
+      uint32_t echoTimestamp = 0;
+   };
+
+   std::map<uint32_t, DownstreamAcks> _downstreamAcks;
+   std::mutex _relayGuard;
+
+   // Final acknowledgements of recently finished transactions, sealed as sent, for answering an end repeated because
+   // the acknowledgement was lost.  The oldest are forgotten first, in the order of _finishedOrder
+   struct FinishedTransaction
+   {
+      uint32_t endSequence = 0;
+      std::vector<char> ack;
+   };
+
+   std::map<uint32_t, FinishedTransaction> _finished;
+   std::deque<uint32_t> _finishedOrder;
+   std::mutex _finishedGuard;
+
+   // Ended transactions nobody has asked for yet, and callers of NextTransfer() waiting for one
+   std::deque<CompletedTransfer> _completedTransfers;
+   std::deque<std::promise<CompletedTransfer>> _transferWaiters;
+   std::mutex _transferGuard;
+
+   // Pulled files being sent, by transaction id, each by a client of its own sending through the server's transport.
+   // Only touched while handling a received message
+   struct Download
+   {
+      std::shared_ptr<PullChannel> channel;
+      std::unique_ptr<DataTransferClient> client;
+   };
+
+   std::map<uint32_t, Download> _downloads;
+   std::atomic<size_t> _downloadCount;
+
+   // Sessions opened by clients, each carrying many transactions.  Transactions started in a session skip the cookie
+   // handshake and are acknowledged together, a short while after the first acknowledgement falls due
+   struct ServerSession
+   {
+      uint64_t token = 0;                    // Given to the client when the session opens, its starts carry it
+      std::map<uint32_t, uint32_t> acks;     // Next expected sequence of each transaction with an acknowledgement due
+      uint32_t echoTimestamp = 0;
+      bool timerPending = false;
+   };
+
+   std::map<uint32_t, ServerSession> _sessions;
+   std::map<uint32_t, uint32_t> _sessionTransactions;    // Transaction id -> session id
+   std::mt19937_64 _sessionRandom;
+   std::mutex _sessionGuard;
+
+   // Guards the transactions and their writers against the flush timer, which runs on the thread pool
+   std::mutex _writerGuard;
+
+   // State shared with timers.  Timers run on the thread pool and can fire after the server is gone, so they hold
+   // this rather than the server, which detaches itself on destruction
+   struct RepairTransaction
+   {
+      bool timerPending = false;
+      uint32_t endSequence = 0;     // Units sent in total, known once the end has arrived
+      std::map<uint32_t, std::chrono::steady_clock::time_point> requested;   // Last time anyone NAKed each sequence
+   };
+
+   // A pull made from here, until the transaction it asked for ends
+   struct PendingPull
+   {
+      std::string source;
+      std::vector<char> request;
+      int attempts = 0;
+      bool started = false;
+   };
+
+   struct TimerContext
+   {
+      std::mutex guard;
+      BasicDataTransferServer* server = nullptr;
+      std::map<uint32_t, RepairTransaction> repairs;
+      std::map<uint32_t, PendingPull> pulls;
+      std::set<uint32_t> flushes;      // Transactions with a flush timer running
+      std::mt19937 random;
+   };
+
+   std::shared_ptr<TimerContext> _timers;
+
+   void StartNakTimer(uint32_t transactionID, RepairTransaction& transaction);
+   void ScheduleFlush(uint32_t transactionID);
+   void OnFlushTimer(uint32_t transactionID);
+   void StartPullTimer(uint32_t transactionID);
+   void OnPullTimer(uint32_t transactionID);
+   void StartRelayHoldTimer(uint32_t transactionID);
+   void OnRelayHoldTimer(uint32_t transactionID);
+   void StartSessionAckTimer(uint32_t sessionID);
+   void OnSessionAckTimer(uint32_t sessionID);
 };
 
+// The server as tests and most configurations build it, through the interfaces.  DataTransferServerBuilds.h has
+// the builds that call their components directly
+using DataTransferServer = BasicDataTransferServer<InterfaceServerPolicies>;
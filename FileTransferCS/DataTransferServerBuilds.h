@@ -0,0 +1,36 @@
+#pragma once
+
+#include "DataTransferServer.h"
+#include "UDPUnreliableSenderReceiver.h"
+#include "PacketReplayer.h"
+#include "FileWriter.h"
+#include "SimpleLogger.h"
+
+// Builds of the server that call their components directly, each instantiated once in DataTransferServer.cpp.
+// A configuration with components other than these, such as a recording transport, uses DataTransferServer
+
+// A server on a UDP socket writing files, unicast or on a multicast group
+struct UdpFileServerPolicies
+{
+   using Logger = SimpleLogger;
+   using Transport = UDPUnreliableSenderReceiver;
+   using WriterFactory = FileWriterFactory;
+   using Writer = FileWriter;
+
+   static std::shared_ptr<Writer> CreateWriter(WriterFactory& factory, std::shared_ptr<ILogger> logger) { return factory.CreateFileWriter(logger); }
+};
+
+using UdpFileServer = BasicDataTransferServer<UdpFileServerPolicies>;
+
+// A server a packet capture is replayed into, writing files
+struct ReplayFileServerPolicies
+{
+   using Logger = SimpleLogger;
+   using Transport = PacketReplayer;
+   using WriterFactory = FileWriterFactory;
+   using Writer = FileWriter;
+
+   static std::shared_ptr<Writer> CreateWriter(WriterFactory& factory, std::shared_ptr<ILogger> logger) { return factory.CreateFileWriter(logger); }
+};
+
+using ReplayFileServer = BasicDataTransferServer<ReplayFileServerPolicies>;
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+
+struct DelayStats
+{
+   uint32_t smoothedUs = 0;
+   uint32_t variationUs = 0;     // Mean deviation from the smoothed delay, the jitter
+   uint32_t minimumUs = 0;
+   uint32_t latestUs = 0;
+   uint64_t samples = 0;
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Smoothed delay and its variation, estimated the way TCP estimates its round trip time (RFC
+/// 6298).  Each sample moves the smoothed delay an eighth of the way towards it and the variation
+/// a quarter of the way towards its deviation.
+///
+/// Fed round trips, the time from sending a timestamp to having it echoed back, it gives the RTT.
+/// Fed one way transit times, a unit's arrival time less the sender's timestamp in it, the smoothed
+/// value also holds the offset between the two clocks, but the variation is the jitter all the same.
+///
+/// Not thread safe.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class DelayEstimator
+{
+public:
+   void AddSample(uint32_t delayUs)
+   {
+      if (_stats.samples == 0)
+      {
+         _smoothed = delayUs;
+         _variation = delayUs / 2;
+         _stats.minimumUs = delayUs;
+      }
+      else
+      {
+         int64_t deviation = (int64_t)delayUs - _smoothed;
+         _variation += ((deviation < 0 ? -deviation : deviation) - _variation) / 4;
+         _smoothed += deviation / 8;
+         if (delayUs < _stats.minimumUs) _stats.minimumUs = delayUs;
+      }
+
+      _stats.latestUs = delayUs;
+      _stats.smoothedUs = (uint32_t)_smoothed;
+      _stats.variationUs = (uint32_t)_variation;
+      _stats.samples++;
+   }
+
+   const DelayStats& GetStats() const { return _stats; }
+
+private:
+   int64_t _smoothed = 0;
+   int64_t _variation = 0;
+   DelayStats _stats;
+};
@@ -1,23 +1,240 @@
 #include "FileReader.h"
 
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 FileReader::FileReader(std::shared_ptr<ILogger> logger)
    : _logger(logger),
-   _blockSize(128)
+   _blockSize(128),
+   _chunkSize(0x100000),
+   _chunkOffset(0),
+   _chunkPosition(0)
 {}
 
 uint32_t FileReader::Read(std::vector<char>& s)
 {
-   // Open and read file data
-   s.resize(_blockSize);
-   _fileStream.read(s.data(), s.size());
+   if (_chunkOffset >= _chunk.size() && !NextChunk())
+   {
+      s.clear();
+      return 0;
+   }
 
-   auto count = _fileStream.gcount();
-   s.resize((size_t)count);
+   auto count = std::min<size_t>(_blockSize, _chunk.size() - _chunkOffset);
+   s.assign(_chunk.begin() + _chunkOffset, _chunk.begin() + _chunkOffset + count);
+   _chunkOffset += count;
    return (uint32_t)count;
 };
 
+uint32_t FileReader::ReadAt(uint64_t offset, uint32_t length, std::vector<char>& s)
+{
+   std::lock_guard<std::mutex> lock(_randomAccessGuard);
+
+   if (!_randomAccessStream.is_open())
+   {
+      _randomAccessStream.open(_filename, std::ios::in | std::ios::binary);
+   }
+
+   _randomAccessStream.clear();
+   _randomAccessStream.seekg((std::streamoff)offset);
+
+   s.resize(length);
+   _randomAccessStream.read(s.data(), s.size());
+
+   auto count = _randomAccessStream.gcount();
+   s.resize((size_t)count);
+   return (uint32_t)count;
+}
+
+uint64_t FileReader::ReadZeros(uint64_t maxLength)
+{
+   uint64_t length = 0;
+   while (length < maxLength)
+   {
+      // Holes read back as zeros, skip them without reading
+      auto position = _chunkPosition + _chunkOffset;
+      auto holeEnd = GetHoleEnd(position);
+      if (holeEnd > position)
+      {
+         auto skip = std::min(holeEnd - position, maxLength - length);
+         Seek(position + skip);
+         length += skip;
+         continue;
+      }
+
+      // Otherwise consume whole blocks for as long as they are zero
+      if (_chunkOffset >= _chunk.size() && !NextChunk()) break;
+
+      auto count = std::min<size_t>(_blockSize, _chunk.size() - _chunkOffset);
+      if (length + count > maxLength || !IsZero(_chunk.data() + _chunkOffset, count)) break;
+
+      _chunkOffset += count;
+      length += count;
+   }
+
+   return length;
+}
+
 void FileReader::SetFile(const std::string& filename)
 {
    _filename = filename;
-   _fileStream.open(filename);
-}
\ No newline at end of file
+   _fileStream.open(filename, std::ios::in | std::ios::binary);
+
+   FindHoles();
+   StartPrefetch();
+}
+
+void FileReader::StartPrefetch()
+{
+   // Nothing left to read, Read() will report the end of the file once the current chunk is drained
+   if (!_fileStream.good()) return;
+
+   _prefetch = std::async(std::launch::async, [this]()
+   {
+      std::vector<char> chunk(_chunkSize);
+      _fileStream.read(chunk.data(), chunk.size());
+      chunk.resize((size_t)_fileStream.gcount());
+      return chunk;
+   });
+}
+
+bool FileReader::NextChunk()
+{
+   // The current chunk is used up, swap in the prefetched one and start reading the next
+   if (!_prefetch.valid()) return false;
+
+   _chunkPosition += _chunk.size();
+   _chunk = _prefetch.get();
+   _chunkOffset = 0;
+
+   if (_chunk.empty()) return false;
+
+   StartPrefetch();
+   return true;
+}
+
+void FileReader::Seek(uint64_t position)
+{
+   if (position >= _chunkPosition && position <= _chunkPosition + _chunk.size())
+   {
+      _chunkOffset = (size_t)(position - _chunkPosition);
+      return;
+   }
+
+   // Beyond the current chunk, throw away the read ahead and restart it from the new position
+   if (_prefetch.valid()) _prefetch.get();
+
+   _fileStream.clear();
+   _fileStream.seekg((std::streamoff)position);
+
+   _chunk.clear();
+   _chunkOffset = 0;
+   _chunkPosition = position;
+   StartPrefetch();
+}
+
+void FileReader::FindHoles()
+{
+   _holes.clear();
+
+#ifdef _WIN32
+   // Only sparse files have holes
+   auto attributes = GetFileAttributesA(_filename.c_str());
+   if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_SPARSE_FILE)) return;
+
+   HANDLE h = CreateFileA(_filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+   if (h == INVALID_HANDLE_VALUE) return;
+
+   LARGE_INTEGER size;
+   if (GetFileSizeEx(h, &size))
+   {
+      // The gaps between allocated ranges are holes
+      uint64_t position = 0;
+      uint64_t end = size.QuadPart;
+      bool complete = false;
+      while (!complete)
+      {
+         FILE_ALLOCATED_RANGE_BUFFER query;
+         query.FileOffset.QuadPart = position;
+         query.Length.QuadPart = end - position;
+
+         FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+         DWORD bytes = 0;
+         BOOL ok = DeviceIoControl(h, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &bytes, nullptr);
+         if (!ok && GetLastError() != ERROR_MORE_DATA) break;
+
+         auto count = bytes / sizeof(ranges[0]);
+         for (size_t i = 0; i < count; i++)
+         {
+            uint64_t start = ranges[i].FileOffset.QuadPart;
+            if (start > position) _holes[position] = start;
+            position = start + ranges[i].Length.QuadPart;
+         }
+
+         complete = ok || count == 0;
+      }
+
+      if (complete && position < end) _holes[position] = end;
+      if (!complete) _holes.clear();
+   }
+
+   CloseHandle(h);
+#elif defined(SEEK_HOLE)
+   int fd = open(_filename.c_str(), O_RDONLY);
+   if (fd < 0) return;
+
+   off_t end = lseek(fd, 0, SEEK_END);
+   off_t position = 0;
+   while (position < end)
+   {
+      off_t hole = lseek(fd, position, SEEK_HOLE);
+      if (hole < 0 || hole >= end) break;
+
+      // No more data means the hole runs to the end
+      off_t data = lseek(fd, hole, SEEK_DATA);
+      if (data < 0) data = end;
+
+      _holes[hole] = data;
+      position = data;
+   }
+
+   close(fd);
+#endif
+}
+
+uint64_t FileReader::GetHoleEnd(uint64_t position)
+{
+   auto iter = _holes.upper_bound(position);
+   if (iter == _holes.begin()) return position;
+
+   --iter;
+   return position < iter->second ? iter->second : position;
+}
+
+bool FileReader::IsZero(const char* data, size_t length)
+{
+   // Eight bytes at a time, simple enough for the compiler to vectorize
+   uint64_t bits = 0;
+   size_t i = 0;
+   for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+   {
+      uint64_t word;
+      memcpy(&word, data + i, sizeof(word));
+      bits |= word;
+   }
+
+   for (; i < length; i++)
+   {
+      bits |= (uint8_t)data[i];
+   }
+
+   return bits == 0;
+}
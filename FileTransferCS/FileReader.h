@@ -5,24 +5,54 @@
 
 #include <memory>
 #include <fstream>
+#include <future>
+#include <mutex>
+#include <map>
 
 class FileReader : public IReader
 {
 public:
    FileReader(std::shared_ptr<ILogger> logger);
    FileReader(const FileReader&) = delete;
-   FileReader(FileReader&&) = default;
+   // Not movable, an outstanding prefetch holds a pointer to this reader
+   FileReader(FileReader&&) = delete;
    ~FileReader() = default;
 
 
    uint32_t Read(std::vector<char>& s) override;
+   uint32_t ReadAt(uint64_t offset, uint32_t length, std::vector<char>& s) override;
+   bool CanReadAt() override { return true; }
+   uint64_t ReadZeros(uint64_t maxLength) override;
    const std::string& GetSource() override { return _filename; }
 
    void SetFile(const std::string& filename);
 
 private:
+   void StartPrefetch();
+   bool NextChunk();
+   void Seek(uint64_t position);
+   void FindHoles();
+   uint64_t GetHoleEnd(uint64_t position);
+   static bool IsZero(const char* data, size_t length);
+
    std::shared_ptr<ILogger> _logger;
    std::fstream _fileStream;
    std::string _filename;
    const uint8_t _blockSize;
+   const uint32_t _chunkSize;
+
+   // Random access reads use their own stream so they don't disturb the sequential read and prefetch.
+   // They come from the receive thread, hence the lock
+   std::ifstream _randomAccessStream;
+   std::mutex _randomAccessGuard;
+
+   // Blocks are served out of _chunk while the next chunk is read from disk in the background.
+   // _prefetch is declared last so an outstanding read completes before the stream is destroyed
+   std::vector<char> _chunk;
+   size_t _chunkOffset;
+   uint64_t _chunkPosition;      // Offset of _chunk in the file
+
+   // Unallocated ranges of a sparse file, offset -> end.  They read back as zeros so are skipped without reading
+   std::map<uint64_t, uint64_t> _holes;
+   std::future<std::vector<char>> _prefetch;
 };
@@ -5,22 +5,64 @@
 //
 
 #include "FileReader.h"
+#include "TailFileReader.h"
 #include "FileWriter.h"
 #include "UDPUnreliableSenderReceiver.h"
+#include "UDPMulticastSenderReceiver.h"
 #include "DataTransferClient.h"
 #include "DataTransferServer.h"
+#include "DataTransferServerBuilds.h"
+#include "AesGcmCipher.h"
+#include "PacedSenderReceiver.h"
+#include "MultipathSenderReceiver.h"
+#include "TransferSession.h"
+#include "RecordingSenderReceiver.h"
+#include "PacketReplayer.h"
 
 #include <sstream>
 #include <iostream>
 #include <memory>
+#include <vector>
+#include <thread>
+#include <chrono>
 
 #include "WorkerThreadPool.h"
 #include "SimpleLogger.h"
 
+// A capture is replayed into each build of the server this many times with --bench, the fastest replay of each counts
+static const int BenchRounds = 5;
+
 
 int main(int argc, char* argv[])
 {
    std::string filename("Test.txt");
+   std::vector<std::string> filenames;
+
+   std::string key;
+   uint64_t rate = 0;
+   bool dedup = false;
+   bool sync = false;
+   std::string chunkStoreDirectory;
+   uint16_t port = 1234;
+   std::vector<std::string> relays;
+   std::string multicastGroup;
+   bool follow = false;
+   int flushIntervalMs = 0;
+   bool cookies = false;
+   int idleTimeoutSeconds = 0;
+   bool verbose = false;
+   bool numa = false;
+   std::string traceFile;
+   std::string connect;
+   std::vector<std::string> paths;
+   bool repair = false;
+   std::string serveDirectory;
+   std::string pull;
+   bool session = false;
+   std::string recordFile;
+   std::string replayFile;
+   double speed = 1.0;
+   bool bench = false;
 
    bool bServer = true;
    bool bClient = true;
@@ -30,43 +72,482 @@ int main(int argc, char* argv[])
       if (s == "--server")
       {
          bClient = false;
-         break;
+         continue;
       }
 
       if (s == "--client")
       {
          bServer = false;
-         break;
+         continue;
+      }
+
+      if (s == "--key" && i + 1 < argc)
+      {
+         key = argv[++i];
+         continue;
+      }
+
+      if (s == "--rate" && i + 1 < argc)
+      {
+         rate = std::stoull(argv[++i]);
+         continue;
+      }
+
+      if (s == "--dedup")
+      {
+         dedup = true;
+         continue;
+      }
+
+      if (s == "--sync")
+      {
+         sync = true;
+         continue;
+      }
+
+      if (s == "--chunkstore" && i + 1 < argc)
+      {
+         chunkStoreDirectory = argv[++i];
+         continue;
+      }
+
+      if (s == "--port" && i + 1 < argc)
+      {
+         port = (uint16_t)std::stoul(argv[++i]);
+         continue;
+      }
+
+      if (s == "--relay" && i + 1 < argc)
+      {
+         relays.push_back(argv[++i]);
+         continue;
+      }
+
+      if (s == "--multicast" && i + 1 < argc)
+      {
+         multicastGroup = argv[++i];
+         continue;
+      }
+
+      if (s == "--follow")
+      {
+         follow = true;
+         continue;
+      }
+
+      if (s == "--flush" && i + 1 < argc)
+      {
+         flushIntervalMs = std::stoi(argv[++i]);
+         continue;
+      }
+
+      if (s == "--cookies")
+      {
+         cookies = true;
+         continue;
+      }
+
+      if (s == "--idle" && i + 1 < argc)
+      {
+         idleTimeoutSeconds = std::stoi(argv[++i]);
+         continue;
+      }
+
+      if (s == "--verbose")
+      {
+         verbose = true;
+         continue;
+      }
+
+      if (s == "--numa")
+      {
+         numa = true;
+         continue;
+      }
+
+      if (s == "--trace" && i + 1 < argc)
+      {
+         traceFile = argv[++i];
+         continue;
+      }
+
+      if (s == "--connect" && i + 1 < argc)
+      {
+         connect = argv[++i];
+         continue;
+      }
+
+      if (s == "--path" && i + 1 < argc)
+      {
+         paths.push_back(argv[++i]);
+         continue;
+      }
+
+      if (s == "--repair")
+      {
+         repair = true;
+         continue;
+      }
+
+      if (s == "--serve" && i + 1 < argc)
+      {
+         serveDirectory = argv[++i];
+         continue;
+      }
+
+      if (s == "--pull" && i + 1 < argc)
+      {
+         pull = argv[++i];
+         continue;
+      }
+
+      if (s == "--session")
+      {
+         session = true;
+         continue;
+      }
+
+      if (s == "--record" && i + 1 < argc)
+      {
+         recordFile = argv[++i];
+         continue;
+      }
+
+      if (s == "--replay" && i + 1 < argc)
+      {
+         replayFile = argv[++i];
+         continue;
+      }
+
+      if (s == "--speed" && i + 1 < argc)
+      {
+         speed = std::stod(argv[++i]);
+         continue;
+      }
+
+      if (s == "--bench")
+      {
+         bench = true;
+         continue;
       }
 
       filename = argv[i];
+      filenames.push_back(filename);
+   }
+
+   // Where the client sends, the local server's port unless given
+   std::string serverAddress("127.0.0.1");
+   uint16_t serverPort = port;
+   if (!connect.empty())
+   {
+      auto separator = connect.rfind(':');
+      if (separator == std::string::npos)
+      {
+         std::cout << "Server " << connect << " should be host:port" << std::endl;
+         return 1;
+      }
+
+      serverAddress = connect.substr(0, separator);
+      serverPort = (uint16_t)std::stoul(connect.substr(separator + 1));
    }
 
-   auto logger = std::make_shared<SimpleLogger>();
+   // Per packet debug messages are only formatted when asked for
+   auto logger = std::make_shared<SimpleLogger>(verbose ? 0 : 1);
    auto threadPool = std::make_shared<WorkerThreadPool>();
    threadPool->SetThreadCount(4);
+   if (numa)
+   {
+      // A group of threads pinned to each node
+      auto nodes = NumaTopology::Query();
+      threadPool->SetTopology(nodes, true);
+      threadPool->SetThreadCount(4 * (int)nodes.size());
+   }
+
+   // One reactor thread services every socket
+   auto reactor = std::make_shared<SocketReactor>(logger);
 
-   auto reader = std::make_shared<FileReader>(logger);
-   reader->SetFile(filename);
+   // Following keeps the transaction open and streams whatever is appended to the file, or piped to standard input
+   std::shared_ptr<IReader> reader;
+   std::shared_ptr<TailFileReader> tailReader;
+   if (follow)
+   {
+      tailReader = std::make_shared<TailFileReader>(logger);
+      tailReader->SetFile(filename);
+      reader = tailReader;
+   }
+   else
+   {
+      auto fileReader = std::make_shared<FileReader>(logger);
+      fileReader->SetFile(filename);
+      reader = fileReader;
+   }
 
    auto writerFactory = std::make_shared<FileWriterFactory>();
 
+   // A pre-shared key turns on authenticated encryption for both sides.  Each side keeps its own keys, run together
+   // the client and server would otherwise share the entry for the transaction between them
+   std::shared_ptr<ITransactionCipher> cipher;
+   std::shared_ptr<ITransactionCipher> clientCipher;
+   if (!key.empty())
+   {
+      cipher = std::make_shared<AesGcmCipher>(logger, key);
+      clientCipher = std::make_shared<AesGcmCipher>(logger, key);
+   }
+
+   // Sampled units are traced through both sides and written out on exit
+   std::shared_ptr<PacketTracer> tracer;
+   if (!traceFile.empty())
+   {
+      tracer = std::make_shared<PacketTracer>();
+   }
+
+   DataTransferServerOptions serverOptions;
+   serverOptions.cipher = cipher;
+   serverOptions.flushIntervalMs = flushIntervalMs;
+   serverOptions.requireCookie = cookies;
+   serverOptions.idleTimeoutMs = idleTimeoutSeconds * 1000;
+   serverOptions.tracer = tracer;
+   serverOptions.repair = repair;
+   if (!serveDirectory.empty())
+   {
+      // Pulls of the same file share its blocks
+      serverOptions.pullDirectory = serveDirectory;
+      serverOptions.blockCache = std::make_shared<BlockCache>(logger);
+   }
+   if (!chunkStoreDirectory.empty())
+   {
+      serverOptions.chunkStore = std::make_shared<ChunkStore>(logger, chunkStoreDirectory);
+   }
+
+   // Each downstream server gets its own socket, their replies come back on it
+   for (auto& relay : relays)
+   {
+      auto separator = relay.rfind(':');
+      if (separator == std::string::npos)
+      {
+         std::cout << "Relay " << relay << " should be host:port" << std::endl;
+         return 1;
+      }
+
+      auto downstream = std::make_shared<UDPUnreliableSenderReceiver>(logger, reactor);
+      downstream->Start(0);
+      downstream->SetDestination(relay.substr(0, separator), (uint16_t)std::stoul(relay.substr(separator + 1)));
+      serverOptions.relays.push_back(downstream);
+   }
+
+   // On a multicast group servers repair gaps with NAKs, and don't acknowledge so the client isn't swamped
+   if (!multicastGroup.empty())
+   {
+      serverOptions.repair = true;
+      serverOptions.sendAcks = false;
+   }
+
+   DataTransferClientOptions clientOptions;
+   clientOptions.cipher = clientCipher;
+   clientOptions.dedup = dedup;
+   clientOptions.sync = sync;
+   clientOptions.cookieHandshake = cookies;
+   clientOptions.tracer = tracer;
+   clientOptions.repeatEnd = multicastGroup.empty();
+
+   // A recorded capture is played into a server of its own, with no sockets, and the run measured.  The recorded
+   // cookies were made with another secret, so they are not checked
+   if (!replayFile.empty())
+   {
+      auto replayer = std::make_shared<PacketReplayer>(logger, replayFile);
+      serverOptions.requireCookie = false;
+
+      // Compares the time a datagram takes in the server built on the interfaces with the time it takes in the server built
+      // on these components, played as fast as each takes them.  The builds take turns, so both see the disk and caches alike
+      if (bench)
+      {
+         uint64_t interfaceUs = UINT64_MAX;
+         uint64_t directUs = UINT64_MAX;
+         uint64_t datagrams = 0;
+         for (int round = 0; round < BenchRounds; round++)
+         {
+            {
+               DataTransferServer server(logger, threadPool, replayer, writerFactory, serverOptions);
+               auto stats = replayer->Replay(server, 0);
+               interfaceUs = std::min(interfaceUs, stats.elapsedUs);
+               datagrams = std::max<uint64_t>(stats.datagrams, 1);
+            }
+            {
+               ReplayFileServer server(logger, threadPool, replayer, writerFactory, serverOptions);
+               auto stats = replayer->Replay(server, 0);
+               directUs = std::min(directUs, stats.elapsedUs);
+            }
+         }
+
+         std::cout << "Interface build " << interfaceUs * 1000 / datagrams << "ns per datagram, direct build " << directUs * 1000 / datagrams
+                   << "ns per datagram, best of " << BenchRounds << " replays of " << datagrams << " datagrams" << std::endl;
+         return 0;
+      }
+
+      auto replayServer = std::make_unique<ReplayFileServer>(logger, threadPool, replayer, writerFactory, serverOptions);
+      auto stats = replayer->Replay(*replayServer, speed);
+      replayServer.reset();
+
+      auto seconds = (stats.elapsedUs + 1) / 1000000.0;
+      std::cout << "Replayed " << stats.datagrams << " datagrams, " << stats.bytes << " bytes in " << stats.elapsedUs / 1000 << "ms, recorded over "
+                << stats.recordedUs / 1000 << "ms" << std::endl;
+      std::cout << "Throughput " << (uint64_t)(stats.datagrams / seconds) << " datagrams/s, " << stats.bytes / seconds / 1000000 << " MB/s" << std::endl;
+      std::cout << "Peak buffered " << stats.peakBufferedBytes << " bytes, working set grew " << stats.workingSetBytes << " bytes" << std::endl;
+      std::cout << "Sent " << stats.replies << " datagrams, " << stats.recordedReplies << " when recorded" << std::endl;
+      return 0;
+   }
+
    std::unique_ptr<DataTransferServer> pFTS;
+   std::unique_ptr<UdpFileServer> pUdpFTS;
    if (bServer)
    {
-      auto senderRecieverServer = std::make_shared<UDPUnreliableSenderReceiver>(logger, threadPool);
-      senderRecieverServer->Start(1234);
+      std::shared_ptr<UDPUnreliableSenderReceiver> senderRecieverServer;
+      if (multicastGroup.empty())
+      {
+         auto unicast = std::make_shared<UDPUnreliableSenderReceiver>(logger, reactor);
+         unicast->EnableReceiveTimestamps();
+         unicast->Start(port);
+         unicast->SetReplyToSender(true);
+         senderRecieverServer = unicast;
+      }
+      else
+      {
+         senderRecieverServer = std::make_shared<UDPMulticastSenderReceiver>(logger, reactor, multicastGroup, port);
+         senderRecieverServer->Start(port);
+      }
 
-      pFTS = std::make_unique<DataTransferServer>(logger, threadPool, senderRecieverServer, writerFactory);
+      // Everything the server sends and receives goes into the capture.  Otherwise the server is the build that calls
+      // the socket, writers and logger directly
+      if (!recordFile.empty())
+      {
+         auto recorder = std::make_shared<RecordingSenderReceiver>(senderRecieverServer, recordFile);
+         pFTS = std::make_unique<DataTransferServer>(logger, threadPool, recorder, writerFactory, serverOptions);
+      }
+      else
+      {
+         pUdpFTS = std::make_unique<UdpFileServer>(logger, threadPool, senderRecieverServer, writerFactory, serverOptions);
+      }
    }
 
    std::unique_ptr<DataTransferClient> pFTC;
-   if (bClient)
+   std::unique_ptr<TransferSession> pSession;
+   std::shared_ptr<MultipathSenderReceiver> multipath;
+   std::unique_ptr<UdpFileServer> pPuller;
+   std::thread followThread;
+   if (bClient && !pull.empty())
    {
-      auto senderRecieverClient = std::make_shared<UDPUnreliableSenderReceiver>(logger, threadPool);
-      senderRecieverClient->Start(0);
+      // Pulling, the client receives the file the way a server receives an upload
+      auto unicast = std::make_shared<UDPUnreliableSenderReceiver>(logger, reactor);
+      unicast->SetDestination(serverAddress, serverPort);
+      unicast->EnableReceiveTimestamps();
+      unicast->Start(0);
+
+      DataTransferServerOptions pullOptions;
+      pullOptions.cipher = clientCipher;
+      pullOptions.flushIntervalMs = flushIntervalMs;
+      pullOptions.tracer = tracer;
+      pullOptions.repair = repair;
+      pPuller = std::make_unique<UdpFileServer>(logger, threadPool, unicast, writerFactory, pullOptions);
 
-      pFTC = std::make_unique<DataTransferClient>(logger, threadPool, reader, senderRecieverClient);
+      auto transfer = pPuller->NextTransfer();
+      pPuller->Pull(pull);
+      auto result = transfer.get();
+      std::cout << (result.complete ? "Pulled " : "Failed to pull ") << result.destination << std::endl;
+   }
+   else if (bClient)
+   {
+      std::shared_ptr<ISenderReceiver> senderRecieverClient;
+      if (!paths.empty())
+      {
+         // A socket bound to each local address, with the data spread over them by what each carries
+         multipath = std::make_shared<MultipathSenderReceiver>(logger);
+         for (auto& path : paths)
+         {
+            auto unicast = std::make_shared<UDPUnreliableSenderReceiver>(logger, reactor);
+            unicast->SetLocalAddress(path);
+            unicast->SetDestination(serverAddress, serverPort);
+            unicast->EnableReceiveTimestamps();
+            unicast->Start(0);
+            multipath->AddPath(unicast);
+         }
+         senderRecieverClient = multipath;
+      }
+      else if (multicastGroup.empty())
+      {
+         auto unicast = std::make_shared<UDPUnreliableSenderReceiver>(logger, reactor);
+         unicast->SetDestination(serverAddress, serverPort);
+         unicast->EnableReceiveTimestamps();
+         unicast->Start(0);
+         senderRecieverClient = unicast;
+      }
+      else
+      {
+         // Blocks go to the group once, NAKs from the servers come back on it
+         senderRecieverClient = std::make_shared<UDPMulticastSenderReceiver>(logger, reactor, multicastGroup, port);
+         senderRecieverClient->Start(port);
+      }
+
+      // Optionally cap the client's egress, in bytes per second
+      std::shared_ptr<ISenderReceiver> clientTransport = senderRecieverClient;
+      if (rate)
+      {
+         auto scheduler = std::make_shared<BandwidthScheduler>(rate);
+         clientTransport = std::make_shared<PacedSenderReceiver>(senderRecieverClient, scheduler);
+      }
+
+      if (session)
+      {
+         // Every file named goes over one session, the handshake is done once rather than for each file
+         TransferSessionOptions sessionOptions;
+         sessionOptions.cipher = clientCipher;
+         sessionOptions.dedup = dedup;
+         sessionOptions.sync = sync;
+         sessionOptions.tracer = tracer;
+         pSession = std::make_unique<TransferSession>(logger, threadPool, clientTransport, sessionOptions);
+         if (filenames.empty()) filenames.push_back(filename);
+
+         auto start = std::chrono::steady_clock::now();
+         if (pSession->Open())
+         {
+            std::vector<std::shared_future<bool>> sent;
+            for (auto& name : filenames)
+            {
+               auto fileReader = std::make_shared<FileReader>(logger);
+               fileReader->SetFile(name);
+               sent.push_back(pSession->Send(fileReader));
+            }
+
+            size_t complete = 0;
+            for (auto& file : sent)
+            {
+               if (file.wait_for(std::chrono::seconds(30)) == std::future_status::ready && file.get()) complete++;
+            }
+
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Sent " << complete << " of " << sent.size() << " files in " << elapsed << "ms" << std::endl;
+         }
+      }
+      else if (follow)
+      {
+         // The client sends from its constructor until the reader ends, which for a followed source is when it is stopped
+         followThread = std::thread([&, clientTransport]()
+         {
+            pFTC = std::make_unique<DataTransferClient>(logger, threadPool, reader, clientTransport, clientOptions);
+         });
+      }
+      else
+      {
+         pFTC = std::make_unique<DataTransferClient>(logger, threadPool, reader, clientTransport, clientOptions);
+      }
+   }
+
+   // Standard input is the data, so the stream ends when it is closed rather than on user input
+   if (followThread.joinable() && filename == "-")
+   {
+      followThread.join();
+      std::cout << "Terminating processes..." << std::endl;
+      if (tracer) tracer->Export(traceFile);
+      return 0;
    }
 
    // Todo: Hang out for a while waiting for retransmit requests
@@ -75,5 +556,35 @@ int main(int argc, char* argv[])
    char q;
    std::cin >> q;
 
+   if (followThread.joinable())
+   {
+      tailReader->Stop();
+      followThread.join();
+   }
+
+   if (pFTC || pSession)
+   {
+      auto roundTrip = pFTC ? pFTC->GetRoundTrip() : pSession->GetRoundTrip();
+      std::cout << "Round trip " << roundTrip.smoothedUs << "us, variation " << roundTrip.variationUs << "us, minimum "
+                << roundTrip.minimumUs << "us over " << roundTrip.samples << " samples" << std::endl;
+   }
+
+   if (multipath)
+   {
+      auto stats = multipath->GetPathStats();
+      for (size_t i = 0; i < stats.size(); i++)
+      {
+         std::cout << "Path " << paths[i] << " share " << stats[i].share << ", " << stats[i].units << " units, "
+                   << stats[i].bytes << " bytes, " << stats[i].lost << " lost" << std::endl;
+      }
+   }
+
+   if (serverOptions.blockCache)
+   {
+      auto cache = serverOptions.blockCache->GetStats();
+      std::cout << "Block cache " << cache.hits << " hits, " << cache.misses << " misses, " << cache.bytesRead << " bytes read from disk" << std::endl;
+   }
+
    std::cout << "Terminating processes..." << std::endl;
+   if (tracer) tracer->Export(traceFile);
 }
@@ -3,22 +3,49 @@
 #include <sstream>
 #include <filesystem>
 
+// Runs of zeros shorter than this are written, the file system allocates in clusters so small holes gain nothing
+static const uint64_t SparseThreshold = 0x10000;
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <unistd.h>
+#endif
+
+FileWriterFactory::FileWriterFactory(uint32_t coalesceSize, bool syncOnFlush)
+   : _coalesceSize(coalesceSize),
+   _syncOnFlush(syncOnFlush)
+{}
+
 std::shared_ptr<IWriter> FileWriterFactory::Create(std::shared_ptr<ILogger> logger)
 {
-   return std::make_shared<FileWriter>(logger);
+   return CreateFileWriter(logger);
 }
 
-FileWriter::FileWriter(std::shared_ptr<ILogger> logger)
-   : _logger(logger)
+std::shared_ptr<FileWriter> FileWriterFactory::CreateFileWriter(std::shared_ptr<ILogger> logger)
 {
+   return std::make_shared<FileWriter>(logger, _coalesceSize, _syncOnFlush);
+}
 
+FileWriter::FileWriter(std::shared_ptr<ILogger> logger, uint32_t coalesceSize, bool syncOnFlush)
+   : _logger(logger),
+   _file(nullptr),
+   _coalesceSize(coalesceSize),
+   _syncOnFlush(syncOnFlush),
+   _sparse(false),
+   _endsInHole(false)
+{
+   _buffer.reserve(_coalesceSize);
 }
 
 FileWriter::~FileWriter()
 {
-   if (_file.is_open())
+   if (_file)
    {
-      _file.close();
+      Flush();
+      std::fclose(_file);
    }
 }
 void FileWriter::SetDestination(const std::string& s)
@@ -31,14 +58,128 @@ void FileWriter::SetDestination(const std::string& s)
    
    _filename = ss.str();
 
-   // Todo: Error handling
-   _file.open(_filename);
+#ifdef _WIN32
+   fopen_s(&_file, _filename.c_str(), "wb");
+#else
+   _file = std::fopen(_filename.c_str(), "wb");
+#endif
+
+   if (!_file)
+   {
+      std::stringstream ss;
+      ss << "Unable to open " << _filename << " for writing";
+      _logger->Log(5, ss.str());
+      return;
+   }
+
+   // All writes are already coalesced into large blocks, stdio buffering would only add a copy
+   std::setvbuf(_file, nullptr, _IONBF, 0);
 }
 
 void FileWriter::Write(const std::string& s)
 {
-   if (_file.is_open())
+   if (!_file) return;
+
+   if (_buffer.empty() && s.size() >= _coalesceSize)
+   {
+      // Large enough to go straight to disk
+      std::fwrite(s.data(), 1, s.size(), _file);
+      _endsInHole = false;
+      return;
+   }
+
+   _buffer.insert(_buffer.end(), s.begin(), s.end());
+   if (_buffer.size() >= _coalesceSize)
+   {
+      WriteBuffer();
+   }
+}
+
+void FileWriter::WriteZeros(uint64_t length)
+{
+   if (!_file) return;
+
+   if (length < SparseThreshold)
+   {
+      _buffer.insert(_buffer.end(), (size_t)length, '\0');
+      if (_buffer.size() >= _coalesceSize)
+      {
+         WriteBuffer();
+      }
+      return;
+   }
+
+   WriteBuffer();
+   if (!_sparse) SetSparse();
+
+   // Skipping ahead leaves the range unwritten, a hole in a sparse file and zeros either way
+#ifdef _WIN32
+   _fseeki64(_file, (__int64)length, SEEK_CUR);
+#else
+   fseeko(_file, (off_t)length, SEEK_CUR);
+#endif
+   _endsInHole = true;
+}
+
+void FileWriter::Flush()
+{
+   if (!_file) return;
+
+   WriteBuffer();
+
+   if (_endsInHole)
+   {
+      // Nothing was written after the last hole, extend the file over it
+#ifdef _WIN32
+      bool extended = _chsize_s(_fileno(_file), _ftelli64(_file)) == 0;
+#else
+      bool extended = ftruncate(fileno(_file), ftello(_file)) == 0;
+#endif
+      if (!extended)
+      {
+         std::stringstream ss;
+         ss << "Extending " << _filename << " over its final hole failed";
+         _logger->Log(5, ss.str());
+      }
+      _endsInHole = false;
+   }
+
+   if (_syncOnFlush)
+   {
+#ifdef _WIN32
+      _commit(_fileno(_file));
+#else
+      fsync(fileno(_file));
+#endif
+   }
+}
+
+void FileWriter::WriteBuffer()
+{
+   if (_buffer.empty()) return;
+
+   _endsInHole = false;
+   if (std::fwrite(_buffer.data(), 1, _buffer.size(), _file) != _buffer.size())
+   {
+      std::stringstream ss;
+      ss << "Write to " << _filename << " failed";
+      _logger->Log(5, ss.str());
+   }
+   _buffer.clear();
+}
+
+void FileWriter::SetSparse()
+{
+   _sparse = true;
+
+#ifdef _WIN32
+   // Without this NTFS fills skipped ranges with allocated zeros
+   DWORD bytes = 0;
+   if (!DeviceIoControl((HANDLE)_get_osfhandle(_fileno(_file)), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytes, nullptr))
    {
-      _file << s;
+      std::stringstream ss;
+      ss << "Unable to make " << _filename << " sparse, holes will be filled with zeros";
+      _logger->Log(3, ss.str());
    }
+#endif
 }
@@ -3,27 +3,60 @@
 #include "ILogger.h"
 #include "IWriter.h"
 
-#include <fstream>
+#include <cstdio>
+#include <vector>
+
+// Default size of the buffer incoming blocks are coalesced into before being written to disk
+static const uint32_t DefaultCoalesceSize = 0x100000;
+
+class FileWriter;
 
 class FileWriterFactory : public IWriterFactory
 {
 public:
+   FileWriterFactory(uint32_t coalesceSize = DefaultCoalesceSize, bool syncOnFlush = false);
+
    std::shared_ptr<IWriter> Create(std::shared_ptr<ILogger> logger) override;
+
+   // As Create(), for servers built to call the writer directly
+   std::shared_ptr<FileWriter> CreateFileWriter(std::shared_ptr<ILogger> logger);
+
+private:
+   const uint32_t _coalesceSize;
+   const bool _syncOnFlush;
 };
 
-class FileWriter : public IWriter
+class FileWriter final : public IWriter
 {
 public:
-   FileWriter(std::shared_ptr<ILogger> logger);
+   FileWriter(std::shared_ptr<ILogger> logger, uint32_t coalesceSize = DefaultCoalesceSize, bool syncOnFlush = false);
    ~FileWriter();
 
    void Write(const std::string& s) override;
+   void WriteZeros(uint64_t length) override;
+   void Flush() override;
+   void SetSyncOnFlush(bool sync) override { _syncOnFlush = sync; }
    const std::string& GetDestination() override { return _filename; }
    void SetDestination(const std::string& s) override;
 
 private:
+   void WriteBuffer();
+   void SetSparse();
+
    std::shared_ptr<ILogger> _logger;
-   std::ofstream _file;
+   std::FILE* _file;
    std::string _filename;
-};
 
+   // Blocks are appended here and handed to the OS in a single write once the buffer fills
+   std::vector<char> _buffer;
+   const uint32_t _coalesceSize;
+
+   // When set, Flush() also commits the file contents to stable storage.  Set for every file by the factory, or
+   // for one transaction by its start
+   bool _syncOnFlush;
+
+   // Long runs of zeros are skipped over, leaving a hole in a sparse file.  A hole at the very end only
+   // takes effect once the file size is set
+   bool _sparse;
+   bool _endsInHole;
+};
@@ -0,0 +1,73 @@
+#include "HandshakeCookie.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#pragma comment(lib, "bcrypt.lib")
+
+// Length of the period a cookie is made in.  A cookie is accepted for up to twice this
+static const int CookiePeriodSeconds = 10;
+
+HandshakeCookie::HandshakeCookie()
+   : _hmacAlgorithm(nullptr)
+{
+   if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&_hmacAlgorithm, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG)))
+   {
+      throw std::runtime_error("open HMAC provider failed");
+   }
+
+   if (!BCRYPT_SUCCESS(BCryptGenRandom(nullptr, _secret.data(), (ULONG)_secret.size(), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+   {
+      BCryptCloseAlgorithmProvider(_hmacAlgorithm, 0);
+      throw std::runtime_error("generate cookie secret failed");
+   }
+}
+
+HandshakeCookie::~HandshakeCookie()
+{
+   BCryptCloseAlgorithmProvider(_hmacAlgorithm, 0);
+}
+
+std::vector<char> HandshakeCookie::Make(uint64_t sender, uint32_t transactionID, const std::vector<char>& start)
+{
+   return Make(GetPeriod(), sender, transactionID, start);
+}
+
+bool HandshakeCookie::Check(const std::vector<char>& cookie, uint64_t sender, uint32_t transactionID, const std::vector<char>& start)
+{
+   if (cookie.size() != HandshakeCookieSize) return false;
+
+   auto period = GetPeriod();
+   return cookie == Make(period, sender, transactionID, start) || cookie == Make(period - 1, sender, transactionID, start);
+}
+
+std::vector<char> HandshakeCookie::Make(uint32_t period, uint64_t sender, uint32_t transactionID, const std::vector<char>& start)
+{
+   unsigned char digest[32];
+
+   BCRYPT_HASH_HANDLE hash = nullptr;
+   if (!BCRYPT_SUCCESS(BCryptCreateHash(_hmacAlgorithm, &hash, nullptr, 0, _secret.data(), (ULONG)_secret.size(), 0)))
+   {
+      throw std::runtime_error("create cookie hash failed");
+   }
+
+   bool ok = BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)&period, sizeof(period), 0)) &&
+             BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)&sender, sizeof(sender), 0)) &&
+             BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)&transactionID, sizeof(transactionID), 0)) &&
+             BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)start.data(), (ULONG)start.size(), 0)) &&
+             BCRYPT_SUCCESS(BCryptFinishHash(hash, digest, sizeof(digest), 0));
+   BCryptDestroyHash(hash);
+
+   if (!ok)
+   {
+      throw std::runtime_error("hash cookie failed");
+   }
+
+   return std::vector<char>((char*)digest, (char*)digest + HandshakeCookieSize);
+}
+
+uint32_t HandshakeCookie::GetPeriod()
+{
+   auto seconds = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+   return (uint32_t)(seconds / CookiePeriodSeconds);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+#include <windows.h>
+#include <bcrypt.h>
+
+// Size of a cookie on the wire
+static const size_t HandshakeCookieSize = 8;
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Stateless cookies for the start handshake.  The server answers a start with a cookie instead of
+/// creating any state, and only starts the transaction when the client echoes the cookie back with
+/// the same start from the same address, proving it receives at the address it sends from.
+///
+/// A cookie is the truncated HMAC-SHA256, under a random secret, of the time, the sender's address,
+/// the transaction id and the start message.  Nothing is kept per cookie; one is valid for the
+/// period it was made in and the one after, and only when echoed from the address it was sent to.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class HandshakeCookie
+{
+public:
+   HandshakeCookie();
+   ~HandshakeCookie();
+   HandshakeCookie(const HandshakeCookie&) = delete;
+
+   // The sender is as reported by the transport, see ISenderReceiver::GetSender()
+   std::vector<char> Make(uint64_t sender, uint32_t transactionID, const std::vector<char>& start);
+   bool Check(const std::vector<char>& cookie, uint64_t sender, uint32_t transactionID, const std::vector<char>& start);
+
+private:
+   std::vector<char> Make(uint32_t period, uint64_t sender, uint32_t transactionID, const std::vector<char>& start);
+   static uint32_t GetPeriod();
+
+   BCRYPT_ALG_HANDLE _hmacAlgorithm;
+   std::array<unsigned char, 32> _secret;
+};
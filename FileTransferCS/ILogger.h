@@ -6,5 +6,8 @@ class ILogger
 {
 public:
    virtual void Log(int level, const std::string& s) = 0;
+
+   // Whether messages at this level are kept.  Callers check before formatting messages on per packet paths
+   virtual bool IsEnabled(int level) { return true; }
 };
 
@@ -8,4 +8,17 @@ class IReader
 public:
    virtual uint32_t Read(std::vector<char>& s) = 0;
    virtual const std::string& GetSource() = 0;
+
+   // Random access read of data already returned by Read(), used to rebuild blocks for retransmission.
+   // Sources that can't seek back return 0
+   virtual uint32_t ReadAt(uint64_t offset, uint32_t length, std::vector<char>& s) { s.clear(); return 0; }
+
+   // Whether ReadAt() can read back what Read() returned.  Blocks of sources that can't are kept in memory for
+   // retransmission instead
+   virtual bool CanReadAt() { return false; }
+
+   // If the source continues with zeros, consumes up to maxLength of them and returns how many, so they can
+   // be sent as a zero range instead of data.  Returns 0 when the next block holds data.  Sources that
+   // don't look for zeros always return 0
+   virtual uint64_t ReadZeros(uint64_t maxLength) { return 0; }
 };
@@ -7,6 +7,46 @@ class ISenderReceiver
 {
 public:
    virtual void Send(const std::vector<char>& s) = 0;
-   virtual void Receive(std::function<void(std::vector<char>)> callback) = 0;
+   // The received message is only valid for the duration of the callback, which copies what it keeps
+   virtual void Receive(std::function<void(const std::vector<char>&)> callback) = 0;
    virtual void Start(uint16_t port) = 0;
+
+   // Send one message made up of a header and a payload.  Transports that support gather I/O
+   // override this to avoid joining the two parts, the default joins them and calls Send(s)
+   virtual void Send(const std::vector<char>& header, const std::vector<char>& payload)
+   {
+      std::vector<char> s;
+      s.reserve(header.size() + payload.size());
+      s.insert(s.end(), header.begin(), header.end());
+      s.insert(s.end(), payload.begin(), payload.end());
+      Send(s);
+   }
+
+   // When the message being handed to the receive callback arrived, in microseconds of the steady clock, as
+   // stamped by the network stack.  Only meaningful during the callback.  Zero when the transport can't tell
+   virtual uint64_t GetReceiveTime()
+   {
+      return 0;
+   }
+
+   // Who sent the message being handed to the receive callback, its address packed into an integer by the
+   // transport.  Only meaningful during the callback.  Zero when the transport can't tell
+   virtual uint64_t GetSender()
+   {
+      return 0;
+   }
+
+   // Answer the transaction at the sender from now on.  Servers call this once they have accepted a message from
+   // there, so a message that fails their checks can't redirect a transaction's replies.  Transports that don't
+   // reply to senders ignore it
+   virtual void SetReplyAddress(uint32_t transactionID, uint64_t sender)
+   {
+   }
+
+   // Send to the sender only, leaving where its transaction is answered as it was.  For answering messages that
+   // have not been accepted.  The default sends as Send(s) does
+   virtual void SendTo(uint64_t sender, const std::vector<char>& s)
+   {
+      Send(s);
+   }
 };
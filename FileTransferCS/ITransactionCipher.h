@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+
+#include "TransactionUnit.h"
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Authenticated encryption of message data.  Keys are established per transaction from a 
+/// handshake the client sends with its start message, units are then sealed and opened in place.
+/// Both directions are sealed, the server's replies as well as the client's data.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class ITransactionCipher
+{
+public:
+   // Client side.  Creates the keys for a new transaction and returns the handshake to send to the server
+   virtual void BeginTransaction(uint32_t transactionID, std::vector<char>& handshake) = 0;
+
+   // Server side.  Creates the keys for a transaction from the handshake received from the client and opens
+   // the start unit with them.  The keys are only kept if the start unit is authentic
+   virtual bool AcceptTransaction(const std::vector<char>& handshake, TransactionUnit& tu) = 0;
+
+   // Server side.  Seals a reply to a start before its transaction exists, with keys made from the start's handshake
+   // that are not kept.  False if the start is not authentic
+   virtual bool SealReply(const std::vector<char>& handshake, const TransactionUnit& start, TransactionUnit& reply) = 0;
+
+   virtual void EndTransaction(uint32_t transactionID) = 0;
+
+   // Size of the handshake produced by BeginTransaction
+   virtual size_t GetHandshakeSize() = 0;
+
+   // Encrypts the message data and appends what is needed to open it, messagelength is updated.  Sets the
+   // timestamp, and marks the unit stamped, where the cipher authenticates it.  Set echoTimestamp first
+   virtual void Seal(TransactionUnit& tu) = 0;
+
+   // Authenticates and decrypts the message data.  Returns false if the unit is not authentic
+   virtual bool Open(TransactionUnit& tu) = 0;
+};
@@ -22,5 +22,9 @@ public:
    
     virtual void Post(std::function<void()> Task) = 0;
     virtual void Post(std::function<void()> Task, int nStrandID) = 0;
+
+    // Threads are grouped by node, a task posted to a node only runs on that node's threads
+    virtual int GetNodeCount() = 0;
+    virtual void PostToNode(std::function<void()> Task, int node) = 0;
 };
 
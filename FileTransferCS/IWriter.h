@@ -2,11 +2,32 @@
 
 #include <memory>
 #include <string>
+#include <algorithm>
+#include <cstdint>
 
 class IWriter
 {
 public:
    virtual void Write(const std::string& s) = 0;
+
+   // Writes a run of zeros.  Writers that can leave a hole in the destination instead should
+   virtual void WriteZeros(uint64_t length)
+   {
+      std::string zeros((size_t)std::min<uint64_t>(length, 0x10000), '\0');
+      while (length)
+      {
+         auto count = std::min<uint64_t>(length, zeros.size());
+         Write(count == zeros.size() ? zeros : zeros.substr(0, (size_t)count));
+         length -= count;
+      }
+   }
+
+   virtual void Flush() = 0;
+
+   // Has every flush from now on also commit the destination to stable storage, for a transaction that asks for
+   // it.  Writers with nothing to commit ignore it
+   virtual void SetSyncOnFlush(bool sync) {}
+
    virtual const std::string& GetDestination() = 0;
    virtual void SetDestination(const std::string& s) = 0;
 };
@@ -0,0 +1,220 @@
+#include "MultipathSenderReceiver.h"
+
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+// Header fields read straight from outgoing messages, see TransactionUnit.h
+static const size_t TransactionIdOffset = 4;
+static const size_t MessageTypeOffset = 8;
+static const size_t SequenceOffset = 12;
+
+// A path's share is raised by this factor for each NAK that finds it lost nothing
+static const double ProbeGain = 1.25;
+
+// No path's share drops below this, so a path that lost everything is still tried now and again
+static const double MinShare = 0.02;
+
+// Bound on the data units remembered until acknowledged, the oldest are forgotten beyond it
+static const size_t MaxInFlight = 0x100000;
+
+static uint64_t InFlightKey(uint32_t transactionID, uint32_t sequence)
+{
+   return ((uint64_t)transactionID << 32) | sequence;
+}
+
+MultipathSenderReceiver::MultipathSenderReceiver(std::shared_ptr<ILogger> logger)
+   : _logger(logger),
+   _receivingPath(0)
+{}
+
+MultipathSenderReceiver::~MultipathSenderReceiver()
+{
+   // The paths may outlive this object, make sure they stop calling into it
+   for (auto& path : _paths)
+   {
+      path.senderReceiver->Receive(nullptr);
+   }
+}
+
+void MultipathSenderReceiver::AddPath(std::shared_ptr<ISenderReceiver> path, uint32_t weight)
+{
+   size_t index;
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+      index = _paths.size();
+
+      Path p;
+      p.senderReceiver = path;
+      p.stats.share = weight > 0 ? weight : 1;
+      _paths.push_back(p);
+
+      // Shares are kept as fractions of the whole
+      double total = 0;
+      for (auto& existing : _paths) total += existing.stats.share;
+      for (auto& existing : _paths) existing.stats.share /= total;
+   }
+
+   path->Receive([this, index](const std::vector<char>& buf)
+   {
+      OnReceive(index, buf);
+   });
+}
+
+size_t MultipathSenderReceiver::PickPath(const char* header, size_t headerSize, size_t size)
+{
+   if (headerSize < SequenceOffset + sizeof(uint32_t)) return 0;
+
+   uint16_t messageType;
+   memcpy(&messageType, header + MessageTypeOffset, sizeof(messageType));
+   if (messageType != MsgType_Data && messageType != MsgType_ChunkRef && messageType != MsgType_ZeroRange) return 0;
+
+   uint32_t transactionID;
+   uint32_t sequence;
+   memcpy(&transactionID, header + TransactionIdOffset, sizeof(transactionID));
+   memcpy(&sequence, header + SequenceOffset, sizeof(sequence));
+
+   std::lock_guard<std::mutex> lock(_guard);
+
+   // The path furthest behind its share of the bytes sent goes next
+   size_t best = 0;
+   for (size_t i = 1; i < _paths.size(); i++)
+   {
+      if (_paths[i].virtualTime < _paths[best].virtualTime) best = i;
+   }
+
+   auto& path = _paths[best];
+   path.virtualTime += size / path.stats.share;
+   path.stats.units++;
+   path.stats.bytes += size;
+   path.sentSinceNak++;
+
+   if (_inFlight.size() >= MaxInFlight) _inFlight.erase(_inFlight.begin());
+   _inFlight[InFlightKey(transactionID, sequence)] = best;
+   return best;
+}
+
+void MultipathSenderReceiver::Send(const std::vector<char>& s)
+{
+   // Sent outside the guard, a transport may deliver the answer before returning
+   auto path = PickPath(s.data(), s.size(), s.size());
+   _paths[path].senderReceiver->Send(s);
+}
+
+void MultipathSenderReceiver::Send(const std::vector<char>& header, const std::vector<char>& payload)
+{
+   auto path = PickPath(header.data(), header.size(), header.size() + payload.size());
+   _paths[path].senderReceiver->Send(header, payload);
+}
+
+void MultipathSenderReceiver::Receive(std::function<void(const std::vector<char>&)> callback)
+{
+   std::lock_guard<std::mutex> lock(_receiveGuard);
+   _callback = callback;
+}
+
+void MultipathSenderReceiver::Start(uint16_t port)
+{
+   for (auto& path : _paths)
+   {
+      path.senderReceiver->Start(port);
+   }
+}
+
+uint64_t MultipathSenderReceiver::GetReceiveTime()
+{
+   // Only called from the receive callback, with the receive guard held
+   return _paths[_receivingPath].senderReceiver->GetReceiveTime();
+}
+
+std::vector<PathStats> MultipathSenderReceiver::GetPathStats()
+{
+   std::lock_guard<std::mutex> lock(_guard);
+
+   std::vector<PathStats> stats;
+   for (auto& path : _paths) stats.push_back(path.stats);
+   return stats;
+}
+
+void MultipathSenderReceiver::OnReceive(size_t path, const std::vector<char>& buf)
+{
+   TransactionUnit tu(buf);
+   if (tu.IsValid())
+   {
+      if (tu.messagetype == MsgType_Nak)
+      {
+         OnNak(tu);
+      }
+      else if (tu.messagetype == MsgType_Ack)
+      {
+         // Everything before the acknowledged sequence arrived, whatever path it took
+         std::lock_guard<std::mutex> lock(_guard);
+         _inFlight.erase(_inFlight.lower_bound(InFlightKey(tu.transactionid, 0)), _inFlight.lower_bound(InFlightKey(tu.transactionid, tu.sequencenum)));
+      }
+   }
+
+   std::lock_guard<std::mutex> lock(_receiveGuard);
+   _receivingPath = path;
+   if (_callback) _callback(buf);
+}
+
+void MultipathSenderReceiver::OnNak(const TransactionUnit& nak)
+{
+   std::lock_guard<std::mutex> lock(_guard);
+
+   // Charge each missing sequence to the path that carried it, once.  A repair is charged to the path it goes out on
+   for (size_t offset = 0; offset + sizeof(uint32_t) <= nak.messagedata.size(); offset += sizeof(uint32_t))
+   {
+      uint32_t sequence;
+      memcpy(&sequence, nak.messagedata.data() + offset, sizeof(sequence));
+
+      auto iter = _inFlight.find(InFlightKey(nak.transactionid, sequence));
+      if (iter == _inFlight.end()) continue;
+
+      auto& path = _paths[iter->second];
+      path.stats.lost++;
+      path.lostSinceNak++;
+      _inFlight.erase(iter);
+   }
+
+   Rebalance();
+}
+
+void MultipathSenderReceiver::Rebalance()
+{
+   // Called with the guard held
+   double total = 0;
+   for (auto& path : _paths)
+   {
+      if (path.lostSinceNak)
+      {
+         // Cut to the part of its share the path delivered
+         double sent = (double)std::max(path.sentSinceNak, path.lostSinceNak);
+         path.stats.share *= 1.0 - path.lostSinceNak / sent;
+      }
+      else if (path.sentSinceNak)
+      {
+         path.stats.share *= ProbeGain;
+      }
+
+      path.stats.share = std::max(path.stats.share, MinShare);
+      path.sentSinceNak = 0;
+      path.lostSinceNak = 0;
+      total += path.stats.share;
+   }
+
+   // The schedule starts over with the new shares
+   for (auto& path : _paths)
+   {
+      path.stats.share /= total;
+      path.virtualTime = 0;
+   }
+
+   if (_logger->IsEnabled(0))
+   {
+      std::stringstream ss;
+      ss << "Path shares";
+      for (auto& path : _paths) ss << " " << path.stats.share;
+      _logger->Log(0, ss.str());
+   }
+}
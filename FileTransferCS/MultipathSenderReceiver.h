@@ -0,0 +1,83 @@
+#pragma once
+
+#include "ISenderReceiver.h"
+#include "ILogger.h"
+#include "TransactionUnit.h"
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <mutex>
+
+struct PathStats
+{
+   double share = 0;             // Fraction of the data units currently scheduled onto the path
+   uint64_t units = 0;           // Data units sent on the path
+   uint64_t bytes = 0;
+   uint64_t lost = 0;            // Data units sent on the path that the server reported missing
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Spreads a client's data units over several paths, typically one UDP socket bound to each local
+/// interface, in proportion to what each path is found to carry.  The server needs nothing new,
+/// its reorder buffer merges the units by sequence whichever path they came in on.
+///
+/// Each path's capacity is probed through loss.  The sequence of every data unit is remembered
+/// with the path it went out on, so the sequences in a server's NAK are charged to the paths that
+/// lost them.  On each NAK a path that lost part of what it was given since the last one has its
+/// share cut to the part it delivered, and a path that lost nothing has its share raised to probe
+/// for more.  When the client sends faster than the paths carry, the shares settle in proportion
+/// to the paths' bandwidths.  The server must be repairing gaps with NAKs for this to happen,
+/// without them the shares stay as weighted.
+///
+/// Control messages, the start, end and handshake, all go on the first path so the server sees a
+/// transaction start from one address.  Messages received on any path are passed to the one
+/// receive callback, one at a time.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class MultipathSenderReceiver : public ISenderReceiver
+{
+public:
+   MultipathSenderReceiver(std::shared_ptr<ILogger> logger);
+   ~MultipathSenderReceiver();
+   MultipathSenderReceiver(const MultipathSenderReceiver&) = delete;
+
+   // Adds a path with a starting weight relative to the other paths.  Add every path before the first send
+   void AddPath(std::shared_ptr<ISenderReceiver> path, uint32_t weight = 1);
+
+   void Send(const std::vector<char>& s) override;
+   void Send(const std::vector<char>& header, const std::vector<char>& payload) override;
+   void Receive(std::function<void(const std::vector<char>&)> callback) override;
+   void Start(uint16_t port) override;
+   uint64_t GetReceiveTime() override;
+
+   std::vector<PathStats> GetPathStats();
+
+private:
+   struct Path
+   {
+      std::shared_ptr<ISenderReceiver> senderReceiver;
+      PathStats stats;
+      double virtualTime = 0;       // Bytes sent over share, the path furthest behind is sent on next
+      uint64_t sentSinceNak = 0;    // Data units since the shares were last adjusted
+      uint64_t lostSinceNak = 0;
+   };
+
+   size_t PickPath(const char* header, size_t headerSize, size_t size);
+   void OnReceive(size_t path, const std::vector<char>& buf);
+   void OnNak(const TransactionUnit& nak);
+   void Rebalance();
+
+   std::shared_ptr<ILogger> _logger;
+
+   std::mutex _guard;
+   std::vector<Path> _paths;
+
+   // Transaction id and sequence of each data unit in flight -> path it was sent on, until acknowledged
+   std::map<uint64_t, size_t> _inFlight;
+
+   // Incoming messages from every path are delivered one at a time.  _receivingPath is the path of the one
+   // being delivered, for GetReceiveTime()
+   std::mutex _receiveGuard;
+   std::function<void(const std::vector<char>&)> _callback;
+   size_t _receivingPath;
+};
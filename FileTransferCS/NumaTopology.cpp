@@ -0,0 +1,60 @@
+#include "NumaTopology.h"
+
+#include <thread>
+
+#include <windows.h>
+
+std::vector<NumaNode> NumaTopology::Query()
+{
+   std::vector<NumaNode> nodes;
+
+   ULONG highest = 0;
+   if (GetNumaHighestNodeNumber(&highest))
+   {
+      for (ULONG n = 0; n <= highest; n++)
+      {
+         // Nodes with memory but no processors are of no use for placing threads
+         GROUP_AFFINITY affinity = {};
+         if (!GetNumaNodeProcessorMaskEx((USHORT)n, &affinity) || affinity.Mask == 0) continue;
+
+         NumaNode node;
+         node.node = (int)n;
+         node.processorGroup = affinity.Group;
+         node.processorMask = (uint64_t)affinity.Mask;
+         nodes.push_back(node);
+      }
+   }
+
+   if (nodes.empty()) nodes = Emulate(1);
+   return nodes;
+}
+
+std::vector<NumaNode> NumaTopology::Emulate(int nodeCount)
+{
+   // A processor group holds at most 64 processors
+   uint64_t processors = std::thread::hardware_concurrency();
+   if (processors > 64) processors = 64;
+
+   std::vector<NumaNode> nodes(nodeCount > 0 ? nodeCount : 1);
+   for (size_t i = 0; i < nodes.size(); i++)
+   {
+      // Contiguous runs, the way real nodes usually number their processors
+      nodes[i].node = (int)i;
+      for (auto p = processors * i / nodes.size(); p < processors * (i + 1) / nodes.size(); p++)
+      {
+         nodes[i].processorMask |= 1ull << p;
+      }
+   }
+
+   return nodes;
+}
+
+bool NumaTopology::Pin(const NumaNode& node)
+{
+   if (node.processorMask == 0) return false;
+
+   GROUP_AFFINITY affinity = {};
+   affinity.Group = node.processorGroup;
+   affinity.Mask = (KAFFINITY)node.processorMask;
+   return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+}
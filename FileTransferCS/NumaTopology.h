@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+struct NumaNode
+{
+   int node = 0;
+   uint16_t processorGroup = 0;
+   uint64_t processorMask = 0;      // Processors of the group on this node.  Zero leaves threads unpinned
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Processor layout the thread pool groups its threads by.  Query() reads the machine's NUMA nodes,
+/// Emulate() splits the processors into made up nodes so node placement can be tried out, and
+/// tested, on a single socket machine.
+///
+/// Windows places the pages a thread first touches in the memory of the node it runs on, so a
+/// thread pinned to a node gets node local buffers from the ordinary allocators.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class NumaTopology
+{
+public:
+   // Nodes that have processors.  A machine without NUMA reports a single node
+   static std::vector<NumaNode> Query();
+
+   // The processors of the first processor group cut into nodeCount runs.  Nodes left without a processor
+   // when there are more nodes than processors are unpinned
+   static std::vector<NumaNode> Emulate(int nodeCount);
+
+   // Restricts the calling thread to the node's processors.  False if the node has none or pinning failed
+   static bool Pin(const NumaNode& node);
+};
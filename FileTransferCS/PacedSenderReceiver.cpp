@@ -0,0 +1,41 @@
+#include "PacedSenderReceiver.h"
+
+PacedSenderReceiver::PacedSenderReceiver(std::shared_ptr<ISenderReceiver> senderReceiver, std::shared_ptr<BandwidthScheduler> scheduler, uint32_t weight, uint64_t bytesPerSecond)
+   : _senderReceiver(senderReceiver),
+   _scheduler(scheduler)
+{
+   _flowID = _scheduler->AddFlow(weight, bytesPerSecond);
+}
+
+PacedSenderReceiver::~PacedSenderReceiver()
+{
+   _scheduler->RemoveFlow(_flowID);
+}
+
+void PacedSenderReceiver::Send(const std::vector<char>& s)
+{
+   if (!_scheduler->Acquire(_flowID, s.size())) return;
+   _senderReceiver->Send(s);
+}
+
+void PacedSenderReceiver::Send(const std::vector<char>& header, const std::vector<char>& payload)
+{
+   if (!_scheduler->Acquire(_flowID, header.size() + payload.size())) return;
+   _senderReceiver->Send(header, payload);
+}
+
+void PacedSenderReceiver::SendTo(uint64_t sender, const std::vector<char>& s)
+{
+   if (!_scheduler->Acquire(_flowID, s.size())) return;
+   _senderReceiver->SendTo(sender, s);
+}
+
+void PacedSenderReceiver::Receive(std::function<void(const std::vector<char>&)> callback)
+{
+   _senderReceiver->Receive(callback);
+}
+
+void PacedSenderReceiver::Start(uint16_t port)
+{
+   _senderReceiver->Start(port);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "ISenderReceiver.h"
+#include "BandwidthScheduler.h"
+
+#include <memory>
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Decorator that paces sends through a shared BandwidthScheduler.  Each instance is one flow with
+/// its own weight and optional rate cap, receiving is passed straight through.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class PacedSenderReceiver : public ISenderReceiver
+{
+public:
+   PacedSenderReceiver(std::shared_ptr<ISenderReceiver> senderReceiver, std::shared_ptr<BandwidthScheduler> scheduler, uint32_t weight = 1, uint64_t bytesPerSecond = 0);
+   ~PacedSenderReceiver();
+   PacedSenderReceiver(const PacedSenderReceiver&) = delete;
+
+   void Send(const std::vector<char>& s) override;
+   void Send(const std::vector<char>& header, const std::vector<char>& payload) override;
+   void Receive(std::function<void(const std::vector<char>&)> callback) override;
+   void Start(uint16_t port) override;
+   uint64_t GetSender() override { return _senderReceiver->GetSender(); }
+   void SetReplyAddress(uint32_t transactionID, uint64_t sender) override { _senderReceiver->SetReplyAddress(transactionID, sender); }
+   void SendTo(uint64_t sender, const std::vector<char>& s) override;
+
+private:
+   std::shared_ptr<ISenderReceiver> _senderReceiver;
+   std::shared_ptr<BandwidthScheduler> _scheduler;
+   int _flowID;
+};
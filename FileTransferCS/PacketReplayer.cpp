@@ -0,0 +1,137 @@
+#include "PacketReplayer.h"
+#include "RecordingSenderReceiver.h"
+
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <unistd.h>
+#endif
+
+// Memory is sampled after this many datagrams, and at the end
+static const uint64_t MemorySampleInterval = 256;
+
+// Bytes of the process in physical memory now
+static uint64_t GetWorkingSet()
+{
+#ifdef _WIN32
+   PROCESS_MEMORY_COUNTERS counters;
+   if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+   return counters.WorkingSetSize;
+#else
+   uint64_t size = 0, resident = 0;
+   std::ifstream statm("/proc/self/statm");
+   if (!(statm >> size >> resident)) return 0;
+   return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+PacketReplayer::PacketReplayer(std::shared_ptr<ILogger> logger, const std::string& filename)
+   : _logger(logger),
+   _replies(0)
+{
+   std::ifstream file(filename, std::ios::in | std::ios::binary);
+   if (!file.is_open())
+   {
+      throw std::runtime_error("Unable to open packet capture " + filename);
+   }
+
+   uint32_t magic = 0, version = 0;
+   file.read((char*)&magic, sizeof(magic));
+   file.read((char*)&version, sizeof(version));
+   if (!file || magic != PacketCaptureMagic || version != PacketCaptureVersion)
+   {
+      throw std::runtime_error(filename + " is not a packet capture");
+   }
+
+   uint64_t atUs = 0;
+   while (1)
+   {
+      uint32_t deltaUs, length;
+      if (!file.read((char*)&deltaUs, sizeof(deltaUs)) || !file.read((char*)&length, sizeof(length))) break;
+
+      Record record;
+      atUs += deltaUs;
+      record.atUs = atUs;
+      record.sent = (length & PacketCaptureSentFlag) != 0;
+      record.length = length & ~PacketCaptureSentFlag;
+      record.offset = _data.size();
+
+      _data.resize(record.offset + record.length);
+      if (!file.read(_data.data() + record.offset, record.length))
+      {
+         // A capture cut short, say by the recording process being killed, plays up to the last whole datagram
+         _data.resize(record.offset);
+         break;
+      }
+      _records.push_back(record);
+   }
+
+   std::stringstream ss;
+   ss << "Loaded " << _records.size() << " datagrams, " << _data.size() << " bytes, from " << filename;
+   _logger->Log(1, ss.str());
+}
+
+void PacketReplayer::Receive(std::function<void(const std::vector<char>&)> callback)
+{
+   std::lock_guard<std::mutex> lock(_guard);
+   _callback = callback;
+}
+
+ReplayStats PacketReplayer::Play(std::function<uint64_t()> bufferedBytes, double speed)
+{
+   ReplayStats stats;
+   if (!_records.empty()) stats.recordedUs = _records.back().atUs;
+
+   auto baseWorkingSet = GetWorkingSet();
+   auto sampleMemory = [&]()
+   {
+      auto buffered = bufferedBytes();
+      if (buffered > stats.peakBufferedBytes) stats.peakBufferedBytes = buffered;
+
+      auto workingSet = GetWorkingSet();
+      if (workingSet > baseWorkingSet && workingSet - baseWorkingSet > stats.workingSetBytes) stats.workingSetBytes = workingSet - baseWorkingSet;
+   };
+
+   auto replies = _replies.load();
+   auto start = std::chrono::steady_clock::now();
+
+   // Reused for each datagram, as a socket's receive buffer is
+   std::vector<char> buffer;
+   for (auto& record : _records)
+   {
+      if (record.sent)
+      {
+         stats.recordedReplies++;
+         continue;
+      }
+
+      if (speed > 0)
+      {
+         std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t)(record.atUs / speed)));
+      }
+
+      buffer.assign(_data.begin() + record.offset, _data.begin() + record.offset + record.length);
+      {
+         std::lock_guard<std::mutex> lock(_guard);
+         if (_callback) _callback(buffer);
+      }
+
+      stats.datagrams++;
+      stats.bytes += record.length;
+      if (stats.datagrams % MemorySampleInterval == 0) sampleMemory();
+   }
+
+   sampleMemory();
+   stats.elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+   stats.replies = _replies - replies;
+   return stats;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "ISenderReceiver.h"
+#include "ILogger.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+struct ReplayStats
+{
+   uint64_t datagrams = 0;          // Recorded received datagrams fed to the server
+   uint64_t bytes = 0;
+   uint64_t replies = 0;            // Datagrams the server sent during the replay
+   uint64_t recordedReplies = 0;    // Datagrams the recorded server sent, to compare with
+   uint64_t recordedUs = 0;         // Time the capture spans as recorded
+   uint64_t elapsedUs = 0;          // Time the replay took
+   uint64_t peakBufferedBytes = 0;  // Most held in the server's reorder buffers
+   uint64_t workingSetBytes = 0;    // Most the process working set grew by over the replay
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Plays a packet capture made by RecordingSenderReceiver back into a server, as a fixed workload
+/// for tracking the server's performance from one version to the next.
+///
+/// The replayer is the server's transport.  The capture's received datagrams are handed to the
+/// server one at a time, as a socket's receive thread would, either with their recorded timing
+/// scaled up by a speed factor or as fast as the server takes them.  What the server sends back is
+/// counted and dropped.  Memory is sampled as the replay goes, from the server's reorder buffers
+/// and the process working set.
+///
+/// The server handles each datagram on the thread handing it over, so the time a replay takes
+/// covers receiving, reordering and writing all of it.  Only what the server leaves to timers,
+/// such as periodic flushes and delayed acknowledgements, falls outside it.
+///
+/// The server should be set up as the recorded one was, but without cookies.  Their secret is
+/// random, so the recorded echoes would not check.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class PacketReplayer final : public ISenderReceiver
+{
+public:
+   // Reads the whole capture up front, so the replay measures the server rather than the disk.  Throws if the
+   // file can't be read or isn't a capture
+   PacketReplayer(std::shared_ptr<ILogger> logger, const std::string& filename);
+   PacketReplayer(const PacketReplayer&) = delete;
+
+   void Send(const std::vector<char>& s) override { _replies++; }
+   void Send(const std::vector<char>& header, const std::vector<char>& payload) override { _replies++; }
+   void Receive(std::function<void(const std::vector<char>&)> callback) override;
+   void Start(uint16_t port) override {}
+
+   // Feeds the capture to the server, which must be the one receiving from this replayer.  A speed of 2 plays it
+   // twice as fast as recorded, zero as fast as the server takes it.  Returns once the server has handled every datagram.
+   // Any build of the server
+   template <typename Server>
+   ReplayStats Replay(Server& server, double speed = 1.0)
+   {
+      return Play([&server]() { return server.GetReorderStats().bufferedBytes; }, speed);
+   }
+
+   size_t GetRecordCount() const { return _records.size(); }
+
+private:
+   ReplayStats Play(std::function<uint64_t()> bufferedBytes, double speed);
+
+   struct Record
+   {
+      uint64_t atUs;       // Since the start of the capture
+      size_t offset;       // Of the datagram in _data
+      uint32_t length;
+      bool sent;
+   };
+
+   std::shared_ptr<ILogger> _logger;
+   std::vector<Record> _records;
+   std::vector<char> _data;
+
+   std::mutex _guard;
+   std::function<void(const std::vector<char>&)> _callback;
+   std::atomic<uint64_t> _replies;
+};
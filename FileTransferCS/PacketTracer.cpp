@@ -0,0 +1,133 @@
+#include "PacketTracer.h"
+
+#include <fstream>
+
+static std::atomic<uint64_t> nextTracerID(1);
+
+// The buffer this thread last recorded into and the tracer it belongs to
+struct CachedTraceBuffer
+{
+   uint64_t tracerID = 0;
+   void* buffer = nullptr;
+};
+
+static thread_local CachedTraceBuffer cachedBuffer;
+
+static const char* GetStageName(TraceStage stage)
+{
+   switch (stage)
+   {
+   case TraceStage_Read: return "read";
+   case TraceStage_Framed: return "framed";
+   case TraceStage_Sent: return "sent";
+   case TraceStage_Received: return "received";
+   case TraceStage_Reordered: return "reordered";
+   case TraceStage_Written: return "written";
+   }
+   return "unknown";
+}
+
+PacketTracer::PacketTracer(uint32_t sampleInterval, size_t eventsPerThread)
+   : _sampleInterval(sampleInterval > 0 ? sampleInterval : 1),
+   _eventsPerThread(eventsPerThread),
+   _id(nextTracerID++),
+   _origin(std::chrono::steady_clock::now())
+{
+}
+
+uint64_t PacketTracer::Now() const
+{
+   return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _origin).count();
+}
+
+void PacketTracer::Record(TraceStage stage, uint32_t transactionID, uint32_t sequence, uint64_t start, uint64_t end)
+{
+   auto& buffer = GetThreadBuffer();
+
+   // Only this thread writes the buffer, readers see an event once the count includes it
+   auto count = buffer.count.load(std::memory_order_relaxed);
+   if (count >= buffer.events.size())
+   {
+      buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+   }
+
+   auto& event = buffer.events[count];
+   event.start = start;
+   event.duration = (uint32_t)(end > start ? end - start : 0);
+   event.transactionID = transactionID;
+   event.sequence = sequence;
+   event.stage = stage;
+   buffer.count.store(count + 1, std::memory_order_release);
+}
+
+PacketTracer::ThreadBuffer& PacketTracer::GetThreadBuffer()
+{
+   if (cachedBuffer.tracerID == _id) return *(ThreadBuffer*)cachedBuffer.buffer;
+
+   // First span from this thread, or it last recorded for another tracer
+   std::lock_guard<std::mutex> lock(_buffersGuard);
+
+   ThreadBuffer* buffer = nullptr;
+   auto thread = std::this_thread::get_id();
+   for (auto& b : _buffers)
+   {
+      if (b->owner == thread) buffer = b.get();
+   }
+
+   if (!buffer)
+   {
+      _buffers.push_back(std::make_unique<ThreadBuffer>(_eventsPerThread, thread, _buffers.size()));
+      buffer = _buffers.back().get();
+   }
+
+   cachedBuffer.tracerID = _id;
+   cachedBuffer.buffer = buffer;
+   return *buffer;
+}
+
+bool PacketTracer::Export(const std::string& filename)
+{
+   std::ofstream f(filename, std::ios::out | std::ios::trunc);
+   if (!f.is_open()) return false;
+
+   Export(f);
+   return f.good();
+}
+
+void PacketTracer::Export(std::ostream& out)
+{
+   std::lock_guard<std::mutex> lock(_buffersGuard);
+
+   // Complete ("X") events, one track per recording thread.  Timestamps and durations are in microseconds
+   out << "{\"traceEvents\":[";
+   bool first = true;
+   for (auto& buffer : _buffers)
+   {
+      out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->index
+          << ",\"args\":{\"name\":\"Thread " << buffer->index << "\"}}";
+      first = false;
+
+      auto count = buffer->count.load(std::memory_order_acquire);
+      for (size_t i = 0; i < count; i++)
+      {
+         auto& event = buffer->events[i];
+         out << ",\n{\"name\":\"" << GetStageName(event.stage) << "\",\"cat\":\"packet\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->index
+             << ",\"ts\":" << event.start << ",\"dur\":" << event.duration
+             << ",\"args\":{\"transaction\":" << event.transactionID << ",\"sequence\":" << event.sequence << "}}";
+      }
+   }
+   out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+uint64_t PacketTracer::GetDroppedCount()
+{
+   std::lock_guard<std::mutex> lock(_buffersGuard);
+
+   uint64_t dropped = 0;
+   for (auto& buffer : _buffers)
+   {
+      dropped += buffer->dropped.load(std::memory_order_relaxed);
+   }
+   return dropped;
+}
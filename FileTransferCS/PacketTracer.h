@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Stages of a data unit's trip from the source to the destination, in order
+enum TraceStage
+{
+   TraceStage_Read,        // Client reads the block from its source
+   TraceStage_Framed,      // Client builds and seals the unit
+   TraceStage_Sent,        // Client hands the unit to the transport
+   TraceStage_Received,    // Server parses and dispatches the unit
+   TraceStage_Reordered,   // Unit waits in the reorder buffer for the units before it
+   TraceStage_Written,     // Server writes the unit to the destination
+};
+
+// One unit in this many is traced, by sequence number
+static const uint32_t DefaultTraceSampleInterval = 64;
+
+// Spans each thread can record before it stops recording
+static const size_t DefaultTraceEventsPerThread = 0x10000;    // 64K
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Records where sampled data units spend their time, one span per stage, and exports the spans
+/// in the Chrome trace event format for chrome://tracing or Perfetto.  Units are sampled by
+/// sequence number, so both sides trace the same units and, with the client and server sharing a
+/// tracer, a unit's spans line up end to end.
+///
+/// Each thread records into a buffer of its own without taking a lock.  A full buffer stops
+/// recording and counts what it drops.  Components given no tracer trace nothing, at the cost of a
+/// pointer check per unit.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class PacketTracer
+{
+public:
+   PacketTracer(uint32_t sampleInterval = DefaultTraceSampleInterval, size_t eventsPerThread = DefaultTraceEventsPerThread);
+   PacketTracer(const PacketTracer&) = delete;
+
+   bool IsSampled(uint32_t sequence) const { return sequence % _sampleInterval == 0; }
+
+   // Microseconds since the tracer was created, the time base of every span
+   uint64_t Now() const;
+
+   void Record(TraceStage stage, uint32_t transactionID, uint32_t sequence, uint64_t start, uint64_t end);
+
+   // Writes the spans recorded so far.  Spans being recorded meanwhile may or may not be included
+   bool Export(const std::string& filename);
+   void Export(std::ostream& out);
+
+   // Spans lost to full buffers
+   uint64_t GetDroppedCount();
+
+private:
+   struct TraceEvent
+   {
+      uint64_t start;
+      uint32_t duration;
+      uint32_t transactionID;
+      uint32_t sequence;
+      TraceStage stage;
+   };
+
+   struct ThreadBuffer
+   {
+      ThreadBuffer(size_t capacity, std::thread::id owner, size_t index)
+         : events(capacity), count(0), dropped(0), owner(owner), index(index)
+      {}
+
+      std::vector<TraceEvent> events;
+      std::atomic<size_t> count;       // Events written so far, each published after it is complete
+      std::atomic<uint64_t> dropped;
+      const std::thread::id owner;
+      const size_t index;              // Shown as the thread id in the trace
+   };
+
+   ThreadBuffer& GetThreadBuffer();
+
+   const uint32_t _sampleInterval;
+   const size_t _eventsPerThread;
+   const uint64_t _id;              // Tells tracers apart in the buffer each thread has cached
+   const std::chrono::steady_clock::time_point _origin;
+
+   // Only locked the first time a thread records, and to export
+   std::vector<std::unique_ptr<ThreadBuffer>> _buffers;
+   std::mutex _buffersGuard;
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Records a span from construction to destruction, if there is a tracer and it samples the unit.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class TraceSpan
+{
+public:
+   TraceSpan(PacketTracer* tracer, TraceStage stage, uint32_t transactionID, uint32_t sequence)
+      : _tracer(tracer && tracer->IsSampled(sequence) ? tracer : nullptr),
+      _stage(stage),
+      _transactionID(transactionID),
+      _sequence(sequence),
+      _start(_tracer ? _tracer->Now() : 0)
+   {}
+
+   ~TraceSpan()
+   {
+      if (_tracer) _tracer->Record(_stage, _transactionID, _sequence, _start, _tracer->Now());
+   }
+
+   TraceSpan(const TraceSpan&) = delete;
+
+private:
+   PacketTracer* const _tracer;
+   const TraceStage _stage;
+   const uint32_t _transactionID;
+   const uint32_t _sequence;
+   const uint64_t _start;
+};
@@ -0,0 +1,89 @@
+#include "RecordingSenderReceiver.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+RecordingSenderReceiver::RecordingSenderReceiver(std::shared_ptr<ISenderReceiver> senderReceiver, const std::string& filename)
+   : _senderReceiver(senderReceiver),
+   _file(filename, std::ios::out | std::ios::binary | std::ios::trunc),
+   _last(std::chrono::steady_clock::now()),
+   _records(0)
+{
+   if (!_file.is_open())
+   {
+      throw std::runtime_error("Unable to create packet capture " + filename);
+   }
+
+   _file.write((const char*)&PacketCaptureMagic, sizeof(PacketCaptureMagic));
+   _file.write((const char*)&PacketCaptureVersion, sizeof(PacketCaptureVersion));
+}
+
+RecordingSenderReceiver::~RecordingSenderReceiver()
+{
+   // The transport may outlive this object, make sure it stops calling into it
+   _senderReceiver->Receive(nullptr);
+}
+
+void RecordingSenderReceiver::Send(const std::vector<char>& s)
+{
+   Record(true, s.data(), s.size(), nullptr, 0);
+   _senderReceiver->Send(s);
+}
+
+void RecordingSenderReceiver::Send(const std::vector<char>& header, const std::vector<char>& payload)
+{
+   Record(true, header.data(), header.size(), payload.data(), payload.size());
+   _senderReceiver->Send(header, payload);
+}
+
+void RecordingSenderReceiver::SendTo(uint64_t sender, const std::vector<char>& s)
+{
+   Record(true, s.data(), s.size(), nullptr, 0);
+   _senderReceiver->SendTo(sender, s);
+}
+
+void RecordingSenderReceiver::Receive(std::function<void(const std::vector<char>&)> callback)
+{
+   if (!callback)
+   {
+      _senderReceiver->Receive(nullptr);
+      return;
+   }
+
+   _senderReceiver->Receive([this, callback](const std::vector<char>& buf)
+   {
+      Record(false, buf.data(), buf.size(), nullptr, 0);
+      callback(buf);
+   });
+}
+
+void RecordingSenderReceiver::Start(uint16_t port)
+{
+   _senderReceiver->Start(port);
+}
+
+uint64_t RecordingSenderReceiver::GetRecordCount()
+{
+   std::lock_guard<std::mutex> lock(_guard);
+   return _records;
+}
+
+void RecordingSenderReceiver::Record(bool sent, const char* header, size_t headerSize, const char* payload, size_t payloadSize)
+{
+   std::lock_guard<std::mutex> lock(_guard);
+
+   // Gaps beyond the 71 minutes a delta can hold are recorded as the longest it can
+   auto now = std::chrono::steady_clock::now();
+   auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - _last).count();
+   auto deltaUs = (uint32_t)std::min<int64_t>(delta, UINT32_MAX);
+   _last = now;
+
+   uint32_t length = (uint32_t)(headerSize + payloadSize);
+   if (sent) length |= PacketCaptureSentFlag;
+
+   _file.write((const char*)&deltaUs, sizeof(deltaUs));
+   _file.write((const char*)&length, sizeof(length));
+   _file.write(header, headerSize);
+   if (payloadSize) _file.write(payload, payloadSize);
+   _records++;
+}
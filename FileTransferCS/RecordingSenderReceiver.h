@@ -0,0 +1,56 @@
+#pragma once
+
+#include "ISenderReceiver.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+
+// Packet capture file layout.  A header of the magic and version, then a record per datagram of the microseconds
+// since the previous record, the length with the top bit set for a datagram sent rather than received, and the
+// datagram itself.  Integers are little endian
+static const uint32_t PacketCaptureMagic = 0x52435446;        // "FTCR"
+static const uint32_t PacketCaptureVersion = 1;
+static const uint32_t PacketCaptureSentFlag = 0x80000000;
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Decorator that records every datagram passing through a transport, in both directions, with
+/// its timing into a packet capture file.  PacketReplayer plays a capture back into a server, so
+/// a workload seen once can be rerun as often as needed.
+///
+/// Records are written through a buffer under a lock, so recording costs a copy into the buffer
+/// per datagram.  The file is complete once the recorder is destroyed.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class RecordingSenderReceiver : public ISenderReceiver
+{
+public:
+   // Throws if the file can't be created
+   RecordingSenderReceiver(std::shared_ptr<ISenderReceiver> senderReceiver, const std::string& filename);
+   ~RecordingSenderReceiver();
+   RecordingSenderReceiver(const RecordingSenderReceiver&) = delete;
+
+   void Send(const std::vector<char>& s) override;
+   void Send(const std::vector<char>& header, const std::vector<char>& payload) override;
+   void Receive(std::function<void(const std::vector<char>&)> callback) override;
+   void Start(uint16_t port) override;
+   uint64_t GetReceiveTime() override { return _senderReceiver->GetReceiveTime(); }
+   uint64_t GetSender() override { return _senderReceiver->GetSender(); }
+   void SetReplyAddress(uint32_t transactionID, uint64_t sender) override { _senderReceiver->SetReplyAddress(transactionID, sender); }
+   void SendTo(uint64_t sender, const std::vector<char>& s) override;
+
+   // Datagrams recorded so far
+   uint64_t GetRecordCount();
+
+private:
+   void Record(bool sent, const char* header, size_t headerSize, const char* payload, size_t payloadSize);
+
+   std::shared_ptr<ISenderReceiver> _senderReceiver;
+
+   std::mutex _guard;
+   std::ofstream _file;
+   std::chrono::steady_clock::time_point _last;
+   uint64_t _records;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <mutex>
+
+// Most block data kept for sources that can't be read again
+static const size_t DefaultRetransmitDataLimit = 0x1000000;
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Remembers where each unacknowledged block came from in the source so the block can be read
+/// again if the server asks for it.  Only the source offset and length are kept, not the data,
+/// and entries are released as soon as the server acknowledges them.
+///
+/// A source that can't be read again, a pipe on standard input, has its blocks' data kept here
+/// instead, in a window bounded by the data limit.  Beyond it the oldest data is dropped first and
+/// those blocks can no longer be retransmitted.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class RetransmitStore
+{
+public:
+   RetransmitStore(size_t dataLimit = DefaultRetransmitDataLimit)
+      : _firstSequence(0),
+      _dataLimit(dataLimit),
+      _dataBytes(0),
+      _dataStart(0)
+   {}
+
+   // Sequences are expected to be added in order with no gaps.  Zero entries were sent as a zero range
+   // rather than data and are resent the same way
+   void Add(uint32_t sequence, uint64_t offset, uint32_t length, bool zeros = false)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if (_entries.empty())
+      {
+         _firstSequence = sequence;
+      }
+      _entries.push_back(Entry{ offset, length, zeros });
+   }
+
+   // Adds a block along with a copy of its data, for sources that can't be read again
+   void Add(uint32_t sequence, uint64_t offset, const char* data, uint32_t length)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if (_entries.empty())
+      {
+         _firstSequence = sequence;
+      }
+      _entries.push_back(Entry{ offset, length, false, std::vector<char>(data, data + length) });
+      _dataBytes += length;
+
+      // Entries before _dataStart hold no data, so the oldest still held are found from there
+      while (_dataBytes > _dataLimit && _dataStart < _entries.size())
+      {
+         auto& entry = _entries[_dataStart++];
+         _dataBytes -= entry.data.size();
+         std::vector<char>().swap(entry.data);
+      }
+   }
+
+   bool Find(uint32_t sequence, uint64_t& offset, uint32_t& length)
+   {
+      bool zeros;
+      return Find(sequence, offset, length, zeros);
+   }
+
+   bool Find(uint32_t sequence, uint64_t& offset, uint32_t& length, bool& zeros)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if (sequence < _firstSequence || sequence - _firstSequence >= _entries.size()) return false;
+
+      auto& entry = _entries[sequence - _firstSequence];
+      offset = entry.offset;
+      length = entry.length;
+      zeros = entry.zeros;
+      return true;
+   }
+
+   // Copies out the data kept for a block, false if none is kept
+   bool FindData(uint32_t sequence, std::vector<char>& data)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if (sequence < _firstSequence || sequence - _firstSequence >= _entries.size()) return false;
+
+      auto& entry = _entries[sequence - _firstSequence];
+      if (entry.data.empty()) return false;
+
+      data = entry.data;
+      return true;
+   }
+
+   // Cumulative acknowledgement, releases every sequence before nextSequence
+   void Release(uint32_t nextSequence)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      while (!_entries.empty() && _firstSequence < nextSequence)
+      {
+         _dataBytes -= _entries.front().data.size();
+         if (_dataStart > 0) _dataStart--;
+
+         _entries.pop_front();
+         _firstSequence++;
+      }
+   }
+
+   size_t GetCount()
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _entries.size();
+   }
+
+   // Bytes of block data kept
+   size_t GetDataBytes()
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _dataBytes;
+   }
+
+private:
+   struct Entry
+   {
+      uint64_t offset;
+      uint32_t length;
+      bool zeros;
+      std::vector<char> data;
+   };
+
+   std::mutex _mutex;
+   uint32_t _firstSequence;
+   std::deque<Entry> _entries;
+
+   const size_t _dataLimit;
+   size_t _dataBytes;
+   size_t _dataStart;       // Index of the oldest entry that may still hold data
+};
@@ -6,11 +6,20 @@
 #include <sstream>
 #include <debugapi.h>
 
-class SimpleLogger : public ILogger
+class SimpleLogger final : public ILogger
 {
 public:
+   // Messages below minimumLevel are dropped, 0 keeps the per packet debug messages
+   SimpleLogger(int minimumLevel = 0)
+      : _minimumLevel(minimumLevel)
+   {}
+
+   bool IsEnabled(int level) override { return level >= _minimumLevel; }
+
    void Log(int level, const std::string& s) override
    {
+      if (!IsEnabled(level)) return;
+
       std::stringstream ss;
       ss << "[Sev:" << level << "] " << s << std::endl;
       std::cout << ss.str();
@@ -19,4 +28,7 @@ public:
       OutputDebugString(ss.str().c_str());
 #endif
    }
+
+private:
+   const int _minimumLevel;
 };
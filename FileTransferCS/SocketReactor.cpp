@@ -0,0 +1,170 @@
+#include "SocketReactor.h"
+
+#include <sstream>
+#include <vector>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+// Most sockets a reactor waits on, select() takes FD_SETSIZE and one of them is the wake socket
+static const size_t MaxSockets = FD_SETSIZE - 1;
+
+SocketReactor::SocketReactor(std::shared_ptr<ILogger> logger)
+   : _logger(logger),
+   _stopFlag(false)
+{
+   WSADATA wsa;
+   if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+   {
+      throw std::runtime_error("WSAStartup failed");
+   }
+
+   // The wake socket is bound to loopback and sends to itself
+   _wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if (_wakeSocket == INVALID_SOCKET) throw std::runtime_error("create wake socket failed");
+
+   _wakeAddress.sin_family = AF_INET;
+   _wakeAddress.sin_port = 0;
+   inet_pton(AF_INET, "127.0.0.1", (void*)&_wakeAddress.sin_addr.s_addr);
+
+   int addrlen = sizeof(_wakeAddress);
+   if (bind(_wakeSocket, (sockaddr*)&_wakeAddress, sizeof(_wakeAddress)) == SOCKET_ERROR ||
+       getsockname(_wakeSocket, (sockaddr*)&_wakeAddress, &addrlen) == SOCKET_ERROR)
+   {
+      closesocket(_wakeSocket);
+      throw std::runtime_error("bind wake socket failed");
+   }
+
+   u_long nonBlocking = 1;
+   ioctlsocket(_wakeSocket, FIONBIO, &nonBlocking);
+
+   _thread = std::thread([this]() { Run(); });
+}
+
+SocketReactor::~SocketReactor()
+{
+   Stop();
+
+   closesocket(_wakeSocket);
+   WSACleanup();
+}
+
+bool SocketReactor::Register(SOCKET s, std::function<void()> onReadable)
+{
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!_handlers.count(s) && _handlers.size() >= MaxSockets)
+      {
+         std::stringstream ss;
+         ss << "Socket reactor already waits on " << _handlers.size() << " sockets, the most it can, refusing another";
+         _logger->Log(5, ss.str());
+         return false;
+      }
+      _handlers[s] = onReadable;
+   }
+
+   // The reactor thread has to rebuild its wait set to include the new socket
+   Wake();
+   return true;
+}
+
+size_t SocketReactor::GetSocketCount()
+{
+   std::lock_guard<std::mutex> lock(_mutex);
+   return _handlers.size();
+}
+
+void SocketReactor::Unregister(SOCKET s)
+{
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _handlers.erase(s);
+   }
+
+   Wake();
+
+   // Wait out a handler that may be running right now, unless this is called from a handler
+   if (std::this_thread::get_id() != _thread.get_id())
+   {
+      std::lock_guard<std::mutex> lock(_dispatchGuard);
+   }
+}
+
+void SocketReactor::Stop()
+{
+   if (!_stopFlag.exchange(true))
+   {
+      Wake();
+
+      if (_thread.joinable() && std::this_thread::get_id() != _thread.get_id())
+      {
+         _thread.join();
+      }
+   }
+}
+
+void SocketReactor::Wake()
+{
+   char c = 0;
+   sendto(_wakeSocket, &c, sizeof(c), 0, (sockaddr*)&_wakeAddress, sizeof(_wakeAddress));
+}
+
+void SocketReactor::Run()
+{
+   std::vector<SOCKET> ready;
+
+   while (!_stopFlag)
+   {
+      fd_set readSet;
+      FD_ZERO(&readSet);
+      FD_SET(_wakeSocket, &readSet);
+      {
+         std::lock_guard<std::mutex> lock(_mutex);
+         for (auto& pair : _handlers)
+         {
+            FD_SET(pair.first, &readSet);
+         }
+      }
+
+      // Block until a socket has data or someone wakes us, there is no polling interval
+      int result = select(0, &readSet, nullptr, nullptr, nullptr);
+      if (result == SOCKET_ERROR)
+      {
+         // Most likely a socket was closed while we were waiting on it, the next pass rebuilds the set
+         std::stringstream ss;
+         ss << "select failed, rc=" << WSAGetLastError();
+         _logger->Log(0, ss.str());
+         continue;
+      }
+
+      if (FD_ISSET(_wakeSocket, &readSet))
+      {
+         char buf[16];
+         while (recv(_wakeSocket, buf, sizeof(buf), 0) > 0);
+      }
+
+      std::lock_guard<std::mutex> dispatchLock(_dispatchGuard);
+
+      ready.clear();
+      {
+         std::lock_guard<std::mutex> lock(_mutex);
+         for (auto& pair : _handlers)
+         {
+            if (FD_ISSET(pair.first, &readSet)) ready.push_back(pair.first);
+         }
+      }
+
+      for (auto s : ready)
+      {
+         // Look the handler up again, an earlier handler may have unregistered this socket
+         std::function<void()> handler;
+         {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto iter = _handlers.find(s);
+            if (iter == _handlers.end()) continue;
+            handler = iter->second;
+         }
+
+         handler();
+      }
+   }
+}
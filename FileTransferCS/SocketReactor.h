@@ -0,0 +1,60 @@
+#pragma once
+
+#include "ILogger.h"
+
+#include <memory>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Readiness loop for sockets.  One reactor thread waits on every registered socket at once and 
+/// calls the socket's handler when data is waiting, so no thread is parked in a blocking receive
+/// per socket.  A loopback wake socket lets registration changes and shutdown take effect
+/// immediately.
+///
+/// select() takes at most FD_SETSIZE sockets, 64 on Windows, and the wake socket is one of them.
+/// Registration beyond that is refused rather than leaving the socket out of the wait unread.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class SocketReactor
+{
+public:
+   SocketReactor(std::shared_ptr<ILogger> logger);
+   ~SocketReactor();
+   SocketReactor(const SocketReactor&) = delete;
+   SocketReactor(SocketReactor&&) = delete;
+
+   // The handler is called on the reactor thread and should drain the socket without blocking.  False, and the
+   // handler is never called, when the reactor already waits on as many sockets as it can
+   bool Register(SOCKET s, std::function<void()> onReadable);
+
+   // Sockets registered now
+   size_t GetSocketCount();
+
+   // Once this returns the handler is not running and will not be called again
+   void Unregister(SOCKET s);
+
+   void Stop();
+
+private:
+   void Run();
+   void Wake();
+
+   std::shared_ptr<ILogger> _logger;
+   SOCKET _wakeSocket;
+   sockaddr_in _wakeAddress;
+
+   std::map<SOCKET, std::function<void()>> _handlers;
+   std::mutex _mutex;
+
+   // Held by the reactor thread while handlers run
+   std::mutex _dispatchGuard;
+
+   std::atomic<bool> _stopFlag;
+   std::thread _thread;
+};
@@ -0,0 +1,213 @@
+#include "TailFileReader.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
+#include <thread>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+// Most data held between the source and Read(), beyond this the source is left to wait
+static const size_t MaxPending = 0x1000000;
+
+TailFileReader::TailFileReader(std::shared_ptr<ILogger> logger, const TailFileReaderOptions& options)
+   : _logger(logger),
+   _options(options),
+   _followStdin(false),
+   _pending(std::make_shared<Pending>()),
+   _fileBuffer(0x10000),
+   _filePosition(0),
+   _fileBase(0),
+   _logicalBase(0),
+   _logicalPosition(0)
+{}
+
+TailFileReader::~TailFileReader()
+{
+   // A pump blocked reading standard input holds its own reference to the pending data and exits on its next read
+   Stop();
+}
+
+void TailFileReader::SetFile(const std::string& filename)
+{
+   _filename = filename;
+
+   if (filename == "-")
+   {
+      _followStdin = true;
+
+#ifdef _WIN32
+      _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+      // Reads from a pipe block, so they get a thread of their own
+      auto pending = _pending;
+      std::thread([pending]()
+      {
+         std::vector<char> buffer(0x10000);
+         while (1)
+         {
+            // Returns as soon as the pipe has anything, rather than waiting for a full buffer
+#ifdef _WIN32
+            auto count = _read(_fileno(stdin), buffer.data(), (unsigned int)buffer.size());
+#else
+            auto count = read(STDIN_FILENO, buffer.data(), buffer.size());
+#endif
+            if (count <= 0) break;
+
+            std::unique_lock<std::mutex> lock(pending->mutex);
+            pending->wake.wait(lock, [&]() { return pending->data.size() < MaxPending || pending->ended; });
+            if (pending->ended) return;
+
+            if (pending->data.empty()) pending->since = Clock::now();
+            pending->data.insert(pending->data.end(), buffer.begin(), buffer.begin() + count);
+            pending->wake.notify_all();
+         }
+
+         std::lock_guard<std::mutex> lock(pending->mutex);
+         pending->ended = true;
+         pending->wake.notify_all();
+      }).detach();
+      return;
+   }
+
+   _fileStream.open(filename, std::ios::in | std::ios::binary);
+   if (!_fileStream.is_open())
+   {
+      std::stringstream ss;
+      ss << "Unable to open " << filename << " to follow";
+      _logger->Log(5, ss.str());
+      return;
+   }
+
+   if (_options.startAtEnd)
+   {
+      _fileStream.seekg(0, std::ios::end);
+      _filePosition = (uint64_t)_fileStream.tellg();
+      _fileBase = _filePosition;
+   }
+}
+
+uint32_t TailFileReader::Read(std::vector<char>& s)
+{
+   std::unique_lock<std::mutex> lock(_pending->mutex);
+   auto& data = _pending->data;
+
+   while (1)
+   {
+      if (!_followStdin) Fill();
+
+      // A full block goes straight away, a part filled one once it has waited the flush interval
+      if (data.size() >= _options.blockSize) break;
+
+      if (_pending->ended)
+      {
+         if (data.empty())
+         {
+            s.clear();
+            return 0;
+         }
+         break;
+      }
+
+      auto now = Clock::now();
+      auto flushAt = _pending->since + std::chrono::milliseconds(_options.flushIntervalMs);
+      if (!data.empty() && now >= flushAt) break;
+
+      // Sleep until the next poll or flush, whichever is first.  Stop() and the standard input pump wake us early
+      auto wait = std::chrono::duration_cast<Clock::duration>(std::chrono::milliseconds(_options.pollIntervalMs));
+      if (!data.empty()) wait = std::min(wait, flushAt - now);
+      _pending->wake.wait_for(lock, wait);
+   }
+
+   auto count = std::min<size_t>(_options.blockSize, data.size());
+   s.assign(data.begin(), data.begin() + count);
+   data.erase(data.begin(), data.begin() + count);
+
+   // There may be room for the standard input pump again
+   _pending->wake.notify_all();
+   return (uint32_t)count;
+}
+
+uint32_t TailFileReader::ReadAt(uint64_t offset, uint32_t length, std::vector<char>& s)
+{
+   std::lock_guard<std::mutex> lock(_randomAccessGuard);
+
+   // A pipe can't be read again, and neither can a file generation that has been truncated away
+   s.clear();
+   if (_followStdin || offset < _logicalBase) return 0;
+
+   if (!_randomAccessStream.is_open())
+   {
+      _randomAccessStream.open(_filename, std::ios::in | std::ios::binary);
+   }
+
+   _randomAccessStream.clear();
+   _randomAccessStream.seekg((std::streamoff)(offset - _logicalBase + _fileBase));
+
+   s.resize(length);
+   _randomAccessStream.read(s.data(), s.size());
+
+   auto count = _randomAccessStream.gcount();
+   s.resize((size_t)count);
+   return (uint32_t)count;
+}
+
+void TailFileReader::Stop()
+{
+   std::lock_guard<std::mutex> lock(_pending->mutex);
+   _pending->ended = true;
+   _pending->wake.notify_all();
+}
+
+void TailFileReader::Fill()
+{
+   // Called with the pending lock held
+   if (!_fileStream.is_open()) return;
+
+   std::error_code ec;
+   auto size = std::filesystem::file_size(_filename, ec);
+   if (ec) return;
+
+   // Shorter than what we have read, it was truncated or replaced by a new file
+   if (size < _filePosition) ReopenFile();
+   if (size == _filePosition) return;
+
+   auto& data = _pending->data;
+   while (data.size() < MaxPending)
+   {
+      // Clear the end of file state left by the last read so appended data can be read
+      _fileStream.clear();
+      _fileStream.read(_fileBuffer.data(), _fileBuffer.size());
+
+      auto count = (size_t)_fileStream.gcount();
+      if (count == 0) break;
+
+      if (data.empty()) _pending->since = Clock::now();
+      data.insert(data.end(), _fileBuffer.begin(), _fileBuffer.begin() + count);
+      _filePosition += count;
+      _logicalPosition += count;
+   }
+}
+
+void TailFileReader::ReopenFile()
+{
+   std::stringstream ss;
+   ss << _filename << " was truncated, following it again from the start";
+   _logger->Log(3, ss.str());
+
+   _fileStream.close();
+   _fileStream.open(_filename, std::ios::in | std::ios::binary);
+   _filePosition = 0;
+
+   std::lock_guard<std::mutex> lock(_randomAccessGuard);
+   _randomAccessStream.close();
+   _fileBase = 0;
+   _logicalBase = _logicalPosition;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "IReader.h"
+#include "ILogger.h"
+
+#include <memory>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <string>
+
+struct TailFileReaderOptions
+{
+   // Largest block handed out by Read(), and so the payload of each data unit
+   uint32_t blockSize = 128;
+
+   // How long a part filled block waits for more data before it is handed out anyway.  Lower is less latency,
+   // higher packs small appends into fewer units
+   int flushIntervalMs = 20;
+
+   // How often the file is checked for appended data
+   int pollIntervalMs = 10;
+
+   // Skip what the file already holds and only send what is appended from now on
+   bool startAtEnd = false;
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Reader for a source that keeps growing, an application log being appended to or a pipe on
+/// standard input.  Read() waits for new data rather than reporting the end, so the client keeps
+/// a single transaction open for as long as the source is followed.  The stream ends when Stop()
+/// is called, or when standard input is closed.
+///
+/// A followed file that shrinks is taken to have been truncated or rotated and is followed again
+/// from its start.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class TailFileReader : public IReader
+{
+public:
+   TailFileReader(std::shared_ptr<ILogger> logger, const TailFileReaderOptions& options = TailFileReaderOptions());
+   TailFileReader(const TailFileReader&) = delete;
+   ~TailFileReader();
+
+   uint32_t Read(std::vector<char>& s) override;
+   uint32_t ReadAt(uint64_t offset, uint32_t length, std::vector<char>& s) override;
+   bool CanReadAt() override { return !_followStdin; }
+   const std::string& GetSource() override { return _filename; }
+
+   // Follows the file, "-" follows standard input
+   void SetFile(const std::string& filename);
+
+   // Ends the stream.  Read() hands out whatever is still pending and then returns 0
+   void Stop();
+
+private:
+   using Clock = std::chrono::steady_clock;
+
+   void Fill();
+   void ReopenFile();
+
+   // Shared with the thread pumping standard input, which may block in a read past the reader's lifetime
+   struct Pending
+   {
+      std::mutex mutex;
+      std::condition_variable wake;
+      std::deque<char> data;
+      Clock::time_point since;      // When the oldest pending byte arrived
+      bool ended = false;
+   };
+
+   std::shared_ptr<ILogger> _logger;
+   const TailFileReaderOptions _options;
+   std::string _filename;
+   bool _followStdin;
+
+   std::shared_ptr<Pending> _pending;
+
+   // Followed file.  _fileBase is the file offset the current generation of the file was first read from and
+   // _logicalBase the stream offset that byte was handed out at, together they map stream offsets back to the file
+   std::ifstream _fileStream;
+   std::vector<char> _fileBuffer;
+   uint64_t _filePosition;
+   uint64_t _fileBase;
+   uint64_t _logicalBase;
+   uint64_t _logicalPosition;
+
+   std::ifstream _randomAccessStream;
+   std::mutex _randomAccessGuard;
+};
@@ -2,56 +2,362 @@
 
 #include <memory>
 #include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <vector>
+#include <iterator>
 
 #include "TransactionUnit.h"
 
+// Default limits on the memory held by units that arrived ahead of their turn
+static const uint64_t DefaultTransactionReorderBudget = 0x400000;      // 4 MB per transaction
+static const uint64_t DefaultGlobalReorderBudget = 0x10000000;         // 256 MB across all transactions
+static const uint64_t DefaultSpillBudget = 0x100000000;                // 4 GB of scratch file
+
+struct TransactionManagerStats
+{
+   size_t transactions;       // Transactions with reorder state
+   uint64_t bufferedBytes;    // Early units held in memory
+   uint64_t spilledBytes;     // Early units held in the spill file
+   uint64_t spillFileBytes;   // Extent of the spill file in use, space freed inside it included
+   uint64_t spillCount;       // Units spilled since the manager was created
+   uint64_t dropCount;        // Units dropped because they could not be buffered or spilled
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Collects units per transaction and hands them out in sequence order.  Units that arrive early
+/// are held in memory up to a per transaction and a global budget, beyond that they are spilled
+/// to a scratch file and read back when their turn comes.  Space in the file is reused as units
+/// are read back, so it only grows with the units spilled at once.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
 class TransactionManager
 {
 public:
-   TransactionManager() = default;
-   ~TransactionManager() = default;
+   TransactionManager(uint64_t transactionBudget = DefaultTransactionReorderBudget, uint64_t globalBudget = DefaultGlobalReorderBudget,
+                      uint64_t spillBudget = DefaultSpillBudget)
+      : _transactionBudget(transactionBudget),
+      _globalBudget(globalBudget),
+      _spillBudget(spillBudget),
+      _bufferedBytes(0),
+      _spilledBytes(0),
+      _spillCount(0),
+      _dropCount(0),
+      _spillEnd(0)
+   {}
+
+   ~TransactionManager()
+   {
+      if (_spillFile.is_open())
+      {
+         _spillFile.close();
+
+         std::error_code ec;
+         std::filesystem::remove(_spillFilename, ec);
+      }
+   }
+
+   TransactionManager(const TransactionManager&) = delete;
 
    void Add(std::shared_ptr<TransactionUnit> tu)
    {
-      // Find the associated transaction and add the unit to the list of pending messages
-      auto iter = _packetMap.find(tu->transactionid);
-      if (iter != _packetMap.end())
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      // Find the associated transaction, creating it for the first unit
+      auto& transaction = _transactions[tu->transactionid];
+
+      // Drop anything we already have or have already handed out
+      if (tu->sequencenum < transaction.nextSequence ||
+          transaction.units.count(tu->sequencenum) ||
+          transaction.spilled.count(tu->sequencenum))
       {
-         iter->second.insert(std::make_pair(tu->sequencenum, tu));
+         return;
       }
-      else
+
+      auto size = GetSize(*tu);
+
+      // The unit that is next in line is collected straight away, there is no point spilling it
+      bool overBudget = transaction.bufferedBytes + size > _transactionBudget || _bufferedBytes + size > _globalBudget;
+      if (overBudget && tu->sequencenum != transaction.nextSequence)
       {
-         // Create a new transaction for this unit
-         _packetMap[tu->transactionid].insert(std::make_pair(tu->sequencenum, tu));
+         Spill(transaction, *tu);
+         return;
       }
+
+      transaction.units.insert(std::make_pair(tu->sequencenum, tu));
+      transaction.bufferedBytes += size;
+      _bufferedBytes += size;
    }
 
    std::shared_ptr<TransactionUnit> Collect(uint32_t transactionID)
    {
-      auto iter = _packetMap.find(transactionID);
-      if (iter != _packetMap.end())
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      auto iter = _transactions.find(transactionID);
+      if (iter != _transactions.end())
       {
-         auto& sequenceMap = iter->second;
-         if (sequenceMap.size())
+         auto& transaction = iter->second;
+
+         // Check sequence
+         auto unitIter = transaction.units.begin();
+         if (unitIter != transaction.units.end() && unitIter->first == transaction.nextSequence)
          {
-            auto p = sequenceMap.begin()->second;
+            auto p = unitIter->second;
+            auto size = GetSize(*p);
+
+            transaction.units.erase(unitIter);
+            transaction.bufferedBytes -= size;
+            _bufferedBytes -= size;
+            transaction.nextSequence++;
+            return p;
+         }
 
-            // Check sequence
-            if (p->sequencenum == _nextSequenceMap[transactionID])
+         auto spillIter = transaction.spilled.find(transaction.nextSequence);
+         if (spillIter != transaction.spilled.end())
+         {
+            auto p = Unspill(transactionID, spillIter->first, spillIter->second);
+            _spilledBytes -= spillIter->second.length;
+            FreeSpill(spillIter->second.offset, spillIter->second.length);
+            transaction.spilled.erase(spillIter);
+
+            transaction.nextSequence++;
+            return p;
+         }
+      }
+
+      return std::shared_ptr<TransactionUnit>();
+   }
+
+   // The sequence number the transaction is waiting for, everything before it has been collected
+   uint32_t GetNextSequence(uint32_t transactionID)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      auto iter = _transactions.find(transactionID);
+      return iter != _transactions.end() ? iter->second.nextSequence : 0;
+   }
+
+   // Sequences not held yet between the next expected sequence and the highest one held, in order and at most
+   // maxCount of them.  When endSequence is beyond everything held, the sequences up to it are missing too
+   std::vector<uint32_t> GetMissing(uint32_t transactionID, size_t maxCount, uint32_t endSequence = 0)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      std::vector<uint32_t> missing;
+      auto iter = _transactions.find(transactionID);
+      uint32_t expected = iter != _transactions.end() ? iter->second.nextSequence : 0;
+
+      if (iter != _transactions.end())
+      {
+         // Walk the held sequences in order, in memory and spilled, the gaps between them are missing
+         auto& transaction = iter->second;
+         auto unitIter = transaction.units.begin();
+         auto spillIter = transaction.spilled.begin();
+         while (missing.size() < maxCount && (unitIter != transaction.units.end() || spillIter != transaction.spilled.end()))
+         {
+            uint32_t sequence;
+            if (spillIter == transaction.spilled.end() || (unitIter != transaction.units.end() && unitIter->first < spillIter->first))
+            {
+               sequence = (unitIter++)->first;
+            }
+            else
             {
-               _nextSequenceMap[transactionID]++;
-               _packetMap.erase(iter);
-               return p;
+               sequence = (spillIter++)->first;
             }
+
+            for (; expected < sequence && missing.size() < maxCount; expected++)
+            {
+               missing.push_back(expected);
+            }
+            expected = sequence + 1;
          }
       }
 
-      return std::shared_ptr<TransactionUnit>();
+      for (; expected < endSequence && missing.size() < maxCount; expected++)
+      {
+         missing.push_back(expected);
+      }
+
+      return missing;
+   }
+
+   // Releases all state held for a transaction
+   void Remove(uint32_t transactionID)
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      auto iter = _transactions.find(transactionID);
+      if (iter == _transactions.end()) return;
+
+      _bufferedBytes -= iter->second.bufferedBytes;
+      for (auto& pair : iter->second.spilled)
+      {
+         _spilledBytes -= pair.second.length;
+         FreeSpill(pair.second.offset, pair.second.length);
+      }
+      _transactions.erase(iter);
+   }
+
+   TransactionManagerStats GetStats()
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      TransactionManagerStats stats;
+      stats.transactions = _transactions.size();
+      stats.bufferedBytes = _bufferedBytes;
+      stats.spilledBytes = _spilledBytes;
+      stats.spillFileBytes = _spillEnd;
+      stats.spillCount = _spillCount;
+      stats.dropCount = _dropCount;
+      return stats;
    }
 
 private:
-   std::map<uint32_t, std::map<uint32_t, std::shared_ptr<TransactionUnit>>> _packetMap;
-   std::map<uint32_t, uint32_t> _nextSequenceMap;
-};
+   struct SpillEntry
+   {
+      uint64_t offset;
+      uint16_t messagetype;
+      uint16_t length;
+      uint32_t timestamp;
+      uint32_t echoTimestamp;
+      uint64_t receivedAt;
+   };
+
+   struct Transaction
+   {
+      uint32_t nextSequence = 0;
+      uint64_t bufferedBytes = 0;
+      std::map<uint32_t, std::shared_ptr<TransactionUnit>> units;
+      std::map<uint32_t, SpillEntry> spilled;
+   };
+
+   // Memory accounted to a buffered unit, the data plus a rough allowance for the unit and map node
+   static uint64_t GetSize(const TransactionUnit& tu)
+   {
+      return tu.messagedata.size() + 128;
+   }
 
+   void Spill(Transaction& transaction, const TransactionUnit& tu)
+   {
+      uint64_t offset;
+      if (!AllocateSpill(tu.messagedata.size(), offset))
+      {
+         // The scratch file is bounded too.  The unit is lost here, the server asks for it again once the end
+         // shows it missing, or sooner with repair on
+         _dropCount++;
+         return;
+      }
 
+      if (!_spillFile.is_open())
+      {
+         std::stringstream ss;
+         ss << "FileTransferCS_spill_" << std::hex << (uintptr_t)this << ".tmp";
+         _spillFilename = (std::filesystem::temp_directory_path() / ss.str()).string();
+         _spillFile.open(_spillFilename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+      }
+
+      _spillFile.clear();
+      _spillFile.seekp((std::streamoff)offset);
+      _spillFile.write(tu.messagedata.data(), tu.messagedata.size());
+      if (!_spillFile.good())
+      {
+         // Nowhere to put it
+         FreeSpill(offset, tu.messagedata.size());
+         _dropCount++;
+         return;
+      }
+
+      SpillEntry entry;
+      entry.offset = offset;
+      entry.messagetype = tu.messagetype;
+      entry.length = (uint16_t)tu.messagedata.size();
+      entry.timestamp = tu.timestamp;
+      entry.echoTimestamp = tu.echoTimestamp;
+      entry.receivedAt = tu.receivedAt;
+      transaction.spilled.insert(std::make_pair(tu.sequencenum, entry));
+
+      _spilledBytes += entry.length;
+      _spillCount++;
+   }
+
+   std::shared_ptr<TransactionUnit> Unspill(uint32_t transactionID, uint32_t sequence, const SpillEntry& entry)
+   {
+      auto p = std::make_shared<TransactionUnit>();
+      p->transactionid = transactionID;
+      p->messagetype = entry.messagetype;
+      p->messagelength = entry.length;
+      p->sequencenum = sequence;
+      p->timestamp = entry.timestamp;
+      p->echoTimestamp = entry.echoTimestamp;
+      p->receivedAt = entry.receivedAt;
+      p->messagedata.resize(entry.length);
+
+      _spillFile.clear();
+      _spillFile.seekg((std::streamoff)entry.offset);
+      _spillFile.read(p->messagedata.data(), entry.length);
+      return p;
+   }
+
+   // Takes the first freed extent the unit fits in, otherwise grows the file within its budget
+   bool AllocateSpill(uint64_t length, uint64_t& offset)
+   {
+      for (auto iter = _freeSpill.begin(); iter != _freeSpill.end(); ++iter)
+      {
+         if (iter->second < length) continue;
+
+         offset = iter->first;
+         auto remaining = iter->second - length;
+         _freeSpill.erase(iter);
+         if (remaining) _freeSpill[offset + length] = remaining;
+         return true;
+      }
+
+      if (_spillEnd + length > _spillBudget) return false;
+
+      offset = _spillEnd;
+      _spillEnd += length;
+      return true;
+   }
+
+   // Returns an extent for reuse, merged with free neighbours.  Free space at the end of the file shrinks it
+   void FreeSpill(uint64_t offset, uint64_t length)
+   {
+      auto next = _freeSpill.lower_bound(offset);
+      if (next != _freeSpill.end() && next->first == offset + length)
+      {
+         length += next->second;
+         next = _freeSpill.erase(next);
+      }
+      if (next != _freeSpill.begin())
+      {
+         auto previous = std::prev(next);
+         if (previous->first + previous->second == offset)
+         {
+            offset = previous->first;
+            length += previous->second;
+            _freeSpill.erase(previous);
+         }
+      }
+
+      if (offset + length == _spillEnd) _spillEnd = offset;
+      else _freeSpill[offset] = length;
+   }
+
+   const uint64_t _transactionBudget;
+   const uint64_t _globalBudget;
+   const uint64_t _spillBudget;
+
+   std::mutex _mutex;
+   std::map<uint32_t, Transaction> _transactions;
+
+   uint64_t _bufferedBytes;
+   uint64_t _spilledBytes;
+   uint64_t _spillCount;
+   uint64_t _dropCount;
+
+   std::fstream _spillFile;
+   std::string _spillFilename;
+   uint64_t _spillEnd;                         // Everything in the file lies before this
+   std::map<uint64_t, uint64_t> _freeSpill;    // Freed extents before _spillEnd, offset -> length
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+// Default limit on transactions held at once
+static const size_t DefaultMaxTransactions = 0x100000;      // 1M
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Live transaction state keyed by transaction id, in one flat open addressed array.  Collisions
+/// probe linearly and removal shifts the following entries back, so there are no tombstones and
+/// no allocation per transaction.  The table doubles while under three quarters full and stops
+/// accepting transactions at its maximum count, which bounds its memory.
+///
+/// Each entry records when it was last touched.  ExpireIdle() moves a clock hand a few slots at a
+/// time and removes entries idle for too long, so abandoned transactions are dropped without ever
+/// walking the whole table at once.
+///
+/// Not thread safe.  Entry pointers are valid until the next Insert() or Remove().
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+class TransactionTable
+{
+public:
+   TransactionTable(size_t maxCount = DefaultMaxTransactions)
+      : _maxCount(maxCount),
+      _count(0),
+      _bits(0),
+      _hand(0)
+   {}
+
+   T* Find(uint32_t id)
+   {
+      if (_slots.empty()) return nullptr;
+
+      for (size_t i = Home(id); _slots[i].used; i = Next(i))
+      {
+         if (_slots[i].id == id) return &_slots[i].value;
+      }
+      return nullptr;
+   }
+
+   // Finds the entry, adding an empty one if there is none.  Null when the table is full
+   T* Insert(uint32_t id, uint32_t now)
+   {
+      auto value = Find(id);
+      if (value) return value;
+
+      if (_count >= _maxCount) return nullptr;
+      if ((_count + 1) * 4 > _slots.size() * 3) Grow();
+
+      size_t i = Home(id);
+      while (_slots[i].used) i = Next(i);
+
+      _slots[i].id = id;
+      _slots[i].lastActive = now;
+      _slots[i].used = true;
+      _count++;
+      return &_slots[i].value;
+   }
+
+   bool Remove(uint32_t id)
+   {
+      if (_slots.empty()) return false;
+
+      for (size_t i = Home(id); _slots[i].used; i = Next(i))
+      {
+         if (_slots[i].id == id)
+         {
+            RemoveAt(i);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Records activity for a transaction, if it is in the table
+   void Touch(uint32_t id, uint32_t now)
+   {
+      if (_slots.empty()) return;
+
+      for (size_t i = Home(id); _slots[i].used; i = Next(i))
+      {
+         if (_slots[i].id == id)
+         {
+            _slots[i].lastActive = now;
+            return;
+         }
+      }
+   }
+
+   // Moves the clock hand over up to steps slots, removing entries not touched for idleTime.  Each is
+   // passed to expired(id, value) before it goes.  Times are in any unit that wraps at 32 bits
+   template <typename F>
+   void ExpireIdle(uint32_t now, uint32_t idleTime, size_t steps, F expired)
+   {
+      for (; steps && !_slots.empty(); steps--)
+      {
+         _hand = Next(_hand);
+
+         // An entry shifted back into this slot by the removal is looked at again rather than skipped
+         while (_slots[_hand].used && now - _slots[_hand].lastActive > idleTime)
+         {
+            expired(_slots[_hand].id, _slots[_hand].value);
+            RemoveAt(_hand);
+         }
+      }
+   }
+
+   size_t GetCount() const { return _count; }
+   size_t GetCapacity() const { return _slots.size(); }
+
+   // Bytes held by the slot array, not counting anything the entries own themselves
+   size_t GetMemoryUsage() const { return _slots.capacity() * sizeof(Slot); }
+
+private:
+   struct Slot
+   {
+      uint32_t id = 0;
+      uint32_t lastActive = 0;
+      bool used = false;
+      T value = T();
+   };
+
+   size_t Home(uint32_t id) const
+   {
+      // Fibonacci hashing spreads sequential and clustered ids over the table
+      return (size_t)((id * 0x9E3779B9u) >> (32 - _bits));
+   }
+
+   size_t Next(size_t i) const { return (i + 1) & (_slots.size() - 1); }
+
+   void RemoveAt(size_t i)
+   {
+      // Shift back any following entry that probed past this slot, so lookups never stop short
+      for (size_t j = Next(i); _slots[j].used; j = Next(j))
+      {
+         auto home = Home(_slots[j].id);
+         bool movable = (j > i) ? (home <= i || home > j) : (home <= i && home > j);
+         if (movable)
+         {
+            _slots[i] = std::move(_slots[j]);
+            i = j;
+         }
+      }
+
+      _slots[i] = Slot();
+      _count--;
+   }
+
+   void Grow()
+   {
+      std::vector<Slot> old;
+      old.swap(_slots);
+
+      _bits = old.empty() ? 6 : _bits + 1;
+      _slots.resize((size_t)1 << _bits);
+      _hand = 0;
+
+      for (auto& slot : old)
+      {
+         if (!slot.used) continue;
+
+         size_t i = Home(slot.id);
+         while (_slots[i].used) i = Next(i);
+         _slots[i] = std::move(slot);
+      }
+   }
+
+   const size_t _maxCount;
+   size_t _count;
+   int _bits;
+   size_t _hand;
+   std::vector<Slot> _slots;
+};
@@ -1,8 +1,26 @@
 #include "TransactionUnit.h"
 
-TransactionUnit::TransactionUnit(const std::vector<char> buffer)
-   : _mySize(16)
+#include <chrono>
+
+uint32_t GetWireTimestamp()
+{
+   return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TransactionUnit::TransactionUnit(const std::vector<char>& buffer)
+   : cookie(0),
+   transactionid(0),
+   messagetype(0),
+   messagelength(0),
+   sequencenum(0),
+   timestamp(0),
+   echoTimestamp(0),
+   _mySize(24),
+   _isValid(false)
 {
+   // Datagrams come from the network, never trust them to be complete
+   if (buffer.size() < _mySize) return;
+
    auto buf = buffer.data();
 
    memcpy(&cookie, buf, sizeof(cookie));
@@ -20,14 +38,23 @@ TransactionUnit::TransactionUnit(const std::vector<char> buffer)
    memcpy(&sequencenum, buf, sizeof(sequencenum));
    buf += sizeof(sequencenum);
 
-   messagedata.resize(messagelength);
+   memcpy(&timestamp, buf, sizeof(timestamp));
+   buf += sizeof(timestamp);
+
+   memcpy(&echoTimestamp, buf, sizeof(echoTimestamp));
+   buf += sizeof(echoTimestamp);
+
+   if (messagelength > buffer.size() - _mySize) return;
+
    messagedata.assign(buf, buf + messagelength);
 
    _isValid = cookie == MagicCookie;
 }
 
 TransactionUnit::TransactionUnit()
-   : _mySize(16),
+   : timestamp(0),
+   echoTimestamp(0),
+   _mySize(24),
    _isValid(true),
    cookie(MagicCookie)
 {}
@@ -36,8 +63,19 @@ void TransactionUnit::GetBlob(std::vector<char>& buffer)
 {
    buffer.resize(_mySize + messagedata.size());
 
-   char* buf = buffer.data();
+   WriteHeader(buffer.data());
+   memcpy(buffer.data() + _mySize, messagedata.data(), messagedata.size());
+}
+
+void TransactionUnit::GetHeader(std::vector<char>& buffer)
+{
+   buffer.resize(_mySize);
 
+   WriteHeader(buffer.data());
+}
+
+void TransactionUnit::WriteHeader(char* buf)
+{
    memcpy(buf, &cookie, sizeof(cookie));
    buf += sizeof(cookie);
 
@@ -53,5 +91,9 @@ void TransactionUnit::GetBlob(std::vector<char>& buffer)
    memcpy(buf, &sequencenum, sizeof(sequencenum));
    buf += sizeof(sequencenum);
 
-   memcpy(buf, messagedata.data(), messagedata.size());
+   if (!stamped) timestamp = GetWireTimestamp();
+   memcpy(buf, &timestamp, sizeof(timestamp));
+   buf += sizeof(timestamp);
+
+   memcpy(buf, &echoTimestamp, sizeof(echoTimestamp));
 }
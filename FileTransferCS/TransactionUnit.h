@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
 
 // Transaction unit headers
 //
@@ -11,6 +12,8 @@
 //       |                 32 bit transaction id                         |
 //       |       Msg type                  |        Length               |
 //       |                    32 bit Sequence #                          |
+//       |           32 bit timestamp (sender's clock, microseconds)     |
+//       |       32 bit echoed timestamp (peer's latest, 0 if none)      |
 //       +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 //       |                                                               |
 //       |                         Message data                          |
@@ -19,35 +22,69 @@
 //       .                                                               .
 //       +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 
-static const int MagicCookie = 0xA343F33B;               // A magic cookie to recognize our activity
+static const int MagicCookie = 0xA343F33C;               // A magic cookie to recognize our activity, changed with the header layout
 // Message types
 enum MsgType
 {
-   MsgType_StartTransaction = 0x0001,  // Message data contains filename (Sequence #0 expected)
-   MsgType_EndTransaction = 0x0002,    // Message data empty
+   MsgType_StartTransaction = 0x0001,  // Message data contains filename (Sequence # carries the start flags)
+   MsgType_EndTransaction = 0x0002,    // Message data contains filename (Sequence # is the number of units sent)
    MsgType_RetransmitReq = 0x0003,     // Message data empty (Sequence number is requested sequence)
    MsgType_Data = 0x0004,              // Message data contains a message blob of specified size
+   MsgType_StartSecureTransaction = 0x0005,  // Message data contains the cipher handshake followed by the sealed filename
+   MsgType_Ack = 0x0006,               // Message data empty (Sequence number is the next expected sequence, all before it were received)
+   MsgType_ChunkRef = 0x0007,          // Message data contains a 32 byte chunk fingerprint and 32 bit chunk length, in place of the chunk's data
+   MsgType_ZeroRange = 0x0008,         // Message data contains the 32 bit length of a run of zeros, in place of the data
+   MsgType_Nak = 0x0009,               // Message data contains a list of 32 bit sequence numbers that are missing
+   MsgType_Challenge = 0x000A,         // Message data contains a cookie the client must echo to start the transaction
+   MsgType_CookieEcho = 0x000B,        // Message data contains the cookie followed by the complete start message it was issued for
+   MsgType_PullRequest = 0x000C,       // Message data contains the name of a file to send back, as a transaction under the request's id
+   MsgType_SessionOpen = 0x000D,       // Message data empty (Transaction id is the session id).  Acknowledged with the session's token as message data
+   MsgType_SessionStart = 0x000E,      // Message data contains the session id, the session's token and the complete start message of a transaction in it
+   MsgType_SessionAck = 0x000F,        // Message data contains pairs of 32 bit transaction id and next expected sequence (Transaction id is the session id)
+   MsgType_SessionClose = 0x0010,      // Message data contains the session's token (Transaction id is the session id)
 };
 
+// Start flags, carried in the sequence number of a start, plain or secure
+static const uint32_t StartFlag_Sync = 0x0001;  // The server commits the file to stable storage each time it flushes it
+
+// Microseconds of the steady clock, the time base of header timestamps.  Wraps every 71 minutes, so compare
+// timestamps by subtracting them
+uint32_t GetWireTimestamp();
+
 class TransactionUnit
 {
 public:
    TransactionUnit();
-   TransactionUnit(const std::vector<char> buffer);
+   TransactionUnit(const std::vector<char>& buffer);
 
    bool IsValid() { return _isValid; }
 
+   // Formats the complete message (header and data) for the wire.  The timestamp is set to the time of formatting,
+   // which is just before the message is sent, unless the unit was stamped when it was sealed
    void GetBlob(std::vector<char>& buffer);
 
+   // Formats only the header, for transports that can send the header and messagedata without joining them
+   void GetHeader(std::vector<char>& buffer);
+
    uint32_t cookie;
    uint32_t transactionid;
    uint16_t messagetype;
    uint16_t messagelength;
    uint32_t sequencenum;
+   uint32_t timestamp;
+   uint32_t echoTimestamp;       // The latest timestamp received from the peer, for it to measure the round trip
 
    std::vector<char> messagedata;
 
+   // When a traced unit arrived, by the tracer's clock.  Local only, never on the wire
+   uint64_t receivedAt = 0;
+
+   // The timestamp was set by a cipher that authenticates it, formatting keeps it.  Local only, never on the wire
+   bool stamped = false;
+
 private:
+   void WriteHeader(char* buf);
+
    const uint32_t _mySize;
    bool _isValid;
 };
@@ -0,0 +1,425 @@
+#include "TransferSession.h"
+
+#include <sstream>
+#include <cstring>
+
+// The open, and then the cookie echo, are resent at this interval until answered
+static const int OpenRetryMs = 200;
+static const int OpenAttempts = 10;
+
+// Header fields read straight from outgoing messages, see TransactionUnit.h
+static const size_t TransactionIdOffset = 4;
+static const size_t MessageTypeOffset = 8;
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// Transport of the client sending one of the session's files.  The start is sent inside a session
+/// start carrying the session's token, everything else goes out as it is.  The session hands over
+/// the replies for the file's transaction as it receives them.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class TransferSession::StreamChannel : public ISenderReceiver
+{
+public:
+   StreamChannel(std::shared_ptr<ISenderReceiver> senderReceiver, uint32_t sessionID, uint64_t token)
+      : _senderReceiver(senderReceiver)
+   {
+      _prefix.assign((char*)&sessionID, (char*)&sessionID + sizeof(sessionID));
+      _prefix.insert(_prefix.end(), (char*)&token, (char*)&token + sizeof(token));
+   }
+
+   void Send(const std::vector<char>& s) override
+   {
+      uint16_t messageType = 0;
+      if (s.size() >= MessageTypeOffset + sizeof(messageType)) memcpy(&messageType, s.data() + MessageTypeOffset, sizeof(messageType));
+      if (messageType != MsgType_StartTransaction && messageType != MsgType_StartSecureTransaction)
+      {
+         _senderReceiver->Send(s);
+         return;
+      }
+
+      TransactionUnit tu;
+      memcpy(&tu.transactionid, s.data() + TransactionIdOffset, sizeof(tu.transactionid));
+      tu.messagedata = _prefix;
+      tu.messagedata.insert(tu.messagedata.end(), s.begin(), s.end());
+      tu.messagelength = (uint16_t)tu.messagedata.size();
+      tu.messagetype = MsgType_SessionStart;
+      tu.sequencenum = 0;
+
+      std::vector<char> buffer;
+      tu.GetBlob(buffer);
+      _senderReceiver->Send(buffer);
+   }
+
+   void Send(const std::vector<char>& header, const std::vector<char>& payload) override { _senderReceiver->Send(header, payload); }
+   void Start(uint16_t port) override {}
+
+   void Receive(std::function<void(const std::vector<char>&)> callback) override
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+      _callback = callback;
+   }
+
+   void Deliver(const std::vector<char>& buffer)
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+      if (_callback) _callback(buffer);
+   }
+
+private:
+   std::shared_ptr<ISenderReceiver> _senderReceiver;
+   std::vector<char> _prefix;          // Session id and token
+   std::mutex _guard;
+   std::function<void(const std::vector<char>&)> _callback;
+};
+
+TransferSession::TransferSession(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<ISenderReceiver> senderReceiver,
+                                 const TransferSessionOptions& options)
+   : _logger(logger),
+   _threadPool(threadPool),
+   _senderReceiver(senderReceiver),
+   _options(options),
+   _random(std::random_device()()),
+   _open(false),
+   _token(0),
+   _reaps(std::make_shared<ReapContext>())
+{
+   if (_options.maxStreams == 0) _options.maxStreams = 1;
+
+   std::uniform_int_distribution<uint32_t> ids(1, UINT32_MAX);
+   _sessionID = ids(_random);
+
+   TransactionUnit tu;
+   tu.messagelength = 0;
+   tu.messagetype = MsgType_SessionOpen;
+   tu.transactionid = _sessionID;
+   tu.sequencenum = 0;
+   if (_options.cipher)
+   {
+      // Keyed like a secure start, the server seals the session's messages with the keys the handshake makes
+      std::vector<char> handshake;
+      _options.cipher->BeginTransaction(_sessionID, handshake);
+      _options.cipher->Seal(tu);
+
+      tu.messagedata.insert(tu.messagedata.begin(), handshake.begin(), handshake.end());
+      tu.messagelength = (uint16_t)tu.messagedata.size();
+   }
+   tu.GetBlob(_openMessage);
+
+   _reaps->session = this;
+   _senderReceiver->Receive([this](const std::vector<char>& buf)
+   {
+      OnReceive(buf);
+   });
+}
+
+TransferSession::~TransferSession()
+{
+   _senderReceiver->Receive(nullptr);
+
+   {
+      // Waits out a reap that is running now, later ones find no session and do nothing
+      std::lock_guard<std::mutex> lock(_reaps->guard);
+      _reaps->session = nullptr;
+   }
+
+   std::map<uint32_t, Stream> streams;
+   std::deque<QueuedFile> queue;
+   bool open;
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+      streams.swap(_streams);
+      queue.swap(_queue);
+      open = _open;
+      _open = false;
+   }
+
+   for (auto& pair : streams)
+   {
+      pair.second.channel->Receive(nullptr);
+      pair.second.client.reset();
+      pair.second.done.set_value(false);
+   }
+   for (auto& file : queue)
+   {
+      file.done.set_value(false);
+   }
+
+   // The server stops acknowledging together for the session.  Transactions still running there carry on
+   if (open)
+   {
+      TransactionUnit tu;
+      tu.messagedata.assign((char*)&_token, (char*)&_token + sizeof(_token));
+      tu.messagelength = (uint16_t)tu.messagedata.size();
+      tu.messagetype = MsgType_SessionClose;
+      tu.transactionid = _sessionID;
+      tu.sequencenum = 0;
+      if (_options.cipher) _options.cipher->Seal(tu);
+
+      std::vector<char> buffer;
+      tu.GetBlob(buffer);
+      _senderReceiver->Send(buffer);
+   }
+
+   if (_options.cipher) _options.cipher->EndTransaction(_sessionID);
+}
+
+bool TransferSession::Open()
+{
+   std::unique_lock<std::mutex> lock(_guard);
+
+   // As in the start handshake, the open is sent until the server answers with a cookie, then echoed with the
+   // cookie until the server answers with the token
+   for (int attempt = 0; attempt < OpenAttempts && !_open; attempt++)
+   {
+      bool echo = !_cookie.empty();
+      auto buffer = _openMessage;
+      if (echo)
+      {
+         TransactionUnit tu;
+         tu.messagedata = _cookie;
+         tu.messagedata.insert(tu.messagedata.end(), _openMessage.begin(), _openMessage.end());
+         tu.messagelength = (uint16_t)tu.messagedata.size();
+         tu.messagetype = MsgType_CookieEcho;
+         tu.transactionid = _sessionID;
+         tu.sequencenum = 0;
+         tu.GetBlob(buffer);
+      }
+
+      // Not held while sending, the answer may arrive on this thread
+      lock.unlock();
+      _senderReceiver->Send(buffer);
+      lock.lock();
+
+      _wake.wait_for(lock, std::chrono::milliseconds(OpenRetryMs), [&]()
+      {
+         return _open || (!echo && !_cookie.empty());
+      });
+   }
+
+   std::stringstream ss;
+   if (_open)
+   {
+      ss << "Session " << _sessionID << " open";
+      _logger->Log(1, ss.str());
+   }
+   else
+   {
+      ss << "Server did not open session " << _sessionID;
+      _logger->Log(5, ss.str());
+   }
+   return _open;
+}
+
+std::shared_future<bool> TransferSession::Send(std::shared_ptr<IReader> reader)
+{
+   QueuedFile file;
+   file.reader = reader;
+   auto future = file.done.get_future().share();
+
+   std::lock_guard<std::mutex> lock(_guard);
+   if (!_open)
+   {
+      _logger->Log(5, "Session is not open, unable to send " + reader->GetSource());
+      file.done.set_value(false);
+      return future;
+   }
+
+   _queue.push_back(std::move(file));
+   StartStreams();
+   return future;
+}
+
+size_t TransferSession::GetStreamCount()
+{
+   std::lock_guard<std::mutex> lock(_guard);
+   return _streams.size();
+}
+
+size_t TransferSession::GetQueuedCount()
+{
+   std::lock_guard<std::mutex> lock(_guard);
+   return _queue.size();
+}
+
+DelayStats TransferSession::GetRoundTrip()
+{
+   std::lock_guard<std::mutex> lock(_guard);
+   return _roundTrip.GetStats();
+}
+
+void TransferSession::OnReceive(const std::vector<char>& buf)
+{
+   // The network stack's arrival time is the more precise, where the transport has it
+   auto receiveTime = _senderReceiver->GetReceiveTime();
+   auto receivedAt = receiveTime ? (uint32_t)receiveTime : GetWireTimestamp();
+
+   TransactionUnit tu(buf);
+   if (!tu.IsValid()) return;
+
+   if (tu.transactionid == _sessionID) OnSessionMessage(tu, receivedAt);
+   else Deliver(tu.transactionid, buf);
+}
+
+void TransferSession::OnSessionMessage(TransactionUnit& tu, uint32_t receivedAt)
+{
+   // With encryption on the server seals the session's messages, one that does not open is forged
+   if (_options.cipher && !_options.cipher->Open(tu)) return;
+
+   switch (tu.messagetype)
+   {
+   case MsgType_Challenge:
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+      if (!_open) _cookie = tu.messagedata;
+      _wake.notify_all();
+   }
+   break;
+
+   case MsgType_Ack:
+   {
+      // The session's acknowledgement carries its token
+      if (tu.messagedata.size() != sizeof(_token)) break;
+
+      std::lock_guard<std::mutex> lock(_guard);
+      memcpy(&_token, tu.messagedata.data(), sizeof(_token));
+      _open = true;
+      _wake.notify_all();
+   }
+   break;
+
+   case MsgType_SessionAck:
+   {
+      if (tu.echoTimestamp)
+      {
+         std::lock_guard<std::mutex> lock(_guard);
+         _roundTrip.AddSample(receivedAt - tu.echoTimestamp);
+      }
+
+      // Handed to each file's client as an acknowledgement of its own
+      const size_t entrySize = 2 * sizeof(uint32_t);
+      for (size_t offset = 0; offset + entrySize <= tu.messagedata.size(); offset += entrySize)
+      {
+         TransactionUnit ack;
+         memcpy(&ack.transactionid, tu.messagedata.data() + offset, sizeof(ack.transactionid));
+         memcpy(&ack.sequencenum, tu.messagedata.data() + offset + sizeof(uint32_t), sizeof(ack.sequencenum));
+         ack.messagetype = MsgType_Ack;
+         ack.messagelength = 0;
+         ack.echoTimestamp = tu.echoTimestamp;
+
+         // The file's client only takes acknowledgements that open with its own key.  A file that has finished no
+         // longer has one
+         if (_options.cipher && !SealAck(ack)) continue;
+
+         std::vector<char> buffer;
+         ack.GetBlob(buffer);
+         Deliver(ack.transactionid, buffer);
+      }
+   }
+   break;
+
+   default:
+      break;
+   }
+}
+
+void TransferSession::Deliver(uint32_t transactionID, const std::vector<char>& buf)
+{
+   std::shared_ptr<StreamChannel> channel;
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+      auto iter = _streams.find(transactionID);
+      if (iter == _streams.end()) return;
+      channel = iter->second.channel;
+   }
+
+   // Not held while the client handles it, a retransmission may be answered on this thread
+   channel->Deliver(buf);
+}
+
+void TransferSession::ReapStreams()
+{
+   // Finished clients are destroyed outside the guard, they wait for a send step of theirs that may be running
+   std::vector<std::unique_ptr<DataTransferClient>> finished;
+   {
+      std::lock_guard<std::mutex> lock(_guard);
+      FinishStreams(finished);
+      StartStreams();
+   }
+}
+
+void TransferSession::FinishStreams(std::vector<std::unique_ptr<DataTransferClient>>& finished)
+{
+   // Called with the guard held.  A file is done once the server has acknowledged its end, or its client gave up
+   for (auto iter = _streams.begin(); iter != _streams.end(); )
+   {
+      auto completion = iter->second.client->GetCompletion();
+      if (completion.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      {
+         ++iter;
+         continue;
+      }
+
+      iter->second.channel->Receive(nullptr);
+      iter->second.done.set_value(completion.get());
+      finished.push_back(std::move(iter->second.client));
+      iter = _streams.erase(iter);
+   }
+}
+
+void TransferSession::StartStreams()
+{
+   // Called with the guard held
+   while (_streams.size() < _options.maxStreams && !_queue.empty())
+   {
+      auto file = std::move(_queue.front());
+      _queue.pop_front();
+
+      DataTransferClientOptions options;
+      options.cipher = _options.cipher;
+      options.dedup = _options.dedup;
+      options.sync = _options.sync;
+      options.tracer = _options.tracer;
+      options.sendAsync = true;
+      options.transactionID = NewTransactionID();
+
+      // A client that fails, or is acknowledged, frees its stream straight away rather than when the session next
+      // hears from the server.  The reap is posted, a client can't be destroyed from its own completion
+      options.onComplete = [reaps = _reaps, threadPool = _threadPool]()
+      {
+         threadPool->Post([reaps]()
+         {
+            std::lock_guard<std::mutex> lock(reaps->guard);
+            if (reaps->session) reaps->session->ReapStreams();
+         });
+      };
+
+      auto& stream = _streams[options.transactionID];
+      stream.done = std::move(file.done);
+      stream.channel = std::make_shared<StreamChannel>(_senderReceiver, _sessionID, _token);
+      stream.client = std::make_unique<DataTransferClient>(_logger, _threadPool, file.reader, stream.channel, options);
+   }
+}
+
+bool TransferSession::SealAck(TransactionUnit& ack)
+{
+   try
+   {
+      _options.cipher->Seal(ack);
+      return true;
+   }
+   catch (std::exception&)
+   {
+      return false;
+   }
+}
+
+uint32_t TransferSession::NewTransactionID()
+{
+   // Called with the guard held
+   std::uniform_int_distribution<uint32_t> ids(1, UINT32_MAX);
+   uint32_t transactionID;
+   do
+   {
+      transactionID = ids(_random);
+   } while (transactionID == _sessionID || _streams.count(transactionID));
+   return transactionID;
+}
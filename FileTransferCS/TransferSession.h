@@ -0,0 +1,130 @@
+#pragma once
+
+#include "ILogger.h"
+#include "IWorkerThreadPool.h"
+#include "IReader.h"
+#include "ISenderReceiver.h"
+#include "ITransactionCipher.h"
+#include "DataTransferClient.h"
+#include "DelayEstimator.h"
+#include "PacketTracer.h"
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <random>
+
+// Files a session sends at once by default
+static const size_t DefaultSessionStreams = 16;
+
+struct TransferSessionOptions
+{
+   // Passed on to the client sending each file, see DataTransferClientOptions
+   std::shared_ptr<ITransactionCipher> cipher;
+   bool dedup = false;
+   bool sync = false;
+   std::shared_ptr<PacketTracer> tracer;
+
+   // Most files sent at once, later files wait for one of them to finish.  All of them share the one transport,
+   // so pacing it paces the session as a whole
+   size_t maxStreams = DefaultSessionStreams;
+};
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// A long lived association with one server that carries many files, each as a transaction of its
+/// own sent by a DataTransferClient over the session's transport.
+///
+/// The session is opened once, going through the server's cookie handshake if it has one.  The
+/// server answers with a token, and every file after that starts with the token in place of a
+/// handshake, so its data follows the start straight away.  The server acknowledges the session's
+/// transactions together, in one message listing each, which the session splits up for the files'
+/// clients.  The round trip is measured across all of them.
+///
+/// With a cipher the open carries a handshake as a secure start does, and the server seals the
+/// session's messages with the keys it makes.  The acknowledgements split out for each file are
+/// sealed again with the file's own key, as its client expects.
+///
+/// Thread safe.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class TransferSession
+{
+public:
+   // The pool needs threads, files are sent from it
+   TransferSession(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool, std::shared_ptr<ISenderReceiver> senderReceiver,
+                   const TransferSessionOptions& options = TransferSessionOptions());
+   ~TransferSession();
+   TransferSession(const TransferSession&) = delete;
+
+   // Opens the session, waiting for the server to answer.  False if it never does
+   bool Open();
+
+   // Sends a file in the open session.  Ready once the server has acknowledged all of it, true, or the file failed
+   // or the session closed first, false
+   std::shared_future<bool> Send(std::shared_ptr<IReader> reader);
+
+   // Files being sent now, and waiting to be
+   size_t GetStreamCount();
+   size_t GetQueuedCount();
+
+   // Round trip to the server, measured from the session's acknowledgements
+   DelayStats GetRoundTrip();
+
+private:
+   class StreamChannel;
+
+   struct Stream
+   {
+      std::shared_ptr<StreamChannel> channel;
+      std::unique_ptr<DataTransferClient> client;
+      std::promise<bool> done;
+   };
+
+   struct QueuedFile
+   {
+      std::shared_ptr<IReader> reader;
+      std::promise<bool> done;
+   };
+
+   void OnReceive(const std::vector<char>& buf);
+   void OnSessionMessage(TransactionUnit& tu, uint32_t receivedAt);
+   bool SealAck(TransactionUnit& ack);
+   void Deliver(uint32_t transactionID, const std::vector<char>& buf);
+   void ReapStreams();
+   void StartStreams();
+   void FinishStreams(std::vector<std::unique_ptr<DataTransferClient>>& finished);
+   uint32_t NewTransactionID();
+
+   std::shared_ptr<ILogger> _logger;
+   std::shared_ptr<IWorkerThreadPool> _threadPool;
+   std::shared_ptr<ISenderReceiver> _senderReceiver;
+   TransferSessionOptions _options;
+
+   std::mutex _guard;
+   std::condition_variable _wake;
+   std::mt19937 _random;
+   uint32_t _sessionID;
+   std::vector<char> _openMessage;     // The open as sent, echoed back in the cookie handshake
+   std::vector<char> _cookie;          // The server's challenge to the open
+   bool _open;
+   uint64_t _token;
+
+   // Files being sent by transaction id, and files waiting for a free stream
+   std::map<uint32_t, Stream> _streams;
+   std::deque<QueuedFile> _queue;
+
+   DelayEstimator _roundTrip;
+
+   // Shared with the reaps the files' clients post to the pool as they complete.  The guard is held while one
+   // runs, so the session can detach itself
+   struct ReapContext
+   {
+      std::mutex guard;
+      TransferSession* session = nullptr;
+   };
+
+   std::shared_ptr<ReapContext> _reaps;
+};
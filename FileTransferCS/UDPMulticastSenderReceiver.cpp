@@ -0,0 +1,38 @@
+#include "UDPMulticastSenderReceiver.h"
+
+#include <sstream>
+
+UDPMulticastSenderReceiver::UDPMulticastSenderReceiver(std::shared_ptr<ILogger> logger, std::shared_ptr<SocketReactor> reactor, const std::string& group, uint16_t port, int ttl)
+   : UDPUnreliableSenderReceiver(logger, reactor),
+   _group(group),
+   _port(port)
+{
+   SetDestination(group, port);
+
+   // Keep the scope to the local network unless asked otherwise, and loop sends back so members on this host hear them
+   DWORD hops = ttl;
+   DWORD loop = 1;
+   if (setsockopt(_udpSocket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&hops, sizeof(hops)) == SOCKET_ERROR ||
+       setsockopt(_udpSocket, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop)) == SOCKET_ERROR)
+   {
+      throw std::runtime_error("set multicast options failed");
+   }
+}
+
+void UDPMulticastSenderReceiver::Start(uint16_t port)
+{
+   BOOL reuse = TRUE;
+   setsockopt(_udpSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+   UDPUnreliableSenderReceiver::Start(_port);
+
+   ip_mreq membership;
+   inet_pton(AF_INET, _group.c_str(), (void*)&membership.imr_multiaddr.s_addr);
+   membership.imr_interface.s_addr = htonl(INADDR_ANY);
+   if (setsockopt(_udpSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR)
+   {
+      std::stringstream ss;
+      ss << "Joining multicast group " << _group << " failed, rc=" << WSAGetLastError();
+      _logger->Log(5, ss.str());
+   }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "UDPUnreliableSenderReceiver.h"
+
+#include <string>
+
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+/// UDP transport over a multicast group.  Everything sent goes to the group, so a client sends each
+/// block once however many servers are listening, and everything sent to the group is received.
+/// Every member binds the group port with address reuse, so any number of them can share a host.
+/// ////////////////////////////////////////////////////////////////////////////////////////////////
+class UDPMulticastSenderReceiver : public UDPUnreliableSenderReceiver
+{
+public:
+   UDPMulticastSenderReceiver(std::shared_ptr<ILogger> logger, std::shared_ptr<SocketReactor> reactor, const std::string& group, uint16_t port, int ttl = 1);
+
+   // Binds the group port given to the constructor and joins the group, the port passed here is ignored
+   void Start(uint16_t port) override;
+
+private:
+   std::string _group;
+   uint16_t _port;
+};
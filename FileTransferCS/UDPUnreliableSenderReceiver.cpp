@@ -2,9 +2,42 @@
 
 #include <sstream>
 
-UDPUnreliableSenderReceiver::UDPUnreliableSenderReceiver(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool)
+#include <mstcpip.h>
+
+// The transaction id follows the 32 bit cookie in every message header, see TransactionUnit.h
+static const size_t TransactionIdOffset = 4;
+
+// Largest UDP payload, data units carrying a whole chunk can be well over the 128 byte blocks
+static const size_t MaxDatagramSize = 0x10000;
+
+// Bound on the number of transactions we remember a reply address for
+static const size_t MaxPeers = 0x100000;
+
+// A sender as reported by GetSender(), the IPv4 address above the port
+static uint64_t PackAddress(const sockaddr_in& address)
+{
+   return (uint64_t)ntohl(address.sin_addr.s_addr) << 16 | ntohs(address.sin_port);
+}
+
+static sockaddr_in UnpackAddress(uint64_t sender)
+{
+   sockaddr_in address = {};
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl((u_long)(sender >> 16));
+   address.sin_port = htons((u_short)sender);
+   return address;
+}
+
+UDPUnreliableSenderReceiver::UDPUnreliableSenderReceiver(std::shared_ptr<ILogger> logger, std::shared_ptr<SocketReactor> reactor)
    : _logger(logger),
-   _threadPool(threadPool)
+   _reactor(reactor),
+   _started(false),
+   _replyToSender(false),
+   _receiveBuffer(MaxDatagramSize),
+   _sender(0),
+   _recvMsg(nullptr),
+   _counterFrequency(0),
+   _receiveTime(0)
 {
    WSADATA wsa;
    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
@@ -14,6 +47,68 @@ UDPUnreliableSenderReceiver::UDPUnreliableSenderReceiver(std::shared_ptr<ILogger
 
    _udpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
    if (_udpSocket == INVALID_SOCKET) throw std::runtime_error("create socket failed");
+
+   _localAddress.s_addr = htonl(INADDR_ANY);
+   SetDestination("127.0.0.1", 1234);
+}
+
+void UDPUnreliableSenderReceiver::SetLocalAddress(const std::string& address)
+{
+   if (inet_pton(AF_INET, address.c_str(), (void*)&_localAddress.s_addr) != 1)
+   {
+      throw std::runtime_error("invalid local address " + address);
+   }
+}
+
+void UDPUnreliableSenderReceiver::SetDestination(const std::string& address, uint16_t port)
+{
+   _destination.sin_family = AF_INET;
+   _destination.sin_port = htons(port);
+   inet_pton(AF_INET, address.c_str(), (void*)&_destination.sin_addr.s_addr);
+}
+
+sockaddr_in UDPUnreliableSenderReceiver::GetDestination(const char* message, size_t size)
+{
+   if (_replyToSender && size >= TransactionIdOffset + sizeof(uint32_t))
+   {
+      uint32_t transactionID;
+      memcpy(&transactionID, message + TransactionIdOffset, sizeof(transactionID));
+
+      std::lock_guard<std::mutex> lock(_peerGuard);
+      auto iter = _peers.find(transactionID);
+      if (iter != _peers.end()) return iter->second;
+   }
+
+   return _destination;
+}
+
+bool UDPUnreliableSenderReceiver::EnableReceiveTimestamps()
+{
+   TIMESTAMPING_CONFIG config = {};
+   config.Flags = TIMESTAMPING_FLAG_RX;
+
+   DWORD bytes = 0;
+   if (WSAIoctl(_udpSocket, SIO_TIMESTAMPING, &config, sizeof(config), nullptr, 0, &bytes, nullptr, nullptr) == SOCKET_ERROR)
+   {
+      std::stringstream ss;
+      ss << "Receive timestamps not available, rc=" << WSAGetLastError();
+      _logger->Log(3, ss.str());
+      return false;
+   }
+
+   // The timestamps arrive as control data, which only WSARecvMsg returns
+   GUID recvMsgID = WSAID_WSARECVMSG;
+   if (WSAIoctl(_udpSocket, SIO_GET_EXTENSION_FUNCTION_POINTER, &recvMsgID, sizeof(recvMsgID), &_recvMsg, sizeof(_recvMsg), &bytes, nullptr, nullptr) == SOCKET_ERROR)
+   {
+      _recvMsg = nullptr;
+      return false;
+   }
+
+   LARGE_INTEGER frequency;
+   QueryPerformanceFrequency(&frequency);
+   _counterFrequency = (uint64_t)frequency.QuadPart;
+   _control.resize(WSA_CMSG_SPACE(sizeof(UINT64)));
+   return true;
 }
 
 void UDPUnreliableSenderReceiver::Start(uint16_t port)
@@ -21,7 +116,7 @@ void UDPUnreliableSenderReceiver::Start(uint16_t port)
    sockaddr_in addr;
    addr.sin_family = AF_INET;
    addr.sin_port = htons(port);
-   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   addr.sin_addr = _localAddress;
    int result = bind(_udpSocket, (sockaddr*)&addr, sizeof(addr));
    if (result == SOCKET_ERROR)
    {
@@ -30,65 +125,177 @@ void UDPUnreliableSenderReceiver::Start(uint16_t port)
       _logger->Log(5, ss.str());
    }
 
-   _threadPool->Post([&]
+   // The reactor drains the socket when data arrives, so receives must never block
+   u_long nonBlocking = 1;
+   ioctlsocket(_udpSocket, FIONBIO, &nonBlocking);
+
+   // Nothing is received on a socket the reactor refused, it has said so
+   _started = _reactor->Register(_udpSocket, [this]() { OnReadable(); });
+}
+
+UDPUnreliableSenderReceiver::~UDPUnreliableSenderReceiver()
+{
+   // Once unregistered the reactor will not call back into this object, so the socket can go
+   if (_started)
+   {
+      _reactor->Unregister(_udpSocket);
+   }
+   closesocket(_udpSocket);
+
+   WSACleanup();
+}
+
+void UDPUnreliableSenderReceiver::OnReadable()
+{
+   std::function<void(const std::vector<char>&)> callback;
+   {
+      std::lock_guard<std::mutex> lock(_callbackGuard);
+      callback = _callback;
+   }
+
+   // Bound the work done per wake so one busy socket can't starve the others sharing the reactor.
+   // Anything left behind is reported as ready again straight away
+   for (int i = 0; i < 64; i++)
    {
-      std::lock_guard<std::mutex> lock(_terminateGuard);
+      sockaddr_in from;
+      int fromlen = sizeof(from);
+      int bytes = _recvMsg ? ReceiveTimestamped(from) : recvfrom(_udpSocket, _receiveBuffer.data(), (int)_receiveBuffer.size(), 0, (sockaddr*)&from, &fromlen);
 
-      while (1)
+      if (bytes == SOCKET_ERROR)
       {
-         sockaddr_in from;
-         int fromlen = sizeof(from);
-         std::vector<char> buf;
-         buf.resize(0x1000);
-         int bytes = recvfrom(_udpSocket, buf.data(), buf.size(), 0, (sockaddr*)&from, &fromlen);
-
-         if (bytes == SOCKET_ERROR)
-         {
-            std::stringstream ss;
-            ss << "recvfrom failed, rc=" << WSAGetLastError();
-            _logger->Log(5, ss.str());
-            break;
-         }
-
-         buf.resize(bytes);
+         auto error = WSAGetLastError();
+
+         // Drained
+         if (error == WSAEWOULDBLOCK) break;
+
+         // An ICMP port unreachable for an earlier send, the socket is still usable
+         if (error == WSAECONNRESET) continue;
 
+         std::stringstream ss;
+         ss << "recvfrom failed, rc=" << error;
+         _logger->Log(5, ss.str());
+         break;
+      }
+
+      // Only the bytes received are handed on, the receive buffer is sized for the largest datagram
+      _datagram.assign(_receiveBuffer.begin(), _receiveBuffer.begin() + bytes);
+      _sender = PackAddress(from);
+
+      if (_logger->IsEnabled(0))
+      {
          std::stringstream ss;
          char ip[20];
          ss << "Received " << bytes << " bytes from " << inet_ntop(AF_INET, (void*)&from.sin_addr, (PSTR)&ip, sizeof(ip)) << ":" << ntohs(from.sin_port);
          _logger->Log(0, ss.str());
-
-         _callback(buf);
       }
-   });
 
+      if (callback) callback(_datagram);
+   }
 }
 
-UDPUnreliableSenderReceiver::~UDPUnreliableSenderReceiver()
+int UDPUnreliableSenderReceiver::ReceiveTimestamped(sockaddr_in& from)
 {
-   closesocket(_udpSocket);
+   WSABUF data;
+   data.buf = _receiveBuffer.data();
+   data.len = (ULONG)_receiveBuffer.size();
 
-   // This is a bit of kludge.  A message posted to a 'stranded' thread execution would be best, but strands are not yet implemented in the thread pool
-   std::lock_guard<std::mutex> lock(_terminateGuard);
+   WSAMSG msg = {};
+   msg.name = (sockaddr*)&from;
+   msg.namelen = sizeof(from);
+   msg.lpBuffers = &data;
+   msg.dwBufferCount = 1;
+   msg.Control.buf = _control.data();
+   msg.Control.len = (ULONG)_control.size();
 
-   WSACleanup();
+   DWORD bytes = 0;
+   if (_recvMsg(_udpSocket, &msg, &bytes, nullptr, nullptr) == SOCKET_ERROR) return SOCKET_ERROR;
+
+   _receiveTime = 0;
+   for (auto cmsg = WSA_CMSG_FIRSTHDR(&msg); cmsg; cmsg = WSA_CMSG_NXTHDR(&msg, cmsg))
+   {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMP)
+      {
+         // Performance counter ticks, the counter the steady clock reads, in microseconds
+         UINT64 ticks;
+         memcpy(&ticks, WSA_CMSG_DATA(cmsg), sizeof(ticks));
+         _receiveTime = ticks / _counterFrequency * 1000000 + ticks % _counterFrequency * 1000000 / _counterFrequency;
+      }
+   }
+
+   return (int)bytes;
 }
 
 void UDPUnreliableSenderReceiver::Send(const std::vector<char>& s)
 {
-   sockaddr_in addr;
+   auto addr = GetDestination(s.data(), s.size());
 
-   addr.sin_family = AF_INET;
-   addr.sin_port = htons(1234);
-   inet_pton(AF_INET, "127.0.0.1", (void*)&addr.sin_addr.s_addr);
+   if (_logger->IsEnabled(0))
+   {
+      std::stringstream ss;
+      ss << "Sending " << s.size() << " bytes";
+      _logger->Log(0, ss.str());
+   }
 
-   std::stringstream ss;
-   ss << "Sending " << s.size() << " bytes";
-   _logger->Log(0, ss.str());
+   sendto(_udpSocket, s.data(), s.size(), 0, (sockaddr*)&addr, sizeof(addr));
+}
 
+void UDPUnreliableSenderReceiver::SetReplyAddress(uint32_t transactionID, uint64_t sender)
+{
+   if (!_replyToSender || !sender) return;
+
+   std::lock_guard<std::mutex> lock(_peerGuard);
+   auto iter = _peers.find(transactionID);
+   if (iter != _peers.end())
+   {
+      iter->second = UnpackAddress(sender);
+      return;
+   }
+
+   _peers.emplace(transactionID, UnpackAddress(sender));
+   _peerOrder.push_back(transactionID);
+   if (_peerOrder.size() > MaxPeers)
+   {
+      _peers.erase(_peerOrder.front());
+      _peerOrder.pop_front();
+   }
+}
+
+void UDPUnreliableSenderReceiver::SendTo(uint64_t sender, const std::vector<char>& s)
+{
+   if (!sender)
+   {
+      Send(s);
+      return;
+   }
+
+   auto addr = UnpackAddress(sender);
    sendto(_udpSocket, s.data(), s.size(), 0, (sockaddr*)&addr, sizeof(addr));
 }
 
-void UDPUnreliableSenderReceiver::Receive(std::function<void(std::vector<char>)> callback)
+void UDPUnreliableSenderReceiver::Send(const std::vector<char>& header, const std::vector<char>& payload)
+{
+   auto addr = GetDestination(header.data(), header.size());
+
+   if (_logger->IsEnabled(0))
+   {
+      std::stringstream ss;
+      ss << "Sending " << header.size() + payload.size() << " bytes";
+      _logger->Log(0, ss.str());
+   }
+
+   // Gather the header and payload straight from their own buffers into one datagram
+   WSABUF buffers[2];
+   buffers[0].buf = const_cast<char*>(header.data());
+   buffers[0].len = (ULONG)header.size();
+   buffers[1].buf = const_cast<char*>(payload.data());
+   buffers[1].len = (ULONG)payload.size();
+
+   DWORD sent = 0;
+   WSASendTo(_udpSocket, buffers, 2, &sent, 0, (sockaddr*)&addr, sizeof(addr), nullptr, nullptr);
+}
+
+void UDPUnreliableSenderReceiver::Receive(std::function<void(const std::vector<char>&)> callback)
 {
+   std::lock_guard<std::mutex> lock(_callbackGuard);
    _callback = callback;
 }
\ No newline at end of file
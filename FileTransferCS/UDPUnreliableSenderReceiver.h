@@ -2,32 +2,85 @@
 
 #include "ISenderReceiver.h"
 #include "ILogger.h"
-#include "IWorkerThreadPool.h"
+#include "SocketReactor.h"
 
 #include <memory>
 #include <functional>
 #include <vector>
 #include <mutex>
+#include <string>
+#include <unordered_map>
+#include <deque>
 
 #include <WinSock2.h>
 #include <WS2tcpip.h>
+#include <mswsock.h>
 
 class UDPUnreliableSenderReceiver : public ISenderReceiver
 {
 public:
-   UDPUnreliableSenderReceiver(std::shared_ptr<ILogger> logger, std::shared_ptr<IWorkerThreadPool> threadPool);
+   UDPUnreliableSenderReceiver(std::shared_ptr<ILogger> logger, std::shared_ptr<SocketReactor> reactor);
    ~UDPUnreliableSenderReceiver();
    UDPUnreliableSenderReceiver(const UDPUnreliableSenderReceiver&) = delete;
-   UDPUnreliableSenderReceiver(UDPUnreliableSenderReceiver&&) = default;
+   UDPUnreliableSenderReceiver(UDPUnreliableSenderReceiver&&) = delete;
 
-   void Send(const std::vector<char>& s) override;
-   void Receive(std::function<void(std::vector<char>)> callback) override;
+   // Those called for each packet are final, so a server built on this transport calls them directly.  Subclasses
+   // change how the socket is set up
+   void Send(const std::vector<char>& s) override final;
+   void Send(const std::vector<char>& header, const std::vector<char>& payload) override final;
+   void Receive(std::function<void(const std::vector<char>&)> callback) override;
    void Start(uint16_t port) override;
+   uint64_t GetReceiveTime() override final { return _receiveTime; }
+   uint64_t GetSender() override final { return _sender; }
+   void SetReplyAddress(uint32_t transactionID, uint64_t sender) override final;
+   void SendTo(uint64_t sender, const std::vector<char>& s) override final;
+
+   // Has the network stack timestamp each datagram as it arrives, which GetReceiveTime() then reports.  Needs
+   // Windows 10 2004 or later, returns false where that is not available.  Call before Start()
+   bool EnableReceiveTimestamps();
+
+   // Local address the socket is bound to by Start(), every interface unless changed.  Binding each of several
+   // sockets to a different interface's address gives a path per interface
+   void SetLocalAddress(const std::string& address);
+
+   // Where messages are sent, 127.0.0.1:1234 unless changed
+   void SetDestination(const std::string& address, uint16_t port);
+
+   // Send messages back to the address given for their transaction by SetReplyAddress(), rather than
+   // to the destination.  Used by servers that answer many clients on one socket
+   void SetReplyToSender(bool replyToSender) { _replyToSender = replyToSender; }
+
+protected:
+   void OnReadable();
+   int ReceiveTimestamped(sockaddr_in& from);
+   sockaddr_in GetDestination(const char* message, size_t size);
 
-private:
    std::shared_ptr<ILogger> _logger;
-   std::shared_ptr<IWorkerThreadPool> _threadPool;
+   std::shared_ptr<SocketReactor> _reactor;
    SOCKET _udpSocket;
-   std::function<void(std::vector<char>)> _callback;
-   std::mutex _terminateGuard;
-};
\ No newline at end of file
+   bool _started;
+   std::function<void(const std::vector<char>&)> _callback;
+   std::mutex _callbackGuard;
+
+   in_addr _localAddress;
+   sockaddr_in _destination;
+   bool _replyToSender;
+
+   // Only touched on the reactor thread.  Each datagram is handed on in _datagram, which keeps its capacity
+   // from one datagram to the next
+   std::vector<char> _receiveBuffer;
+   std::vector<char> _datagram;
+   uint64_t _sender;
+
+   // Receive timestamping, set up by EnableReceiveTimestamps().  Timestamps come in performance counter ticks
+   LPFN_WSARECVMSG _recvMsg;
+   uint64_t _counterFrequency;
+   uint64_t _receiveTime;
+   std::vector<char> _control;
+
+   // Transaction id -> address to reply to, as accepted by the server.  The oldest are forgotten first once there
+   // are too many, in the order of _peerOrder
+   std::unordered_map<uint32_t, sockaddr_in> _peers;
+   std::deque<uint32_t> _peerOrder;
+   std::mutex _peerGuard;
+};
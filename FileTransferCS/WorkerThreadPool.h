@@ -1,24 +1,42 @@
 #pragma once
 
 #include "IWorkerThreadPool.h"
+#include "NumaTopology.h"
 
 #include <functional>
 #include <thread>
 #include <queue>
+#include <mutex>
 #include <condition_variable>
 #include <chrono>
 #include <map>
+#include <memory>
+#include <vector>
+#include <atomic>
 
 using Clock = std::chrono::high_resolution_clock;
 using TimePoint = std::chrono::time_point<Clock>;
 
+// How long a thread with nothing to do stays before it retires
+static const int DefaultIdleTimeoutMs = 2000;
+
+// Checks for work, then yields, before a thread out of work parks on its condition variable.  Work posted
+// meanwhile is picked up without the latency of a wakeup.  Small enough that an idle pool costs nothing
+static const int SpinIterations = 2000;
+static const int YieldIterations = 20;
+
 class WorkerThreadPool : public IWorkerThreadPool
 {
 public:
    WorkerThreadPool()
       : _stopFlag(false),
-      _threadCount(0)
+      _threadCount(0),
+      _idleTimeoutMs(DefaultIdleTimeoutMs),
+      _pinThreads(false),
+      _nextGroup(0),
+      _nextStrandID(0)
    {
+      _groups.push_back(std::make_unique<WorkerGroup>());
    }
 
    virtual ~WorkerThreadPool()
@@ -28,43 +46,313 @@ public:
 
    virtual void SetThreadCount(int count) override
    {
-      _threadCount = count;
+      _threadCount = count > 0 ? count : 0;
+   }
+
+   // Threads are started as work backs up, up to the thread count, and retire after this long without any
+   void SetIdleTimeout(int timeoutMs)
+   {
+      _idleTimeoutMs = timeoutMs;
+   }
+
+   // Threads running now, which drops back as idle threads retire
+   size_t GetThreadCount()
+   {
+      size_t count = 0;
+      for (auto& group : _groups)
+      {
+         std::lock_guard<std::mutex> lk(group->mutex);
+         count += group->threads.size();
+      }
+      return count;
+   }
+
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   /// Splits the pool into one group of threads per node, each group with its own task queue.  The
+   /// thread count is shared out between the groups, every group getting at least one thread.  With
+   /// pinThreads a group's threads only run on its node's processors, so the memory they allocate
+   /// is the node's own.  Must be called before anything is posted.
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   void SetTopology(const std::vector<NumaNode>& nodes, bool pinThreads)
+   {
+      _groups.clear();
+      for (auto& node : nodes)
+      {
+         _groups.push_back(std::make_unique<WorkerGroup>());
+         _groups.back()->node = node;
+      }
+
+      if (_groups.empty()) _groups.push_back(std::make_unique<WorkerGroup>());
+      _pinThreads = pinThreads;
+   }
+
+   int GetNodeCount() override
+   {
+      return (int)_groups.size();
    }
 
-   void CreateThreadPoolThread(uint8_t index)
+   // Node, as the pool numbers them, of the group the calling thread belongs to.  -1 for threads outside the pool
+   static int GetCurrentNode()
+   {
+      return CurrentGroup();
+   }
+
+   void Stop() override
+   {
+      if (!_stopFlag)
+      {
+         // Set under each group's lock so no thread can miss it between checking its predicate and waiting
+         for (auto& group : _groups)
+         {
+            std::lock_guard<std::mutex> lk(group->mutex);
+            _stopFlag = true;
+         }
+
+         for (auto& group : _groups)
+         {
+            group->wake.notify_all();
+         }
+
+         // Wait for the threads.  None retire once the stop flag is set, so the maps no longer change
+         for (auto& group : _groups)
+         {
+            for (auto& pair : group->threads)
+            {
+               pair.second.join();
+            }
+            JoinRetired(*group);
+         }
+      }
+   }
+
+   void StartTimer(int timeoutMs, std::function<void()> Callback) override
    {
-      _threads[index] = std::make_shared<std::thread>([=]()
+      // Register a timer
+      bool wakeTimerThread = false;
+      auto& group = *_groups.front();
+
       {
+         // Lock the mutex while we push a new task onto the queue
+         std::lock_guard<std::mutex> lk(group.mutex);
+
+         // Create an absolute target time for this timer entry.  This has to come from the same clock
+         // as the map's time points
+         auto target = Clock::now() + std::chrono::milliseconds(timeoutMs);
+
+         if (_timerMap.empty() || _timerMap.begin()->first > target)
+         {
+            wakeTimerThread = true;
+         }
+
+         _timerMap.insert(std::make_pair(target, Callback));
+
+         if (group.threads.empty() && GetGroupThreadCount(0) > 0)
+         {
+            // Timers need a thread to wait on them
+            CreateThreadPoolThread(group);
+         }
+      }
+
+      if (wakeTimerThread)
+      {
+         // Wake up a thread to handle the new timer
+         group.wake.notify_one();
+      }
+   }
+
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   /// Strands run their tasks one at a time in the order posted, on the threads of one node.  Strands
+   /// are spread over the nodes in the order they are created.
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   void CreateStrand(int& nStrandID) override
+   {
+      std::lock_guard<std::mutex> lk(_strandGuard);
+      nStrandID = _nextStrandID++;
+
+      auto strand = std::make_shared<Strand>();
+      strand->node = nStrandID % (int)_groups.size();
+      _strands[nStrandID] = strand;
+   }
+
+   void DestroyStrand(int nStrandID) override
+   {
+      // Tasks already posted to the strand still run
+      std::lock_guard<std::mutex> lk(_strandGuard);
+      _strands.erase(nStrandID);
+   }
+
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   /// Post a TASK to the task queue.  A pool thread posts to its own node's queue, anyone else's
+   /// tasks are dealt out over the nodes in turn.
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   void Post(std::function<void()> Task) override
+   {
+      auto node = CurrentGroup();
+      if (node < 0) node = (int)(_nextGroup++ % _groups.size());
+
+      PostToNode(Task, node);
+   }
+
+   void PostToNode(std::function<void()> Task, int node) override
+   {
+      std::vector<std::function<void()>> tasks(1, Task);
+      PostBatch(tasks, node);
+   }
+
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   /// Posts several tasks to a node's queue under one lock.  Only as many parked threads are woken as
+   /// there are tasks for, and none when every thread is busy or still looking for work, so a busy
+   /// pool takes no system call per task.
+   /// ////////////////////////////////////////////////////////////////////////////////////////////////
+   void PostBatch(std::vector<std::function<void()>>& tasks, int node)
+   {
+      if (tasks.empty()) return;
+
+      auto index = node % _groups.size();
+      auto& group = *_groups[index];
+      size_t wake;
+      bool wakeAll;
+      {
+         // Lock the mutex while we push the new tasks onto the queue
+         std::lock_guard<std::mutex> lk(group.mutex);
+         for (auto& task : tasks)
+         {
+            group.taskQueue.push(std::move(task));
+         }
+         group.queued += tasks.size();
+
+         // Start threads for work nobody is free to take, up to the group's share of the thread count
+         auto available = group.parked + group.spinning;
+         auto backlog = group.queued > available ? group.queued - available : 0;
+         auto limit = GetGroupThreadCount(index);
+         for (; backlog > 0 && group.threads.size() < limit; backlog--)
+         {
+            CreateThreadPoolThread(group);
+         }
+
+         wake = tasks.size() < group.parked ? tasks.size() : group.parked;
+         wakeAll = wake > 1 && wake == group.parked;
+      }
+      tasks.clear();
+
+      if (wakeAll) group.wake.notify_all();
+      else for (size_t i = 0; i < wake; i++) group.wake.notify_one();
+   }
+
+   void Post(std::function<void()> Task, int nStrandID) override
+   {
+      std::shared_ptr<Strand> strand;
+      {
+         std::lock_guard<std::mutex> lk(_strandGuard);
+         auto iter = _strands.find(nStrandID);
+         if (iter != _strands.end()) strand = iter->second;
+      }
+
+      // Not a strand, or no longer one
+      if (!strand)
+      {
+         Post(Task);
+         return;
+      }
+
+      bool start;
+      {
+         std::lock_guard<std::mutex> lk(strand->mutex);
+         strand->tasks.push(Task);
+         start = !strand->running;
+         strand->running = true;
+      }
+
+      if (start) PostToNode([this, strand]() { RunStrand(strand); }, strand->node);
+   }
+
+private:
+   struct WorkerGroup
+   {
+      NumaNode node;
+      std::queue<std::function<void()>> taskQueue;
+      std::atomic<size_t> queued{ 0 };       // Size of the task queue, for spinning threads to watch without the lock
+      std::map<int, std::thread> threads;
+      std::vector<std::thread> retired;      // Threads that have retired and are yet to be joined
+      int nextThreadID = 0;
+      size_t parked = 0;                     // Threads waiting on the condition variable
+      std::atomic<size_t> spinning{ 0 };     // Threads out of work that have not parked yet
+      std::mutex mutex;
+      std::condition_variable wake;
+   };
+
+   struct Strand
+   {
+      int node = 0;
+      std::queue<std::function<void()>> tasks;
+      bool running = false;      // A task is queued or running that will work through the strand's tasks
+      std::mutex mutex;
+   };
+
+   static int& CurrentGroup()
+   {
+      static thread_local int group = -1;
+      return group;
+   }
+
+   // Called with the group's mutex held
+   void CreateThreadPoolThread(WorkerGroup& group)
+   {
+      // Threads that retired since the last one was created have let go of the mutex and finished by now
+      JoinRetired(group);
+
+      // The first group's threads also run the timers
+      bool runsTimers = &group == _groups.front().get();
+      int groupIndex = (int)GetGroupIndex(group);
+      int id = group.nextThreadID++;
+
+      group.threads[id] = std::thread([=, &group]()
+      {
+         CurrentGroup() = groupIndex;
+         if (_pinThreads) NumaTopology::Pin(group.node);
+
          while (true)
          {
+            // Look for more work for a moment before going to sleep
+            if (group.queued == 0) SpinForWork(group);
+
             // Construct a lock object and wait for a client to put a request on the queue
-            std::unique_lock<std::mutex> lk(_mutex);
+            std::unique_lock<std::mutex> lk(group.mutex);
+            bool idle = false;
 
-            if (!_timerMap.empty())
+            group.parked++;
+            if (runsTimers && !_timerMap.empty())
             {
                // If there is a timer request in the queue, start a timed wait for the target time of the first entry
                auto targetTime = _timerMap.begin()->first;
 
                // wait_until will block until the target time is reached.  The predicate lambda checks for spurious
-               // wakeups
-               _conditionVariable.wait_until(lk, targetTime, [=]() { return !_taskQueue.empty(); });
+               // wakeups, and also wakes us if an earlier timer was registered in the meantime
+               group.wake.wait_until(lk, targetTime, [=, &group]() { return _stopFlag || !group.taskQueue.empty() || _timerMap.empty() || _timerMap.begin()->first < targetTime; });
             }
             else
             {
-               // Start an untimed wait.
-               _conditionVariable.wait(lk, [=]() { return (!_taskQueue.empty() || !_timerMap.empty()); });
+               // Wait for work, for no longer than the idle timeout
+               idle = !group.wake.wait_for(lk, std::chrono::milliseconds(_idleTimeoutMs), [=, &group]() { return _stopFlag || !group.taskQueue.empty() || (runsTimers && !_timerMap.empty()); });
             }
+            group.parked--;
 
             // If the stop signal is set, break out and terminate
             if (_stopFlag) break;
 
+            if (idle)
+            {
+               // Nothing to do for the whole timeout, retire.  The next thread created, or Stop(), joins this one
+               group.retired.push_back(std::move(group.threads[id]));
+               group.threads.erase(id);
+               break;
+            }
+
             // Check for an expired timer
-            if (!_timerMap.empty())
+            if (runsTimers && !_timerMap.empty() && _timerMap.begin()->first <= Clock::now())
             {
                auto iter = _timerMap.begin();
-               auto targetTime = iter->first;
                auto callbackMethod = iter->second;
-               //if (targetTime < std::chrono::system_clock::now())
                {
                   _timerMap.erase(iter);
 
@@ -78,11 +366,12 @@ public:
                // time.  But we return control to the thread now and let it expire again.  This way, other threads may be
                // able to process timers and events
             }
-            else if (!_taskQueue.empty())
+            else if (!group.taskQueue.empty())
             {
-               // Pop a copy of the next task off the queue
-               auto Task = _taskQueue.front();
-               _taskQueue.pop();
+               // Pop the next task off the queue
+               auto Task = std::move(group.taskQueue.front());
+               group.taskQueue.pop();
+               group.queued--;
 
                // Release the lock before executing the task Task() is the stored function
                lk.unlock();
@@ -92,97 +381,86 @@ public:
       });
    }
 
-   void Stop() override
+   void SpinForWork(WorkerGroup& group)
    {
-      if (!_stopFlag)
+      group.spinning++;
+      for (int i = 0; i < SpinIterations && group.queued == 0 && !_stopFlag; i++)
       {
-         _stopFlag = true;
-
-         // Post a 0 task to wake the threads.  
-         for (auto& p : _threads)
-         {
-            Post(0);
-         }
-
-         // Wait for the threads
-         for (auto& pair : _threads)
-         {
-            auto pThread = pair.second;
-            pThread->join();
-         }
       }
+      for (int i = 0; i < YieldIterations && group.queued == 0 && !_stopFlag; i++)
+      {
+         std::this_thread::yield();
+      }
+      group.spinning--;
    }
 
-   // Todo: This StartTimer implementation worked in Ubuntu but the commented
-   // code block fails in windows.  Requires investigation, but the function
-   // is not currently required by this project
-   void StartTimer(int timeoutMs, std::function<void()> Callback) override
+   void JoinRetired(WorkerGroup& group)
    {
-      // Register a timer
-      bool wakeTimerThread = false;
-
+      for (auto& thread : group.retired)
       {
-         // Lock the mutex while we push a new task onto the queue
-         std::lock_guard<std::mutex> lk(_mutex);
-
-         // Create an absolute target time for this timer entry
-         auto now = std::chrono::system_clock::now();
-         auto target = now + std::chrono::milliseconds(timeoutMs);
-
-         //if (_timerMap.empty() || _timerMap.begin()->first > target)
-         //{
-         //    wakeTimerThread = true;
-         //}
-         //
-         //_timerMap.insert(std::make_pair(target, Callback));
+         thread.join();
       }
+      group.retired.clear();
+   }
 
-      if (wakeTimerThread)
+   size_t GetGroupIndex(const WorkerGroup& group) const
+   {
+      for (size_t i = 0; i < _groups.size(); i++)
       {
-         // Wake up a thread to handle the new timer
-         _conditionVariable.notify_one();
+         if (_groups[i].get() == &group) return i;
       }
-
-      printf("Start timer req: %s, %ld\n", wakeTimerThread ? "wake" : "nowake", _timerMap.size());
+      return 0;
    }
 
-   // See IWorkerThreadPool.h for details on stands
-   void CreateStrand(int& nStrandID) override {}
-   void DestroyStrand(int nStrandID) override {}
+   // Threads allowed for a group, the thread count split evenly with the first groups taking any remainder
+   size_t GetGroupThreadCount(size_t index) const
+   {
+      if (_threadCount == 0) return 0;
 
-   /// ////////////////////////////////////////////////////////////////////////////////////////////////
-   /// Post a TASK to the task queue.
-   /// ////////////////////////////////////////////////////////////////////////////////////////////////
-   void Post(std::function<void()> Task) override
+      size_t threads = (size_t)_threadCount;
+      size_t count = threads / _groups.size() + (index < threads % _groups.size() ? 1 : 0);
+      return count > 0 ? count : 1;
+   }
+
+   void RunStrand(std::shared_ptr<Strand> strand)
    {
+      // Runs what was queued when it started, then gives the thread back rather than holding on to it for a busy strand
+      std::queue<std::function<void()>> tasks;
       {
-         // Lock the mutex while we push a new task onto the queue
-         std::lock_guard<std::mutex> lk(_mutex);
-         _taskQueue.push(Task);
+         std::lock_guard<std::mutex> lk(strand->mutex);
+         tasks.swap(strand->tasks);
+      }
+
+      while (!tasks.empty())
+      {
+         tasks.front()();
+         tasks.pop();
+      }
 
-         if (_taskQueue.size() > _threads.size() &&
-             _threads.size() < _threadCount)
+      {
+         std::lock_guard<std::mutex> lk(strand->mutex);
+         if (strand->tasks.empty())
          {
-            // Start up a new thread. 
-            // Todo: Shrink the threads running in the pool as well.  This requires some thought still.
-            CreateThreadPoolThread((uint8_t)_threads.size());
+            strand->running = false;
+            return;
          }
       }
-      _conditionVariable.notify_one();
-   }
 
-   void Post(std::function<void()> Task, int nStrandID) override
-   {
-      // Strand execution will apply a strand id to a task
-      Post(Task);
+      PostToNode([this, strand]() { RunStrand(strand); }, strand->node);
    }
 
-private:
-   uint8_t _threadCount;
-   std::queue<std::function<void()>> _taskQueue;
-   std::map<TimePoint, std::function<void()>> _timerMap;
-   std::map<uint8_t, std::shared_ptr<std::thread>> _threads;
-   bool _stopFlag;
-   std::mutex _mutex;
-   std::condition_variable _conditionVariable;
+   int _threadCount;
+   int _idleTimeoutMs;
+   bool _pinThreads;
+   std::vector<std::unique_ptr<WorkerGroup>> _groups;
+   std::atomic<size_t> _nextGroup;
+
+   // Guarded by the first group's mutex, whose threads run the timers
+   std::multimap<TimePoint, std::function<void()>> _timerMap;
+
+   std::map<int, std::shared_ptr<Strand>> _strands;
+   int _nextStrandID;
+   std::mutex _strandGuard;
+
+   std::atomic<bool> _stopFlag;
 };
@@ -3,15 +3,33 @@
 
 #include <iostream>
 #include <string>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <sstream>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <fstream>
+#include <filesystem>
 
 #include "..\FileTransferCS\ILogger.h"
 #include "..\FileTransferCS\IReader.h"
 #include "..\FileTransferCS\ISenderReceiver.h"
+#include "..\FileTransferCS\IWriter.h"
 
 #include "..\FileTransferCS\WorkerThreadPool.h"
 
 #include "..\FileTransferCS\DataTransferClient.h"
 #include "..\FileTransferCS\DataTransferServer.h"
+#include "..\FileTransferCS\MultipathSenderReceiver.h"
+#include "..\FileTransferCS\BlockCache.h"
+#include "..\FileTransferCS\TransferSession.h"
+#include "..\FileTransferCS\CachedFileReader.h"
+#include "..\FileTransferCS\RecordingSenderReceiver.h"
+#include "..\FileTransferCS\PacketReplayer.h"
+#include "..\FileTransferCS\DataTransferServerBuilds.h"
+#include "..\FileTransferCS\AesGcmCipher.h"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -51,6 +69,21 @@ public:
 	std::string data;
 };
 
+// A source that is gone by the time the transfer starts
+class MockMissingReader : public IReader
+{
+public:
+	uint32_t Read(std::vector<char>& s) override
+	{
+		throw std::runtime_error("Source is missing");
+	}
+
+	virtual const std::string& GetSource() override
+	{
+		throw std::runtime_error("Source is missing");
+	}
+};
+
 class MockSender : public ISenderReceiver
 {
 public:
@@ -61,15 +94,263 @@ public:
 		sendData.push_back(stringData);
 	}
 
-	void Receive(std::function<void(std::vector<char>)> callback)
-	{}
+	void Receive(std::function<void(const std::vector<char>&)> callback)
+	{
+		receiveCallback = callback;
+	}
 
 	void Start(uint16_t port)
 	{}
 
+	uint64_t GetSender()
+	{
+		return sender;
+	}
+
+	void SetReplyAddress(uint32_t transactionID, uint64_t sender)
+	{
+		replyAddresses[transactionID] = sender;
+	}
+
+	void SendTo(uint64_t sender, const std::vector<char>& s)
+	{
+		sentTo.push_back(sender);
+		Send(s);
+	}
+
+	uint64_t GetReceiveTime()
+	{
+		return receiveTime;
+	}
+
 	std::vector<std::string> sendData;
+	std::function<void(const std::vector<char>&)> receiveCallback;
+
+	// Reported as the sender of what is received, and where the server was told to reply or sent directly
+	uint64_t sender = 0;
+	std::map<uint32_t, uint64_t> replyAddresses;
+	std::vector<uint64_t> sentTo;
+
+	// Reported as when what is received arrived, zero leaves the receiver to take the time itself
+	uint64_t receiveTime = 0;
+};
+
+// Stands in for a server that has everything, acknowledging each transaction's end as soon as it is sent
+class MockAckingSender : public ISenderReceiver
+{
+public:
+	void Send(const std::vector<char>& s) override
+	{
+		TransactionUnit tu(s);
+		if (tu.messagetype != MsgType_EndTransaction || !receiveCallback) return;
+
+		TransactionUnit ack;
+		ack.transactionid = tu.transactionid;
+		ack.messagetype = MsgType_Ack;
+		ack.sequencenum = tu.sequencenum;
+		ack.messagelength = 0;
+
+		std::vector<char> buffer;
+		ack.GetBlob(buffer);
+		receiveCallback(buffer);
+	}
+
+	void Receive(std::function<void(const std::vector<char>&)> callback) override
+	{
+		receiveCallback = callback;
+	}
+
+	void Start(uint16_t port) override
+	{}
+
+	std::function<void(const std::vector<char>&)> receiveCallback;
+};
+
+// One end of an emulated link, delivering what is sent to the other end after a fixed delay.  An end with
+// replyToSender set answers each transaction on the link given for it by SetReplyAddress(), as a UDP server does
+class DelayedWire : public ISenderReceiver, public std::enable_shared_from_this<DelayedWire>
+{
+public:
+	DelayedWire(std::shared_ptr<IWorkerThreadPool> threadPool, int delayMs)
+		: _threadPool(threadPool),
+		_delayMs(delayMs),
+		_sender(0)
+	{}
+
+	void Send(const std::vector<char>& s) override
+	{
+		// Lost on the way
+		TransactionUnit tu(s);
+		if (tu.IsValid() && tu.messagetype == MsgType_Data && tu.sequencenum == dropData.load() && dropData.exchange(-1) >= 0) return;
+
+		std::weak_ptr<DelayedWire> peer = this->peer;
+		if (replyToSender && s.size() >= 2 * sizeof(uint32_t))
+		{
+			std::lock_guard<std::mutex> lock(_routeGuard);
+			auto iter = _routes.find(GetTransactionID(s));
+			if (iter != _routes.end()) peer = iter->second;
+		}
+
+		SendOn(peer, s);
+	}
+
+	void Receive(std::function<void(const std::vector<char>&)> callback) override
+	{
+		std::lock_guard<std::mutex> lock(_guard);
+		_callback = callback;
+	}
+
+	void Start(uint16_t port) override
+	{}
+
+	// Each sender is known by the address of its end
+	uint64_t GetSender() override
+	{
+		return _sender;
+	}
+
+	void SetReplyAddress(uint32_t transactionID, uint64_t sender) override
+	{
+		std::lock_guard<std::mutex> lock(_routeGuard);
+		auto iter = _senders.find(sender);
+		if (replyToSender && iter != _senders.end()) _routes[transactionID] = iter->second;
+	}
+
+	void SendTo(uint64_t sender, const std::vector<char>& s) override
+	{
+		std::weak_ptr<DelayedWire> peer;
+		{
+			std::lock_guard<std::mutex> lock(_routeGuard);
+			auto iter = _senders.find(sender);
+			if (iter == _senders.end()) return;
+			peer = iter->second;
+		}
+
+		SendOn(peer, s);
+	}
+
+	std::weak_ptr<DelayedWire> peer;
+	bool replyToSender = false;
+	std::atomic<size_t> sent{ 0 };
+
+	// Cookies handed out and echoed back, the handshakes that went through this end
+	std::atomic<size_t> challenges{ 0 };
+	std::atomic<size_t> cookieEchoes{ 0 };
+
+	// The data unit with this sequence is lost the first time it is sent
+	std::atomic<int64_t> dropData{ -1 };
+
+private:
+	static uint32_t GetTransactionID(const std::vector<char>& s)
+	{
+		uint32_t transactionID;
+		memcpy(&transactionID, s.data() + sizeof(uint32_t), sizeof(transactionID));
+		return transactionID;
+	}
+
+	void SendOn(std::weak_ptr<DelayedWire> peer, const std::vector<char>& s)
+	{
+		sent++;
+		TransactionUnit tu(s);
+		if (tu.IsValid() && tu.messagetype == MsgType_Challenge) challenges++;
+		if (tu.IsValid() && tu.messagetype == MsgType_CookieEcho) cookieEchoes++;
+
+		std::weak_ptr<DelayedWire> from = shared_from_this();
+		_threadPool->StartTimer(_delayMs, [peer, from, s]()
+		{
+			auto wire = peer.lock();
+			if (wire) wire->Deliver(s, from);
+		});
+	}
+
+	void Deliver(const std::vector<char>& s, std::weak_ptr<DelayedWire> from)
+	{
+		auto sender = (uint64_t)(uintptr_t)from.lock().get();
+		{
+			std::lock_guard<std::mutex> lock(_routeGuard);
+			if (sender) _senders[sender] = from;
+		}
+
+		// One message at a time, as from a socket's receive thread
+		std::lock_guard<std::mutex> lock(_guard);
+		_sender = sender;
+		if (_callback) _callback(s);
+	}
+
+	std::shared_ptr<IWorkerThreadPool> _threadPool;
+	int _delayMs;
+	std::mutex _guard;
+	std::function<void(const std::vector<char>&)> _callback;
+	uint64_t _sender;
+	std::map<uint32_t, std::weak_ptr<DelayedWire>> _routes;
+	std::map<uint64_t, std::weak_ptr<DelayedWire>> _senders;
+	std::mutex _routeGuard;
+};
+
+class MockWriter : public IWriter
+{
+public:
+	void Write(const std::string& s) override
+	{
+		data += s;
+	}
+
+	void Flush() override
+	{
+		flushed = true;
+	}
+
+	const std::string& GetDestination() override
+	{
+		return destination;
+	}
+
+	void SetDestination(const std::string& s) override
+	{
+		destination = s;
+	}
+
+	void SetSyncOnFlush(bool sync) override
+	{
+		syncOnFlush = sync;
+	}
+
+	std::string destination;
+	std::string data;
+	bool flushed = false;
+	bool syncOnFlush = false;
 };
 
+class MockWriterFactory : public IWriterFactory
+{
+public:
+	std::shared_ptr<IWriter> Create(std::shared_ptr<ILogger> logger) override
+	{
+		std::lock_guard<std::mutex> lock(guard);
+		writer = std::make_shared<MockWriter>();
+		writers.push_back(writer);
+		return writer;
+	}
+
+	std::shared_ptr<MockWriter> writer;
+	std::vector<std::shared_ptr<MockWriter>> writers;
+	std::mutex guard;
+};
+
+static std::vector<char> MakeMessage(MsgType messagetype, uint32_t sequence, const std::string& data)
+{
+	TransactionUnit tu;
+	tu.transactionid = 42;
+	tu.messagetype = messagetype;
+	tu.sequencenum = sequence;
+	tu.messagedata.assign(data.begin(), data.end());
+	tu.messagelength = (uint16_t)data.size();
+
+	std::vector<char> buffer;
+	tu.GetBlob(buffer);
+	return buffer;
+}
+
 namespace UnitTest
 {
 	TEST_CLASS(UnitTest)
@@ -91,5 +372,859 @@ namespace UnitTest
 			auto actualData = (int)sender->sendData.size();
 			Assert::AreEqual(3, actualData);
 		}
+
+		TEST_METHOD(DataTransferClient_RepeatsEndUntilAcknowledged)
+		{
+			auto reader = std::make_shared<MockReader>();
+			auto sender = std::make_shared<MockSender>();
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(1);
+			auto p = std::make_shared<DataTransferClient>(std::make_shared<LoggerStub>(), threadPool, reader, sender);
+			Assert::AreEqual((size_t)3, sender->sendData.size());
+
+			// Nothing came back, so the end goes again
+			std::this_thread::sleep_for(std::chrono::milliseconds(700));
+			threadPool->Stop();
+			Assert::AreEqual((size_t)4, sender->sendData.size());
+			Assert::IsTrue(sender->sendData[3] == sender->sendData[2]);
+			Assert::IsTrue(p->GetCompletion().wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+
+			// Until the final acknowledgement arrives
+			TransactionUnit end(std::vector<char>(sender->sendData[2].begin(), sender->sendData[2].end()));
+			TransactionUnit ack;
+			ack.transactionid = end.transactionid;
+			ack.messagetype = MsgType_Ack;
+			ack.sequencenum = end.sequencenum;
+			ack.messagelength = 0;
+			std::vector<char> buffer;
+			ack.GetBlob(buffer);
+			sender->receiveCallback(buffer);
+			Assert::IsTrue(p->GetCompletion().get());
+		}
+
+		TEST_METHOD(DataTransferClient_ResendsUnrereadableSource)
+		{
+			// The mock reader hands its data out once and can't read it back
+			auto reader = std::make_shared<MockReader>();
+			auto sender = std::make_shared<MockSender>();
+			auto p = std::make_shared<DataTransferClient>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), reader, sender);
+			Assert::AreEqual((size_t)3, sender->sendData.size());
+
+			// Asked for again, the block is resent from the copy the client kept
+			TransactionUnit start(std::vector<char>(sender->sendData[0].begin(), sender->sendData[0].end()));
+			TransactionUnit request;
+			request.transactionid = start.transactionid;
+			request.messagetype = MsgType_RetransmitReq;
+			request.sequencenum = 0;
+			request.messagelength = 0;
+			std::vector<char> buffer;
+			request.GetBlob(buffer);
+			sender->receiveCallback(buffer);
+
+			Assert::AreEqual((size_t)4, sender->sendData.size());
+			TransactionUnit resent(std::vector<char>(sender->sendData[3].begin(), sender->sendData[3].end()));
+			Assert::AreEqual((uint16_t)MsgType_Data, resent.messagetype);
+			Assert::AreEqual(std::string("Test Data 12345"), std::string(resent.messagedata.begin(), resent.messagedata.end()));
+		}
+
+		TEST_METHOD(DataTransferClient_AsyncManyTransfers)
+		{
+			// One pool thread drives every transfer, the constructors return without sending
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(1);
+
+			DataTransferClientOptions options;
+			options.sendAsync = true;
+
+			std::vector<std::shared_ptr<DataTransferClient>> clients;
+			for (int i = 0; i < 1000; i++)
+			{
+				clients.push_back(std::make_shared<DataTransferClient>(std::make_shared<LoggerStub>(), threadPool, std::make_shared<MockReader>(), std::make_shared<MockAckingSender>(), options));
+			}
+
+			for (auto& client : clients)
+			{
+				auto completion = client->GetCompletion();
+				Assert::IsTrue(completion.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+				Assert::IsTrue(completion.get());
+			}
+		}
+
+		TEST_METHOD(DataTransferServer_NextTransfer)
+		{
+			auto upstream = std::make_shared<MockSender>();
+			auto p = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), upstream, std::make_shared<MockWriterFactory>());
+
+			auto next = p->NextTransfer();
+			upstream->receiveCallback(MakeMessage(MsgType_StartTransaction, 0, "First"));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 0, "Test Data 12345"));
+			Assert::IsTrue(next.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+
+			upstream->receiveCallback(MakeMessage(MsgType_EndTransaction, 1, "First"));
+			auto transfer = next.get();
+			Assert::AreEqual((uint32_t)42, transfer.transactionID);
+			Assert::AreEqual(std::string("First"), transfer.destination);
+			Assert::IsTrue(transfer.complete);
+
+			// Ended with nobody waiting, it is kept for the next call
+			upstream->receiveCallback(MakeMessage(MsgType_StartTransaction, 0, "Second"));
+			upstream->receiveCallback(MakeMessage(MsgType_EndTransaction, 0, "Second"));
+			Assert::AreEqual(std::string("Second"), p->NextTransfer().get().destination);
+		}
+
+		TEST_METHOD(DataTransferServer_SyncsWhenStartAsks)
+		{
+			// A client asking for it flags its start
+			auto sender = std::make_shared<MockSender>();
+			DataTransferClientOptions options;
+			options.sync = true;
+			auto client = std::make_shared<DataTransferClient>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), std::make_shared<MockReader>(), sender, options);
+			TransactionUnit start(std::vector<char>(sender->sendData[0].begin(), sender->sendData[0].end()));
+			Assert::AreEqual(StartFlag_Sync, start.sequencenum);
+
+			// The server syncs the file of that transaction and not of others
+			auto upstream = std::make_shared<MockSender>();
+			auto factory = std::make_shared<MockWriterFactory>();
+			auto p = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), upstream, factory);
+			upstream->receiveCallback(MakeMessage(MsgType_StartTransaction, 0, "Plain"));
+			upstream->receiveCallback(MakeMessage(MsgType_EndTransaction, 0, "Plain"));
+			upstream->receiveCallback(MakeMessage(MsgType_StartTransaction, StartFlag_Sync, "Synced"));
+
+			Assert::AreEqual((size_t)2, factory->writers.size());
+			Assert::IsFalse(factory->writers[0]->syncOnFlush);
+			Assert::AreEqual(std::string("Synced"), factory->writers[1]->destination);
+			Assert::IsTrue(factory->writers[1]->syncOnFlush);
+		}
+
+		TEST_METHOD(DataTransferClient_RoundTripFromEchoedStamps)
+		{
+			auto sender = std::make_shared<MockSender>();
+			auto p = std::make_shared<DataTransferClient>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), std::make_shared<MockReader>(), sender);
+			Assert::AreEqual((size_t)3, sender->sendData.size());
+			TransactionUnit data(std::vector<char>(sender->sendData[1].begin(), sender->sendData[1].end()));
+			TransactionUnit end(std::vector<char>(sender->sendData[2].begin(), sender->sendData[2].end()));
+
+			// The data is acknowledged, its timestamp echoed, 20ms after it was stamped
+			TransactionUnit ack;
+			ack.transactionid = end.transactionid;
+			ack.messagetype = MsgType_Ack;
+			ack.sequencenum = data.sequencenum;
+			ack.echoTimestamp = data.timestamp;
+			ack.messagelength = 0;
+			std::vector<char> buffer;
+			ack.GetBlob(buffer);
+			sender->receiveTime = (uint32_t)(data.timestamp + 20000);
+			sender->receiveCallback(buffer);
+
+			auto roundTrip = p->GetRoundTrip();
+			Assert::AreEqual((uint64_t)1, roundTrip.samples);
+			Assert::AreEqual((uint32_t)20000, roundTrip.smoothedUs);
+
+			// The end's acknowledgement takes 36ms, the estimate moves an eighth of the way
+			ack.sequencenum = end.sequencenum;
+			ack.echoTimestamp = end.timestamp;
+			ack.GetBlob(buffer);
+			sender->receiveTime = (uint32_t)(end.timestamp + 36000);
+			sender->receiveCallback(buffer);
+			Assert::IsTrue(p->GetCompletion().get());
+
+			roundTrip = p->GetRoundTrip();
+			Assert::AreEqual((uint64_t)2, roundTrip.samples);
+			Assert::AreEqual((uint32_t)22000, roundTrip.smoothedUs);
+		}
+
+		TEST_METHOD(DataTransferServer_EchoesTimestamps)
+		{
+			auto upstream = std::make_shared<MockSender>();
+			auto p = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), upstream, std::make_shared<MockWriterFactory>());
+
+			// Units stamped 5ms before they arrive
+			auto stamp = [](std::vector<char> buffer)
+			{
+				uint32_t timestamp = GetWireTimestamp() - 5000;
+				memcpy(buffer.data() + 16, &timestamp, sizeof(timestamp));
+				return buffer;
+			};
+
+			upstream->receiveCallback(stamp(MakeMessage(MsgType_StartTransaction, 0, "First")));
+			upstream->receiveCallback(stamp(MakeMessage(MsgType_Data, 0, "Test Data 12345")));
+			upstream->receiveCallback(stamp(MakeMessage(MsgType_Data, 1, "67890")));
+
+			// Timed from the first unit after the start
+			DelayStats transit;
+			Assert::IsTrue(p->GetTransit(42, transit));
+			Assert::AreEqual((uint64_t)2, transit.samples);
+			Assert::IsTrue(transit.minimumUs >= 5000 && transit.smoothedUs < 1000000);
+
+			// The final acknowledgement echoes the end's timestamp back
+			auto end = stamp(MakeMessage(MsgType_EndTransaction, 2, "First"));
+			upstream->receiveCallback(end);
+			Assert::IsFalse(p->GetTransit(42, transit));
+
+			TransactionUnit sent(end);
+			TransactionUnit ack(std::vector<char>(upstream->sendData.back().begin(), upstream->sendData.back().end()));
+			Assert::AreEqual((int)MsgType_Ack, (int)ack.messagetype);
+			Assert::AreEqual(sent.timestamp, ack.echoTimestamp);
+		}
+
+		TEST_METHOD(MultipathSenderReceiver_SharesByBandwidth)
+		{
+			auto multipath = std::make_shared<MultipathSenderReceiver>(std::make_shared<LoggerStub>());
+			std::vector<std::shared_ptr<MockSender>> paths;
+			for (int i = 0; i < 3; i++)
+			{
+				paths.push_back(std::make_shared<MockSender>());
+				multipath->AddPath(paths.back());
+			}
+
+			std::vector<std::string> received;
+			multipath->Receive([&](const std::vector<char>& buf) { received.push_back(std::string(buf.begin(), buf.end())); });
+
+			// Control messages stay on the first path
+			multipath->Send(MakeMessage(MsgType_StartTransaction, 0, "First"));
+			Assert::AreEqual((size_t)1, paths[0]->sendData.size());
+			paths[0]->sendData.clear();
+
+			// Each round the paths carry 100, 200 and 400 units and drop the rest, which the server NAKs
+			const size_t capacity[] = { 100, 200, 400 };
+			uint32_t sequence = 0;
+			for (int round = 0; round < 20; round++)
+			{
+				for (int i = 0; i < 1000; i++) multipath->Send(MakeMessage(MsgType_Data, sequence++, "x"));
+
+				TransactionUnit nak;
+				nak.transactionid = 42;
+				nak.messagetype = MsgType_Nak;
+				for (size_t path = 0; path < paths.size(); path++)
+				{
+					auto& sent = paths[path]->sendData;
+					for (size_t i = capacity[path]; i < sent.size(); i++)
+					{
+						TransactionUnit lost(std::vector<char>(sent[i].begin(), sent[i].end()));
+						nak.messagedata.insert(nak.messagedata.end(), (char*)&lost.sequencenum, (char*)&lost.sequencenum + sizeof(uint32_t));
+					}
+					sent.clear();
+				}
+				nak.messagelength = (uint16_t)nak.messagedata.size();
+
+				std::vector<char> buffer;
+				nak.GetBlob(buffer);
+				paths[round % paths.size()]->receiveCallback(buffer);
+			}
+
+			// Shares in proportion to the bandwidths, and every NAK passed on
+			auto stats = multipath->GetPathStats();
+			for (size_t path = 0; path < paths.size(); path++)
+			{
+				double expected = capacity[path] / 700.0;
+				Assert::IsTrue(stats[path].share > expected - 0.03 && stats[path].share < expected + 0.03);
+			}
+			Assert::AreEqual((size_t)20, received.size());
+			Assert::AreEqual((uint64_t)20000, stats[0].units + stats[1].units + stats[2].units);
+		}
+
+		TEST_METHOD(DataTransferServer_ServesPulls)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "FileTransferCS_pull_test";
+			std::filesystem::remove_all(directory);
+			std::filesystem::create_directories(directory);
+
+			std::string content;
+			for (int i = 0; i < 0xFF00; i++) content.push_back((char)(i * 7 + i / 251));
+			std::ofstream((directory / "hot.bin").string(), std::ios::binary) << content;
+
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(4);
+
+			// Serves the file from a cache of 16KB blocks, it takes four
+			DataTransferServerOptions options;
+			options.pullDirectory = directory.string();
+			options.blockCache = std::make_shared<BlockCache>(std::make_shared<LoggerStub>(), DefaultBlockCacheCapacity, 0x4000);
+
+			auto serverEnd = std::make_shared<DelayedWire>(threadPool, 1);
+			serverEnd->replyToSender = true;
+			auto server = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, serverEnd, std::make_shared<MockWriterFactory>(), options);
+
+			struct Puller
+			{
+				std::shared_ptr<DelayedWire> wire;
+				std::shared_ptr<MockWriterFactory> factory;
+				std::shared_ptr<DataTransferServer> server;
+				std::future<CompletedTransfer> transfer;
+			};
+
+			// Two hundred pull the file at once, and one asks for something outside the directory
+			auto start = std::chrono::steady_clock::now();
+			std::vector<Puller> pullers(201);
+			for (size_t i = 0; i < pullers.size(); i++)
+			{
+				auto& puller = pullers[i];
+				puller.wire = std::make_shared<DelayedWire>(threadPool, 1);
+				puller.wire->peer = serverEnd;
+				puller.factory = std::make_shared<MockWriterFactory>();
+				// The wire delivers from several threads, so units can overtake the end
+				DataTransferServerOptions pullerOptions;
+				pullerOptions.repair = true;
+				puller.server = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, puller.wire, puller.factory, pullerOptions);
+				puller.transfer = puller.server->NextTransfer();
+				puller.server->Pull(i < 200 ? "hot.bin" : "../hot.bin");
+			}
+
+			for (size_t i = 0; i < 200; i++)
+			{
+				Assert::IsTrue(pullers[i].transfer.wait_for(std::chrono::seconds(30)) == std::future_status::ready);
+				auto transfer = pullers[i].transfer.get();
+				Assert::IsTrue(transfer.complete);
+				Assert::AreEqual(std::string("hot.bin"), transfer.destination);
+				Assert::IsTrue(content == pullers[i].factory->writer->data);
+			}
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+			// Each block read from disk once between them
+			auto stats = options.blockCache->GetStats();
+			Assert::AreEqual((uint64_t)4, stats.misses);
+			Assert::AreEqual((uint64_t)content.size(), stats.bytesRead);
+			std::ostringstream report;
+			report << "200 pulls of " << content.size() << " bytes in " << elapsed << "ms, " << 200 * content.size() * 1000 / (elapsed + 1)
+			       << " bytes/s egress, " << stats.misses << " disk reads" << std::endl;
+			Logger::WriteMessage(report.str().c_str());
+
+			// Refused, so never started
+			Assert::IsTrue(pullers[200].transfer.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+			Assert::IsFalse(pullers[200].transfer.get().complete);
+
+			pullers.clear();
+			server.reset();
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(DataTransferServer_TracesStages)
+		{
+			DataTransferServerOptions options;
+			options.tracer = std::make_shared<PacketTracer>(2);
+
+			auto upstream = std::make_shared<MockSender>();
+			auto p = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), upstream, std::make_shared<MockWriterFactory>(), options);
+
+			// Sequence 2 waits in the reorder buffer for 1, which is not sampled
+			upstream->receiveCallback(MakeMessage(MsgType_StartTransaction, 0, "First"));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 0, "Test "));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 2, "12345"));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 1, "Data "));
+
+			std::stringstream ss;
+			options.tracer->Export(ss);
+			auto json = ss.str();
+
+			for (auto stage : { "received", "reordered", "written" })
+			{
+				for (auto sequence : { 0, 2 })
+				{
+					std::stringstream span;
+					span << "\"name\":\"" << stage << "\"";
+					std::stringstream unit;
+					unit << "\"transaction\":42,\"sequence\":" << sequence << "}";
+
+					// The stage's span for the unit, on one line of the export
+					bool found = false;
+					std::string line;
+					std::stringstream lines(json);
+					while (std::getline(lines, line))
+					{
+						if (line.find(span.str()) != std::string::npos && line.find(unit.str()) != std::string::npos) found = true;
+					}
+					Assert::IsTrue(found);
+				}
+			}
+			Assert::IsTrue(json.find("\"sequence\":1}") == std::string::npos);
+		}
+
+		TEST_METHOD(DataTransferServer_Relay)
+		{
+			auto upstream = std::make_shared<MockSender>();
+			auto downstream = std::make_shared<MockSender>();
+			auto writerFactory = std::make_shared<MockWriterFactory>();
+
+			DataTransferServerOptions options;
+			options.relays.push_back(downstream);
+			auto p = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), upstream, writerFactory, options);
+
+			// Everything from upstream is forwarded untouched, even out of order, and still written here in order
+			auto start = MakeMessage(MsgType_StartTransaction, 0, "Relayed");
+			auto second = MakeMessage(MsgType_Data, 1, "12345");
+			auto first = MakeMessage(MsgType_Data, 0, "Test Data ");
+			upstream->receiveCallback(start);
+			upstream->receiveCallback(second);
+			upstream->receiveCallback(first);
+
+			Assert::AreEqual((size_t)3, downstream->sendData.size());
+			Assert::IsTrue(downstream->sendData[1] == std::string(second.begin(), second.end()));
+			Assert::AreEqual(std::string("Test Data 12345"), writerFactory->writer->data);
+
+			// Downstream retransmit requests go up to the client
+			auto request = MakeMessage(MsgType_RetransmitReq, 1, "");
+			downstream->receiveCallback(request);
+			Assert::IsTrue(upstream->sendData.back() == std::string(request.begin(), request.end()));
+
+			// The client is only told to release what the downstream server has acknowledged
+			downstream->receiveCallback(MakeMessage(MsgType_Ack, 1, ""));
+			TransactionUnit ack(std::vector<char>(upstream->sendData.back().begin(), upstream->sendData.back().end()));
+			Assert::AreEqual((uint16_t)MsgType_Ack, ack.messagetype);
+			Assert::AreEqual((uint32_t)1, ack.sequencenum);
+
+			// The end finishes the transaction here and goes downstream, but the downstream server still lacks a unit
+			auto end = MakeMessage(MsgType_EndTransaction, 2, "");
+			upstream->receiveCallback(end);
+			Assert::IsTrue(downstream->sendData.back() == std::string(end.begin(), end.end()));
+			Assert::IsTrue(writerFactory->writer->flushed);
+			TransactionUnit held(std::vector<char>(upstream->sendData.back().begin(), upstream->sendData.back().end()));
+			Assert::AreEqual((uint32_t)1, held.sequencenum);
+
+			// The final acknowledgement goes up once the downstream server has the end too, and only once
+			downstream->receiveCallback(MakeMessage(MsgType_Ack, 2, ""));
+			TransactionUnit last(std::vector<char>(upstream->sendData.back().begin(), upstream->sendData.back().end()));
+			Assert::AreEqual((uint16_t)MsgType_Ack, last.messagetype);
+			Assert::AreEqual((uint32_t)2, last.sequencenum);
+
+			auto sent = upstream->sendData.size();
+			downstream->receiveCallback(MakeMessage(MsgType_Ack, 2, ""));
+			Assert::AreEqual(sent, upstream->sendData.size());
+		}
+
+		TEST_METHOD(DataTransferServer_NakForGap)
+		{
+			auto upstream = std::make_shared<MockSender>();
+			auto writerFactory = std::make_shared<MockWriterFactory>();
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(1);
+
+			DataTransferServerOptions options;
+			options.repair = true;
+			options.sendAcks = false;
+			auto p = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, upstream, writerFactory, options);
+
+			upstream->receiveCallback(MakeMessage(MsgType_StartTransaction, 0, "Repaired"));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 0, "A"));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 2, "C"));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 4, "E"));
+
+			// Give the randomized NAK delay time to expire, then stop the pool so the sends can be inspected
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			threadPool->Stop();
+
+			Assert::IsFalse(upstream->sendData.empty());
+			TransactionUnit nak(std::vector<char>(upstream->sendData.front().begin(), upstream->sendData.front().end()));
+			Assert::AreEqual((uint16_t)MsgType_Nak, nak.messagetype);
+			Assert::AreEqual((size_t)8, nak.messagedata.size());
+			uint32_t missing[2];
+			memcpy(missing, nak.messagedata.data(), sizeof(missing));
+			Assert::AreEqual((uint32_t)1, missing[0]);
+			Assert::AreEqual((uint32_t)3, missing[1]);
+
+			// The end waits for the repairs before the transaction completes
+			upstream->receiveCallback(MakeMessage(MsgType_EndTransaction, 5, "Repaired"));
+			Assert::IsFalse(writerFactory->writer->flushed);
+
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 3, "D"));
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 1, "B"));
+			Assert::IsTrue(writerFactory->writer->flushed);
+			Assert::AreEqual(std::string("ABCDE"), writerFactory->writer->data);
+		}
+
+		TEST_METHOD(DataTransferServer_AsksForUnitsMissingAtEnd)
+		{
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(2);
+			auto clientEnd = std::make_shared<DelayedWire>(threadPool, 1);
+			auto serverEnd = std::make_shared<DelayedWire>(threadPool, 1);
+			clientEnd->peer = serverEnd;
+			serverEnd->peer = clientEnd;
+
+			// Without repair, the only data unit is lost and the end arrives ahead of it
+			clientEnd->dropData = 0;
+			auto writerFactory = std::make_shared<MockWriterFactory>();
+			auto server = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, serverEnd, writerFactory);
+			auto next = server->NextTransfer();
+			auto client = std::make_shared<DataTransferClient>(std::make_shared<LoggerStub>(), threadPool, std::make_shared<MockReader>(), clientEnd);
+
+			// The server asks for it again, and both ends agree the transfer completed
+			auto completion = client->GetCompletion();
+			Assert::IsTrue(completion.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+			Assert::IsTrue(completion.get());
+			Assert::IsTrue(next.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+			Assert::IsTrue(next.get().complete);
+			Assert::AreEqual((int64_t)-1, clientEnd->dropData.load());
+			Assert::AreEqual(std::string("Test Data 12345"), writerFactory->writer->data);
+		}
+
+		TEST_METHOD(DataTransferServer_CookieHandshake)
+		{
+			auto upstream = std::make_shared<MockSender>();
+			auto writerFactory = std::make_shared<MockWriterFactory>();
+
+			DataTransferServerOptions options;
+			options.requireCookie = true;
+			auto p = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), upstream, writerFactory, options);
+
+			// A start only gets a challenge, sent straight back, and nothing is kept for it or for data that follows
+			auto start = MakeMessage(MsgType_StartTransaction, 0, "Cookie");
+			upstream->sender = 1;
+			upstream->receiveCallback(start);
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 0, "Dropped"));
+			Assert::IsFalse((bool)writerFactory->writer);
+			Assert::AreEqual((size_t)1, upstream->sendData.size());
+			Assert::AreEqual((size_t)1, upstream->sentTo.size());
+			Assert::AreEqual((uint64_t)1, upstream->sentTo[0]);
+			Assert::IsTrue(upstream->replyAddresses.empty());
+
+			TransactionUnit challenge(std::vector<char>(upstream->sendData[0].begin(), upstream->sendData[0].end()));
+			Assert::AreEqual((uint16_t)MsgType_Challenge, challenge.messagetype);
+
+			// A forged cookie is ignored
+			std::string echo(challenge.messagedata.begin(), challenge.messagedata.end());
+			echo += std::string(start.begin(), start.end());
+			std::string forged = echo;
+			forged[0] ^= 1;
+			upstream->receiveCallback(MakeMessage(MsgType_CookieEcho, 0, forged));
+			Assert::IsFalse((bool)writerFactory->writer);
+
+			// So is the real cookie echoed from another address
+			upstream->sender = 2;
+			upstream->receiveCallback(MakeMessage(MsgType_CookieEcho, 0, echo));
+			Assert::IsFalse((bool)writerFactory->writer);
+			Assert::IsTrue(upstream->replyAddresses.empty());
+
+			// The echoed cookie starts the transaction and is acknowledged, where the echo came from
+			upstream->sender = 1;
+			upstream->receiveCallback(MakeMessage(MsgType_CookieEcho, 0, echo));
+			Assert::IsTrue((bool)writerFactory->writer);
+			Assert::AreEqual(std::string("Cookie"), writerFactory->writer->destination);
+			Assert::AreEqual((uint64_t)1, upstream->replyAddresses[42]);
+
+			TransactionUnit ack(std::vector<char>(upstream->sendData.back().begin(), upstream->sendData.back().end()));
+			Assert::AreEqual((uint16_t)MsgType_Ack, ack.messagetype);
+			Assert::AreEqual((uint32_t)0, ack.sequencenum);
+
+			upstream->receiveCallback(MakeMessage(MsgType_Data, 0, "Test Data 12345"));
+			Assert::AreEqual(std::string("Test Data 12345"), writerFactory->writer->data);
+
+			// The end is acknowledged, and so is the end repeated once the transaction is gone, cookie or not
+			upstream->receiveCallback(MakeMessage(MsgType_EndTransaction, 1, "Cookie"));
+			auto finalAck = upstream->sendData.back();
+			TransactionUnit last(std::vector<char>(finalAck.begin(), finalAck.end()));
+			Assert::AreEqual((uint16_t)MsgType_Ack, last.messagetype);
+			Assert::AreEqual((uint32_t)1, last.sequencenum);
+
+			auto sent = upstream->sendData.size();
+			upstream->receiveCallback(MakeMessage(MsgType_EndTransaction, 1, "Cookie"));
+			Assert::AreEqual(sent + 1, upstream->sendData.size());
+			TransactionUnit repeated(std::vector<char>(upstream->sendData.back().begin(), upstream->sendData.back().end()));
+			Assert::AreEqual((uint16_t)MsgType_Ack, repeated.messagetype);
+			Assert::AreEqual((uint32_t)1, repeated.sequencenum);
+		}
+
+		TEST_METHOD(DataTransferClient_SecureRepliesMustOpen)
+		{
+			// Each end with a cipher of its own, as two processes would have
+			DataTransferClientOptions clientOptions;
+			clientOptions.cipher = std::make_shared<AesGcmCipher>(std::make_shared<LoggerStub>(), "shared secret");
+			DataTransferServerOptions serverOptions;
+			serverOptions.cipher = std::make_shared<AesGcmCipher>(std::make_shared<LoggerStub>(), "shared secret");
+
+			auto sender = std::make_shared<MockSender>();
+			auto client = std::make_shared<DataTransferClient>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), std::make_shared<MockReader>(), sender, clientOptions);
+			Assert::AreEqual((size_t)3, sender->sendData.size());
+			TransactionUnit end(std::vector<char>(sender->sendData.back().begin(), sender->sendData.back().end()));
+
+			// A forged final acknowledgement, and retransmit request, are not taken
+			TransactionUnit forged;
+			forged.transactionid = end.transactionid;
+			forged.messagetype = MsgType_Ack;
+			forged.sequencenum = end.sequencenum;
+			forged.messagelength = 0;
+			std::vector<char> buffer;
+			forged.GetBlob(buffer);
+			sender->receiveCallback(buffer);
+
+			forged.messagetype = MsgType_RetransmitReq;
+			forged.sequencenum = 0;
+			forged.GetBlob(buffer);
+			sender->receiveCallback(buffer);
+
+			Assert::IsTrue(client->GetCompletion().wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+			Assert::AreEqual((size_t)1, client->GetUnacknowledgedCount());
+			Assert::AreEqual((size_t)3, sender->sendData.size());
+
+			// The server's sealed acknowledgement is
+			auto upstream = std::make_shared<MockSender>();
+			auto writerFactory = std::make_shared<MockWriterFactory>();
+			auto server = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), std::make_shared<WorkerThreadPool>(), upstream, writerFactory, serverOptions);
+			for (auto& message : sender->sendData)
+			{
+				upstream->receiveCallback(std::vector<char>(message.begin(), message.end()));
+			}
+			Assert::AreEqual(std::string("Test Data 12345"), writerFactory->writer->data);
+
+			Assert::IsFalse(upstream->sendData.empty());
+			auto& ack = upstream->sendData.back();
+			sender->receiveCallback(std::vector<char>(ack.begin(), ack.end()));
+			Assert::IsTrue(client->GetCompletion().wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+			Assert::IsTrue(client->GetCompletion().get());
+			Assert::AreEqual((size_t)0, client->GetUnacknowledgedCount());
+
+			// Through the cookie handshake, alone and in a session, everything the server sends has to open
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(1);
+			auto clientEnd = std::make_shared<DelayedWire>(threadPool, 1);
+			auto serverEnd = std::make_shared<DelayedWire>(threadPool, 1);
+			clientEnd->peer = serverEnd;
+			serverEnd->peer = clientEnd;
+
+			serverOptions.requireCookie = true;
+			auto factory = std::make_shared<MockWriterFactory>();
+			auto cookieServer = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, serverEnd, factory, serverOptions);
+
+			clientOptions.cookieHandshake = true;
+			auto handshaken = std::make_unique<DataTransferClient>(std::make_shared<LoggerStub>(), threadPool, std::make_shared<MockReader>(), clientEnd, clientOptions);
+			auto completion = handshaken->GetCompletion();
+			Assert::IsTrue(completion.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+			Assert::IsTrue(completion.get());
+
+			TransferSessionOptions sessionOptions;
+			sessionOptions.cipher = clientOptions.cipher;
+			auto session = std::make_shared<TransferSession>(std::make_shared<LoggerStub>(), threadPool, clientEnd, sessionOptions);
+			Assert::IsTrue(session->Open());
+
+			std::vector<std::shared_future<bool>> done;
+			for (int i = 0; i < 3; i++)
+			{
+				done.push_back(session->Send(std::make_shared<MockReader>()));
+			}
+			for (auto& file : done)
+			{
+				Assert::IsTrue(file.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+				Assert::IsTrue(file.get());
+			}
+
+			Assert::AreEqual((size_t)4, factory->writers.size());
+			for (auto& writer : factory->writers)
+			{
+				Assert::AreEqual(std::string("Test Data 12345"), writer->data);
+			}
+
+			session.reset();
+			for (int i = 0; i < 100 && cookieServer->GetSessionCount(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			Assert::AreEqual((size_t)0, cookieServer->GetSessionCount());
+		}
+
+		TEST_METHOD(TransferSession_SmallFilesWithoutHandshakes)
+		{
+			// 5ms each way to a server that puts every transaction through the cookie handshake.  One pool thread keeps
+			// the wire in order, a unit overtaking its start would be dropped by the server
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(1);
+			auto clientEnd = std::make_shared<DelayedWire>(threadPool, 5);
+			auto serverEnd = std::make_shared<DelayedWire>(threadPool, 5);
+			clientEnd->peer = serverEnd;
+			serverEnd->peer = clientEnd;
+
+			DataTransferServerOptions options;
+			options.requireCookie = true;
+			auto factory = std::make_shared<MockWriterFactory>();
+			auto server = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, serverEnd, factory, options);
+
+			const size_t files = 20;
+			auto makeReader = [](size_t i)
+			{
+				auto reader = std::make_shared<MockReader>();
+				reader->source = "small" + std::to_string(i);
+				reader->data = std::string(100, (char)('a' + i));
+				return reader;
+			};
+
+			// One transaction per file, each with a handshake of its own.  Clients are kept until the end, the last
+			// acknowledgement is still being handled by a client as it completes
+			DataTransferClientOptions clientOptions;
+			clientOptions.cookieHandshake = true;
+			std::vector<std::unique_ptr<DataTransferClient>> clients;
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < files; i++)
+			{
+				clients.push_back(std::make_unique<DataTransferClient>(std::make_shared<LoggerStub>(), threadPool, makeReader(i), clientEnd, clientOptions));
+				auto completion = clients.back()->GetCompletion();
+				Assert::IsTrue(completion.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+				Assert::IsTrue(completion.get());
+			}
+			auto perTransaction = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+			Assert::AreEqual(files, serverEnd->challenges.load());
+			Assert::AreEqual(files, clientEnd->cookieEchoes.load());
+
+			// The same files one after another in a session, which does the handshake once
+			auto session = std::make_shared<TransferSession>(std::make_shared<LoggerStub>(), threadPool, clientEnd);
+			start = std::chrono::steady_clock::now();
+			Assert::IsTrue(session->Open());
+			for (size_t i = 0; i < files; i++)
+			{
+				auto done = session->Send(makeReader(i));
+				Assert::IsTrue(done.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+				Assert::IsTrue(done.get());
+			}
+			auto perSession = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+			// The one handshake is for opening the session, none for the files in it
+			Assert::AreEqual(files + 1, serverEnd->challenges.load());
+			Assert::AreEqual(files + 1, clientEnd->cookieEchoes.load());
+
+			// And all at once, the server acknowledging them together
+			auto serverSent = serverEnd->sent.load();
+			start = std::chrono::steady_clock::now();
+			std::vector<std::shared_future<bool>> done;
+			for (size_t i = 0; i < files; i++)
+			{
+				done.push_back(session->Send(makeReader(i)));
+			}
+			for (auto& file : done)
+			{
+				Assert::IsTrue(file.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+				Assert::IsTrue(file.get());
+			}
+			auto concurrent = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+			auto acks = serverEnd->sent.load() - serverSent;
+
+			Assert::AreEqual(files + 1, serverEnd->challenges.load());
+
+			std::ostringstream report;
+			report << files << " files, one transaction each " << perTransaction << "ms, in a session " << perSession << "ms, at once "
+			       << concurrent << "ms with " << acks << " acknowledgements" << std::endl;
+			Logger::WriteMessage(report.str().c_str());
+
+			// Fewer acknowledgements than files
+			Assert::IsTrue(acks < files);
+			Assert::IsTrue(session->GetRoundTrip().samples > 0);
+			Assert::AreEqual((size_t)1, server->GetSessionCount());
+
+			// Every file written whole, three times over
+			Assert::AreEqual(3 * files, factory->writers.size());
+			for (auto& writer : factory->writers)
+			{
+				auto i = std::stoul(writer->destination.substr(5));
+				Assert::IsTrue(std::string(100, (char)('a' + i)) == writer->data);
+			}
+
+			// Closing the session tells the server
+			session.reset();
+			for (int i = 0; i < 100 && server->GetSessionCount(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			Assert::AreEqual((size_t)0, server->GetSessionCount());
+		}
+
+		TEST_METHOD(TransferSession_FreesFailedStreams)
+		{
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(2);
+			auto clientEnd = std::make_shared<DelayedWire>(threadPool, 1);
+			auto serverEnd = std::make_shared<DelayedWire>(threadPool, 1);
+			clientEnd->peer = serverEnd;
+			serverEnd->peer = clientEnd;
+
+			auto factory = std::make_shared<MockWriterFactory>();
+			auto server = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, serverEnd, factory);
+
+			TransferSessionOptions options;
+			options.maxStreams = 1;
+			auto session = std::make_shared<TransferSession>(std::make_shared<LoggerStub>(), threadPool, clientEnd, options);
+			Assert::IsTrue(session->Open());
+
+			// The failed file sends nothing, so nothing comes back for it.  Its stream is still freed for the next
+			auto failed = session->Send(std::make_shared<MockMissingReader>());
+			auto next = session->Send(std::make_shared<MockReader>());
+			Assert::IsTrue(failed.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+			Assert::IsFalse(failed.get());
+			Assert::IsTrue(next.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+			Assert::IsTrue(next.get());
+			Assert::AreEqual(std::string("Test Data 12345"), factory->writer->data);
+
+			for (int i = 0; i < 100 && session->GetStreamCount(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			Assert::AreEqual((size_t)0, session->GetStreamCount());
+		}
+
+		TEST_METHOD(PacketReplayer_ReplaysRecordedTransfer)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "FileTransferCS_replay_test";
+			std::filesystem::remove_all(directory);
+			std::filesystem::create_directories(directory);
+			auto capture = (directory / "capture.bin").string();
+
+			std::string content;
+			for (int i = 0; i < 0x10000; i++) content.push_back((char)(i * 11 + i / 257));
+			std::ofstream((directory / "source.bin").string(), std::ios::binary) << content;
+
+			// Record a transfer as the server sees it
+			auto threadPool = std::make_shared<WorkerThreadPool>();
+			threadPool->SetThreadCount(2);
+
+			uint64_t recorded;
+			{
+				auto clientEnd = std::make_shared<DelayedWire>(threadPool, 1);
+				auto serverEnd = std::make_shared<DelayedWire>(threadPool, 1);
+				clientEnd->peer = serverEnd;
+				serverEnd->peer = clientEnd;
+
+				auto recorder = std::make_shared<RecordingSenderReceiver>(serverEnd, capture);
+				auto server = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, recorder, std::make_shared<MockWriterFactory>());
+				auto reader = std::make_shared<CachedFileReader>(std::make_shared<BlockCache>(std::make_shared<LoggerStub>()), (directory / "source.bin").string(), "replayed.bin");
+				DataTransferClient client(std::make_shared<LoggerStub>(), threadPool, reader, clientEnd);
+
+				auto completion = client.GetCompletion();
+				Assert::IsTrue(completion.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+				Assert::IsTrue(completion.get());
+
+				// The capture is complete once the recorder goes, after the server
+				server.reset();
+				recorded = recorder->GetRecordCount();
+			}
+
+			// Played back as fast as a fresh server takes it, the server writes the same file and answers the same way
+			PacketReplayer replayer(std::make_shared<LoggerStub>(), capture);
+			Assert::AreEqual((size_t)recorded, replayer.GetRecordCount());
+
+			auto factory = std::make_shared<MockWriterFactory>();
+			auto fast = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, std::shared_ptr<ISenderReceiver>(&replayer, [](ISenderReceiver*) {}), factory);
+			auto stats = replayer.Replay(*fast, 0);
+
+			Assert::AreEqual(recorded, stats.datagrams + stats.recordedReplies);
+			Assert::IsTrue(stats.datagrams > 512);
+			Assert::AreEqual(stats.recordedReplies, stats.replies);
+			Assert::AreEqual(std::string("replayed.bin"), factory->writer->destination);
+			Assert::IsTrue(content == factory->writer->data);
+			std::ostringstream report;
+			report << stats.datagrams << " datagrams replayed in " << stats.elapsedUs << "us, " << stats.datagrams * 1000000 / (stats.elapsedUs + 1)
+			       << " datagrams/s, recorded over " << stats.recordedUs << "us, working set grew " << stats.workingSetBytes << " bytes" << std::endl;
+			Logger::WriteMessage(report.str().c_str());
+
+			// And at twice the recorded speed
+			fast.reset();
+			auto timed = std::make_shared<DataTransferServer>(std::make_shared<LoggerStub>(), threadPool, std::shared_ptr<ISenderReceiver>(&replayer, [](ISenderReceiver*) {}), factory);
+			stats = replayer.Replay(*timed, 2);
+			Assert::IsTrue(content == factory->writer->data);
+			Assert::IsTrue(stats.elapsedUs + 5000 >= stats.recordedUs / 2);
+
+			timed.reset();
+
+			// The build calling the replayer, file writer and logger directly answers the same way and writes the same file
+			auto direct = std::make_shared<ReplayFileServer>(std::make_shared<SimpleLogger>(5), threadPool, std::shared_ptr<PacketReplayer>(&replayer, [](PacketReplayer*) {}),
+			                                                 std::make_shared<FileWriterFactory>());
+			auto transfer = direct->NextTransfer();
+			stats = replayer.Replay(*direct, 0);
+			Assert::AreEqual(stats.recordedReplies, stats.replies);
+			auto destination = transfer.get().destination;
+			direct.reset();
+
+			std::ifstream f(destination, std::ios::binary);
+			std::string written((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+			f.close();
+			Assert::IsTrue(content == written);
+			std::filesystem::remove(destination);
+			std::filesystem::remove_all(directory);
+		}
 	};
 }
@@ -2,9 +2,32 @@
 #include "CppUnitTest.h"
 
 #include <iostream>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <set>
+#include <filesystem>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
 
 #include "..\FileTransferCS\FileReader.h"
 #include "..\FileTransferCS\FileWriter.h"
+#include "..\FileTransferCS\TailFileReader.h"
+#include "..\FileTransferCS\AesGcmCipher.h"
+#include "..\FileTransferCS\RetransmitStore.h"
+#include "..\FileTransferCS\TransactionManager.h"
+#include "..\FileTransferCS\TransactionTable.h"
+#include "..\FileTransferCS\BandwidthScheduler.h"
+#include "..\FileTransferCS\ContentChunker.h"
+#include "..\FileTransferCS\ChunkStore.h"
+#include "..\FileTransferCS\BlockCache.h"
+#include "..\FileTransferCS\CachedFileReader.h"
+#include "..\FileTransferCS\WorkerThreadPool.h"
+#include "..\FileTransferCS\SocketReactor.h"
+#include "..\FileTransferCS\PacketTracer.h"
+#include "..\FileTransferCS\DelayEstimator.h"
 #include "..\FileTransferCS\ILogger.h"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
@@ -41,6 +64,111 @@ namespace UnitTest1
 			Assert::AreEqual(sbuf, s);
 		}
 
+		TEST_METHOD(FileReader_Read_MultiChunkFile)
+		{
+			// Larger than one prefetch chunk so the reader has to swap buffers part way through
+			std::string s;
+			for (int i = 0; s.size() < 0x100000 + 300; i++)
+			{
+				s += std::to_string(i) + ",";
+			}
+
+			std::string tempName = std::tmpnam(nullptr);
+			std::ofstream f(tempName, std::ios::binary);
+			f << s;
+			f.close();
+
+			auto p = std::make_shared<FileReader>(std::make_shared<LoggerStub>());
+			p->SetFile(tempName);
+
+			std::string sRead;
+			std::vector<char> buf;
+			while (p->Read(buf))
+			{
+				Assert::IsTrue(buf.size() <= 128);
+				sRead.append(buf.begin(), buf.end());
+			}
+
+			Assert::AreEqual(sRead, s);
+		}
+
+		TEST_METHOD(FileReader_ReadZeros_RoundTrip)
+		{
+			// Data, a run of zeros long enough to become a hole, then data again
+			std::string s = "Test file 12345";
+			std::string zeros(0x20000 + 100, '\0');
+			std::string tempName = std::tmpnam(nullptr);
+			std::ofstream f(tempName, std::ios::binary);
+			f << s << zeros << s;
+			f.close();
+
+			auto reader = std::make_shared<FileReader>(std::make_shared<LoggerStub>());
+			reader->SetFile(tempName);
+
+			// The writer puts its output under the Received directory
+			auto writer = std::make_shared<FileWriter>(std::make_shared<LoggerStub>());
+			writer->SetDestination("ReadZeros_RoundTrip.bin");
+
+			uint64_t zeroBytes = 0;
+			std::vector<char> buf;
+			while (1)
+			{
+				auto count = reader->ReadZeros(0x40000000);
+				if (count)
+				{
+					zeroBytes += count;
+					writer->WriteZeros(count);
+					continue;
+				}
+
+				if (!reader->Read(buf)) break;
+				writer->Write(std::string(buf.begin(), buf.end()));
+			}
+			auto destination = writer->GetDestination();
+			writer.reset();
+
+			// Only whole zero blocks are skipped, the zeros sharing a block with data are read as data
+			Assert::IsTrue(zeroBytes >= zeros.size() - 256);
+
+			std::ifstream written(destination, std::ios::binary);
+			std::string sWritten((std::istreambuf_iterator<char>(written)), std::istreambuf_iterator<char>());
+			Assert::IsTrue(sWritten == s + zeros + s);
+		}
+
+		TEST_METHOD(TailFileReader_FollowsAppends)
+		{
+			std::string tempName = std::tmpnam(nullptr);
+			std::ofstream f(tempName, std::ios::binary);
+			f << "Line 1\n";
+			f.flush();
+
+			auto p = std::make_shared<TailFileReader>(std::make_shared<LoggerStub>());
+			p->SetFile(tempName);
+
+			// What the file already holds comes out after the flush interval, as nothing more arrives
+			std::vector<char> buf;
+			Assert::AreEqual((uint32_t)7, p->Read(buf));
+			Assert::AreEqual(std::string("Line 1\n"), std::string(buf.begin(), buf.end()));
+
+			// An append made while Read() is waiting is picked up
+			std::thread writer([&]()
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				f << "Line 2\n";
+				f.flush();
+			});
+			Assert::AreEqual((uint32_t)7, p->Read(buf));
+			Assert::AreEqual(std::string("Line 2\n"), std::string(buf.begin(), buf.end()));
+			writer.join();
+
+			// Still readable for a retransmit
+			Assert::AreEqual((uint32_t)6, p->ReadAt(7, 6, buf));
+			Assert::AreEqual(std::string("Line 2"), std::string(buf.begin(), buf.end()));
+
+			p->Stop();
+			Assert::AreEqual((uint32_t)0, p->Read(buf));
+		}
+
 		TEST_METHOD(FileWriter_Write_SmallFile)
 		{
 			std::string sWriteData = "Test file 12345";
@@ -61,5 +189,764 @@ namespace UnitTest1
 			Assert::AreEqual(sbuf, sWriteData);
 		}
 
+		TEST_METHOD(FileWriter_CoalescesWrites)
+		{
+			// A 16 byte buffer, so the blocks below straddle its boundary
+			auto p = std::make_shared<FileWriter>(std::make_shared<LoggerStub>(), 16);
+			p->SetDestination("FileWriter_CoalescesWrites.bin");
+			std::string destination = p->GetDestination();
+
+			// Held until the buffer fills, then written together
+			p->Write("0123456789");
+			Assert::AreEqual((uintmax_t)0, std::filesystem::file_size(destination));
+			p->Write("abcdefghij");
+			Assert::AreEqual((uintmax_t)20, std::filesystem::file_size(destination));
+
+			// The remainder waits for the flush
+			p->Write("ABCDE");
+			Assert::AreEqual((uintmax_t)20, std::filesystem::file_size(destination));
+			p->Flush();
+			Assert::AreEqual((uintmax_t)25, std::filesystem::file_size(destination));
+
+			// A block the size of the buffer goes straight to disk when nothing is held
+			p->Write("klmnopqrstuvwxyz");
+			Assert::AreEqual((uintmax_t)41, std::filesystem::file_size(destination));
+			p.reset();
+
+			std::ifstream f(destination, std::ios::binary);
+			std::string written((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+			f.close();
+			Assert::AreEqual(std::string("0123456789abcdefghijABCDEklmnopqrstuvwxyz"), written);
+			std::filesystem::remove(destination);
+		}
+
+		TEST_METHOD(AesGcmCipher_SealOpen)
+		{
+			auto client = std::make_shared<AesGcmCipher>(std::make_shared<LoggerStub>(), "shared secret");
+			auto server = std::make_shared<AesGcmCipher>(std::make_shared<LoggerStub>(), "shared secret");
+
+			std::string sPlain = "Test file 12345";
+
+			TransactionUnit start;
+			start.transactionid = 42;
+			start.messagetype = MsgType_StartSecureTransaction;
+			start.sequencenum = 0;
+			start.messagedata.assign(sPlain.begin(), sPlain.end());
+
+			std::vector<char> handshake;
+			client->BeginTransaction(start.transactionid, handshake);
+			client->Seal(start);
+			Assert::IsTrue(std::string(start.messagedata.begin(), start.messagedata.end()) != sPlain);
+
+			Assert::IsTrue(server->AcceptTransaction(handshake, start));
+			Assert::AreEqual(std::string(start.messagedata.begin(), start.messagedata.end()), sPlain);
+
+			TransactionUnit data;
+			data.transactionid = 42;
+			data.messagetype = MsgType_Data;
+			data.sequencenum = 7;
+			data.messagedata.assign(sPlain.begin(), sPlain.end());
+			client->Seal(data);
+
+			// A unit replayed under another sequence number must not open
+			TransactionUnit moved = data;
+			moved.sequencenum = 8;
+			Assert::IsFalse(server->Open(moved));
+
+			TransactionUnit tampered = data;
+			tampered.messagedata[0] ^= 1;
+			Assert::IsFalse(server->Open(tampered));
+
+			// Nor one whose timestamps were rewritten to skew the delays measured from them
+			TransactionUnit delayed = data;
+			delayed.timestamp -= 1000;
+			Assert::IsFalse(server->Open(delayed));
+			TransactionUnit echoed = data;
+			echoed.echoTimestamp = 1;
+			Assert::IsFalse(server->Open(echoed));
+
+			// Formatting for the wire keeps the stamp made when sealing
+			std::vector<char> blob;
+			TransactionUnit(data).GetBlob(blob);
+			TransactionUnit received(blob);
+			Assert::IsTrue(server->Open(received));
+
+			// Sealed again, as for a retransmission, the unit goes out under another nonce
+			TransactionUnit resealed;
+			resealed.transactionid = 42;
+			resealed.messagetype = MsgType_Data;
+			resealed.sequencenum = 7;
+			resealed.messagedata.assign(sPlain.begin(), sPlain.end());
+			client->Seal(resealed);
+			Assert::IsTrue(resealed.messagedata != data.messagedata);
+
+			Assert::IsTrue(server->Open(data));
+			Assert::AreEqual(std::string(data.messagedata.begin(), data.messagedata.end()), sPlain);
+			Assert::IsTrue(server->Open(resealed));
+			Assert::AreEqual(std::string(resealed.messagedata.begin(), resealed.messagedata.end()), sPlain);
+		}
+
+		TEST_METHOD(RetransmitStore_ReleaseOnAck)
+		{
+			RetransmitStore store;
+			for (uint32_t i = 0; i < 10; i++)
+			{
+				store.Add(i, i * 128, 128);
+			}
+
+			uint64_t offset = 0;
+			uint32_t length = 0;
+			Assert::IsTrue(store.Find(3, offset, length));
+			Assert::AreEqual((uint64_t)384, offset);
+			Assert::AreEqual((uint32_t)128, length);
+
+			// Acknowledging 5 releases 0-4 only
+			store.Release(5);
+			Assert::AreEqual((size_t)5, store.GetCount());
+			Assert::IsFalse(store.Find(3, offset, length));
+			Assert::IsTrue(store.Find(5, offset, length));
+			Assert::AreEqual((uint64_t)640, offset);
+
+			store.Release(10);
+			Assert::AreEqual((size_t)0, store.GetCount());
+			Assert::IsFalse(store.Find(9, offset, length));
+		}
+
+		TEST_METHOD(RetransmitStore_KeepsDataInWindow)
+		{
+			// Room for the data of three blocks
+			RetransmitStore store(3 * 128);
+			std::vector<char> block(128);
+			for (uint32_t i = 0; i < 5; i++)
+			{
+				std::fill(block.begin(), block.end(), (char)i);
+				store.Add(i, i * 128, block.data(), (uint32_t)block.size());
+			}
+
+			// The oldest two have had their data dropped, the rest can still be resent
+			std::vector<char> data;
+			Assert::AreEqual((size_t)3 * 128, store.GetDataBytes());
+			Assert::IsFalse(store.FindData(1, data));
+			Assert::IsTrue(store.FindData(2, data));
+			Assert::AreEqual((size_t)128, data.size());
+			Assert::AreEqual((char)2, data[0]);
+
+			store.Release(4);
+			Assert::AreEqual((size_t)128, store.GetDataBytes());
+			Assert::IsFalse(store.FindData(3, data));
+			Assert::IsTrue(store.FindData(4, data));
+			Assert::AreEqual((char)4, data[127]);
+
+			// Appended after a release, nothing more is dropped while within the limit
+			store.Add(5, 5 * 128, block.data(), (uint32_t)block.size());
+			Assert::IsTrue(store.FindData(4, data));
+			Assert::AreEqual((size_t)2 * 128, store.GetDataBytes());
+		}
+
+		TEST_METHOD(TransactionManager_SpillsBeyondBudget)
+		{
+			// Room for roughly two early units per transaction
+			TransactionManager manager(600, 0x100000);
+
+			// Deliver in reverse so everything but the last unit arrives early
+			for (int i = 9; i >= 0; i--)
+			{
+				auto tu = std::make_shared<TransactionUnit>();
+				tu->transactionid = 7;
+				tu->messagetype = MsgType_Data;
+				tu->sequencenum = i;
+				tu->messagedata.assign(128, (char)('a' + i));
+				tu->messagelength = 128;
+				manager.Add(tu);
+			}
+
+			auto stats = manager.GetStats();
+			Assert::IsTrue(stats.spillCount > 0);
+			Assert::IsTrue(stats.bufferedBytes <= 600 + 256);
+
+			for (int i = 0; i < 10; i++)
+			{
+				auto tu = manager.Collect(7);
+				Assert::IsTrue((bool)tu);
+				Assert::AreEqual((uint32_t)i, tu->sequencenum);
+				Assert::AreEqual((char)('a' + i), tu->messagedata[0]);
+				Assert::AreEqual((size_t)128, tu->messagedata.size());
+			}
+			Assert::IsFalse((bool)manager.Collect(7));
+
+			stats = manager.GetStats();
+			Assert::AreEqual((uint64_t)0, stats.bufferedBytes);
+			Assert::AreEqual((uint64_t)0, stats.spilledBytes);
+		}
+
+		TEST_METHOD(TransactionManager_ReusesSpillSpace)
+		{
+			// Nothing is held in memory, and the scratch file has room for four units
+			TransactionManager manager(0, 0, 4 * 128);
+			auto makeUnit = [](uint32_t transactionID, uint32_t sequence)
+			{
+				auto tu = std::make_shared<TransactionUnit>();
+				tu->transactionid = transactionID;
+				tu->messagetype = MsgType_Data;
+				tu->sequencenum = sequence;
+				tu->timestamp = 1000 + sequence;
+				tu->echoTimestamp = 2000 + sequence;
+				tu->messagedata.assign(128, (char)sequence);
+				tu->messagelength = 128;
+				return tu;
+			};
+
+			// One transaction keeps a unit spilled throughout, while another spills and collects a thousand
+			manager.Add(makeUnit(1, 5));
+			for (uint32_t i = 0; i < 1000; i += 2)
+			{
+				manager.Add(makeUnit(2, i + 1));
+				manager.Add(makeUnit(2, i));
+				for (uint32_t sequence = i; sequence < i + 2; sequence++)
+				{
+					auto tu = manager.Collect(2);
+					Assert::IsTrue((bool)tu);
+					Assert::AreEqual(sequence, tu->sequencenum);
+					Assert::AreEqual((uint32_t)(1000 + sequence), tu->timestamp);
+					Assert::AreEqual((uint32_t)(2000 + sequence), tu->echoTimestamp);
+					Assert::AreEqual((char)sequence, tu->messagedata[0]);
+				}
+			}
+
+			auto stats = manager.GetStats();
+			Assert::AreEqual((uint64_t)0, stats.dropCount);
+			Assert::IsTrue(stats.spillFileBytes <= 4 * 128);
+			Assert::AreEqual((uint64_t)128, stats.spilledBytes);
+
+			manager.Remove(1);
+			Assert::AreEqual((uint64_t)0, manager.GetStats().spillFileBytes);
+		}
+
+		TEST_METHOD(TransactionTable_MillionIdleSessions)
+		{
+			// The state of an idle server side transaction, a writer and a counter
+			struct Session
+			{
+				std::shared_ptr<void> writer;
+				uint32_t unacknowledged;
+			};
+
+			const uint32_t count = 1000000;
+			TransactionTable<Session> table(count);
+
+			std::mt19937 mt(1);
+			std::vector<uint32_t> ids(count);
+			for (auto& id : ids)
+			{
+				do { id = mt(); } while (table.Find(id));
+				table.Insert(id, 0)->unacknowledged = id;
+			}
+
+			// Full, and within 96 bytes a session
+			uint32_t extra = 0;
+			while (table.Find(extra)) extra++;
+			Assert::IsTrue(table.Insert(extra, 0) == nullptr);
+			Assert::AreEqual((size_t)count, table.GetCount());
+			Assert::IsTrue(table.GetMemoryUsage() <= count * 96);
+
+			for (auto id : ids)
+			{
+				auto session = table.Find(id);
+				Assert::IsTrue(session && session->unacknowledged == id);
+			}
+
+			// Touch every other session, one turn of the clock hand drops only the rest
+			for (size_t i = 0; i < ids.size(); i += 2)
+			{
+				table.Touch(ids[i], 1000);
+			}
+
+			size_t expired = 0;
+			table.ExpireIdle(1000, 500, table.GetCapacity(), [&](uint32_t id, Session& session) { expired++; });
+			Assert::AreEqual((size_t)count / 2, expired);
+			Assert::AreEqual((size_t)count / 2, table.GetCount());
+
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				Assert::AreEqual(i % 2 == 0, table.Find(ids[i]) != nullptr);
+			}
+		}
+
+		TEST_METHOD(WorkerThreadPool_NodeGroupsAndStrands)
+		{
+			WorkerThreadPool pool;
+			pool.SetTopology(NumaTopology::Emulate(2), true);
+			pool.SetThreadCount(4);
+			Assert::AreEqual(2, pool.GetNodeCount());
+
+			// Tasks posted to a node only run on its threads
+			std::atomic<int> misplaced(0), done(0);
+			for (int i = 0; i < 1000; i++)
+			{
+				pool.PostToNode([&, i]() { if (WorkerThreadPool::GetCurrentNode() != i % 2) misplaced++; done++; }, i % 2);
+			}
+
+			// A strand runs its tasks in order, one at a time, even with two threads on its node
+			int strand;
+			pool.CreateStrand(strand);
+
+			std::vector<int> order;
+			std::atomic<int> running(0), overlapped(0);
+			for (int i = 0; i < 1000; i++)
+			{
+				pool.Post([&, i]()
+				{
+					if (running++ > 0) overlapped++;
+					order.push_back(i);
+					running--;
+					done++;
+				}, strand);
+			}
+
+			while (done < 2000) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			Assert::AreEqual(0, (int)misplaced);
+			Assert::AreEqual(0, (int)overlapped);
+			for (int i = 0; i < 1000; i++)
+			{
+				Assert::AreEqual(i, order[i]);
+			}
+			pool.DestroyStrand(strand);
+		}
+
+		static void MeasureTaskLatency(WorkerThreadPool& pool, int gapMicroseconds, double& median, double& p99)
+		{
+			// Time from posting each task to it starting, with the tasks posted gap apart
+			const int tasks = 200;
+			std::vector<double> latency(tasks);
+			std::atomic<int> done(0);
+
+			for (int i = 0; i < tasks; i++)
+			{
+				auto posted = std::chrono::steady_clock::now();
+				pool.Post([&, i, posted]()
+				{
+					latency[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - posted).count();
+					done++;
+				});
+				if (gapMicroseconds > 0) std::this_thread::sleep_for(std::chrono::microseconds(gapMicroseconds));
+			}
+			while (done < tasks) std::this_thread::yield();
+
+			std::sort(latency.begin(), latency.end());
+			median = latency[tasks / 2];
+			p99 = latency[tasks * 99 / 100];
+		}
+
+		TEST_METHOD(WorkerThreadPool_ElasticLatency)
+		{
+			WorkerThreadPool pool;
+			pool.SetThreadCount(4);
+			pool.SetIdleTimeout(50);
+
+			// Saturated, steady and sparse load.  The figures are printed to compare builds and machines
+			for (int gap : { 0, 20, 1000 })
+			{
+				double median, p99;
+				MeasureTaskLatency(pool, gap, median, p99);
+				std::ostringstream report;
+				report << "Tasks " << gap << "us apart: latency median " << median << "us, p99 " << p99 << "us, "
+					<< pool.GetThreadCount() << " threads" << std::endl;
+				Logger::WriteMessage(report.str().c_str());
+			}
+
+			// Idle threads retire, so an idle pool holds no threads and uses no CPU
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+			Assert::AreEqual((size_t)0, pool.GetThreadCount());
+
+			// Work brings them back
+			std::atomic<bool> ran(false);
+			pool.Post([&]() { ran = true; });
+			while (!ran) std::this_thread::yield();
+			Assert::IsTrue(pool.GetThreadCount() > 0);
+
+			// A batch is taken by as many threads as it needs
+			std::atomic<int> done(0);
+			std::vector<std::function<void()>> batch;
+			for (int i = 0; i < 100; i++)
+			{
+				batch.push_back([&]() { done++; });
+			}
+			pool.PostBatch(batch, 0);
+			while (done < 100) std::this_thread::yield();
+			Assert::IsTrue(pool.GetThreadCount() <= 4);
+		}
+
+		// A non-blocking UDP socket bound to a loopback port of its own
+		static SOCKET OpenLoopbackSocket(sockaddr_in& address)
+		{
+			SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+			address.sin_family = AF_INET;
+			address.sin_port = 0;
+			inet_pton(AF_INET, "127.0.0.1", (void*)&address.sin_addr.s_addr);
+
+			int length = sizeof(address);
+			bind(s, (sockaddr*)&address, sizeof(address));
+			getsockname(s, (sockaddr*)&address, &length);
+
+			u_long nonBlocking = 1;
+			ioctlsocket(s, FIONBIO, &nonBlocking);
+			return s;
+		}
+
+		TEST_METHOD(SocketReactor_UnregisterAndStopAreImmediate)
+		{
+			SocketReactor reactor(std::make_shared<LoggerStub>());
+
+			sockaddr_in address;
+			SOCKET s = OpenLoopbackSocket(address);
+			std::atomic<int> received(0);
+			Assert::IsTrue(reactor.Register(s, [&]()
+			{
+				char buffer[16];
+				while (recv(s, buffer, sizeof(buffer), 0) > 0) received++;
+			}));
+
+			char c = 0;
+			sendto(s, &c, sizeof(c), 0, (sockaddr*)&address, sizeof(address));
+			for (int i = 0; i < 500 && received == 0; i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			Assert::AreEqual(1, (int)received);
+
+			// Once unregistered the handler is not called again, though data keeps arriving
+			reactor.Unregister(s);
+			sendto(s, &c, sizeof(c), 0, (sockaddr*)&address, sizeof(address));
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			Assert::AreEqual(1, (int)received);
+			Assert::AreEqual((size_t)0, reactor.GetSocketCount());
+
+			// An idle reactor is woken to stop, there is no polling interval to wait out
+			auto stopped = std::async(std::launch::async, [&]() { reactor.Stop(); });
+			Assert::IsTrue(stopped.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+			closesocket(s);
+		}
+
+		TEST_METHOD(SocketReactor_RefusesSocketsBeyondSelect)
+		{
+			SocketReactor reactor(std::make_shared<LoggerStub>());
+
+			// select() takes FD_SETSIZE sockets, the reactor's wake socket is one
+			std::vector<SOCKET> sockets;
+			for (size_t i = 0; i < FD_SETSIZE; i++)
+			{
+				sockaddr_in address;
+				sockets.push_back(OpenLoopbackSocket(address));
+			}
+			for (size_t i = 0; i + 1 < sockets.size(); i++)
+			{
+				Assert::IsTrue(reactor.Register(sockets[i], []() {}));
+			}
+			Assert::IsFalse(reactor.Register(sockets.back(), []() {}));
+			Assert::AreEqual((size_t)FD_SETSIZE - 1, reactor.GetSocketCount());
+
+			// Room again once one goes
+			reactor.Unregister(sockets.front());
+			Assert::IsTrue(reactor.Register(sockets.back(), []() {}));
+
+			for (auto s : sockets)
+			{
+				reactor.Unregister(s);
+				closesocket(s);
+			}
+		}
+
+		TEST_METHOD(WorkerThreadPool_TimersFireWhileIdle)
+		{
+			// A reactor waiting on a quiet socket, and a pool with nothing posted to it
+			SocketReactor reactor(std::make_shared<LoggerStub>());
+			sockaddr_in address;
+			SOCKET s = OpenLoopbackSocket(address);
+			reactor.Register(s, []() {});
+
+			WorkerThreadPool pool;
+			pool.SetThreadCount(1);
+
+			// A later timer is started first, the earlier ones still wake the thread waiting on it.  Timers started
+			// with the same delay each fire
+			std::atomic<int> fired(0);
+			std::atomic<bool> late(false);
+			pool.StartTimer(60000, [&]() { late = true; });
+			for (int i = 0; i < 3; i++)
+			{
+				pool.StartTimer(10, [&]() { fired++; });
+			}
+
+			for (int i = 0; i < 500 && fired < 3; i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			Assert::AreEqual(3, (int)fired);
+			Assert::IsFalse(late);
+
+			pool.Stop();
+			reactor.Unregister(s);
+			closesocket(s);
+		}
+
+		TEST_METHOD(PacketTracer_SamplesAndExports)
+		{
+			// Every fourth sequence, up to 10 spans a thread
+			PacketTracer tracer(4, 10);
+			Assert::IsTrue(tracer.IsSampled(8));
+			Assert::IsFalse(tracer.IsSampled(9));
+
+			auto record = [&](uint32_t transactionID)
+			{
+				for (uint32_t sequence = 0; sequence < 48; sequence++)
+				{
+					TraceSpan span(&tracer, TraceStage_Written, transactionID, sequence);
+				}
+			};
+
+			// Two threads, each records 12 sampled spans into a buffer of its own and drops 2
+			std::thread first([&]() { record(1); });
+			std::thread second([&]() { record(2); });
+			first.join();
+			second.join();
+			Assert::AreEqual((uint64_t)4, tracer.GetDroppedCount());
+
+			std::stringstream ss;
+			tracer.Export(ss);
+			auto json = ss.str();
+
+			size_t spans = 0;
+			for (auto pos = json.find("\"ph\":\"X\""); pos != std::string::npos; pos = json.find("\"ph\":\"X\"", pos + 1)) spans++;
+			Assert::AreEqual((size_t)20, spans);
+			Assert::IsTrue(json.find("\"name\":\"written\"") != std::string::npos);
+			Assert::IsTrue(json.find("\"transaction\":2,\"sequence\":36") != std::string::npos);
+			Assert::IsTrue(json.find("\"sequence\":40") == std::string::npos);
+			Assert::IsTrue(json.find("\"traceEvents\"") == 1);
+		}
+
+		TEST_METHOD(DelayEstimator_TracksDelayAndJitter)
+		{
+			// 20ms with up to 2ms either way, a mean deviation of 1ms
+			std::mt19937 generator(7);
+			std::uniform_int_distribution<int> jitter(-2000, 2000);
+
+			DelayEstimator estimator;
+			for (int i = 0; i < 1000; i++) estimator.AddSample(20000 + jitter(generator));
+
+			auto stats = estimator.GetStats();
+			Assert::AreEqual((uint64_t)1000, stats.samples);
+			Assert::IsTrue(stats.smoothedUs > 18500 && stats.smoothedUs < 21500);
+			Assert::IsTrue(stats.variationUs > 200 && stats.variationUs < 2000);
+			Assert::IsTrue(stats.minimumUs >= 18000);
+
+			// The path gets longer, the smoothed delay follows within a few dozen samples
+			for (int i = 0; i < 50; i++) estimator.AddSample(40000 + jitter(generator));
+			stats = estimator.GetStats();
+			Assert::IsTrue(stats.smoothedUs > 38000 && stats.smoothedUs < 42000);
+			Assert::IsTrue(stats.minimumUs < 20000);
+		}
+
+		TEST_METHOD(BandwidthScheduler_PacesAndWeights)
+		{
+			// Time stands still until the test moves it on
+			auto epoch = BandwidthScheduler::Clock::now();
+			std::atomic<int64_t> elapsedUs(0);
+			auto now = [&]() { return epoch + std::chrono::microseconds(elapsedUs.load()); };
+
+			// 100 KB/s with a 1 KB burst: the burst goes at once, the send after it leaves the bucket 1 KB in debt
+			BandwidthScheduler paced(100000, 1000, now);
+			int flow = paced.AddFlow(1);
+			Assert::IsTrue(paced.Acquire(flow, 1000));
+			Assert::IsTrue(paced.Acquire(flow, 1000));
+
+			// The next waits until 10ms have passed
+			auto next = std::async(std::launch::async, [&]() { return paced.Acquire(flow, 1000); });
+			Assert::IsTrue(next.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout);
+			elapsedUs += 10000;
+			Assert::IsTrue(next.get());
+
+			// Another flow's sends leave the shared link in debt while flows weighted 3:1 queue six sends and two
+			BandwidthScheduler shared(100000, 1000, now);
+			int other = shared.AddFlow(1);
+			int heavy = shared.AddFlow(3);
+			int light = shared.AddFlow(1);
+			Assert::IsTrue(shared.Acquire(other, 1000));
+			Assert::IsTrue(shared.Acquire(other, 1000));
+
+			// Light sends are a little larger, so no two finish at the same virtual time and arrival doesn't matter
+			std::mutex guard;
+			std::string granted;
+			std::vector<std::thread> senders;
+			for (int i = 0; i < 8; i++)
+			{
+				bool isHeavy = i % 4 != 3;
+				senders.emplace_back([&, isHeavy]()
+				{
+					Assert::IsTrue(shared.Acquire(isHeavy ? heavy : light, isHeavy ? 1000 : 1100));
+					std::lock_guard<std::mutex> lock(guard);
+					granted += isHeavy ? 'H' : 'L';
+				});
+			}
+			for (int i = 0; i < 1000 && shared.GetWaitingCount() < 8; i++) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			Assert::AreEqual((size_t)8, shared.GetWaitingCount());
+
+			// Each step of time pays off one send and no more.  The heavy flow gets three turns to the light one's one
+			for (size_t i = 1; i <= 8; i++)
+			{
+				elapsedUs += 11000;
+				for (int wait = 0; wait < 1000; wait++)
+				{
+					{
+						std::lock_guard<std::mutex> lock(guard);
+						if (granted.size() >= i) break;
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+				std::lock_guard<std::mutex> lock(guard);
+				Assert::AreEqual(i, granted.size());
+			}
+			for (auto& sender : senders) sender.join();
+			Assert::AreEqual(std::string("HHHLHHHL"), granted);
+		}
+
+		TEST_METHOD(BandwidthScheduler_RemoveWhileWaiting)
+		{
+			// A flow capped at 1 KB/s is in debt for about a second after sending twice its burst
+			BandwidthScheduler scheduler(0);
+			int slow = scheduler.AddFlow(1, 1000, 1000);
+			int other = scheduler.AddFlow(1);
+			Assert::IsTrue(scheduler.Acquire(slow, 2000));
+
+			auto waiter = std::async(std::launch::async, [&]() { return scheduler.Acquire(slow, 1000); });
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+			// Removing it lets the waiter out without sending, and the other flow carries on
+			auto start = std::chrono::steady_clock::now();
+			scheduler.RemoveFlow(slow);
+			Assert::IsFalse(waiter.get());
+			Assert::IsTrue(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500));
+			Assert::IsFalse(scheduler.Acquire(slow, 1000));
+			Assert::IsTrue(scheduler.Acquire(other, 1000));
+		}
+
+		static std::vector<std::string> CutChunks(const std::vector<char>& data)
+		{
+			ContentChunker chunker;
+			std::vector<std::string> chunks;
+			for (size_t offset = 0; offset < data.size(); )
+			{
+				auto length = chunker.Cut(data.data() + offset, data.size() - offset);
+				chunks.emplace_back(data.data() + offset, length);
+				offset += length;
+			}
+			return chunks;
+		}
+
+		TEST_METHOD(ContentChunker_ResyncsAfterInsert)
+		{
+			std::mt19937 mt(1);
+			std::vector<char> data(0x100000);
+			for (auto& c : data) c = (char)mt();
+
+			auto original = CutChunks(data);
+			for (auto& chunk : original)
+			{
+				Assert::IsTrue(chunk.size() <= DefaultMaxChunkSize);
+			}
+
+			// One byte inserted near the front should only disturb the chunk it lands in
+			data.insert(data.begin() + 1000, 'x');
+			auto edited = CutChunks(data);
+
+			std::set<std::string> known(original.begin(), original.end());
+			size_t shared = 0;
+			for (auto& chunk : edited)
+			{
+				if (known.count(chunk)) shared++;
+			}
+			Assert::IsTrue(shared + 2 >= original.size());
+		}
+
+		TEST_METHOD(ChunkStore_PutGet)
+		{
+			auto directory = (std::filesystem::temp_directory_path() / "FileTransferCS_chunkstore_test").string();
+			std::filesystem::remove_all(directory);
+
+			ChunkStore store(std::make_shared<LoggerStub>(), directory);
+
+			std::string s = "Test chunk 12345";
+			std::vector<char> chunk(s.begin(), s.end());
+			auto fingerprint = ChunkStore::Fingerprint(chunk.data(), chunk.size());
+
+			std::vector<char> read;
+			Assert::IsFalse(store.Get(fingerprint, (uint32_t)chunk.size(), read));
+
+			store.Put(fingerprint, chunk);
+			Assert::IsTrue(store.Get(fingerprint, (uint32_t)chunk.size(), read));
+			Assert::AreEqual(s, std::string(read.begin(), read.end()));
+
+			// Still there for a new store over the same directory
+			ChunkStore reopened(std::make_shared<LoggerStub>(), directory);
+			Assert::IsTrue(reopened.Get(fingerprint, (uint32_t)chunk.size(), read));
+
+			auto stats = store.GetStats();
+			Assert::AreEqual((uint64_t)1, stats.hits);
+			Assert::AreEqual((uint64_t)1, stats.misses);
+
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(BlockCache_ReadsOnceAndEvicts)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "FileTransferCS_blockcache_test";
+			std::filesystem::remove_all(directory);
+			std::filesystem::create_directories(directory);
+			auto filename = (directory / "hot.bin").string();
+
+			// Sixteen 64KB blocks
+			std::string content;
+			for (int i = 0; i < 0x100000; i++) content.push_back((char)(i * 13 + i / 509));
+			std::ofstream(filename, std::ios::binary) << content;
+
+			// Eight readers at once, each block is read from disk by one of them
+			auto cache = std::make_shared<BlockCache>(std::make_shared<LoggerStub>(), 0x200000, 0x10000);
+			std::vector<std::thread> readers;
+			std::atomic<int> matched(0);
+			for (int i = 0; i < 8; i++)
+			{
+				readers.emplace_back([&]()
+				{
+					CachedFileReader reader(cache, filename, "hot.bin");
+					std::string read;
+					std::vector<char> block;
+					while (reader.Read(block)) read.append(block.begin(), block.end());
+					if (read == content) matched++;
+				});
+			}
+			for (auto& reader : readers) reader.join();
+			Assert::AreEqual(8, matched.load());
+
+			// The end of the file is one more block, found empty
+			auto stats = cache->GetStats();
+			Assert::AreEqual((uint64_t)17, stats.misses);
+			Assert::AreEqual((uint64_t)8 * 17 - 17, stats.hits);
+			Assert::AreEqual((uint64_t)content.size(), stats.bytesRead);
+
+			// Retransmissions read across block boundaries
+			CachedFileReader reader(cache, filename, "hot.bin");
+			std::vector<char> s;
+			Assert::AreEqual((uint32_t)200, reader.ReadAt(0x10000 - 100, 200, s));
+			Assert::IsTrue(std::string(s.begin(), s.end()) == content.substr(0x10000 - 100, 200));
+
+			// Room for four blocks, the least recently used goes first
+			auto small = std::make_shared<BlockCache>(std::make_shared<LoggerStub>(), 0x40000, 0x10000);
+			for (uint64_t i = 0; i < 6; i++) Assert::IsTrue((bool)small->Get(filename, i));
+			small->Get(filename, 5);
+			stats = small->GetStats();
+			Assert::AreEqual((uint64_t)6, stats.misses);
+			Assert::AreEqual((uint64_t)2, stats.evictions);
+			Assert::AreEqual((uint64_t)0x40000, stats.cachedBytes);
+
+			small->Get(filename, 0);
+			Assert::AreEqual((uint64_t)7, small->GetStats().misses);
+			Assert::IsFalse((bool)small->Get((directory / "missing.bin").string(), 0));
+
+			std::filesystem::remove_all(directory);
+		}
+
 	};
 }